@@ -50,6 +50,73 @@ size_t CountVal8(const uint8_t* ptr, size_t len, char c) {
   return res;
 }
 
+namespace {
+
+typedef void (*FindVal8Fn)(const uint8_t* ptr, size_t len, char c, std::vector<uint32_t>* dest);
+
+// Appends the offsets of the bits set in mask, with base added to each one of them.
+inline void AppendMaskOffsets(uint32_t mask, uint32_t base, std::vector<uint32_t>* dest) {
+  while (mask) {
+    dest->push_back(base + Bits::FindLSBSetNonZero(mask));
+    mask &= mask - 1;
+  }
+}
+
+void FindVal8Sse2(const uint8_t* ptr, size_t len, char c, std::vector<uint32_t>* dest) {
+  __m128i cx16 = _mm_set1_epi8(c);
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i val = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + i));
+    AppendMaskOffsets(_mm_movemask_epi8(_mm_cmpeq_epi8(val, cx16)), i, dest);
+  }
+
+  for (; i < len; ++i) {
+    if (ptr[i] == uint8_t(c))
+      dest->push_back(i);
+  }
+}
+
+__attribute__((target("avx2")))
+void FindVal8Avx2(const uint8_t* ptr, size_t len, char c, std::vector<uint32_t>* dest) {
+  __m256i cx32 = _mm256_set1_epi8(c);
+  size_t i = 0;
+
+  // We compare 64 bytes per iteration and skip both masks with a single branch
+  // since the matches are usually sparse.
+  for (; i + 64 <= len; i += 64) {
+    __m256i val1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr + i));
+    __m256i val2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr + i + 32));
+    uint32_t m1 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(val1, cx32));
+    uint32_t m2 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(val2, cx32));
+    if ((m1 | m2) == 0)
+      continue;
+    AppendMaskOffsets(m1, i, dest);
+    AppendMaskOffsets(m2, i + 32, dest);
+  }
+
+  if (i < len) {
+    size_t tail_start = dest->size();
+    FindVal8Sse2(ptr + i, len - i, c, dest);
+    for (size_t j = tail_start; j < dest->size(); ++j) {
+      (*dest)[j] += i;
+    }
+  }
+}
+
+FindVal8Fn ChooseFindVal8() {
+  __builtin_cpu_init();  // Required since we may run before main().
+  return __builtin_cpu_supports("avx2") ? &FindVal8Avx2 : &FindVal8Sse2;
+}
+
+const FindVal8Fn find_val8 = ChooseFindVal8();
+
+}  // namespace
+
+void FindVal8(const uint8_t* ptr, size_t len, char c, std::vector<uint32_t>* dest) {
+  DCHECK_LT(len, 1ULL << 32);
+  find_val8(ptr, len, c, dest);
+}
+
 #ifdef __SSE4_1__
 
 // taken from: https://github.com/lemire/FastDifferentialCoding/blob/master/src/fastdelta.c
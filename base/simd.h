@@ -5,6 +5,7 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <vector>
 
 namespace base {
 
@@ -13,6 +14,11 @@ namespace base {
 // Returns how many times val appeared in the range.
 size_t CountVal8(const uint8_t* ptr, size_t len, char val);
 
+// Appends to dest the offsets of all the bytes in [ptr, ptr+len) that equal to val.
+// Unlike CountVal8 does not access memory outside of the range. len must be less than 4GB.
+// Uses AVX2 kernel if the cpu supports it and SSE2 kernel otherwise.
+void FindVal8(const uint8_t* ptr, size_t len, char val, std::vector<uint32_t>* dest);
+
 // Writes to buffer the successive differences of buffer
 // (buffer[0]-starting_point, buffer[1]-buffer[2], ...)
 void ComputeDeltasInplace(uint32_t * buffer, size_t length, uint32_t starting_point);
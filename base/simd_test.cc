@@ -73,6 +73,28 @@ TEST(SimdTest, OverFlow) {
   EXPECT_EQ(30, CountVal8(buf.get() + 2, 30, 1));
 }
 
+TEST(SimdTest, FindVal8) {
+  constexpr size_t kBufSize = 1024;
+  std::unique_ptr<uint8_t[]> buf(new uint8_t[kBufSize]);
+  for (unsigned i = 0; i < kBufSize; ++i) {
+    buf[i] = (i * 7919) % 13 == 0 ? '\n' : 'a';
+  }
+
+  std::vector<uint32_t> res, expected;
+  for (unsigned start = 0; start < 64; ++start) {
+    for (unsigned len = 0; len < kBufSize - start; len += 1 + len / 8) {
+      res.assign(1, 42);  // FindVal8 appends to dest.
+      expected.assign(1, 42);
+      for (unsigned i = 0; i < len; ++i) {
+        if (buf[start + i] == '\n')
+          expected.push_back(i);
+      }
+      FindVal8(buf.get() + start, len, '\n', &res);
+      ASSERT_EQ(expected, res) << start << " " << len;
+    }
+  }
+}
+
 using benchmark::DoNotOptimize;
 
 static void BM_Simd(benchmark::State& state) {
@@ -91,4 +113,18 @@ static void BM_Plain(benchmark::State& state) {
 }
 BENCHMARK(BM_Plain)->Range(8, 1 << 16);
 
+static void BM_FindVal8(benchmark::State& state) {
+  std::unique_ptr<uint8[]> buf(new uint8[state.range(0)]);
+  for (int i = 0; i < state.range(0); ++i) {
+    buf[i] = i % 100 == 99 ? '\n' : 'a';
+  }
+  std::vector<uint32_t> res;
+  while (state.KeepRunning()) {
+    res.clear();
+    FindVal8(buf.get(), state.range(0), '\n', &res);
+    DoNotOptimize(res.data());
+  }
+}
+BENCHMARK(BM_FindVal8)->Range(1 << 10, 1 << 17);
+
 }  // namespace base
@@ -20,6 +20,22 @@ if (NOT UNWIND_LIBRARY)
   Message(FATAL_ERROR  "libunwind8-dev is not installed but required for better glog stacktraces")
 endif ()
 
+set(URING_LIBS "")
+if (USE_URING)
+  find_library (URING_LIBRARY NAMES uring DOC "liburing library")
+  find_path (URING_INCLUDE_DIR NAMES liburing.h)
+  mark_as_advanced (URING_LIBRARY URING_INCLUDE_DIR)
+
+  if (URING_LIBRARY AND URING_INCLUDE_DIR)
+    add_definitions(-DUSE_URING)
+    include_directories(${URING_INCLUDE_DIR})
+    set(URING_LIBS ${URING_LIBRARY})
+  else ()
+    Message(WARNING "liburing-dev is not installed, building without io_uring support")
+    set(USE_URING OFF)
+  endif ()
+endif ()
+
 
 function(add_third_party name)
   set(options SHARED)
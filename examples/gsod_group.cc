@@ -11,7 +11,7 @@
 #include "mr/mr_main.h"
 
 #include "absl/strings/str_cat.h"
-#include "strings/split.h"
+#include "file/csv_parser.h"
 #include "util/asio/accept_server.h"
 
 using namespace mr3;
@@ -27,7 +27,8 @@ struct GsodRecord {
 
 namespace mr3 {
 template <> class RecordTraits<GsodRecord> {
-  std::vector<char*> cols_;
+  file::CsvParser parser_;
+  file::CsvBatch batch_;
 
  public:
   static std::string Serialize(bool is_binary, const GsodRecord& rec) {
@@ -35,12 +36,15 @@ template <> class RecordTraits<GsodRecord> {
   }
 
   bool Parse(bool is_binary, std::string&& tmp, GsodRecord* res) {
-    cols_.clear();
+    parser_.Parse(tmp, true, &batch_);
+    CHECK_EQ(1, batch_.num_rows());
+    CHECK_EQ(2, batch_.num_fields(0));
 
-    SplitCSVLineWithDelimiter(&tmp.front(), ',', &cols_);
-    CHECK_EQ(2, cols_.size());
-    CHECK(absl::SimpleAtoi(cols_[0], &res->station));
-    CHECK(absl::SimpleAtoi(cols_[1], &res->year));
+    int64_t station, year;
+    CHECK(batch_.GetInt(0, 0, &station));
+    CHECK(batch_.GetInt(0, 1, &year));
+    res->station = station;
+    res->year = year;
 
     return true;
   }
@@ -48,18 +52,24 @@ template <> class RecordTraits<GsodRecord> {
 }  // namespace mr3
 
 class GsodMapper {
-  std::vector<char*> cols_;
+  file::CsvParser parser_;
+  file::CsvBatch batch_;
 
  public:
+  GsodMapper() { parser_.set_projection({0, 2}); }
+
   void Do(string val, mr3::DoContext<GsodRecord>* context) {
-    cols_.clear();
-    string tmp = val;
-    SplitCSVLineWithDelimiter(&val.front(), ',', &cols_);
-    CHECK_EQ(31, cols_.size()) << tmp;
+    CHECK_EQ(val.size(), parser_.Parse(val, true, &batch_));
+    CHECK_EQ(1, batch_.num_rows());
+    CHECK_EQ(31, batch_.num_columns(0)) << val;
+
+    int64_t station, year;
+    CHECK(batch_.GetInt(0, 0, &station));
+    CHECK(batch_.GetInt(0, 1, &year));
 
     GsodRecord rec;
-    CHECK(absl::SimpleAtoi(cols_[0], &rec.station));
-    CHECK(absl::SimpleAtoi(cols_[2], &rec.year));
+    rec.station = station;
+    rec.year = year;
     context->Write(std::move(rec));
   }
 };
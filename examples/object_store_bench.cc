@@ -0,0 +1,112 @@
+// Copyright 2020, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+
+// Measures the write and read throughput of ObjectStore against the local S3 stand-in server
+// with the given latency, bandwidth and error rate.
+
+#include "base/init.h"
+#include "base/logging.h"
+#include "base/walltime.h"
+#include "util/asio/accept_server.h"
+#include "util/asio/io_context_pool.h"
+#include "util/aws/s3_stand_in.h"
+#include "util/cloud/object_store.h"
+
+using namespace std;
+using namespace util;
+
+DEFINE_uint32(latency_ms, 20, "Latency of every stand-in response.");
+DEFINE_uint32(bandwidth_mb, 0, "Bandwidth of every stand-in connection in MB/s. 0 - unlimited.");
+DEFINE_double(error_rate, 0, "Fraction of the requests that fail with 503 SlowDown.");
+DEFINE_uint32(object_mb, 64, "Size of the benchmarked object.");
+DEFINE_uint32(part_mb, 8, "Size of the uploaded parts.");
+DEFINE_uint32(parallel_parts, 4, "Maximal number of part uploads in flight.");
+DEFINE_uint32(range_mb, 4, "Size of the ranged read requests.");
+DEFINE_uint32(read_ahead, 8, "Maximal number of ranged read requests in flight.");
+
+namespace {
+
+double MbPerSec(size_t bytes, uint64_t usec) {
+  return double(bytes) / std::max<uint64_t>(usec, 1);
+}
+
+void Run(cloud::ObjectStore* store) {
+  string data(size_t(FLAGS_object_mb) << 20, 'a');
+  for (size_t i = 0; i < data.size(); i += 4096) {
+    data[i] = 'a' + i % 26;
+  }
+
+  cloud::ObjectWriteOptions wopts;
+  wopts.part_size = size_t(FLAGS_part_mb) << 20;
+  wopts.max_parallel_parts = FLAGS_parallel_parts;
+
+  uint64_t start = base::GetMonotonicMicrosFast();
+  file::WriteFile* wf = CHECKED_GET(store->OpenWriteFile("bench", "obj", wopts));
+  constexpr size_t kChunk = 1 << 16;
+  for (size_t i = 0; i < data.size(); i += kChunk) {
+    CHECK_STATUS(wf->Write(absl::string_view(data).substr(i, kChunk)));
+  }
+  CHECK(wf->Close());
+  uint64_t write_usec = base::GetMonotonicMicrosFast() - start;
+  LOG(INFO) << "Wrote " << data.size() << " bytes in " << write_usec / 1000 << "ms, "
+            << MbPerSec(data.size(), write_usec) << " MB/s";
+
+  file::ReadonlyFile::Options ropts;
+  ropts.parallel_range_size = size_t(FLAGS_range_mb) << 20;
+  ropts.max_parallel_ranges = FLAGS_read_ahead;
+
+  start = base::GetMonotonicMicrosFast();
+  std::unique_ptr<file::ReadonlyFile> rf(CHECKED_GET(store->OpenReadFile("bench", "obj", ropts)));
+  std::unique_ptr<uint8_t[]> buf(new uint8_t[kChunk]);
+  size_t offset = 0;
+  while (true) {
+    size_t len = CHECKED_GET(rf->Read(offset, strings::MutableByteRange(buf.get(), kChunk)));
+    CHECK_EQ(0, memcmp(buf.get(), data.data() + offset, len));
+    offset += len;
+    if (len < kChunk)
+      break;
+  }
+  CHECK_STATUS(rf->Close());
+  uint64_t read_usec = base::GetMonotonicMicrosFast() - start;
+  CHECK_EQ(data.size(), offset);
+
+  LOG(INFO) << "Read " << offset << " bytes in " << read_usec / 1000 << "ms, "
+            << MbPerSec(offset, read_usec) << " MB/s";
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  MainInitGuard guard(&argc, &argv);
+
+  IoContextPool pool;
+  pool.Run();
+
+  S3StandIn::Options opts;
+  opts.latency_ms = FLAGS_latency_ms;
+  opts.bandwidth = size_t(FLAGS_bandwidth_mb) << 20;
+  opts.error_rate = FLAGS_error_rate;
+  S3StandIn s3(opts);
+
+  AcceptServer server(&pool);
+  uint16_t port = server.AddListener(0, &s3);
+  server.Run();
+
+  IoContext& io_context = pool.GetNextContext();
+  io_context.AwaitSafe([&] {
+    cloud::S3Store store([&](absl::string_view bucket) {
+      return RetryingS3SendCb(MakeStandInSendCb(&io_context, port, bucket));
+    });
+    Run(&store);
+  });
+
+  const S3StandIn::Stats& stats = s3.stats();
+  LOG(INFO) << "Stand-in requests: " << stats.requests << ", injected errors: "
+            << stats.injected_errors << ", max parts in flight: " << stats.max_inflight_parts;
+
+  server.Stop(true);
+  pool.Stop();
+
+  return 0;
+}
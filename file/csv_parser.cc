@@ -0,0 +1,227 @@
+// Copyright 2020, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "file/csv_parser.h"
+
+#include <x86intrin.h>
+#include <cstring>
+
+#include "absl/strings/numbers.h"
+#include "base/logging.h"
+
+namespace file {
+
+namespace {
+
+// Bitmasks of the special characters in a 64 byte block. Bit i corresponds to byte i.
+struct Masks {
+  uint64_t quote, delim, newline;
+};
+
+typedef void (*ClassifyFn)(const char* ptr, char delim, Masks* dest);
+
+inline uint64_t EqualMask16(__m128i val, __m128i cx16) {
+  return uint16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(val, cx16)));
+}
+
+void ClassifySse2(const char* ptr, char delim, Masks* dest) {
+  __m128i quote = _mm_set1_epi8('"'), delim16 = _mm_set1_epi8(delim),
+          newline = _mm_set1_epi8('\n');
+  dest->quote = dest->delim = dest->newline = 0;
+
+  for (unsigned i = 0; i < 4; ++i) {
+    __m128i val = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + i * 16));
+    dest->quote |= EqualMask16(val, quote) << (i * 16);
+    dest->delim |= EqualMask16(val, delim16) << (i * 16);
+    dest->newline |= EqualMask16(val, newline) << (i * 16);
+  }
+}
+
+__attribute__((target("avx2")))
+void ClassifyAvx2(const char* ptr, char delim, Masks* dest) {
+  __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr));
+  __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr + 32));
+
+#define EQUAL_MASK64(c)                                                      \
+  (uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, c)))) |     \
+   (uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, c)))) << 32))
+
+  __m256i quote = _mm256_set1_epi8('"'), delim32 = _mm256_set1_epi8(delim),
+          newline = _mm256_set1_epi8('\n');
+  dest->quote = EQUAL_MASK64(quote);
+  dest->delim = EQUAL_MASK64(delim32);
+  dest->newline = EQUAL_MASK64(newline);
+
+#undef EQUAL_MASK64
+}
+
+ClassifyFn ChooseClassify() {
+  __builtin_cpu_init();  // Required since we may run before main().
+  return __builtin_cpu_supports("avx2") ? &ClassifyAvx2 : &ClassifySse2;
+}
+
+const ClassifyFn classify = ChooseClassify();
+
+// Bit i of the result is the xor of bits [0, i] of x. Applied to the quote mask, marks the bytes
+// that are inside quotes, including the opening quote.
+inline uint64_t PrefixXor(uint64_t x) {
+  x ^= x << 1;
+  x ^= x << 2;
+  x ^= x << 4;
+  x ^= x << 8;
+  x ^= x << 16;
+  x ^= x << 32;
+  return x;
+}
+
+}  // namespace
+
+constexpr uint32_t CsvBatch::kMissing;
+
+StringPiece CsvBatch::raw(size_t row, unsigned index) const {
+  const Field& f = field(row, index);
+  if (f.start == kMissing)
+    return StringPiece();
+  return buf_.substr(f.start, f.end - f.start);
+}
+
+StringPiece CsvBatch::Get(size_t row, unsigned index, std::string* scratch) const {
+  StringPiece val = raw(row, index);
+  if (val.size() < 2 || val.front() != '"' || val.back() != '"')
+    return val;
+
+  val = val.substr(1, val.size() - 2);
+  size_t pos = val.find('"');
+  if (pos == StringPiece::npos)
+    return val;
+
+  // Unescape "" into ".
+  scratch->assign(val.data(), pos);
+  for (; pos < val.size(); ++pos) {
+    scratch->push_back(val[pos]);
+    if (val[pos] == '"' && pos + 1 < val.size() && val[pos + 1] == '"')
+      ++pos;
+  }
+  return *scratch;
+}
+
+bool CsvBatch::GetInt(size_t row, unsigned index, int64_t* dest) const {
+  if (!has_field(row, index))
+    return false;
+  std::string scratch;
+  return absl::SimpleAtoi(Get(row, index, &scratch), dest);
+}
+
+bool CsvBatch::GetDouble(size_t row, unsigned index, double* dest) const {
+  if (!has_field(row, index))
+    return false;
+  std::string scratch;
+  return absl::SimpleAtod(Get(row, index, &scratch), dest);
+}
+
+void CsvParser::set_projection(const std::vector<unsigned>& columns) {
+  slot_.clear();
+  num_slots_ = columns.size();
+  for (unsigned i = 0; i < columns.size(); ++i) {
+    if (columns[i] >= slot_.size())
+      slot_.resize(columns[i] + 1, -1);
+    slot_[columns[i]] = i;
+  }
+}
+
+size_t CsvParser::Parse(StringPiece buf, bool eof, CsvBatch* batch, size_t max_rows) const {
+  typedef CsvBatch::Field Field;
+  CHECK_LT(buf.size(), CsvBatch::kMissing);
+
+  batch->Reset(buf);
+  if (max_rows == 0)
+    return 0;
+
+  const char* data = buf.data();
+  const uint32_t len = buf.size();
+  uint32_t field_start = 0, consumed = 0;
+  unsigned col = 0;
+  bool full = false;
+
+  auto start_row = [&] {
+    if (num_slots_) {
+      batch->fields_.resize(batch->fields_.size() + num_slots_,
+                            Field{CsvBatch::kMissing, CsvBatch::kMissing});
+    }
+  };
+
+  auto add_field = [&](uint32_t end) {
+    if (num_slots_ == 0) {
+      batch->fields_.push_back(Field{field_start, end});
+    } else if (col < slot_.size() && slot_[col] >= 0) {
+      batch->fields_[batch->row_start_.back() + slot_[col]] = Field{field_start, end};
+    }
+    ++col;
+  };
+
+  // Called at the newline or at the end of the last row.
+  auto end_row = [&](uint32_t end) {
+    if (end > field_start && data[end - 1] == '\r')
+      --end;
+    if (col == 0 && end == field_start)  // Empty line.
+      return;
+
+    add_field(end);
+    batch->row_start_.push_back(batch->fields_.size());
+    batch->row_cols_.push_back(col);
+    col = 0;
+    full = batch->num_rows() == max_rows;
+    start_row();
+  };
+
+  start_row();
+
+  uint64_t inside_carry = 0;  // all ones if the previous block ended inside quotes.
+  for (uint32_t pos = 0; pos < len && !full; pos += 64) {
+    Masks masks;
+    if (len - pos >= 64) {
+      classify(data + pos, delimiter_, &masks);
+    } else {
+      char tmp[64] = {0};
+      memcpy(tmp, data + pos, len - pos);
+      classify(tmp, delimiter_, &masks);
+
+      uint64_t valid = (1ULL << (len - pos)) - 1;
+      masks.quote &= valid;
+      masks.delim &= valid;
+      masks.newline &= valid;
+    }
+
+    uint64_t inside = PrefixXor(masks.quote) ^ inside_carry;
+    inside_carry = uint64_t(int64_t(inside) >> 63);
+
+    uint64_t structural = (masks.delim | masks.newline) & ~inside;
+    while (structural) {
+      unsigned bit = __builtin_ctzll(structural);
+      structural &= structural - 1;
+      uint32_t offset = pos + bit;
+
+      if ((masks.newline >> bit) & 1) {
+        end_row(offset);
+        consumed = offset + 1;
+        if (full)
+          break;
+      } else {
+        add_field(offset);
+      }
+      field_start = offset + 1;
+    }
+  }
+
+  if (eof && !full && consumed < len) {
+    end_row(len);
+    consumed = len;
+  }
+
+  // Drop the fields of the partial row.
+  batch->fields_.resize(batch->row_start_.back());
+
+  return consumed;
+}
+
+}  // namespace file
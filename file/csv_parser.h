@@ -0,0 +1,95 @@
+// Copyright 2020, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "strings/stringpiece.h"
+
+namespace file {
+
+// Column offsets of the rows parsed by CsvParser. The fields point into the parsed buffer,
+// therefore the batch is valid only as long as the buffer is.
+class CsvBatch {
+ public:
+  size_t num_rows() const { return row_cols_.size(); }
+
+  // Number of columns in the row, including the columns that were not projected.
+  unsigned num_columns(size_t row) const { return row_cols_[row]; }
+
+  // Number of fields stored per row. With projection, equals to the number of projected columns,
+  // otherwise to num_columns(row).
+  unsigned num_fields(size_t row) const { return row_start_[row + 1] - row_start_[row]; }
+
+  // Returns false if the field is missing, i.e. the row is too short for the projected column.
+  bool has_field(size_t row, unsigned index) const {
+    return index < num_fields(row) && field(row, index).start != kMissing;
+  }
+
+  // The field as it appears in the input, including the quotes.
+  StringPiece raw(size_t row, unsigned index) const;
+
+  // The value of the field. Quoted fields are unquoted. If the field contains escaped quotes,
+  // the value is unescaped into scratch and the result points to it.
+  StringPiece Get(size_t row, unsigned index, std::string* scratch) const;
+
+  // Typed accessors. Return false if the field is missing or can not be parsed.
+  bool GetInt(size_t row, unsigned index, int64_t* dest) const;
+  bool GetDouble(size_t row, unsigned index, double* dest) const;
+
+ private:
+  friend class CsvParser;
+
+  static constexpr uint32_t kMissing = UINT32_MAX;
+
+  struct Field {
+    uint32_t start, end;  // offsets in buf_.
+  };
+
+  const Field& field(size_t row, unsigned index) const {
+    return fields_[row_start_[row] + index];
+  }
+
+  void Reset(StringPiece buf) {
+    buf_ = buf;
+    fields_.clear();
+    row_start_.assign(1, 0);
+    row_cols_.clear();
+  }
+
+  StringPiece buf_;
+  std::vector<Field> fields_;
+  std::vector<uint32_t> row_start_;  // num_rows() + 1 indices into fields_.
+  std::vector<uint32_t> row_cols_;
+};
+
+// RFC 4180 CSV parser. Quoted fields may contain delimiters, newlines and escaped ("") quotes.
+// Rows end with \n or \r\n. Empty lines are skipped.
+//
+// The parser classifies the quotes, delimiters and newlines of 64 byte blocks with SIMD
+// and derives the field boundaries from the resulting bitmasks, so that the per-byte work does
+// not depend on the branches.
+class CsvParser {
+ public:
+  explicit CsvParser(char delimiter = ',') : delimiter_(delimiter) {}
+
+  // Stores only the given columns of each row, in the given order. Field index i of the batch
+  // then refers to columns[i]. Empty vector stores all the columns.
+  void set_projection(const std::vector<unsigned>& columns);
+
+  // Parses upto max_rows complete rows at the beginning of buf into batch.
+  // Returns the number of bytes consumed, i.e. the offset of the first row that was not parsed.
+  // If eof is false, the trailing row that is not terminated with a newline is not parsed,
+  // and should be passed again together with the following data.
+  // buf must be smaller than 4GB.
+  size_t Parse(StringPiece buf, bool eof, CsvBatch* batch, size_t max_rows = SIZE_MAX) const;
+
+ private:
+  char delimiter_;
+  std::vector<int> slot_;  // column -> field index of the projected column or -1.
+  unsigned num_slots_ = 0;
+};
+
+}  // namespace file
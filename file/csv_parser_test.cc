@@ -0,0 +1,117 @@
+// Copyright 2020, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "file/csv_parser.h"
+
+#include <gmock/gmock.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace file {
+
+using namespace std;
+using testing::ElementsAre;
+
+class CsvParserTest : public testing::Test {
+ protected:
+  vector<vector<string>> Rows(StringPiece buf, bool eof = true) {
+    consumed_ = parser_.Parse(buf, eof, &batch_);
+    vector<vector<string>> res(batch_.num_rows());
+    string scratch;
+    for (size_t i = 0; i < res.size(); ++i) {
+      for (unsigned j = 0; j < batch_.num_fields(i); ++j) {
+        res[i].emplace_back(batch_.Get(i, j, &scratch));
+      }
+    }
+    return res;
+  }
+
+  using Row = vector<string>;
+
+  CsvParser parser_;
+  CsvBatch batch_;
+  size_t consumed_ = 0;
+};
+
+TEST_F(CsvParserTest, Basic) {
+  EXPECT_THAT(Rows("a,b,c\n1,,3\r\n\n,\nlast"),
+              ElementsAre(Row{"a", "b", "c"}, Row{"1", "", "3"}, Row{"", ""}, Row{"last"}));
+  EXPECT_THAT(Rows(""), ElementsAre());
+  EXPECT_THAT(Rows("\n\r\n"), ElementsAre());
+}
+
+TEST_F(CsvParserTest, Quotes) {
+  string str = "\"a,b\",\"line1\nline2\",\"say \"\"hi\"\"\"\r\n\"\",x";
+  EXPECT_THAT(Rows(str), ElementsAre(Row{"a,b", "line1\nline2", "say \"hi\""}, Row{"", "x"}));
+  EXPECT_EQ("\"a,b\"", batch_.raw(0, 0));
+
+  // Quoted fields that span the 64 byte blocks.
+  string field(150, 'x');
+  for (size_t i = 0; i < field.size(); i += 7) {
+    field[i] = i % 2 ? ',' : '\n';
+  }
+  str = "1,\"" + field + "\",2\n3";
+  EXPECT_THAT(Rows(str), ElementsAre(Row{"1", field, "2"}, Row{"3"}));
+}
+
+TEST_F(CsvParserTest, Partial) {
+  string str = "a,b\nc,\"d\ne";
+  EXPECT_THAT(Rows(str, false), ElementsAre(Row{"a", "b"}));
+  EXPECT_EQ(4, consumed_);
+
+  str = str.substr(consumed_) + "\"\n";
+  EXPECT_THAT(Rows(str, false), ElementsAre(Row{"c", "d\ne"}));
+  EXPECT_EQ(str.size(), consumed_);
+
+  str = "1\n2\n3\n";
+  EXPECT_EQ(4, parser_.Parse(str, true, &batch_, 2));
+  EXPECT_EQ(2, batch_.num_rows());
+}
+
+TEST_F(CsvParserTest, Projection) {
+  parser_.set_projection({3, 0});
+  string str;
+  for (unsigned i = 0; i < 100; ++i) {
+    str.append(to_string(i)).append(",a,\"b,c\",").append(to_string(i * 0.5)).append("\n");
+  }
+  str.append("7\n");
+
+  ASSERT_EQ(str.size(), parser_.Parse(str, true, &batch_));
+  ASSERT_EQ(101, batch_.num_rows());
+  for (unsigned i = 0; i < 100; ++i) {
+    ASSERT_EQ(2, batch_.num_fields(i));
+    EXPECT_EQ(4, batch_.num_columns(i));
+
+    int64_t ival = 0;
+    double dval = 0;
+    ASSERT_TRUE(batch_.GetInt(i, 1, &ival));
+    ASSERT_TRUE(batch_.GetDouble(i, 0, &dval));
+    EXPECT_EQ(i, ival);
+    EXPECT_EQ(i * 0.5, dval);
+  }
+
+  int64_t val = 0;
+  EXPECT_FALSE(batch_.has_field(100, 0));
+  EXPECT_FALSE(batch_.GetInt(100, 0, &val));
+  EXPECT_TRUE(batch_.GetInt(100, 1, &val));
+  EXPECT_EQ(7, val);
+}
+
+static void BM_ParseCsv(benchmark::State& state) {
+  string str;
+  while (str.size() < (1 << 20)) {
+    str.append("725300,94846,2019,01,01,\"CHICAGO, IL\",25.3,24,18.1,24,1022.4\n");
+  }
+
+  CsvParser parser;
+  parser.set_projection({0, 2});
+  CsvBatch batch;
+  while (state.KeepRunning()) {
+    CHECK_EQ(str.size(), parser.Parse(str, true, &batch));
+  }
+  state.SetBytesProcessed(state.iterations() * str.size());
+}
+BENCHMARK(BM_ParseCsv);
+
+}  // namespace file
@@ -3,8 +3,13 @@
 //
 #include "file/fiber_file.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/uio.h>
+#include <unistd.h>
 #include <atomic>
+#include <deque>
 
 #include "base/hash.h"
 #include "base/histogram.h"
@@ -16,6 +21,12 @@ using namespace util;
 
 namespace {
 
+// How far ahead of the reader MmapFile asks the kernel to read.
+constexpr size_t kMmapReadAhead = 1 << 23;
+
+// Memory of the prefetch buffers of all the FiberReadFile instances.
+std::atomic<size_t> prefetch_memory{0};
+
 ssize_t read_all(int fd, const iovec* iov, int iovcnt, size_t offset) {
   size_t left = std::accumulate(iov, iov + iovcnt, 0,
                                 [](size_t a, const iovec& i2) { return a + i2.iov_len; });
@@ -51,6 +62,7 @@ class FiberReadFile : public ReadonlyFile {
  public:
   FiberReadFile(const FiberReadOptions& opts, ReadonlyFile* next,
                 util::fibers_ext::FiberQueueThreadPool* tp);
+  ~FiberReadFile();
 
   // Reads upto length bytes and updates the result to point to the data.
   // May use buffer for storing data. In case, EOF reached sets result.size() < length but still
@@ -66,27 +78,51 @@ class FiberReadFile : public ReadonlyFile {
   int Handle() const final { return next_->Handle(); }
 
  private:
+  // A prefetch request of prefetch_size_ bytes.
+  struct Chunk {
+    size_t offset = 0;
+    size_t len = 0, consumed = 0;
+    bool ready = false;
+    ssize_t res = 0;
+    std::unique_ptr<uint8_t[]> buf;
+    fibers_ext::Done done;
+  };
+
   StatusObject<size_t> ReadAndPrefetch(size_t offset, const strings::MutableByteRange& range);
 
-  // Returns true if requires further prefetching.
-  std::pair<size_t, bool> ReadFromCache(size_t offset, const strings::MutableByteRange& range);
+  // Reads directly into range via the thread pool.
+  StatusObject<size_t> ReadDirect(size_t offset, const strings::MutableByteRange& range);
 
-  void HandleActivePrefetch();
+  // Keeps up to depth_ requests in flight ahead of the chunk that is being consumed.
+  void Prefetch(size_t offset);
 
-  strings::MutableByteRange prefetch_;
-  size_t file_prefetch_offset_ = -1;
-  std::unique_ptr<uint8_t[]> buf_;
-  size_t buf_size_ = 0;
-  std::unique_ptr<ReadonlyFile> next_;
+  // Returns true if the reader had to wait for the chunk.
+  bool WaitChunk(Chunk* chunk);
+
+  void PopChunk();
+
+  // Waits for all the requests in flight and drops the prefetched data.
+  void DropChunks();
+
+  void SetDepth(unsigned depth);
 
+  bool MemoryPressure() const {
+    return prefetch_memory.load(std::memory_order_relaxed) > memory_limit_;
+  }
+
+  std::unique_ptr<ReadonlyFile> next_;
   fibers_ext::FiberQueueThreadPool* tp_;
   FiberReadOptions::Stats* stats_ = nullptr;
   fibers_ext::Done done_;
   base::Histogram tp_wait_hist_;
 
-  std::atomic<ssize_t> prefetch_res_{0};
-  uint8_t* prefetch_ptr_ = nullptr;
-  int64_t prefetch_start_ts_ = 0;
+  size_t prefetch_size_ = 0;
+  size_t memory_limit_ = 0;
+  unsigned depth_ = 1, max_depth_ = 1;
+
+  std::deque<Chunk> chunks_;  // deque keeps the chunk addresses stable.
+  std::vector<std::unique_ptr<uint8_t[]>> free_bufs_;
+  size_t allocated_ = 0;  // bytes of chunk buffers owned by this file.
 };
 
 class WriteFileImpl : public WriteFile {
@@ -112,19 +148,22 @@ class WriteFileImpl : public WriteFile {
 FiberReadFile::FiberReadFile(const FiberReadOptions& opts, ReadonlyFile* next,
                              util::fibers_ext::FiberQueueThreadPool* tp)
     : next_(next), tp_(tp) {
-  buf_size_ = opts.prefetch_size;
-  if (buf_size_) {
-    buf_.reset(new uint8_t[buf_size_]);
-    prefetch_.reset(buf_.get(), 0);
+  prefetch_size_ = opts.prefetch_size;
+  memory_limit_ = opts.prefetch_memory_limit;
+  if (prefetch_size_ && opts.max_prefetch_size > prefetch_size_) {
+    max_depth_ = opts.max_prefetch_size / prefetch_size_;
   }
   stats_ = opts.stats;
+  SetDepth(1);
+}
+
+FiberReadFile::~FiberReadFile() {
+  DropChunks();
+  prefetch_memory.fetch_sub(allocated_, std::memory_order_relaxed);
 }
 
 Status FiberReadFile::Close() {
-  if (prefetch_ptr_) {
-    done_.Wait(AND_RESET);
-    prefetch_ptr_ = nullptr;
-  }
+  DropChunks();
   VLOG(1) << "Read Histogram: " << tp_wait_hist_.ToString();
 
   return next_->Close();
@@ -132,152 +171,177 @@ Status FiberReadFile::Close() {
 
 StatusObject<size_t> FiberReadFile::ReadAndPrefetch(size_t offset,
                                                     const strings::MutableByteRange& range) {
-  size_t copied = 0;
   if (stats_)
     ++stats_->read_prefetch_cnt;
 
-  if (prefetch_ptr_ || !prefetch_.empty()) {
-    auto res = ReadFromCache(offset, range);
-    if (!res.second)  // if we should not issue a prefetch request, we return what we read.
-      return res.first;
-
-    copied = res.first;
-    offset += copied;
-  }
-  DCHECK(!prefetch_ptr_);  // no active pending requests at this point.
-
-  // At this point prefetch_ must point at buf_ and might still contained prefetched slice.
-  prefetch_.reset(buf_.get(), prefetch_.size());
-
-  iovec io[2] = {{range.data() + copied, range.size() - copied},
-                 {buf_.get() + prefetch_.size(), buf_size_ - prefetch_.size()}};
-
-  if (copied < range.size()) {  // We need to issue request to fill this read.
-    int64_t start = base::GetMonotonicMicrosFast();
-
-    DCHECK(prefetch_.empty());
-
-    ssize_t total_read = -1;
-
-    // We issue 2 read requests: to fill user buffer and our prefetch buffer.
-    tp_->Add([&] {
-      total_read = read_all(next_->Handle(), io, 2, offset);
-      done_.Notify();
-    });
-    done_.Wait(AND_RESET);
-    if (VLOG_IS_ON(1)) {
-      tp_wait_hist_.Add(base::GetMonotonicMicrosFast() - start);
+  size_t copied = 0;
+  while (copied < range.size() && !chunks_.empty()) {
+    Chunk& chunk = chunks_.front();
+    if (chunk.offset + chunk.consumed != offset + copied) {
+      DropChunks();  // Not a sequential read.
+      break;
     }
 
-    if (stats_) {
-      ++stats_->preempt_cnt;
-      stats_->disk_bytes += io[0].iov_len;
+    if (WaitChunk(&chunk) && depth_ < max_depth_ && !MemoryPressure()) {
+      // The reader is faster than our read-ahead - we widen the window.
+      SetDepth(std::min(depth_ * 2, max_depth_));
     }
-    if (total_read < 0)
-      return file::StatusFileError();
-    if (static_cast<size_t>(total_read) <= io[0].iov_len)  // EOF
-      return total_read + copied;
 
-    file_prefetch_offset_ = offset + io[0].iov_len;
-    total_read -= io[0].iov_len;  // reduce range part.
+    if (chunk.res < 0) {
+      // We ignore the error, the direct read will report it if it's persistent.
+      DropChunks();
+      break;
+    }
 
-    prefetch_.reset(buf_.get(), total_read);
-    if (stats_) {
-      stats_->cache_bytes += total_read;
+    size_t sz = std::min(chunk.len - chunk.consumed, range.size() - copied);
+    memcpy(range.data() + copied, chunk.buf.get() + chunk.consumed, sz);
+    chunk.consumed += sz;
+    copied += sz;
+
+    if (chunk.consumed == chunk.len) {
+      bool eof = chunk.len < prefetch_size_;
+      PopChunk();
+      if (eof) {
+        DropChunks();
+        return copied;
+      }
     }
-    return range.size();  // Fully read and possibly some prefetched.
   }
 
-  // else: copied >= range.size() and we did not read from disk yet but we want to prefetch
-  // data into non blocking storage.
-  prefetch_ptr_ = reinterpret_cast<uint8_t*>(io[1].iov_base);
-  struct Pending {
-    iovec io;
-    size_t offs;
-  } pending{io[1], file_prefetch_offset_ + prefetch_.size()};
-
-  // we filled range but we want to issue a readahead fetch.
-  // We must keep reference to done_ in pending because of the shutdown flow.
-  prefetch_start_ts_ = base::GetMonotonicMicrosFast();
-  tp_->Add([this, pending = std::move(pending)]() mutable {
-    prefetch_res_.store(read_all(next_->Handle(), &pending.io, 1, pending.offs),
-                        std::memory_order_release);
-    done_.Notify();
-  });
+  if (copied < range.size()) {
+    strings::MutableByteRange rest(range.data() + copied, range.size() - copied);
+    auto res = ReadDirect(offset + copied, rest);
+    if (!res.ok())
+      return res;
+    copied += res.obj;
+    if (res.obj < rest.size())  // EOF
+      return copied;
+  }
 
-  return range.size();
+  Prefetch(offset + copied);
+  return copied;
 }
 
-// Returns how much was read from cache and whether we should issue prefetch request following
-// this read.
-std::pair<size_t, bool> FiberReadFile::ReadFromCache(size_t offset,
-                                                     const strings::MutableByteRange& range) {
-  bool should_prefetch =
-      (range.size() > prefetch_.size() && prefetch_ptr_) || (offset != file_prefetch_offset_);
-  if (should_prefetch) {
-    HandleActivePrefetch();
-  }
+StatusObject<size_t> FiberReadFile::ReadDirect(size_t offset,
+                                               const strings::MutableByteRange& range) {
+  int64_t start = base::GetMonotonicMicrosFast();
+  iovec io{range.data(), range.size()};
+  ssize_t total_read = -1;
 
-  std::pair<size_t, bool> res(0, true);
-  if (offset != file_prefetch_offset_) {
-    prefetch_.clear();
-    return res;
+  tp_->Add([&] {
+    total_read = read_all(next_->Handle(), &io, 1, offset);
+    done_.Notify();
+  });
+  done_.Wait(AND_RESET);
+  if (VLOG_IS_ON(1)) {
+    tp_wait_hist_.Add(base::GetMonotonicMicrosFast() - start);
   }
 
-  DCHECK(prefetch_.end() <= buf_.get() + buf_size_);
+  if (total_read < 0)
+    return file::StatusFileError();
 
-  // We could put a smarter check but for sequential access it's enough.
-  res.first = std::min(prefetch_.size(), range.size());
+  if (stats_) {
+    ++stats_->preempt_cnt;
+    stats_->disk_bytes += total_read;
+  }
+  return total_read;
+}
 
-  memcpy(range.data(), prefetch_.data(), res.first);
-  file_prefetch_offset_ += res.first;
-  prefetch_.remove_prefix(res.first);
+void FiberReadFile::Prefetch(size_t offset) {
+  size_t file_size = next_->Size();
+  size_t next = chunks_.empty() ? offset : chunks_.back().offset + prefetch_size_;
 
-  if (prefetch_ptr_ || prefetch_.size() >= buf_size_ / 2) {
-    // We do not need to issue prefetch request, either we've issued one already or we have
-    // enough buffer to go forward.
-    res.second = false;
-  } else if (!prefetch_.empty()) {
-    memmove(buf_.get(), prefetch_.data(), prefetch_.size());
+  if (depth_ > 1 && MemoryPressure()) {
+    SetDepth(depth_ / 2);  // Memory pressure - we shrink the window.
   }
 
-  return res;
+  // The front chunk is being consumed, so we keep depth_ more chunks in flight.
+  while (chunks_.size() <= depth_ && next < file_size) {
+    chunks_.emplace_back();
+    Chunk& chunk = chunks_.back();
+    chunk.offset = next;
+    if (free_bufs_.empty()) {
+      chunk.buf.reset(new uint8_t[prefetch_size_]);
+      allocated_ += prefetch_size_;
+      prefetch_memory.fetch_add(prefetch_size_, std::memory_order_relaxed);
+    } else {
+      chunk.buf = std::move(free_bufs_.back());
+      free_bufs_.pop_back();
+    }
+
+    // We must keep a reference to done in the callback because of the shutdown flow.
+    Chunk* ptr = &chunk;
+    tp_->Add([this, ptr, done = chunk.done]() mutable {
+      iovec io{ptr->buf.get(), prefetch_size_};
+      ptr->res = read_all(next_->Handle(), &io, 1, ptr->offset);
+      done.Notify();
+    });
+    next += prefetch_size_;
+  }
 }
 
-void FiberReadFile::HandleActivePrefetch() {
-  bool preempt = done_.Wait(AND_RESET);  // wait for the active prefetch to finish.
-  size_t prefetch_res = prefetch_res_.load(std::memory_order_acquire);
+bool FiberReadFile::WaitChunk(Chunk* chunk) {
+  if (chunk->ready)
+    return false;
+
+  int64_t start = base::GetMonotonicMicrosFast();
+  bool preempt = chunk->done.Wait();
+  chunk->ready = true;
+  chunk->len = chunk->res > 0 ? chunk->res : 0;
 
-  if (prefetch_res > 0) {
-    if (prefetch_.empty()) {
-      prefetch_.reset(prefetch_ptr_, prefetch_res);
+  if (preempt && VLOG_IS_ON(1)) {
+    tp_wait_hist_.Add(base::GetMonotonicMicrosFast() - start);
+  }
+  if (stats_) {
+    if (preempt) {
+      ++stats_->preempt_cnt;
+      stats_->disk_bytes += chunk->len;
     } else {
-      CHECK(prefetch_.end() == prefetch_ptr_);
-      prefetch_.reset(prefetch_.data(), prefetch_res + prefetch_.size());
-    }
-    DCHECK_LE(prefetch_.end() - buf_.get(), buf_size_);
-    if (stats_) {
-      if (preempt) {
-        if (VLOG_IS_ON(1)) {
-          auto delta = base::GetMonotonicMicrosFast() - prefetch_start_ts_;
-          tp_wait_hist_.Add(delta);
-        }
-        ++stats_->preempt_cnt;
-        stats_->disk_bytes += prefetch_res;
-      } else {
-        stats_->cache_bytes += prefetch_res;
-      }
+      stats_->cache_bytes += chunk->len;
     }
+  }
+  return preempt;
+}
+
+void FiberReadFile::PopChunk() {
+  Chunk& chunk = chunks_.front();
+  if (free_bufs_.size() < depth_) {
+    free_bufs_.push_back(std::move(chunk.buf));
   } else {
-    // We ignore the error, maximum the system will reread it in the through the main thread.
-    file_prefetch_offset_ = -1;
+    allocated_ -= prefetch_size_;
+    prefetch_memory.fetch_sub(prefetch_size_, std::memory_order_relaxed);
+  }
+  chunks_.pop_front();
+}
+
+void FiberReadFile::DropChunks() {
+  while (!chunks_.empty()) {
+    Chunk& chunk = chunks_.front();
+    if (!chunk.ready) {
+      chunk.done.Wait();  // The pool thread still writes into the buffer.
+      chunk.ready = true;
+    }
+    PopChunk();
+  }
+}
+
+void FiberReadFile::SetDepth(unsigned depth) {
+  depth_ = std::max(1u, depth);
+
+  // Release the spare buffers that the smaller window does not need.
+  while (free_bufs_.size() > depth_) {
+    free_bufs_.pop_back();
+    allocated_ -= prefetch_size_;
+    prefetch_memory.fetch_sub(prefetch_size_, std::memory_order_relaxed);
   }
-  prefetch_ptr_ = nullptr;
+
+  if (stats_)
+    stats_->prefetch_window = prefetch_size_ * depth_;
 }
 
 StatusObject<size_t> FiberReadFile::Read(size_t offset, const strings::MutableByteRange& range) {
   StatusObject<size_t> res;
-  if (buf_) {  // prefetch enabled.
+  if (prefetch_size_) {  // prefetch enabled.
     res = ReadAndPrefetch(offset, range);
     VLOG(2) << "ReadAndPrefetch " << offset << "/" << res.obj;
     return res;
@@ -316,6 +380,90 @@ Status WriteFileImpl::Write(const uint8* buffer, uint64 length) {
 
 }  // namespace
 
+MmapFile::MmapFile(int fd, const uint8_t* data, size_t size,
+                   util::fibers_ext::FiberQueueThreadPool* tp, FiberReadOptions::Stats* stats)
+    : fd_(fd), data_(data), size_(size), tp_(tp), stats_(stats) {
+  if (size_) {
+    Advise(0, size_, MADV_SEQUENTIAL);
+    ReadAhead(0);
+  }
+}
+
+MmapFile::~MmapFile() {
+  if (fd_ >= 0) {
+    Status st = Close();
+    LOG_IF(WARNING, !st.ok()) << "Error closing mapped file " << st;
+  }
+}
+
+Status MmapFile::Close() {
+  if (fd_ < 0)
+    return Status::OK;
+
+  pending_.Wait();
+  if (size_) {
+    munmap(const_cast<uint8_t*>(data_), size_);
+    data_ = nullptr;
+  }
+
+  int res = close(fd_);
+  fd_ = -1;
+  return res < 0 ? file::StatusFileError() : Status::OK;
+}
+
+StatusObject<size_t> MmapFile::Read(size_t offset, const strings::MutableByteRange& range) {
+  if (offset >= size_)
+    return size_t(0);
+
+  size_t len = std::min(range.size(), size_ - offset);
+  ReadAhead(offset + len);
+  memcpy(range.data(), data_ + offset, len);
+
+  // cache_bytes counts the hits of the prefetch logic. We can not tell which pages of the mapping
+  // were resident, so the copies count as disk reads.
+  if (stats_)
+    stats_->disk_bytes += len;
+
+  return len;
+}
+
+void MmapFile::ReadAhead(size_t offset) {
+  if (advised_end_ >= std::min(size_, offset + kMmapReadAhead / 2))
+    return;
+
+  size_t end = std::min(size_, offset + kMmapReadAhead);
+  size_t start = std::max(offset, advised_end_);
+  Advise(start, end - start, MADV_WILLNEED);
+  advised_end_ = end;
+}
+
+void MmapFile::Advise(size_t offset, size_t len, int advice) {
+  static const size_t kPageSize = sysconf(_SC_PAGESIZE);
+
+  // madvise requires page aligned address.
+  size_t aligned = offset - offset % kPageSize;
+  uint8_t* addr = const_cast<uint8_t*>(data_) + aligned;
+  len += offset - aligned;
+
+  auto cb = [addr, len, advice] {
+    if (madvise(addr, len, advice) != 0) {
+      LOG(WARNING) << "madvise failed " << file::StatusFileError();
+    }
+  };
+
+  if (!tp_) {
+    cb();
+    return;
+  }
+
+  // Close() must not unmap the range while madvise is running.
+  pending_.Add(1);
+  tp_->Add([cb, pending = pending_]() mutable {
+    cb();
+    pending.Dec();
+  });
+}
+
 StatusObject<ReadonlyFile*> OpenFiberReadFile(StringPiece name,
                                               util::fibers_ext::FiberQueueThreadPool* tp,
                                               const FiberReadOptions& opts) {
@@ -338,4 +486,32 @@ StatusObject<WriteFile*> OpenFiberWriteFile(StringPiece name,
   return new WriteFileImpl(wf, hash, tp);
 }
 
+StatusObject<MmapFile*> OpenMmapFile(StringPiece name, util::fibers_ext::FiberQueueThreadPool* tp,
+                                    FiberReadOptions::Stats* stats) {
+  std::string path(name);
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return file::StatusFileError();
+
+  struct stat sb;
+  if (fstat(fd, &sb) < 0) {
+    Status st = file::StatusFileError();
+    close(fd);
+    return st;
+  }
+
+  // mmap fails on empty files.
+  void* addr = nullptr;
+  if (sb.st_size > 0) {
+    addr = mmap(nullptr, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+      Status st = file::StatusFileError();
+      close(fd);
+      return st;
+    }
+  }
+
+  return new MmapFile(fd, reinterpret_cast<const uint8_t*>(addr), sb.st_size, tp, stats);
+}
+
 }  // namespace file
@@ -16,9 +16,17 @@ struct FiberReadOptions : public ReadonlyFile::Options {
     size_t disk_bytes = 0;    // read via  ThreadPool calls.
     size_t read_prefetch_cnt = 0;
     size_t preempt_cnt = 0;
+    size_t prefetch_window = 0;  // the last read-ahead window chosen by the file.
   };
 
   size_t prefetch_size = 0;
+
+  // If greater than prefetch_size, the read-ahead window adapts: it grows in prefetch_size
+  // requests up to max_prefetch_size while the reader keeps waiting for the prefetched data, and
+  // shrinks when the prefetch buffers of all the files exceed prefetch_memory_limit.
+  size_t max_prefetch_size = 0;
+  size_t prefetch_memory_limit = 1ULL << 30;
+
   Stats* stats = nullptr;
 };
 
@@ -26,6 +34,51 @@ util::StatusObject<ReadonlyFile*> OpenFiberReadFile(
     StringPiece name, util::fibers_ext::FiberQueueThreadPool* tp,
     const FiberReadOptions& opts = FiberReadOptions{}) MUST_USE_RESULT;
 
+/*! @brief Read-only memory mapping of a local file.
+ *
+ * Page faults block the calling thread, therefore the file asks the kernel to bring in the pages
+ * ahead of the reader with madvise calls that run in FiberQueueThreadPool.
+ * Read() copies straight from the mapping. data() allows zero-copy access.
+ */
+class MmapFile : public ReadonlyFile {
+ public:
+  MmapFile(int fd, const uint8_t* data, size_t size, util::fibers_ext::FiberQueueThreadPool* tp,
+           FiberReadOptions::Stats* stats);
+  ~MmapFile();
+
+  util::StatusObject<size_t> Read(size_t offset,
+                                  const strings::MutableByteRange& range) final MUST_USE_RESULT;
+
+  // Waits for the pending madvise calls and unmaps the file.
+  util::Status Close() final;
+
+  size_t Size() const final { return size_; }
+
+  int Handle() const final { return fd_; }
+
+  //! The contents of the file. Valid until Close() is called.
+  StringPiece data() const { return StringPiece(reinterpret_cast<const char*>(data_), size_); }
+
+  //! Notifies that the reader reached offset, so that the following pages should be brought in.
+  void ReadAhead(size_t offset);
+
+ private:
+  void Advise(size_t offset, size_t len, int advice);
+
+  int fd_;
+  const uint8_t* data_;
+  size_t size_;
+  size_t advised_end_ = 0;
+
+  util::fibers_ext::FiberQueueThreadPool* tp_;
+  FiberReadOptions::Stats* stats_;
+  util::fibers_ext::BlockingCounter pending_{0};
+};
+
+util::StatusObject<MmapFile*> OpenMmapFile(StringPiece name,
+                                           util::fibers_ext::FiberQueueThreadPool* tp,
+                                           FiberReadOptions::Stats* stats = nullptr) MUST_USE_RESULT;
+
 struct FiberWriteOptions : public OpenOptions {
   bool consistent_thread = true;  // whether to send the write request to the same pool-thread.
 };
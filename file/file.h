@@ -26,6 +26,12 @@ class ReadonlyFile {
   struct Options {
     bool sequential = true;
     bool drop_cache_on_close = true;
+
+    // Remote files can be fetched with concurrent ranged requests of parallel_range_size bytes
+    // instead of a single stream. 0 disables the parallel mode.
+    size_t parallel_range_size = 0;
+    unsigned max_parallel_ranges = 16;
+
     Options()  {}
   };
 
@@ -65,6 +71,13 @@ class WriteFile {
   */
   virtual bool Close() = 0;
 
+  /*! @brief Closes the file without finalizing it and deletes the object.
+   *
+   * Implementations that can drop the data written so far (i.e. network based files
+   * whose contents become visible only on Close()) do so. By default equivalent to Close().
+   */
+  virtual bool Abort() { return Close(); }
+
   //! Opens a file. Should not be called directly. Usually are called by factory functions.
   virtual bool Open() = 0;
 
@@ -8,6 +8,8 @@
 
 #include "base/gtest.h"
 #include "base/logging.h"
+#include "base/walltime.h"
+#include "file/fiber_file.h"
 #include "file/file_util.h"
 #include "file/filesource.h"
 #include "file/gzip_file.h"
@@ -123,6 +125,150 @@ TEST_F(FileTest, UniquePtr) {
   std::unique_ptr<WriteFile> file(Open(base::GetTestTempPath("foo.txt")));
 }
 
+TEST_F(FileTest, MmapLineReader) {
+  string file_path = base::GetTestTempPath("mmap.txt");
+  string contents = "a\n\nbcd\r\nefg\r\r\n\n" + string(5000, 'h') + "\nlast";
+  file_util::WriteStringToFileOrDie(contents, file_path);
+
+  util::fibers_ext::FiberQueueThreadPool pool(1);
+  FiberReadOptions::Stats stats;
+  auto res = OpenMmapFile(file_path, &pool, &stats);
+  ASSERT_TRUE(res.ok()) << res.status;
+  std::unique_ptr<MmapFile> mmap_file(res.obj);
+  ASSERT_EQ(contents, mmap_file->data());
+
+  std::vector<size_t> read_ahead;
+  LineReader lr(mmap_file->data(), [&](size_t offset) { read_ahead.push_back(offset); });
+  std::vector<string> lines;
+  StringPiece line;
+  while (lr.Next(&line)) {
+    lines.emplace_back(line);
+  }
+  EXPECT_THAT(lines, ElementsAre("a", "", "bcd", "efg\r", "", string(5000, 'h'), "last"));
+  EXPECT_EQ(7, lr.line_num());
+  EXPECT_EQ(contents.size(), lr.offset());
+  EXPECT_THAT(read_ahead, ElementsAre(0));
+
+  // Read() copies from the mapping.
+  uint8_t buf[8];
+  auto read_res = mmap_file->Read(contents.size() - 5, strings::MutableByteRange(buf, sizeof(buf)));
+  ASSERT_TRUE(read_res.ok());
+  EXPECT_EQ("\nlast", StringPiece(reinterpret_cast<char*>(buf), read_res.obj));
+  EXPECT_EQ(0, stats.cache_bytes);
+  EXPECT_EQ(5, stats.disk_bytes);
+  ASSERT_TRUE(mmap_file->Close().ok());
+}
+
+TEST_F(FileTest, LineReader) {
+  std::vector<string> expected;
+  string contents;
+  for (unsigned i = 0; i < 3000; ++i) {
+    expected.push_back(string(i % 17 ? i % 97 : 5000, 'a' + i % 26));
+    contents.append(expected.back()).append(i % 3 ? "\n" : "\r\n");
+  }
+  contents.append("last");
+  expected.push_back("last");
+
+  // Lines that cross the reader pages must be returned whole.
+  util::StringSource source(contents);
+  LineReader lr(&source, DO_NOT_TAKE_OWNERSHIP, 11);
+  std::vector<string> lines;
+  StringPiece line;
+  string scratch;
+  while (lr.Next(&line, &scratch)) {
+    lines.emplace_back(line);
+  }
+  EXPECT_TRUE(expected == lines);
+  EXPECT_EQ(expected.size(), lr.line_num());
+
+  LineReader buf_lr{StringPiece(contents)};
+  lines.clear();
+  while (buf_lr.Next(&line)) {
+    lines.emplace_back(line);
+  }
+  EXPECT_TRUE(expected == lines);
+}
+
+TEST_F(FileTest, AdaptivePrefetch) {
+  string file_path = base::GetTestTempPath("prefetch.bin");
+  string contents = base::RandStr(3000000);
+  file_util::WriteStringToFileOrDie(contents, file_path);
+
+  util::fibers_ext::FiberQueueThreadPool pool(1);
+  FiberReadOptions::Stats stats;
+  FiberReadOptions opts;
+  opts.prefetch_size = 1 << 16;
+  opts.max_prefetch_size = 1 << 20;
+  opts.stats = &stats;
+
+  auto res = OpenFiberReadFile(file_path, &pool, opts);
+  ASSERT_TRUE(res.ok()) << res.status;
+  std::unique_ptr<ReadonlyFile> file(res.obj);
+
+  string read;
+  uint8_t buf[10007];
+  for (size_t offset = 0; offset < contents.size();) {
+    auto read_res = file->Read(offset, strings::MutableByteRange(buf, sizeof(buf)));
+    ASSERT_TRUE(read_res.ok()) << read_res.status;
+    read.append(reinterpret_cast<char*>(buf), read_res.obj);
+    offset += read_res.obj;
+  }
+  EXPECT_TRUE(contents == read);
+  EXPECT_GE(stats.cache_bytes + stats.disk_bytes, contents.size());
+  EXPECT_GE(stats.prefetch_window, opts.prefetch_size);
+  EXPECT_LE(stats.prefetch_window, opts.max_prefetch_size);
+
+  // Random access drops the prefetched data.
+  auto read_res = file->Read(10, strings::MutableByteRange(buf, 10));
+  ASSERT_TRUE(read_res.ok());
+  EXPECT_EQ(contents.substr(10, 10), string(reinterpret_cast<char*>(buf), 10));
+  ASSERT_TRUE(file->Close().ok());
+
+  // Grow the window again and then create memory pressure with the buffers of another file.
+  opts.prefetch_memory_limit = 4 << 20;
+  res = OpenFiberReadFile(file_path, &pool, opts);
+  ASSERT_TRUE(res.ok()) << res.status;
+  file.reset(res.obj);
+
+  size_t offset = 0;
+  std::unique_ptr<uint8_t[]> chunk_buf(new uint8_t[2 * opts.prefetch_size]);
+  auto read_next = [&](size_t len) {
+    auto chunk_res = file->Read(offset, strings::MutableByteRange(chunk_buf.get(), len));
+    ASSERT_TRUE(chunk_res.ok()) << chunk_res.status;
+    ASSERT_EQ(len, chunk_res.obj);
+    EXPECT_EQ(contents.substr(offset, len), string(reinterpret_cast<char*>(chunk_buf.get()), len));
+    offset += len;
+  };
+
+  // Prefetches the first two chunks and consumes the first one while the pool thread is stalled,
+  // so the chunk requested behind the stall is not ready when the reader reaches it.
+  read_next(10);
+  pool.Add([] { SleepForMilliseconds(20); });
+  read_next(opts.prefetch_size);
+  read_next(2 * opts.prefetch_size);
+  ASSERT_GT(stats.prefetch_window, opts.prefetch_size);
+
+  FiberReadOptions big_opts;
+  big_opts.prefetch_size = opts.prefetch_memory_limit;
+  res = OpenFiberReadFile(file_path, &pool, big_opts);
+  ASSERT_TRUE(res.ok()) << res.status;
+  std::unique_ptr<ReadonlyFile> big_file(res.obj);
+  ASSERT_TRUE(big_file->Read(0, strings::MutableByteRange(buf, 10)).ok());
+
+  // Every read halves the window until a single request is in flight.
+  for (unsigned i = 0; i < 8; ++i) {
+    read_res = file->Read(offset, strings::MutableByteRange(buf, sizeof(buf)));
+    ASSERT_TRUE(read_res.ok()) << read_res.status;
+    offset += read_res.obj;
+  }
+  EXPECT_EQ(opts.prefetch_size, stats.prefetch_window);
+  EXPECT_EQ(contents.substr(offset - read_res.obj, read_res.obj),
+            string(reinterpret_cast<char*>(buf), read_res.obj));
+
+  ASSERT_TRUE(big_file->Close().ok());
+  ASSERT_TRUE(file->Close().ok());
+}
+
 constexpr size_t kStrLen = 1 << 17;
 
 static void BM_GZipFile(benchmark::State& state) {
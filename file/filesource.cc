@@ -7,9 +7,9 @@
 #include <cstring>
 
 #include "base/logging.h"
+#include "base/simd.h"
 #include "file/file.h"
-#include "strings/split.h"
-#include "strings/strip.h"
+#include "file/parallel_decompress.h"
 #include "util/bzip_source.h"
 #include "util/zlib_source.h"
 #include "util/zstd_sinksource.h"
@@ -20,8 +20,8 @@ using util::Status;
 using util::StatusObject;
 using namespace std;
 
-Source::Source(ReadonlyFile* file)
- : file_(file) {
+Source::Source(ReadonlyFile* file, uint64 offset)
+ : file_(file), offset_(offset) {
 }
 
 Source::~Source() {
@@ -50,6 +50,22 @@ util::Source* Source::Uncompressed(ReadonlyFile* file) {
   return first;
 }
 
+util::Source* Source::Uncompressed(ReadonlyFile* file,
+                                   util::fibers_ext::FiberQueueThreadPool* tp) {
+  if (!tp)
+    return Uncompressed(file);
+
+  Source* first = new Source(file);
+  if (util::ZStdSource::HasValidHeader(first))
+    return new ParallelDecompressSource(ParallelDecompressSource::ZSTD, first, tp);
+
+  if (util::BzipSource::IsBzipSource(first))
+    return new util::BzipSource(first);
+  if (util::ZlibSource::IsZlibSource(first))
+    return new ParallelDecompressSource(ParallelDecompressSource::GZIP, first, tp);
+  return first;
+}
+
 Sink::~Sink() {
   if (ownership_ == TAKE_OWNERSHIP)
     CHECK(file_->Close());
@@ -78,6 +94,17 @@ LineReader::LineReader(const std::string& fl) : ownership_(TAKE_OWNERSHIP) {
   Init(DEFAULT_BUF_LOG);
 }
 
+LineReader::LineReader(StringPiece buf, ReadAheadCb read_ahead_cb)
+    : source_(nullptr), ownership_(DO_NOT_TAKE_OWNERSHIP), page_size_(0), in_buffer_(true),
+      read_ahead_cb_(std::move(read_ahead_cb)) {
+  // We never write into the buffer in this mode.
+  next_ = const_cast<char*>(buf.data());
+  end_ = next_ + buf.size();
+  next_read_ahead_ = next_;
+  scan_end_ = next_;
+  read_bytes_ = buf.size();
+}
+
 LineReader::~LineReader() {
   if (ownership_ == TAKE_OWNERSHIP) {
     delete source_;
@@ -85,12 +112,18 @@ LineReader::~LineReader() {
 }
 
 bool LineReader::Next(StringPiece* result, std::string* scratch) {
+  if (in_buffer_)
+    return NextInBuffer(result);
+
   bool use_scratch = false;
 
   const char* const eof_page = buf_.get() + page_size_ - 1;
   while (true) {
-    // Common case: search of EOL.
-    char* ptr =  reinterpret_cast<char*>(rawmemchr(next_, '\n'));
+    // Common case: the next EOL was already found by ScanEol. Otherwise we point to the
+    // sentinel at end_.
+    char* ptr = end_;
+    if (eol_pos_ < eol_.size())
+      ptr = const_cast<char*>(eol_base_) + eol_[eol_pos_++];
 
     if (ptr < end_) {  // Found EOL.
       ++line_num_;
@@ -104,6 +137,10 @@ bool LineReader::Next(StringPiece* result, std::string* scratch) {
 
       if (use_scratch) {
         scratch->append(next_, ptr);
+
+        // CRLF split between the pages: '\r' was copied into scratch with the previous page.
+        if (ptr == next_ && delta == 1 && !scratch->empty() && scratch->back() == '\r')
+          scratch->pop_back();
         *result = *scratch;
       } else {
         *result = StringPiece(next_, ptr - next_);
@@ -152,6 +189,8 @@ bool LineReader::Next(StringPiece* result, std::string* scratch) {
     next_ = buf_.get();
     end_ = next_ + s.obj;
     *end_ = '\n';  // sentinel.
+    read_bytes_ += s.obj;
+    ScanEol(next_, s.obj);
   }
 
   if (use_scratch) {
@@ -165,35 +204,126 @@ bool LineReader::Next(StringPiece* result, std::string* scratch) {
   return false;
 }
 
+bool LineReader::NextInBuffer(StringPiece* result) {
+  // How often we notify read_ahead_cb_.
+  constexpr size_t kReadAheadStep = 1 << 20;
+
+  if (next_ == end_) {
+    line_num_ |= kEofMask;
+    return false;
+  }
+
+  if (read_ahead_cb_ && next_ >= next_read_ahead_) {
+    read_ahead_cb_(offset());
+    next_read_ahead_ = next_ + kReadAheadStep;
+  }
+
+  // How much of the buffer we scan for EOLs at once.
+  constexpr size_t kScanStep = 1 << 16;
+
+  // Long lines may span multiple scan steps.
+  while (eol_pos_ == eol_.size() && scan_end_ != end_) {
+    size_t len = std::min<size_t>(kScanStep, end_ - scan_end_);
+    ScanEol(scan_end_, len);
+    scan_end_ += len;
+  }
+
+  char* ptr = nullptr;
+  if (eol_pos_ < eol_.size())
+    ptr = const_cast<char*>(eol_base_) + eol_[eol_pos_++];
+
+  char* next = end_;
+  if (ptr) {
+    next = ptr + 1;
+    if (ptr > next_ && ptr[-1] == '\r') {
+      --ptr;
+    }
+  } else {
+    ptr = end_;  // The last line without EOL.
+  }
+
+  *result = StringPiece(next_, ptr - next_);
+  next_ = next;
+  ++line_num_;
+
+  return true;
+}
+
+void LineReader::ScanEol(const char* start, size_t len) {
+  eol_.clear();
+  eol_pos_ = 0;
+  eol_base_ = start;
+  base::FindVal8(reinterpret_cast<const uint8_t*>(start), len, '\n', &eol_);
+}
+
 CsvReader::CsvReader(const std::string& filename,
                      std::function<void(const std::vector<StringPiece>&)> row_cb)
-    : reader_(filename), row_cb_(row_cb) {
+    : row_cb_(row_cb), buf_size_(1 << 17) {
+  auto res = ReadonlyFile::Open(filename);
+  CHECK(res.ok()) << filename << res.status;
+
+  source_.reset(file::Source::Uncompressed(res.obj));
+  buf_.reset(new char[buf_size_]);
+}
+
+CsvReader::~CsvReader() {
 }
 
 void CsvReader::SkipHeader(unsigned rows) {
-  string tmp;
-  StringPiece tmp2;
+  vector<StringPiece> tmp;
   for (unsigned i = 0; i < rows; ++i) {
-    if (!reader_.Next(&tmp2, &tmp))
+    if (!Next(&tmp))
       return;
   }
 }
 
 bool CsvReader::Next(std::vector<StringPiece>* result) {
-  StringPiece line;
+  if (row_ == batch_.num_rows() && !Refill())
+    return false;
 
-  while (true) {
-    if (!reader_.Next(&line, &scratch_))
+  unsigned num_fields = batch_.num_fields(row_);
+  if (scratch_.size() < num_fields)
+    scratch_.resize(num_fields);
+
+  result->resize(num_fields);
+  for (unsigned i = 0; i < num_fields; ++i) {
+    (*result)[i] = batch_.Get(row_, i, &scratch_[i]);
+  }
+  ++row_;
+
+  return true;
+}
+
+bool CsvReader::Refill() {
+  row_ = 0;
+  while (!eof_) {
+    // Move the unparsed tail to the beginning of the buffer.
+    size_ -= consumed_;
+    memmove(buf_.get(), buf_.get() + consumed_, size_);
+    consumed_ = 0;
+
+    if (size_ == buf_size_) {
+      // The row does not fit into the buffer.
+      buf_size_ *= 2;
+      std::unique_ptr<char[]> tmp(new char[buf_size_]);
+      memcpy(tmp.get(), buf_.get(), size_);
+      buf_.swap(tmp);
+    }
+
+    strings::MutableByteRange range(reinterpret_cast<uint8_t*>(buf_.get()) + size_,
+                                    buf_size_ - size_);
+    auto res = source_->Read(range);
+    if (!res.ok()) {
+      LOG(ERROR) << "CsvReader read error " << res.status;
+      batch_ = CsvBatch{};
       return false;
-    line = absl::StripAsciiWhitespace(line);
-    if (line.empty())
-      continue;
-    char* ptr = const_cast<char*>(line.data());
-    parts_.clear();
-    SplitCSVLineWithDelimiter(ptr, ',',  &parts_);
-    result->assign(parts_.begin(), parts_.end());
+    }
+    eof_ = res.obj < range.size();
+    size_ += res.obj;
 
-    return true;
+    consumed_ = parser_.Parse(StringPiece(buf_.get(), size_), eof_, &batch_);
+    if (batch_.num_rows())
+      return true;
   }
   return false;
 }
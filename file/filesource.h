@@ -6,11 +6,19 @@
 
 #include <functional>
 #include <memory>
+#include <vector>
 
 #include "base/integral_types.h"
+#include "file/csv_parser.h"
 #include "strings/stringpiece.h"
 #include "util/sinksource.h"
 
+namespace util {
+namespace fibers_ext {
+class FiberQueueThreadPool;
+}  // namespace fibers_ext
+}  // namespace util
+
 namespace file {
 class ReadonlyFile;
 class WriteFile;
@@ -18,13 +26,19 @@ class WriteFile;
 class Source : public util::Source {
  public:
   // File must be open for reading. Source takes ownership over it.
-  Source(ReadonlyFile* file);
+  // Reads the file starting from offset.
+  Source(ReadonlyFile* file, uint64 offset = 0);
   ~Source();
 
 
   // Returns the source wrapping the file. If the file is compressed, than the stream
   // automatically inflates the compressed data. The returned source owns the file object.
   static util::Source* Uncompressed(ReadonlyFile* file);
+
+  // Similar to the above, but decompresses the independent gzip members and zstd frames
+  // concurrently in tp. See ParallelDecompressSource. tp may be null.
+  static util::Source* Uncompressed(ReadonlyFile* file,
+                                    util::fibers_ext::FiberQueueThreadPool* tp);
  private:
   util::StatusObject<size_t> ReadInternal(const strings::MutableByteRange& range) override;
 
@@ -46,6 +60,8 @@ private:
 
 // Assumes that source provides stream of text characters.
 // Will break the stream into lines ending with EOL (either \r\n\ or \n).
+// EOL positions are found with SIMD for the whole buffer at once and the lines are handed out
+// from the resulting offsets.
 class LineReader {
 public:
   enum {DEFAULT_BUF_LOG = 17};
@@ -57,10 +73,21 @@ public:
 
   explicit LineReader(const std::string& filename);
 
+  typedef std::function<void(size_t offset)> ReadAheadCb;
+
+  // Zero-copy reader over the contiguous buffer, for example over a memory mapped file.
+  // Unlike with the source, the returned lines point into the buffer and are not
+  // null-terminated. The buffer must outlive the reader. If set, read_ahead_cb is called
+  // periodically with the offset of the next line.
+  explicit LineReader(StringPiece buf, ReadAheadCb read_ahead_cb = ReadAheadCb{});
+
   ~LineReader();
 
   uint64 line_num() const { return line_num_ & (kEofMask - 1);}
 
+  // Returns the offset of the next line relative to the beginning of the source.
+  uint64 offset() const { return read_bytes_ - (end_ - next_); }
+
   // Sets the result to point to null-terminated line.
   // Empty lines are also returned.
   // Returns true if new line was found or false if end of stream was reached.
@@ -71,8 +98,14 @@ public:
 private:
   void Init(uint32_t buf_log);
 
+  bool NextInBuffer(StringPiece* result);
+
+  // Replaces eol_ with the EOL offsets of [start, start + len).
+  void ScanEol(const char* start, size_t len);
+
   util::Source* source_;
   uint64 line_num_ = 0;   // MSB bit means EOF was reached.
+  uint64 read_bytes_ = 0;
   std::unique_ptr<char[]> buf_;
   char* next_, *end_;
 
@@ -81,23 +114,49 @@ private:
   std::string scratch_;
   util::Status status_;
 
+  // EOL offsets relative to eol_base_. eol_pos_ is the next unused offset.
+  std::vector<uint32_t> eol_;
+  size_t eol_pos_ = 0;
+  const char* eol_base_ = nullptr;
+
+  // Zero-copy mode.
+  const char* scan_end_ = nullptr;  // The buffer is scanned for EOLs upto here.
+  bool in_buffer_ = false;
+  ReadAheadCb read_ahead_cb_;
+  const char* next_read_ahead_ = nullptr;
+
   static constexpr uint64_t kEofMask = 1ULL << 63;
 };
 
+// Reads RFC 4180 CSV files. See CsvParser for details.
 class CsvReader {
-  LineReader reader_;
-  std::function<void(const std::vector<StringPiece>&)> row_cb_;
-public:
+ public:
   explicit CsvReader(const std::string& filename,
                      std::function<void(const std::vector<StringPiece>&)> row_cb);
+  ~CsvReader();
+
   void SkipHeader(unsigned rows = 1);
 
   void Run();
+
+  // The fields are valid until the next call.
   bool Next(std::vector<StringPiece>* result);
 
  private:
-  std::string scratch_;
-  std::vector<char*> parts_;
+  // Reads more data and parses the next batch of rows. Returns false at EOF.
+  bool Refill();
+
+  std::unique_ptr<util::Source> source_;
+  std::function<void(const std::vector<StringPiece>&)> row_cb_;
+
+  CsvParser parser_;
+  CsvBatch batch_;
+  size_t row_ = 0;  // next row in batch_.
+
+  std::unique_ptr<char[]> buf_;
+  size_t buf_size_, size_ = 0, consumed_ = 0;
+  bool eof_ = false;
+  std::vector<std::string> scratch_;
 };
 
 }  // namespace file
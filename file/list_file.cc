@@ -6,11 +6,14 @@
 
 #include <crc32c/crc32c.h>
 
+#include <deque>
+
 #include "base/fixed.h"
 #include "file/compressors.h"
 #include "file/file_util.h"
 #include "file/filesource.h"
 #include "file/lst2_impl.h"
+#include "util/fibers/fiberqueue_threadpool.h"
 
 #include "base/coder.h"
 #include "base/varint.h"
@@ -313,6 +316,155 @@ Status Lst1Impl::EmitPhysicalRecord(RecordType type, const uint8* ptr, size_t le
   block_leftover_ = block_size_ - block_offset_;
   return Status::OK;
 }
+
+// Runs the wrapped writer on a single worker of the pool, so that the blocks are handled in order.
+// The caller only copies the records into block-sized batches.
+class AsyncImpl : public ListWriter::WriterImpl {
+ public:
+  AsyncImpl(ListWriter::WriterImpl* next, const ListWriter::Options& opts);
+  ~AsyncImpl();
+
+  Status Init(const std::map<string, string>& meta) final;
+  Status AddRecord(StringPiece slice) final;
+  Status Flush() final;
+  Status Close() final;
+
+ private:
+  struct Batch {
+    fibers_ext::Done done;
+    Status status;
+  };
+
+  void Submit();
+
+  // Waits for the oldest batch in flight and records its status.
+  void PopBatch();
+
+  // Submits the pending records and waits for all the batches in flight.
+  Status Drain();
+
+  std::unique_ptr<ListWriter::WriterImpl> next_;
+  fibers_ext::FiberQueueThreadPool* pool_;
+  size_t worker_index_;
+  size_t batch_size_;
+
+  string buf_;  // varint size prefixed records.
+  std::deque<Batch> in_flight_;
+  Status status_;  // the first background error.
+
+  // Set by the worker after the first failure. Following batches are dropped.
+  std::atomic_bool failed_{false};
+};
+
+std::atomic_ulong next_async_worker{0};
+
+AsyncImpl::AsyncImpl(ListWriter::WriterImpl* next, const ListWriter::Options& opts)
+    : WriterImpl(nullptr, opts), next_(next), pool_(opts.async_pool) {
+  CHECK_GT(opts.async_max_blocks, 0);
+  worker_index_ = next_async_worker.fetch_add(1, std::memory_order_relaxed);
+  batch_size_ = kBlockSizeFactor * std::max<uint8>(opts.block_size_multiplier, 1);
+  buf_.reserve(batch_size_ + Varint::kMax32);
+}
+
+AsyncImpl::~AsyncImpl() {
+  Status st = Drain();
+  LOG_IF(ERROR, !st.ok()) << "Async list writer failed: " << st;
+}
+
+Status AsyncImpl::Init(const std::map<string, string>& meta) {
+  RETURN_IF_ERROR(next_->Init(meta));
+  init_called_ = next_->init_called();
+  return Status::OK;
+}
+
+Status AsyncImpl::AddRecord(StringPiece record) {
+  RETURN_IF_ERROR(status_);
+
+  Varint32Encoder enc(record.size());
+  buf_.append(enc.slice().data(), enc.size()).append(record.data(), record.size());
+  ++records_added_;
+
+  // The wrapped writer updates its counter on the worker thread, so we account the record here.
+  // Flush() and Close() replace it with the exact value, which is the same for lst2.
+  bytes_added_ += record.size();
+
+  if (buf_.size() >= batch_size_) {
+    Submit();
+  }
+  return status_;
+}
+
+Status AsyncImpl::Flush() {
+  Status st = Drain();
+
+  // We flush the wrapped writer even after a failure so that it drops its pending records.
+  Status flush_st = next_->Flush();
+  bytes_added_ = next_->bytes_added();
+  compression_savings_ = next_->compression_savings();
+  return st.ok() ? flush_st : st;
+}
+
+Status AsyncImpl::Close() {
+  Status st = Drain();
+  if (!st.ok()) {
+    next_->Flush();
+    return st;
+  }
+
+  st = next_->Close();
+  bytes_added_ = next_->bytes_added();
+  compression_savings_ = next_->compression_savings();
+  return st;
+}
+
+void AsyncImpl::Submit() {
+  if (in_flight_.size() >= options_.async_max_blocks) {
+    PopBatch();
+  }
+  in_flight_.emplace_back();
+  Batch* batch = &in_flight_.back();  // deque does not move its elements on push/pop.
+
+  auto cb = [this, batch, done = batch->done, buf = std::move(buf_)]() mutable {
+    if (!failed_.load(std::memory_order_relaxed)) {
+      const uint8* ptr = u8ptr(buf);
+      const uint8* end = ptr + buf.size();
+      uint32 sz = 0;
+      while (ptr < end) {
+        ptr = Varint::Parse32WithLimit(ptr, end, &sz);
+        batch->status = next_->AddRecord(StringPiece(strings::charptr(ptr), sz));
+        if (!batch->status.ok()) {
+          failed_.store(true, std::memory_order_relaxed);
+          break;
+        }
+        ptr += sz;
+      }
+    }
+    done.Notify();
+  };
+  pool_->Add(worker_index_, std::move(cb));
+
+  buf_.clear();
+  buf_.reserve(batch_size_ + Varint::kMax32);
+}
+
+void AsyncImpl::PopBatch() {
+  Batch& batch = in_flight_.front();
+  batch.done.Wait();
+  if (status_.ok())
+    status_ = std::move(batch.status);
+  in_flight_.pop_front();
+}
+
+Status AsyncImpl::Drain() {
+  if (!buf_.empty()) {
+    Submit();
+  }
+  while (!in_flight_.empty()) {
+    PopBatch();
+  }
+  return status_;
+}
+
 }  // namespace
 
 ListWriter::ListWriter(StringPiece filename, const Options& options) {
@@ -344,6 +496,9 @@ ListWriter::ListWriter(StringPiece filename, const Options& options) {
   WriteFile* file = file::Open(filename, open_options);
 
   impl_.reset(new Lst1Impl(new Sink(file, TAKE_OWNERSHIP), opts));
+  if (opts.async_pool) {
+    impl_.reset(new AsyncImpl(impl_.release(), opts));
+  }
 }
 
 ListWriter::ListWriter(util::Sink* dest, const Options& options) {
@@ -352,6 +507,9 @@ ListWriter::ListWriter(util::Sink* dest, const Options& options) {
   } else {
     impl_.reset(new Lst1Impl(dest, options));
   }
+  if (options.async_pool) {
+    impl_.reset(new AsyncImpl(impl_.release(), options));
+  }
 }
 
 // Adds user provided meta information about the file. Must be called before Init.
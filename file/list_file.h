@@ -13,6 +13,12 @@
 #include "strings/slice.h"
 #include "util/sinksource.h"
 
+namespace util {
+namespace fibers_ext {
+class FiberQueueThreadPool;
+}  // namespace fibers_ext
+}  // namespace util
+
 namespace file {
 
 class ListWriter {
@@ -25,6 +31,26 @@ class ListWriter {
     bool append = false;
     bool v2 = false;
 
+    // lst2 only. Writes the record index when the writer is closed.
+    // See ListReader::SeekToRecord.
+    bool index = false;
+
+    // lst2 only. If set, the index also stores the key of the first record in each block.
+    // See ListReader::SeekToKey. Records must be added in non-decreasing key order.
+    IndexKeyFn index_key;
+
+    // lst2 only. If set, the index also stores min/max and a bloom filter of the keys of the
+    // records in each block. See ListReader::SetBlockFilter. Requires index.
+    IndexKeyFn stats_key;
+    uint8 bloom_bits_per_key = 10;
+
+    // If set, the records are batched into blocks that are compressed and appended to the sink
+    // on a worker of async_pool while the caller keeps filling the next block.
+    // The output is identical to the synchronous one. Background errors are returned
+    // by the subsequent AddRecord/Flush/Close calls. The pool must outlive the writer.
+    util::fibers_ext::FiberQueueThreadPool* async_pool = nullptr;
+    unsigned async_max_blocks = 2;  // the number of blocks in flight.
+
     Options() {}
 
     size_t internal_append_offset = 0;
@@ -45,6 +71,9 @@ class ListWriter {
 
   util::Status Flush() { return impl_->Flush(); }
 
+  // Flushes the pending records and finalizes the file. No records can be added afterwards.
+  util::Status Close() { return impl_->Close(); }
+
   uint32 records_added() const { return impl_->records_added(); }
   uint64 bytes_added() const { return impl_->bytes_added(); }
   uint64 compression_savings() const { return impl_->compression_savings(); }
@@ -58,6 +87,7 @@ class ListWriter {
     virtual util::Status Init(const std::map<std::string, std::string>& meta) = 0;
     virtual util::Status AddRecord(StringPiece slice) = 0;
     virtual util::Status Flush() = 0;
+    virtual util::Status Close() { return Flush(); }
 
     uint32 records_added() const { return records_added_; }
     uint64 bytes_added() const { return bytes_added_; }
@@ -8,12 +8,18 @@
 #ifndef _LIST_FILE_FORMAT_H_
 #define _LIST_FILE_FORMAT_H_
 
+#include <functional>
 #include <map>
 #include "base/integral_types.h"
 #include "file/file.h"
+#include "strings/stringpiece.h"
 #include "util/status.h"
 
 namespace file {
+
+// Extracts the sort key of a record for the lst2 record index.
+typedef std::function<std::string(StringPiece record)> IndexKeyFn;
+
 namespace list_file {
 
 enum RecordType {
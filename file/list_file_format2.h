@@ -30,7 +30,10 @@ enum RecordType : uint8_t {
   kLastType = 4,
   kArrayType = 5,
 
-  kMaxRecordVal = kArrayType,
+  // Marks the end of the data records. It's followed by the record index and its trailer.
+  kIndexType = 6,
+
+  kMaxRecordVal = kIndexType,
 
   kRecordSize3BytesFlag = 0x08,
   kCompressedFlag = 0x10,
@@ -38,6 +41,22 @@ enum RecordType : uint8_t {
 
 static_assert(RecordType::kMaxRecordVal < 8, "Must be 3 bits");
 
+/*
+   Optional record index that follows the kIndexType marker record:
+   |varint num_records|varint num_entries|varint flags|entries...|
+   where each entry is |varint block delta|varint first record delta|varint key_size|key|.
+   If kIndexHasStats flag is set, each entry is followed by the block stats:
+   |varint min_size|min key|varint max_size|max key|varint bloom_size|bloom filter|.
+   The index is followed by the fixed size trailer:
+   |crc32c of the index (4)|index size (4)|kIndexMagic (4)|
+
+   Each entry describes a block that has at least one record starting in it.
+   First record numbers count the meta records as well.
+*/
+constexpr uint8_t kIndexTrailerSize = 12;
+constexpr uint32_t kIndexHasStats = 1;
+extern const char kIndexMagic[];
+
 /*
    Record Header:
    |Type_Flags(1) | CompressType(1)? | ArrayCount(2)? | RecordSize (2-3) | CRC(4)? |
@@ -5,6 +5,7 @@
 #include "file/list_file_reader.h"
 
 #include <cstdio>
+#include <deque>
 
 #include "base/flags.h"
 #include "base/varint.h"
@@ -14,6 +15,7 @@
 #include "file/compressors.h"
 #include "file/lst2_impl.h"
 #include "absl/strings/match.h"
+#include "util/fibers/fiberqueue_threadpool.h"
 
 namespace file {
 
@@ -28,22 +30,48 @@ using namespace ::util;
 
 namespace {
 
+// Describes a corruption found while parsing a block. Blocks may be parsed on a worker thread,
+// therefore corruptions are reported by the reader thread later, in file order.
+struct Drop {
+  size_t bytes = 0;
+  const char* reason = nullptr;
+};
+
 class Lst1Impl : public ListReader::FormatImpl {
  public:
   using FormatImpl::FormatImpl;
+  ~Lst1Impl();
 
   bool ReadHeader(std::map<std::string, std::string>* dest) final;
 
   bool ReadRecord(StringPiece* record, std::string* scratch) final;
 
  private:
+  struct Block;
+
   // Return type, or one of the preceding special values
   unsigned int ReadPhysicalRecord(StringPiece* result);
 
+  // Same as ReadPhysicalRecord but takes the records from the read-ahead blocks.
+  unsigned int ReadAheadPhysicalRecord(StringPiece* result);
+
+  // Reads upcoming blocks and submits them to the decode pool until wrapper_->read_ahead
+  // blocks are in flight.
+  void FillReadAhead();
+
+  // Parses all the records of the block. Runs on a decode pool thread.
+  void DecodeBlock(Block* block) const;
+
+  // Parses the physical record at the beginning of *block and advances past it.
+  // Returns record type, kBadRecord or kBlockEnd if the rest of the block should be skipped.
+  // Compressed records are uncompressed into uncompress_buf that must hold block_size bytes.
+  unsigned int ParsePhysicalRecord(strings::ByteRange* block, uint8* uncompress_buf,
+                                   StringPiece* result, Drop* drop) const;
+
   // 'size' is size of the compressed blob.
-  // Returns true if succeeded. In that case uncompress_buf_ will contain the uncompressed data
+  // Returns true if succeeded. In that case dest will contain the uncompressed data
   // and size will be updated to the uncompressed size.
-  bool Uncompress(const uint8* data_ptr, uint32* size);
+  bool Uncompress(const uint8* data_ptr, uint8* dest, uint32* size) const;
 
   // Extend record types with the following special values
   enum {
@@ -53,10 +81,78 @@ class Lst1Impl : public ListReader::FormatImpl {
     // * The record has an invalid CRC (ReadPhysicalRecord reports a drop)
     // * The record is a 0-length record (No drop is reported)
     // * The record is below constructor's initial_offset (No drop is reported)
-    kBadRecord = list_file::kMaxRecordType + 2
+    kBadRecord = list_file::kMaxRecordType + 2,
+
+    // Returned by ParsePhysicalRecord when the rest of the block is padding.
+    // Must be out of the range of the masked record types, see ParsePhysicalRecord.
+    kBlockEnd = 0x10,
+  };
+
+  // Returns a block from free_blocks_ or allocates a new one.
+  std::unique_ptr<Block> GetBlock();
+
+  std::deque<std::unique_ptr<Block>> read_ahead_;  // Blocks in flight, in file order.
+  std::vector<std::unique_ptr<Block>> free_blocks_;  // Consumed blocks, reused with their buffers.
+  std::unique_ptr<Block> cur_block_;
+  size_t cur_record_ = 0;  // Index of the next record in cur_block_.
+};
+
+struct Lst1Impl::Block {
+  struct Record {
+    unsigned type;
+    StringPiece data;
+    Drop drop;
+    size_t arena_offset;  // kNoOffset unless data was uncompressed into the arena.
   };
+
+  static constexpr size_t kNoOffset = size_t(-1);
+
+  explicit Block(uint32_t block_size) : data(new uint8[block_size]) {}
+
+  void Clear() {
+    size = header_bytes = arena_size = 0;
+    is_last = false;
+    read_status = Status::OK;
+    done.Reset();
+    records.clear();
+  }
+
+  // Returns the end of the arena, which can hold at least len bytes.
+  uint8* ArenaTail(size_t len);
+
+  std::unique_ptr<uint8[]> data;
+  size_t size = 0;
+  bool is_last = false;
+  Status read_status;
+
+  util::fibers_ext::Done done;  // Notified when records were parsed.
+  std::vector<Record> records;
+  size_t header_bytes = 0;
+
+  // Backing store for the uncompressed records of the block.
+  std::unique_ptr<uint8[]> arena;
+  size_t arena_size = 0, arena_cap = 0;
 };
 
+uint8* Lst1Impl::Block::ArenaTail(size_t len) {
+  if (arena_size + len > arena_cap) {
+    size_t cap = std::max(arena_cap * 2, arena_size + len);
+    std::unique_ptr<uint8[]> next(new uint8[cap]);
+    if (arena_size)
+      memcpy(next.get(), arena.get(), arena_size);
+    arena.swap(next);
+    arena_cap = cap;
+  }
+  return arena.get() + arena_size;
+}
+
+Lst1Impl::~Lst1Impl() {
+  // Decode tasks reference the blocks, so we must wait for them to finish.
+  for (auto& block : read_ahead_) {
+    block->done.Wait();
+  }
+}
+
 bool Lst1Impl::ReadHeader(std::map<std::string, std::string>* dest) {
   list_file::HeaderParser parser;
   Status status = parser.Parse(wrapper_->file, dest);
@@ -70,8 +166,10 @@ bool Lst1Impl::ReadHeader(std::map<std::string, std::string>* dest) {
   wrapper_->block_size = parser.block_multiplier() * list_file::kBlockSizeFactor;
 
   CHECK_GT(wrapper_->block_size, 0);
-  backing_store_.reset(new uint8[wrapper_->block_size]);
-  uncompress_buf_.reset(new uint8[wrapper_->block_size]);
+  if (wrapper_->read_ahead == 0) {
+    backing_store_.reset(new uint8[wrapper_->block_size]);
+    uncompress_buf_.reset(new uint8[wrapper_->block_size]);
+  }
   if (file_offset_ >= wrapper_->file->Size()) {
     wrapper_->eof = true;
   }
@@ -105,7 +203,8 @@ bool Lst1Impl::ReadRecord(StringPiece* record, std::string* scratch) {
         return true;
       }
     }
-    const unsigned int record_type = ReadPhysicalRecord(&fragment);
+    const unsigned int record_type = wrapper_->read_ahead ? ReadAheadPhysicalRecord(&fragment)
+                                                          : ReadPhysicalRecord(&fragment);
     switch (record_type) {
       case kFullType:
         if (in_fragmented_record) {
@@ -218,66 +317,191 @@ unsigned int Lst1Impl::ReadPhysicalRecord(StringPiece* result) {
       }
     }
 
-    // Parse the header
-    const uint8* header = block_buffer_.data();
-    const uint8 type = header[8];
-    uint32 length = coding::DecodeFixed32(header + 4);
     wrapper_->read_header_bytes += kBlockHeaderSize;
 
-    if (length == 0 && type == list_file::kZeroType) {
-      size_t bs = block_buffer_.size();
-      block_buffer_.clear();
-      // Handle the case of when mistakenly written last kBlockHeaderSize bytes as empty record.
-      if (bs != kBlockHeaderSize) {
-        LOG(ERROR) << "Bug reading list file " << bs;
-        return kBadRecord;
+    Drop drop;
+    unsigned int type = ParsePhysicalRecord(&block_buffer_, uncompress_buf_.get(), result, &drop);
+    if (drop.reason) {
+      wrapper_->ReportCorruption(drop.bytes, drop.reason);
+    }
+    if (type != kBlockEnd)
+      return type;
+  }
+}
+
+unsigned int Lst1Impl::ReadAheadPhysicalRecord(StringPiece* result) {
+  while (true) {
+    if (cur_block_ && cur_record_ < cur_block_->records.size()) {
+      const Block::Record& rec = cur_block_->records[cur_record_++];
+      if (rec.drop.reason) {
+        wrapper_->ReportCorruption(rec.drop.bytes, rec.drop.reason);
       }
-      continue;
+      if (rec.type == kBlockEnd)
+        continue;
+
+      *result = rec.data;
+      return rec.type;
     }
 
-    if (length + kBlockHeaderSize > block_buffer_.size()) {
-      VLOG(1) << "Invalid length " << length << " file offset " << file_offset_
-              << " block size " << block_buffer_.size() << " type " << int(type);
-      size_t drop_size = block_buffer_.size();
-      block_buffer_.clear();
-      wrapper_->ReportCorruption(drop_size, "bad record length or truncated record at eof.");
-      return kBadRecord;
+    FillReadAhead();
+    if (read_ahead_.empty()) {
+      cur_block_.reset();
+      return kEof;
     }
 
-    const uint8* data_ptr = header + kBlockHeaderSize;
-    // Check crc
-    if (wrapper_->checksum) {
-      uint32_t expected_crc = crc32c::Unmask(coding::DecodeFixed32(header));
-      // compute crc of the record and the type.
-      uint32_t actual_crc = crc32c::Value(data_ptr - 1, 1 + length);
-      if (actual_crc != expected_crc) {
-        // Drop the rest of the buffer since "length" itself may have
-        // been corrupted and if we trust it, we could find some
-        // fragment of a real log record that just happens to look
-        // like a valid log record.
-        size_t drop_size = block_buffer_.size();
-        block_buffer_.clear();
-        wrapper_->ReportCorruption(drop_size, "checksum mismatch");
-        return kBadRecord;
-      }
+    if (cur_block_) {
+      free_blocks_.push_back(std::move(cur_block_));
     }
-    uint32 record_size = length + kBlockHeaderSize;
-    block_buffer_.advance(record_size);
+    cur_block_ = std::move(read_ahead_.front());
+    read_ahead_.pop_front();
+    cur_record_ = 0;
 
-    if (type & list_file::kCompressedMask) {
-      if (!Uncompress(data_ptr, &length)) {
-        wrapper_->ReportCorruption(record_size, "Uncompress failed.");
-        return kBadRecord;
-      }
-      data_ptr = uncompress_buf_.get();
+    FillReadAhead();  // Keep the pipeline full while we wait for the current block.
+    cur_block_->done.Wait();
+
+    if (!cur_block_->read_status.ok()) {
+      wrapper_->ReportDrop(cur_block_->size, cur_block_->read_status);
+      return kEof;
+    }
+    wrapper_->read_header_bytes += cur_block_->header_bytes;
+  }
+}
+
+void Lst1Impl::FillReadAhead() {
+  size_t fsize = wrapper_->file->Size();
+
+  while (!wrapper_->eof && read_ahead_.size() < wrapper_->read_ahead) {
+    std::unique_ptr<Block> block = GetBlock();
+    strings::MutableByteRange mbr(block->data.get(), wrapper_->block_size);
+    auto res = wrapper_->file->Read(file_offset_, mbr);
+    VLOG(2) << "read_size: " << res.obj << ", status: " << res.status;
+
+    block->size = res.obj;
+    if (!res.ok()) {
+      block->read_status = res.status;
+      block->done.Notify();
+      read_ahead_.push_back(std::move(block));
+      wrapper_->eof = true;
+      break;
+    }
+
+    file_offset_ += res.obj;
+    if (file_offset_ >= fsize || res.obj == 0) {
+      wrapper_->eof = block->is_last = true;
     }
 
-    *result = FromBuf(data_ptr, length);
-    return type & 0xF;
+    Block* ptr = block.get();
+    read_ahead_.push_back(std::move(block));
+    wrapper_->decode_pool->Add([this, ptr, done = ptr->done]() mutable {
+      DecodeBlock(ptr);
+      done.Notify();
+    });
   }
 }
 
-bool Lst1Impl::Uncompress(const uint8* data_ptr, uint32* size) {
+std::unique_ptr<Lst1Impl::Block> Lst1Impl::GetBlock() {
+  if (free_blocks_.empty())
+    return std::unique_ptr<Block>(new Block(wrapper_->block_size));
+
+  std::unique_ptr<Block> block = std::move(free_blocks_.back());
+  free_blocks_.pop_back();
+  block->Clear();
+  return block;
+}
+
+void Lst1Impl::DecodeBlock(Block* block) const {
+  using list_file::kBlockHeaderSize;
+  strings::ByteRange buf(block->data.get(), block->size);
+
+  while (buf.size() > kBlockHeaderSize) {
+    block->header_bytes += kBlockHeaderSize;
+
+    // Compressed records are uncompressed at the end of the arena.
+    uint8* tail = block->ArenaTail(wrapper_->block_size);
+    Block::Record rec;
+    rec.type = ParsePhysicalRecord(&buf, tail, &rec.data, &rec.drop);
+    rec.arena_offset = Block::kNoOffset;
+    if (u8ptr(rec.data) == tail) {
+      rec.arena_offset = block->arena_size;
+      block->arena_size += rec.data.size();
+    }
+    block->records.push_back(rec);
+  }
+
+  // The arena may have been reallocated by the following records.
+  for (Block::Record& rec : block->records) {
+    if (rec.arena_offset != Block::kNoOffset) {
+      rec.data = FromBuf(block->arena.get() + rec.arena_offset, rec.data.size());
+    }
+  }
+
+  if (block->is_last && !buf.empty()) {
+    Block::Record rec{kEof, StringPiece{}, Drop{buf.size(), "truncated record at end of file"},
+                      Block::kNoOffset};
+    block->records.push_back(rec);
+  }
+}
+
+unsigned int Lst1Impl::ParsePhysicalRecord(strings::ByteRange* block, uint8* uncompress_buf,
+                                           StringPiece* result, Drop* drop) const {
+  using list_file::kBlockHeaderSize;
+
+  // Parse the header
+  const uint8* header = block->data();
+  const uint8 type = header[8];
+  uint32 length = coding::DecodeFixed32(header + 4);
+
+  if (length == 0 && type == list_file::kZeroType) {
+    size_t bs = block->size();
+    block->clear();
+    // Handle the case of when mistakenly written last kBlockHeaderSize bytes as empty record.
+    if (bs != kBlockHeaderSize) {
+      LOG(ERROR) << "Bug reading list file " << bs;
+      return kBadRecord;
+    }
+    return kBlockEnd;
+  }
+
+  if (length + kBlockHeaderSize > block->size()) {
+    VLOG(1) << "Invalid length " << length << " block size " << block->size() << " type "
+            << int(type);
+    *drop = Drop{block->size(), "bad record length or truncated record at eof."};
+    block->clear();
+    return kBadRecord;
+  }
+
+  const uint8* data_ptr = header + kBlockHeaderSize;
+  // Check crc
+  if (wrapper_->checksum) {
+    uint32_t expected_crc = crc32c::Unmask(coding::DecodeFixed32(header));
+    // compute crc of the record and the type.
+    uint32_t actual_crc = crc32c::Value(data_ptr - 1, 1 + length);
+    if (actual_crc != expected_crc) {
+      // Drop the rest of the buffer since "length" itself may have
+      // been corrupted and if we trust it, we could find some
+      // fragment of a real log record that just happens to look
+      // like a valid log record.
+      *drop = Drop{block->size(), "checksum mismatch"};
+      block->clear();
+      return kBadRecord;
+    }
+  }
+  uint32 record_size = length + kBlockHeaderSize;
+  block->advance(record_size);
+
+  if (type & list_file::kCompressedMask) {
+    if (!Uncompress(data_ptr, uncompress_buf, &length)) {
+      *drop = Drop{record_size, "Uncompress failed."};
+      return kBadRecord;
+    }
+    data_ptr = uncompress_buf;
+  }
+
+  *result = FromBuf(data_ptr, length);
+  return type & 0xF;
+}
+
+bool Lst1Impl::Uncompress(const uint8* data_ptr, uint8* dest, uint32* size) const {
   uint8 method = *data_ptr++;
   VLOG(2) << "Uncompress " << int(method) << " with size " << *size;
 
@@ -290,7 +514,7 @@ bool Lst1Impl::Uncompress(const uint8* data_ptr, uint32* size) {
     return false;
   }
   size_t uncompress_size = wrapper_->block_size;
-  Status status = uncompr_func(data_ptr, inp_sz, uncompress_buf_.get(), &uncompress_size);
+  Status status = uncompr_func(data_ptr, inp_sz, dest, &uncompress_size);
   if (!status.ok()) {
     VLOG(1) << "Uncompress error: " << status;
     return false;
@@ -399,7 +623,30 @@ bool ListReader::ReadRecord(StringPiece* record, std::string* scratch) {
   return impl_->ReadRecord(record, scratch);
 }
 
+bool ListReader::SeekToRecord(uint64_t n) {
+  if (!ReadHeader())
+    return false;
+
+  return impl_->SeekToRecord(n);
+}
+
+bool ListReader::SeekToKey(StringPiece key, const IndexKeyFn& key_fn) {
+  if (!ReadHeader())
+    return false;
+
+  return impl_->SeekToKey(key, key_fn);
+}
+
+bool ListReader::SetBlockFilter(BlockFilter filter) {
+  if (!ReadHeader())
+    return false;
+
+  return impl_->SetBlockFilter(std::move(filter));
+}
+
 void ListReader::Reset() {
+  // Destroying the format waits for the blocks in flight and drops the read-ahead state,
+  // the next read starts from the beginning of the file. read-ahead settings are kept.
   impl_.reset();
   wrapper_->Reset();
 }
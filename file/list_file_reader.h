@@ -12,10 +12,29 @@
 #include "strings/stringpiece.h"
 #include "util/status.h"
 
+namespace util {
+namespace fibers_ext {
+class FiberQueueThreadPool;
+}  // namespace fibers_ext
+}  // namespace util
+
 namespace file {
 
 class ReadonlyFile;
 
+// Statistics of the keys of the records that start in a block.
+// See ListWriter::Options::stats_key.
+struct BlockStats {
+  StringPiece min_key, max_key;
+  StringPiece bloom;
+
+  // Returns false if no record in the block has this key.
+  bool MayContain(StringPiece key) const;
+};
+
+// Returns false if no record in the block can match.
+typedef std::function<bool(const BlockStats& stats)> BlockFilter;
+
 class ListReader {
  public:
   // Create a Listreader that will return log records from "*file".
@@ -54,6 +73,33 @@ class ListReader {
   // will notify reporter about the corruption.
   bool ReadRecord(StringPiece* record, std::string* scratch);
 
+  // Enables read-ahead mode: up to num_blocks upcoming blocks are read in advance and their
+  // checksums are verified and records uncompressed on pool threads. Records are still
+  // returned in file order. Must be called before the first read. pool must outlive the reader.
+  // lst2 files have no compressed records, and they are read ahead only while no block filter
+  // is set.
+  void set_read_ahead(unsigned num_blocks, util::fibers_ext::FiberQueueThreadPool* pool) {
+    CHECK(num_blocks == 0 || pool);
+    wrapper_->read_ahead = num_blocks;
+    wrapper_->decode_pool = pool;
+  }
+
+  // Positions the reader so that the next ReadRecord returns record number n (0-based).
+  // Requires an lst2 file that was written with ListWriter::Options::index.
+  // Returns false if the file has no index or has less than n + 1 records.
+  bool SeekToRecord(uint64_t n);
+
+  // Positions the reader at the first record whose key is not less than key.
+  // Requires an lst2 file that was written with ListWriter::Options::index_key.
+  // key_fn must extract the same keys. Returns false if there is no such record.
+  bool SeekToKey(StringPiece key, const IndexKeyFn& key_fn);
+
+  // Skips the blocks that the filter rejects without reading them. The records of the accepted
+  // blocks are returned as is, so the caller still has to check them.
+  // Requires an lst2 file that was written with ListWriter::Options::stats_key.
+  // Returns false if the file has no block stats.
+  bool SetBlockFilter(BlockFilter filter);
+
   void Reset();
 
   uint32_t read_header_bytes() const { return wrapper_->read_header_bytes; }
@@ -87,6 +133,9 @@ class ListReader {
     const bool checksum = false;
     uint32_t block_size = 0;
 
+    unsigned read_ahead = 0;  // Number of blocks in flight, 0 - sequential reading.
+    util::fibers_ext::FiberQueueThreadPool* decode_pool = nullptr;
+
     CorruptionReporter const reporter_;
   };
 
@@ -98,6 +147,11 @@ class ListReader {
     virtual bool ReadHeader(std::map<std::string, std::string>* dest) = 0;
     virtual bool ReadRecord(StringPiece* record, std::string* scratch) = 0;
 
+    // Supported only by formats that have a record index.
+    virtual bool SeekToRecord(uint64_t n) { return false; }
+    virtual bool SeekToKey(StringPiece key, const IndexKeyFn& key_fn) { return false; }
+    virtual bool SetBlockFilter(BlockFilter filter) { return false; }
+
    protected:
     size_t file_offset_ = 0;
     uint32_t array_records_ = 0;
@@ -14,6 +14,7 @@
 #include "base/fixed.h"
 #include "base/crc32c.h"
 #include "absl/strings/match.h"
+#include "util/fibers/fiberqueue_threadpool.h"
 
 namespace file {
 
@@ -60,6 +61,22 @@ static std::string RandomSkewedString(int i) {
   return BigString(NumberString(i), Skewed(17));
 }
 
+// Fails all the appends after the first "limit" bytes.
+class FailingSink : public util::Sink {
+ public:
+  explicit FailingSink(size_t limit) : limit_(limit) {}
+
+  Status Append(const strings::ByteRange& slice) final {
+    if (written_ + slice.size() > limit_)
+      return Status(util::StatusCode::IO_ERROR, "disk full");
+    written_ += slice.size();
+    return Status::OK;
+  }
+
+ private:
+  size_t limit_, written_ = 0;
+};
+
 class LogTest : public testing::Test  {
  private:
 
@@ -81,6 +98,7 @@ protected:
   util::StringSink* dest_ = nullptr;
   ReadonlyStringFile source_;
   ReportCollector report_;
+  std::unique_ptr<util::fibers_ext::FiberQueueThreadPool> decode_pool_;  // enables read-ahead.
   std::unique_ptr<ListWriter> writer_;
   std::unique_ptr<ListReader> reader_;
   uint32 list_offset_;
@@ -129,6 +147,8 @@ protected:
       source_.set_contents(dest_->contents());
       reader_.reset(new ListReader(&source_, DO_NOT_TAKE_OWNERSHIP,
                                    true/*checksum*/, reporter_func()));
+      if (decode_pool_)
+        reader_->set_read_ahead(4, decode_pool_.get());
     }
 
     std::string scratch;
@@ -499,6 +519,287 @@ TEST_F(LogTest, Compression) {
   ASSERT_EQ("EOF", Read());
 }
 
+TEST_F(LogTest, ReadAhead) {
+  ListWriter::Options options;
+  options.block_size_multiplier = 1;
+  options.use_compression = true;
+  options.compress_method = kCompressionLZ4;
+  SetupWriter(options);
+  decode_pool_.reset(new util::fibers_ext::FiberQueueThreadPool(4));
+
+  vector<string> records;
+  for (int i = 0; i < 1000; ++i) {
+    records.push_back(RandomSkewedString(i));
+    Write(records.back());
+  }
+  for (const string& r : records) {
+    ASSERT_EQ(r, Read());
+  }
+  ASSERT_EQ("EOF", Read());
+  ASSERT_EQ("EOF", Read());
+  EXPECT_EQ(0, DroppedBytes());
+}
+
+TEST_F(LogTest, ReadAheadChecksumMismatch) {
+  decode_pool_.reset(new util::fibers_ext::FiberQueueThreadPool(2));
+  Write("foo");
+  FlushWriter();
+  IncrementByte(0, 10);
+  CaptureStderr();
+  ASSERT_EQ("EOF", Read());
+  EXPECT_EQ(14, DroppedBytes());
+  EXPECT_THAT(ReportMessage(), HasSubstr("checksum mismatch"));
+  EXPECT_FALSE(GetCapturedStderr().empty());
+}
+
+TEST_F(LogTest, ReadAheadReset) {
+  ListWriter::Options options;
+  options.block_size_multiplier = 1;
+  options.use_compression = true;
+  options.compress_method = kCompressionLZ4;
+  SetupWriter(options);
+  decode_pool_.reset(new util::fibers_ext::FiberQueueThreadPool(2));
+
+  vector<string> records;
+  for (int i = 0; i < 500; ++i) {
+    records.push_back(RandomSkewedString(i));
+    Write(records.back());
+  }
+  for (unsigned i = 0; i < 300; ++i) {
+    ASSERT_EQ(records[i], Read());
+  }
+
+  // Blocks that were read ahead must be dropped, the reader starts from the beginning.
+  reader_->Reset();
+  for (const string& r : records) {
+    ASSERT_EQ(r, Read());
+  }
+  ASSERT_EQ("EOF", Read());
+  EXPECT_EQ(0, DroppedBytes());
+}
+
+TEST_F(LogTest, AsyncWrite) {
+  util::fibers_ext::FiberQueueThreadPool pool(2);
+  ListWriter::Options options;
+  options.use_compression = true;
+  options.v2 = FLAGS_v2;
+  if (options.v2)
+    options.use_compression = false;
+
+  vector<string> records;
+  for (int i = 0; i < 2000; ++i) {
+    records.push_back(RandomSkewedString(i));
+  }
+
+  auto write_all = [&](const ListWriter::Options& opts) {
+    util::StringSink* sink = new util::StringSink;
+    ListWriter writer(sink, opts);
+    CHECK(writer.Init().ok());
+    for (const string& r : records) {
+      CHECK(writer.AddRecord(r).ok());
+    }
+    CHECK(writer.Flush().ok());
+    EXPECT_EQ(records.size(), writer.records_added());
+    return sink->contents();
+  };
+
+  string expected = write_all(options);
+
+  options.async_pool = &pool;
+  options.async_max_blocks = 3;
+  string actual = write_all(options);
+
+  EXPECT_EQ(expected, actual);
+}
+
+TEST_F(LogTest, AsyncWriteError) {
+  util::fibers_ext::FiberQueueThreadPool pool(1);
+  ListWriter::Options options;
+  options.use_compression = false;
+  options.async_pool = &pool;
+
+  std::unique_ptr<ListWriter> writer(
+      new ListWriter(new FailingSink(3 * kBlockSizeFactor), options));
+  ASSERT_TRUE(writer->Init().ok());
+
+  Status st;
+  for (int i = 0; i < 20000 && st.ok(); ++i) {
+    st = writer->AddRecord(BigString(NumberString(i), 100));
+  }
+  if (st.ok())
+    st = writer->Flush();
+  EXPECT_EQ(util::StatusCode::IO_ERROR, st.code());
+  EXPECT_EQ(util::StatusCode::IO_ERROR, writer->Flush().code());
+  writer.reset();
+}
+
+TEST_F(LogTest, AsyncLst2) {
+  util::fibers_ext::FiberQueueThreadPool pool(1);
+  ListWriter::Options options;
+  options.use_compression = false;
+  options.v2 = true;
+  options.async_pool = &pool;
+
+  util::StringSink* sink = new util::StringSink;
+  std::unique_ptr<ListWriter> writer(new ListWriter(sink, options));
+  ASSERT_TRUE(writer->Init().ok());
+
+  uint64 bytes = 0;
+  for (int i = 0; i < 1000; ++i) {
+    string record = RandomSkewedString(i);
+    ASSERT_TRUE(writer->AddRecord(record).ok());
+    bytes += record.size();
+    ASSERT_EQ(bytes, writer->bytes_added());
+  }
+  ASSERT_TRUE(writer->Flush().ok());
+  EXPECT_EQ(bytes, writer->bytes_added());
+
+  // A failing lst2 writer is destroyed without Close().
+  writer.reset(new ListWriter(new FailingSink(3 * kBlockSizeFactor), options));
+  ASSERT_TRUE(writer->Init().ok());
+  Status st;
+  for (int i = 0; i < 20000 && st.ok(); ++i) {
+    st = writer->AddRecord(BigString(NumberString(i), 100));
+  }
+  if (st.ok())
+    st = writer->Flush();
+  EXPECT_EQ(util::StatusCode::IO_ERROR, st.code());
+  writer.reset();
+}
+
+TEST_F(LogTest, Lst2SinkError) {
+  ListWriter::Options options;
+  options.use_compression = false;
+  options.v2 = true;
+  options.index = true;
+
+  std::unique_ptr<ListWriter> writer(
+      new ListWriter(new FailingSink(3 * kBlockSizeFactor), options));
+  ASSERT_TRUE(writer->Init().ok());
+
+  Status st;
+  for (int i = 0; i < 20000 && st.ok(); ++i) {
+    st = writer->AddRecord(BigString(NumberString(i), 100));
+  }
+  EXPECT_EQ(util::StatusCode::IO_ERROR, st.code());
+
+  // The writer must be destroyed without Close(), which fails on the same sink.
+  writer.reset();
+}
+
+TEST_F(LogTest, Lst2Index) {
+  ListWriter::Options options;
+  options.block_size_multiplier = 2;
+  options.use_compression = false;
+  options.v2 = true;
+  options.index = true;
+
+  IndexKeyFn key_fn = [](StringPiece record) { return string(record.substr(0, 8)); };
+  options.index_key = key_fn;
+  SetupWriter(options, false);
+  writer_->AddMeta("key1", "data1");
+  ASSERT_TRUE(writer_->Init().ok());
+
+  vector<string> records;
+  char buf[16];
+  for (int i = 0; i < 20000; ++i) {
+    snprintf(buf, sizeof(buf), "%08d", i);
+    records.push_back(buf + BigString("x", i % 1000 ? Skewed(12) : 300000));
+    Write(records.back());
+  }
+  ASSERT_TRUE(writer_->Close().ok());
+
+  ASSERT_EQ(records[0], Read());
+  for (size_t n : {0, 1, 777, 1000, 10000, 19999}) {
+    ASSERT_TRUE(reader_->SeekToRecord(n)) << n;
+    ASSERT_EQ(records[n], Read());
+  }
+  ASSERT_EQ("EOF", Read());
+  EXPECT_FALSE(reader_->SeekToRecord(records.size()));
+
+  ASSERT_TRUE(reader_->SeekToKey("00012345", key_fn));
+  ASSERT_EQ(records[12345], Read());
+  ASSERT_EQ(records[12346], Read());
+  ASSERT_TRUE(reader_->SeekToKey("000123455", key_fn));
+  ASSERT_EQ(records[12346], Read());
+  ASSERT_TRUE(reader_->SeekToKey("", key_fn));
+  ASSERT_EQ(records[0], Read());
+  EXPECT_FALSE(reader_->SeekToKey("99999999", key_fn));
+
+  std::map<string, string> meta;
+  ASSERT_TRUE(reader_->GetMetaData(&meta));
+  EXPECT_EQ("data1", meta["key1"]);
+  EXPECT_EQ(0, DroppedBytes());
+}
+
+TEST_F(LogTest, Lst2BlockFilter) {
+  ListWriter::Options options;
+  options.use_compression = false;
+  options.v2 = true;
+  options.index = true;
+  options.stats_key = [](StringPiece record) { return string(record.substr(0, 4)); };
+  SetupWriter(options);
+
+  char buf[16];
+  for (int i = 0; i < 20000; ++i) {
+    snprintf(buf, sizeof(buf), "%04d", i / 500);
+    Write(BigString(buf, 100 + i % 7));
+  }
+  ASSERT_TRUE(writer_->Close().ok());
+
+  ASSERT_EQ(BigString("0000", 100), Read());
+  ASSERT_TRUE(reader_->SetBlockFilter([](const BlockStats& stats) {
+    return stats.min_key <= "0012" && "0012" <= stats.max_key && stats.MayContain("0012");
+  }));
+
+  unsigned matched = 0, total = 0;
+  for (string record = Read(); record != "EOF"; record = Read()) {
+    ++total;
+    matched += absl::StartsWith(record, "0012");
+  }
+  EXPECT_EQ(500, matched);
+  EXPECT_LT(total, 4000);
+  EXPECT_EQ(0, DroppedBytes());
+}
+
+TEST_F(LogTest, Lst2ReadAhead) {
+  ListWriter::Options options;
+  options.use_compression = false;
+  options.v2 = true;
+  options.index = true;
+  options.stats_key = [](StringPiece record) { return string(record.substr(0, 4)); };
+  SetupWriter(options);
+  decode_pool_.reset(new util::fibers_ext::FiberQueueThreadPool(2));
+
+  vector<string> records;
+  char buf[16];
+  for (int i = 0; i < 2000; ++i) {
+    snprintf(buf, sizeof(buf), "%04d", i / 100);
+    records.push_back(buf + RandomSkewedString(i));
+    Write(records.back());
+  }
+  ASSERT_TRUE(writer_->Close().ok());
+
+  for (const string& r : records) {
+    ASSERT_EQ(r, Read());
+  }
+  ASSERT_EQ("EOF", Read());
+
+  // Seeking drops the blocks that were read ahead.
+  ASSERT_TRUE(reader_->SeekToRecord(777));
+  ASSERT_EQ(records[777], Read());
+  ASSERT_EQ(records[778], Read());
+
+  ASSERT_TRUE(reader_->SetBlockFilter([](const BlockStats& stats) {
+    return stats.min_key <= "0012" && "0012" <= stats.max_key && stats.MayContain("0012");
+  }));
+  unsigned matched = 0;
+  for (string record = Read(); record != "EOF"; record = Read()) {
+    matched += absl::StartsWith(record, "0012");
+  }
+  EXPECT_EQ(100, matched);
+  EXPECT_EQ(0, DroppedBytes());
+}
 
 TEST_F(LogTest, Zlib) {
   ListWriter::Options options;
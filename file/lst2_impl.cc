@@ -9,8 +9,14 @@
 #include <crc32c/crc32c.h>
 #include <lz4.h>
 
+#include <algorithm>
+#include <cstring>
+
+#include "absl/strings/str_cat.h"
 #include "base/endian.h"
+#include "base/hash.h"
 #include "base/varint.h"
+#include "util/fibers/fiberqueue_threadpool.h"
 
 using strings::u8ptr;
 
@@ -22,6 +28,34 @@ namespace lst2 {
 
 constexpr char kMagicString[] = "LST2";
 static_assert(kMagicStringSize == sizeof(kMagicString), "");
+constexpr char kIndexMagic[] = "LSTI";
+constexpr uint32_t kBloomSeed = 0xbc9f1d34;
+
+namespace {
+
+uint32_t BloomHash(StringPiece key) {
+  return base::MurmurHash3_x86_32(strings::u8ptr(key), key.size(), kBloomSeed);
+}
+
+// LevelDB style bloom filter with double hashing. The last byte holds the number of probes.
+void BuildBloom(const std::vector<uint32_t>& hashes, unsigned bits_per_key, string* dest) {
+  size_t bytes = (std::max<size_t>(hashes.size() * bits_per_key, 64) + 7) / 8;
+  size_t bits = bytes * 8;
+  unsigned probes = std::min(std::max(1u, unsigned(bits_per_key * 69 / 100)), 30u);
+
+  dest->assign(bytes, '\0');
+  dest->push_back(char(probes));
+  for (uint32_t h : hashes) {
+    const uint32_t delta = (h >> 17) | (h << 15);
+    for (unsigned j = 0; j < probes; ++j) {
+      const uint32_t bitpos = h % bits;
+      (*dest)[bitpos / 8] |= (1 << (bitpos % 8));
+      h += delta;
+    }
+  }
+}
+
+}  // namespace
 constexpr uint8_t kTypeMask = 7;
 
 /* Block - divides files into equal parts of size BlockSize. Each Block size can be
@@ -29,7 +63,7 @@ constexpr uint8_t kTypeMask = 7;
    Each block consists of one or more records.
 */
 uint8_t* RecordHeader::Write(uint8_t* dest) const {
-  *dest++ = flags;
+  *dest++ = size > 0xFFFF ? (flags | kRecordSize3BytesFlag) : flags;
   if (compress_method != list_file::kCompressionNone) {
     *dest++ = compress_method;
   }
@@ -83,11 +117,13 @@ Lst2Impl::Lst2Impl(util::Sink* sink, const ListWriter::Options& opts) : WriterIm
   if (opts.append) {
     LOG(FATAL) << "TBD";
   }
+  CHECK(opts.index || !opts.stats_key) << "Block stats are stored in the index";
 }
 
 Lst2Impl::~Lst2Impl() {
-  DCHECK_EQ(array_records_, 0) << "ListWriter::Flush() was not called!";
-  CHECK(Flush().ok());
+  DCHECK(closed_ || array_records_ == 0) << "ListWriter::Flush() was not called!";
+  Status st = Close();
+  LOG_IF(ERROR, !st.ok()) << "Could not close list file: " << st;
 }
 
 Status Lst2Impl::Init(const std::map<string, string>& meta) {
@@ -108,12 +144,13 @@ Status Lst2Impl::Init(const std::map<string, string>& meta) {
     RETURN_IF_ERROR(dest_->Append(strings::ByteRange(buf, sizeof(buf))));
 
     block_offset_ = kListFileHeaderSize;
+    init_called_ = true;
+    meta_records_ = meta.size() * 2;
 
     for (const auto& k_v : meta) {
-      RETURN_IF_ERROR(AddRecord(k_v.first));
-      RETURN_IF_ERROR(AddRecord(k_v.second));
+      RETURN_IF_ERROR(WriteRecord(k_v.first));
+      RETURN_IF_ERROR(WriteRecord(k_v.second));
     }
-    init_called_ = true;
   }
   return Status::OK;
 }
@@ -127,7 +164,16 @@ Status Lst2Impl::Init(const std::map<string, string>& meta) {
 */
 Status Lst2Impl::AddRecord(StringPiece record) {
   CHECK(init_called_) << "ListWriter::Init was not called.";
+  CHECK(!closed_) << "ListWriter::Close was called.";
+
+  RETURN_IF_ERROR(WriteRecord(record));
+  ++records_added_;
+  bytes_added_ += record.size();
+
+  return Status::OK;
+}
 
+Status Lst2Impl::WriteRecord(StringPiece record) {
   if (record.size() >= (1ULL << 30)) {
     return Status("Record too large");
   }
@@ -139,6 +185,8 @@ Status Lst2Impl::AddRecord(StringPiece record) {
         memcpy(next, record.data(), record.size());
         array_next_ = next + record.size();
         ++array_records_;
+        UpdateBlockStats(record);
+        ++record_num_;
         if (array_records_ == kuint16max) {
           RETURN_IF_ERROR(FlushArray());
         }
@@ -149,6 +197,10 @@ Status Lst2Impl::AddRecord(StringPiece record) {
   }
   DCHECK_EQ(0, array_records_);
 
+  IndexRecord(record);
+  UpdateBlockStats(record);
+  ++record_num_;
+
   uint32_t block_left = block_size() - block_offset_;
   DCHECK_GT(block_left, RecordHeader::kSingleSmallSize);
 
@@ -173,6 +225,92 @@ Status Lst2Impl::AddRecord(StringPiece record) {
 
 Status Lst2Impl::Flush() { return FlushArray(); }
 
+Status Lst2Impl::Close() {
+  if (closed_)
+    return Status::OK;
+
+  RETURN_IF_ERROR(FlushArray());
+  closed_ = true;
+
+  if (options_.index && init_called_) {
+    return WriteIndex();
+  }
+  return Status::OK;
+}
+
+void Lst2Impl::IndexRecord(StringPiece record) {
+  if (!options_.index || (!index_.empty() && index_.back().block == block_num_))
+    return;
+
+  IndexEntry entry{block_num_, record_num_, string{}};
+  if (options_.index_key && record_num_ >= meta_records_) {
+    entry.key = options_.index_key(record);
+  }
+  index_.push_back(std::move(entry));
+}
+
+void Lst2Impl::UpdateBlockStats(StringPiece record) {
+  if (!options_.stats_key || record_num_ < meta_records_)
+    return;
+
+  DCHECK(!index_.empty() && index_.back().block == block_num_);
+  IndexEntry& entry = index_.back();
+
+  string key = options_.stats_key(record);
+  if (entry.key_hashes.empty() || key < entry.min_key) {
+    entry.min_key = key;
+  }
+  if (entry.key_hashes.empty() || key > entry.max_key) {
+    entry.max_key = key;
+  }
+  entry.key_hashes.push_back(BloomHash(key));
+}
+
+Status Lst2Impl::WriteIndex() {
+  // The marker record ends the data records, so that the index is not read as records.
+  RecordHeader rh;
+  uint8_t buf[RecordHeader::kMaxSize];
+  rh.flags = kIndexType;
+  uint8_t* next = rh.Write(buf);
+  RETURN_IF_ERROR(EmitPhysicalRecord(strings::ByteRange(buf, next - buf), strings::ByteRange{}));
+
+  string index;
+  Varint::Append64(&index, record_num_ - meta_records_);
+  Varint::Append64(&index, index_.size());
+  Varint::Append32(&index, options_.stats_key ? kIndexHasStats : 0);
+
+  auto append_str = [&index](StringPiece str) {
+    Varint::Append32(&index, str.size());
+    index.append(str.data(), str.size());
+  };
+
+  string bloom;
+  uint64_t prev_block = 0, prev_record = 0;
+  for (const IndexEntry& entry : index_) {
+    Varint::Append64(&index, entry.block - prev_block);
+    Varint::Append64(&index, entry.first_record - prev_record);
+    append_str(entry.key);
+
+    if (options_.stats_key) {
+      BuildBloom(entry.key_hashes, options_.bloom_bits_per_key, &bloom);
+      append_str(entry.min_key);
+      append_str(entry.max_key);
+      append_str(bloom);
+    }
+
+    prev_block = entry.block;
+    prev_record = entry.first_record;
+  }
+
+  uint8_t trailer[kIndexTrailerSize];
+  LittleEndian::Store32(trailer, crc32c::Crc32c(index.data(), index.size()));
+  LittleEndian::Store32(trailer + 4, index.size());
+  memcpy(trailer + 8, kIndexMagic, kIndexTrailerSize - 8);
+
+  RETURN_IF_ERROR(dest_->Append(strings::ToByteRange(index)));
+  return dest_->Append(strings::ByteRange(trailer, sizeof(trailer)));
+}
+
 Status Lst2Impl::FlushArray() {
   if (array_records_ == 0)
     return Status::OK;
@@ -181,7 +319,7 @@ Status Lst2Impl::FlushArray() {
   uint8_t buf[RecordHeader::kMaxSize];
   rh.flags = kArrayType;
   rh.arr_count = array_records_;
-  rh.size = array_end_ - array_store_.get();
+  rh.size = array_next_ - array_store_.get();
   rh.crc = crc32c::Crc32c(array_store_.get(), rh.size);
 
   uint8_t* next = rh.Write(buf);
@@ -209,6 +347,7 @@ util::Status Lst2Impl::WriteFragmented(StringPiece record) {
   DCHECK(!options_.use_compression || list_file::kCompressionNone == options_.compress_method);
 
   while (true) {
+    rh.flags = t;
     rh.crc = crc32c::Crc32c(record.data(), rh.size);
     uint8_t* next = rh.Write(buf);
     strings::ByteRange header(buf, next - buf);
@@ -252,28 +391,66 @@ util::Status Lst2Impl::EmitPhysicalRecord(strings::ByteRange header, strings::By
       RETURN_IF_ERROR(dest_->Append(strings::ByteRange(buf, block_size_ - block_offset_)));
     }
     block_offset_ = 0;
+    ++block_num_;
   }
   return Status::OK;
 }
 
+struct ReaderImpl::Block {
+  // We allocate more to allow simpler parsing, as with backing_store_.
+  explicit Block(uint32_t block_size) : data(new uint8_t[block_size + 8]) {}
+
+  void Clear() {
+    offset = size = verified_end = 0;
+    read_status = Status::OK;
+    done.Reset();
+  }
+
+  std::unique_ptr<uint8_t[]> data;
+  size_t offset = 0;  // File offset of the block.
+  size_t size = 0;
+  Status read_status;
+
+  util::fibers_ext::Done done;  // Notified when the checksums were verified.
+
+  // The records that end at or before this block offset passed the checksum verification.
+  size_t verified_end = 0;
+};
+
+ReaderImpl::ReaderImpl(ListReader::ReaderWrapper* wrapper) : FormatImpl(wrapper) {}
+
+ReaderImpl::~ReaderImpl() {
+  // Verification tasks reference the blocks, so we must wait for them to finish.
+  for (auto& block : read_ahead_) {
+    block->done.Wait();
+  }
+}
+
 bool ReaderImpl::ReadHeader(std::map<std::string, std::string>* dest) {
   uint8_t buf[4];
   auto res = wrapper_->file->Read(kMagicStringSize, strings::MutableByteRange(buf, sizeof(buf)));
-  if (!res.ok())
+  if (!res.ok()) {
+    wrapper_->BadHeader(res.status);
     return false;
+  }
 
   uint16_t multiplier = LittleEndian::Load16(buf);
   uint16_t num_pairs = LittleEndian::Load16(buf + 2);
 
-  if (multiplier == 0 || multiplier >= 256 || (num_pairs % 2) != 0) {
+  if (multiplier == 0 || multiplier >= 256) {
+    wrapper_->BadHeader(Status(StatusCode::PARSE_ERROR, "Invalid header"));
     return false;
   }
   wrapper_->block_size = multiplier * kBlockSizeFactor;
-  file_offset_ = kListFileHeaderSize;
+  wrapper_->read_header_bytes = kListFileHeaderSize;
+  meta_records_ = num_pairs * 2;
 
-  if (kListFileHeaderSize >= wrapper_->file->Size()) {
-    wrapper_->eof = true;
-  }
+  // We allocate more to allow simpler parsing.
+  backing_store_.reset(new uint8_t[wrapper_->block_size + 8]);
+
+  file_offset_ = 0;
+  if (!ReadBlock())
+    return false;
 
   string key, val;
 
@@ -282,13 +459,13 @@ bool ReaderImpl::ReadHeader(std::map<std::string, std::string>* dest) {
 
     if (!ReadRecord(&skey, &key))
       return false;
+    string meta_key(skey);  // skey may point to the block that is replaced by the next read.
+
     if (!ReadRecord(&sval, &val))
       return false;
-    dest->emplace(string(skey), string(sval));
+    dest->emplace(std::move(meta_key), string(sval));
   }
 
-  // We allocate more to allow simpler parsing.
-  backing_store_.reset(new uint8_t[wrapper_->block_size + 8]);
   return true;
 }
 
@@ -296,61 +473,574 @@ bool ReaderImpl::ReadRecord(StringPiece* record, std::string* scratch) {
   bool in_fragmented_record = false;
   scratch->clear();
 
+  if (has_pending_) {
+    has_pending_ = false;
+    scratch->swap(pending_);
+    *record = *scratch;
+    return true;
+  }
+
   while (true) {
-    if (!array_store_.empty()) {
-      uint32_t len;
-      const uint8_t* start = strings::u8ptr(array_store_.data());
-      const uint8_t* next = Varint::Parse32Inline(start, &len);
-      size_t s = next - start + len;
-      if (s > array_store_.size()) {
+    if (array_records_ > 0) {
+      uint32_t len = 0;
+      const uint8_t* start = strings::u8ptr(array_store_);
+      const uint8_t* end = start + array_store_.size();
+      const uint8_t* next = Varint::Parse32WithLimit(start, end, &len);
+      if (next == nullptr || next + len > end) {
         wrapper_->ReportCorruption(array_store_.size(), "Invalid array record");
         array_store_ = StringPiece();
+        array_records_ = 0;
         continue;
       }
 
+      --array_records_;
+      wrapper_->read_header_bytes += next - start;
+      wrapper_->read_data_bytes += len;
+      array_store_.remove_prefix(next + len - start);
       *record = StringPiece(strings::charptr(next), len);
-      array_store_.remove_prefix(s);
       return true;
     }
 
-    if (block_buffer_.size() >= RecordHeader::kSingleSmallSize) {
-      StringPiece cur_rec;
-      unsigned type = ReadPhysicalRecord(&cur_rec);
-      switch (type) {
-        case kFullType:
-          if (in_fragmented_record) {
-            wrapper_->ReportCorruption(scratch->size(), "partial record without end(1)");
-          } else {
-            *record = cur_rec;
-            return true;
-          }
-        /* code */
+    StringPiece fragment;
+    const unsigned type = ReadPhysicalRecord(&fragment);
+    switch (type) {
+      case kFullType:
+        if (in_fragmented_record) {
+          wrapper_->ReportCorruption(scratch->size(), "partial record without end(1)");
+          scratch->clear();
+        }
+        *record = fragment;
+        wrapper_->read_data_bytes += fragment.size();
+        return true;
+
+      case kFirstType:
+        if (in_fragmented_record) {
+          wrapper_->ReportCorruption(scratch->size(), "partial record without end(2)");
+        }
+        scratch->assign(fragment.data(), fragment.size());
+        in_fragmented_record = true;
         break;
 
-        default:
+      case kMiddleType:
+        if (!in_fragmented_record) {
+          wrapper_->ReportCorruption(fragment.size(), "missing start of fragmented record(1)");
+        } else {
+          scratch->append(fragment.data(), fragment.size());
+        }
         break;
-      }
+
+      case kLastType:
+        if (!in_fragmented_record) {
+          wrapper_->ReportCorruption(fragment.size(), "missing start of fragmented record(2)");
+        } else {
+          scratch->append(fragment.data(), fragment.size());
+          *record = StringPiece(*scratch);
+          wrapper_->read_data_bytes += record->size();
+          return true;
+        }
+        break;
+
+      case kArrayType:
+        if (in_fragmented_record) {
+          wrapper_->ReportCorruption(scratch->size(), "partial record without end(3)");
+          in_fragmented_record = false;
+          scratch->clear();
+        }
+        array_store_ = fragment;  // array_records_ was set by ReadPhysicalRecord.
+        break;
+
+      case kEof:
+        if (in_fragmented_record) {
+          wrapper_->ReportCorruption(scratch->size(), "partial record without end(4)");
+          scratch->clear();
+        }
+        return false;
+
+      case kBadRecord:
+        if (in_fragmented_record) {
+          wrapper_->ReportCorruption(scratch->size(), "error in middle of record");
+          in_fragmented_record = false;
+          scratch->clear();
+        }
+        break;
+
+      default:
+        wrapper_->ReportCorruption(fragment.size() + (in_fragmented_record ? scratch->size() : 0),
+                                   absl::StrCat("unknown record type ", type));
+        in_fragmented_record = false;
+        scratch->clear();
     }
   }
   return true;
 }
 
 unsigned ReaderImpl::ReadPhysicalRecord(StringPiece* dest) {
-  RecordHeader rh;
-  size_t parsed = rh.Parse(block_buffer_.data());
-  if (parsed + rh.size > block_buffer_.size()) {
-    wrapper_->ReportCorruption(block_buffer_.size(), "Bad record size");
+  while (true) {
+    // The writer pads the tail of the block if it can not hold a record.
+    if (block_buffer_.size() <= RecordHeader::kSingleSmallSize) {
+      if (wrapper_->eof && read_ahead_.empty()) {
+        block_buffer_.clear();
+        return kEof;
+      }
+      if (!ReadBlock())
+        return kEof;
+      continue;
+    }
+
+    RecordHeader rh;
+    size_t parsed = rh.Parse(block_buffer_.data());
+    const unsigned type = rh.flags & kTypeMask;
+
+    if (type == kIndexType) {
+      // The rest of the file is the record index.
+      block_buffer_.clear();
+      ClearReadAhead();
+      wrapper_->eof = true;
+      return kEof;
+    }
+
+    if (parsed + rh.size > block_buffer_.size()) {
+      wrapper_->ReportCorruption(block_buffer_.size(), "Bad record size");
+      block_buffer_.clear();
+      return kBadRecord;
+    }
+
+    if (type == kMiddleType || type == kLastType) {
+      if (skip_tail_) {  // The tail of the record that was filtered out.
+        block_buffer_.advance(parsed + rh.size);
+        continue;
+      }
+    } else {
+      skip_tail_ = false;
+      if (block_filtered_) {
+        // The records that start in this block were filtered out.
+        block_buffer_.clear();
+        skip_tail_ = true;
+        continue;
+      }
+    }
+
+    if (rh.flags & kCompressedFlag) {
+      wrapper_->ReportCorruption(block_buffer_.size(), "Compressed records are not supported");
+      block_buffer_.clear();
+      return kBadRecord;
+    }
+
+    const uint8_t* data = block_buffer_.data() + parsed;
+    if (wrapper_->checksum && !IsVerified(data + rh.size) &&
+        crc32c::Crc32c(data, rh.size) != rh.crc) {
+      // Drop the rest of the block since the size itself may have been corrupted.
+      size_t drop_size = block_buffer_.size();
+      block_buffer_.clear();
+      wrapper_->ReportCorruption(drop_size, "checksum mismatch");
+      return kBadRecord;
+    }
+
+    wrapper_->read_header_bytes += parsed;
+    block_buffer_.advance(parsed + rh.size);
+    if (type == kArrayType) {
+      array_records_ = rh.arr_count;
+    }
+    last_type_ = type;
+    *dest = StringPiece(strings::charptr(data), rh.size);
+
+    return type;
+  }
+}
+
+bool ReaderImpl::ReadBlock() {
+  if (wrapper_->read_ahead && !block_filter_)
+    return ReadAheadBlock();
+
+  if (cur_block_) {
+    free_blocks_.push_back(std::move(cur_block_));
+  }
+  if (block_filter_) {
+    SkipFilteredBlocks();
+    if (wrapper_->eof)
+      return false;
+  }
+
+  size_t fsize = wrapper_->file->Size();
+  strings::MutableByteRange mbr(backing_store_.get(), wrapper_->block_size);
+  auto res = wrapper_->file->Read(file_offset_, mbr);
+  VLOG(2) << "read_size: " << res.obj << ", status: " << res.status;
+
+  if (!res.ok()) {
+    wrapper_->ReportDrop(res.obj, res.status);
+    wrapper_->eof = true;
+    return false;
+  }
+
+  block_buffer_.reset(backing_store_.get(), res.obj);
+  if (file_offset_ == 0) {
+    // The first block starts with the file header.
+    block_buffer_.advance(std::min<size_t>(kListFileHeaderSize, res.obj));
+  }
+  file_offset_ += res.obj;
+  if (file_offset_ >= fsize || res.obj == 0) {
+    wrapper_->eof = true;
+  }
+  return true;
+}
+
+bool ReaderImpl::ReadAheadBlock() {
+  FillReadAhead();
+  if (cur_block_) {
+    free_blocks_.push_back(std::move(cur_block_));
+  }
+  if (read_ahead_.empty()) {
     block_buffer_.clear();
-    return kBadRecord;
+    return false;
+  }
+
+  cur_block_ = std::move(read_ahead_.front());
+  read_ahead_.pop_front();
+
+  FillReadAhead();  // Keep the pipeline full while we wait for the current block.
+  cur_block_->done.Wait();
+
+  if (!cur_block_->read_status.ok()) {
+    wrapper_->ReportDrop(cur_block_->size, cur_block_->read_status);
+    block_buffer_.clear();
+    return false;
+  }
+
+  block_buffer_.reset(cur_block_->data.get(), cur_block_->size);
+  if (cur_block_->offset == 0) {
+    // The first block starts with the file header.
+    block_buffer_.advance(std::min<size_t>(kListFileHeaderSize, cur_block_->size));
   }
+  return true;
+}
+
+void ReaderImpl::FillReadAhead() {
+  size_t fsize = wrapper_->file->Size();
+
+  while (!wrapper_->eof && read_ahead_.size() < wrapper_->read_ahead) {
+    std::unique_ptr<Block> block = GetBlock();
+    block->offset = file_offset_;
+    strings::MutableByteRange mbr(block->data.get(), wrapper_->block_size);
+    auto res = wrapper_->file->Read(file_offset_, mbr);
+    VLOG(2) << "read_size: " << res.obj << ", status: " << res.status;
+
+    block->size = res.obj;
+    if (!res.ok()) {
+      block->read_status = res.status;
+      block->done.Notify();
+      read_ahead_.push_back(std::move(block));
+      wrapper_->eof = true;
+      break;
+    }
 
-  block_buffer_.advance(parsed);
-  DCHECK_EQ(0, rh.flags & kCompressedFlag);
-  *dest = StringPiece(strings::charptr(block_buffer_.data()), rh.size);
-  block_buffer_.remove_prefix(rh.size);
+    file_offset_ += res.obj;
+    if (file_offset_ >= fsize || res.obj == 0) {
+      wrapper_->eof = true;
+    }
 
-  return rh.flags & kTypeMask;
+    Block* ptr = block.get();
+    read_ahead_.push_back(std::move(block));
+    if (!wrapper_->checksum) {
+      ptr->done.Notify();
+      continue;
+    }
+    wrapper_->decode_pool->Add([this, ptr, done = ptr->done]() mutable {
+      VerifyBlock(ptr);
+      done.Notify();
+    });
+  }
 }
 
+void ReaderImpl::ClearReadAhead() {
+  if (read_ahead_.empty())
+    return;
+
+  file_offset_ = read_ahead_.front()->offset;
+  wrapper_->eof = false;
+  for (auto& block : read_ahead_) {
+    block->done.Wait();
+    free_blocks_.push_back(std::move(block));
+  }
+  read_ahead_.clear();
+}
+
+void ReaderImpl::VerifyBlock(Block* block) const {
+  strings::ByteRange buf(block->data.get(), block->size);
+  if (block->offset == 0) {
+    buf.advance(std::min<size_t>(kListFileHeaderSize, block->size));
+  }
+
+  // Stops at the first record that ReadPhysicalRecord checks by itself.
+  while (buf.size() > RecordHeader::kSingleSmallSize) {
+    RecordHeader rh;
+    size_t parsed = rh.Parse(buf.data());
+    if ((rh.flags & kTypeMask) == kIndexType || parsed + rh.size > buf.size() ||
+        crc32c::Crc32c(buf.data() + parsed, rh.size) != rh.crc) {
+      break;
+    }
+    buf.advance(parsed + rh.size);
+    block->verified_end = buf.data() - block->data.get();
+  }
+}
+
+bool ReaderImpl::IsVerified(const uint8_t* rec_end) const {
+  return cur_block_ && size_t(rec_end - cur_block_->data.get()) <= cur_block_->verified_end;
+}
+
+std::unique_ptr<ReaderImpl::Block> ReaderImpl::GetBlock() {
+  if (free_blocks_.empty())
+    return std::unique_ptr<Block>(new Block(wrapper_->block_size));
+
+  std::unique_ptr<Block> block = std::move(free_blocks_.back());
+  free_blocks_.pop_back();
+  block->Clear();
+  return block;
+}
+
+bool ReaderImpl::LoadIndex() {
+  if (index_loaded_)
+    return !index_.empty();
+  index_loaded_ = true;
+
+  ReadonlyFile* file = wrapper_->file;
+  size_t fsize = file->Size();
+  if (fsize < kListFileHeaderSize + kIndexTrailerSize)
+    return false;
+
+  uint8_t trailer[kIndexTrailerSize];
+  auto res = file->Read(fsize - kIndexTrailerSize, strings::MutableByteRange(trailer, sizeof(trailer)));
+  if (!res.ok() || res.obj != sizeof(trailer) ||
+      memcmp(trailer + 8, kIndexMagic, kIndexTrailerSize - 8) != 0) {
+    VLOG(1) << "No record index found " << res.status;
+    return false;
+  }
+
+  uint32_t crc = LittleEndian::Load32(trailer);
+  uint32_t size = LittleEndian::Load32(trailer + 4);
+  if (size > fsize - kIndexTrailerSize) {
+    LOG(ERROR) << "Invalid record index size " << size;
+    return false;
+  }
+
+  std::unique_ptr<uint8_t[]> buf(new uint8_t[size]);
+  res = file->Read(fsize - kIndexTrailerSize - size, strings::MutableByteRange(buf.get(), size));
+  if (!res.ok() || res.obj != size || crc32c::Crc32c(buf.get(), size) != crc) {
+    LOG(ERROR) << "Corrupted record index " << res.status;
+    return false;
+  }
+
+  const uint8_t* end = buf.get() + size;
+  uint64_t num_entries = 0;
+  uint32_t flags = 0;
+  const uint8_t* ptr = Varint::Parse64WithLimit(buf.get(), end, &num_records_);
+  if (ptr)
+    ptr = Varint::Parse64WithLimit(ptr, end, &num_entries);
+  if (ptr)
+    ptr = Varint::Parse32WithLimit(ptr, end, &flags);
+  has_stats_ = (flags & kIndexHasStats) != 0;
+
+  auto parse_str = [&ptr, end](string* dest) {
+    uint32_t sz = 0;
+    if (ptr)
+      ptr = Varint::Parse32WithLimit(ptr, end, &sz);
+    if (!ptr || sz > size_t(end - ptr)) {
+      ptr = nullptr;
+      return;
+    }
+    dest->assign(strings::charptr(ptr), sz);
+    ptr += sz;
+  };
+
+  IndexEntry entry{0, 0, string{}};
+  for (uint64_t i = 0; ptr && i < num_entries; ++i) {
+    uint64_t block_delta = 0, record_delta = 0;
+
+    ptr = Varint::Parse64WithLimit(ptr, end, &block_delta);
+    if (ptr)
+      ptr = Varint::Parse64WithLimit(ptr, end, &record_delta);
+    parse_str(&entry.key);
+    if (has_stats_) {
+      parse_str(&entry.min_key);
+      parse_str(&entry.max_key);
+      parse_str(&entry.bloom);
+    }
+    if (!ptr)
+      break;
+
+    entry.block += block_delta;
+    entry.first_record += record_delta;
+    index_.push_back(entry);
+  }
+
+  if (!ptr) {
+    LOG(ERROR) << "Corrupted record index";
+    index_.clear();
+  }
+  return !index_.empty();
+}
+
+bool ReaderImpl::SeekToEntry(const IndexEntry& entry) {
+  ClearReadAhead();
+  has_pending_ = false;
+  array_records_ = 0;
+  array_store_ = StringPiece();
+  wrapper_->eof = false;
+
+  // The block we seek to is read regardless of the block filter.
+  BlockFilter filter = std::move(block_filter_);
+  block_filter_ = nullptr;
+  block_filtered_ = skip_tail_ = false;
+  last_type_ = kZeroType;
+
+  file_offset_ = entry.block * wrapper_->block_size;
+  bool res = ReadBlock();
+  block_filter_ = std::move(filter);
+  if (!res)
+    return false;
+
+  // Skip the tail of the record that started in one of the previous blocks.
+  while (block_buffer_.size() > RecordHeader::kSingleSmallSize) {
+    RecordHeader rh;
+    size_t parsed = rh.Parse(block_buffer_.data());
+    const unsigned type = rh.flags & kTypeMask;
+    if (type != kMiddleType && type != kLastType)
+      return true;
+
+    if (parsed + rh.size > block_buffer_.size())
+      break;
+    block_buffer_.advance(parsed + rh.size);
+  }
+
+  wrapper_->ReportCorruption(block_buffer_.size(), "Indexed block without a record start");
+  block_buffer_.clear();
+  return false;
+}
+
+bool ReaderImpl::SeekToRecord(uint64_t n) {
+  if (!LoadIndex() || n >= num_records_)
+    return false;
+
+  uint64_t target = n + meta_records_;
+  auto it = std::upper_bound(index_.begin(), index_.end(), target,
+                             [](uint64_t r, const IndexEntry& e) { return r < e.first_record; });
+  if (it == index_.begin())
+    return false;
+  --it;
+
+  // Records are counted, therefore we can not skip blocks until we reach the target.
+  BlockFilter filter = std::move(block_filter_);
+  block_filter_ = nullptr;
+
+  bool res = SeekToEntry(*it);
+  string scratch;
+  StringPiece record;
+  for (uint64_t i = it->first_record; res && i < target; ++i) {
+    res = ReadRecord(&record, &scratch);
+  }
+  block_filter_ = std::move(filter);
+
+  return res;
+}
+
+bool ReaderImpl::SeekToKey(StringPiece key, const IndexKeyFn& key_fn) {
+  if (!LoadIndex())
+    return false;
+
+  // All the records before the first block with the key not less than "key" are smaller than key,
+  // except maybe for the records of its preceding block.
+  auto it = std::lower_bound(index_.begin(), index_.end(), key,
+                             [](const IndexEntry& e, StringPiece k) { return StringPiece(e.key) < k; });
+  if (it != index_.begin())
+    --it;
+
+  if (!SeekToEntry(*it))
+    return false;
+
+  string scratch;
+  StringPiece record;
+  for (uint64_t i = it->first_record; ReadRecord(&record, &scratch); ++i) {
+    if (i < meta_records_)
+      continue;
+
+    string record_key = key_fn(record);
+    if (StringPiece(record_key) < key)
+      continue;
+
+    pending_.assign(record.data(), record.size());
+    has_pending_ = true;
+    return true;
+  }
+  return false;
+}
+
+bool ReaderImpl::SetBlockFilter(BlockFilter filter) {
+  if (!LoadIndex() || !has_stats_)
+    return false;
+
+  block_filter_ = std::move(filter);
+  ClearReadAhead();  // The filter decides on the blocks that follow the current one.
+
+  // The current block was read before the filter was set.
+  uint64_t block = file_offset_ ? (file_offset_ - 1) / wrapper_->block_size : 0;
+  block_filtered_ = !BlockPasses(block);
+  return true;
+}
+
+bool ReaderImpl::BlockPasses(uint64_t block) const {
+  auto it = std::lower_bound(index_.begin(), index_.end(), block,
+                             [](const IndexEntry& e, uint64_t b) { return e.block < b; });
+
+  // No records start in this block, it holds only a part of the record from a previous block.
+  if (it == index_.end() || it->block != block)
+    return false;
+
+  BlockStats stats{it->min_key, it->max_key, it->bloom};
+  return block_filter_(stats);
+}
+
+void ReaderImpl::SkipFilteredBlocks() {
+  // A record that started in the previous block needs the leading fragments of the next one.
+  const bool continues = last_type_ == kFirstType || last_type_ == kMiddleType;
+  const size_t fsize = wrapper_->file->Size();
+  block_filtered_ = false;
+
+  while (file_offset_ < fsize) {
+    if (BlockPasses(file_offset_ / wrapper_->block_size))
+      return;
+
+    if (continues) {
+      block_filtered_ = true;
+      return;
+    }
+
+    VLOG(2) << "Skipping block at " << file_offset_;
+    file_offset_ += wrapper_->block_size;
+    skip_tail_ = true;
+  }
+  wrapper_->eof = true;
+}
+
+
 }  // namespace lst2
+
+bool BlockStats::MayContain(StringPiece key) const {
+  if (bloom.size() < 2)
+    return true;
+
+  const size_t bits = (bloom.size() - 1) * 8;
+  const unsigned probes = uint8_t(bloom.back());
+  if (probes > 30)  // Reserved for other encodings.
+    return true;
+
+  uint32_t h = lst2::BloomHash(key);
+  const uint32_t delta = (h >> 17) | (h << 15);
+  for (unsigned j = 0; j < probes; ++j) {
+    const uint32_t bitpos = h % bits;
+    if ((bloom[bitpos / 8] & (1 << (bitpos % 8))) == 0)
+      return false;
+    h += delta;
+  }
+  return true;
+}
+
 }  // namespace file
@@ -3,6 +3,10 @@
 //
 #pragma once
 
+#include <deque>
+#include <memory>
+#include <vector>
+
 #include "file/list_file.h"
 #include "file/list_file_format2.h"
 
@@ -17,8 +21,10 @@ class Lst2Impl : public ListWriter::WriterImpl {
   util::Status Init(const std::map<std::string, std::string>& meta) final;
   util::Status AddRecord(StringPiece slice) final;
   util::Status Flush() final;
+  util::Status Close() final;
 
  private:
+  util::Status WriteRecord(StringPiece record);
   util::Status EmitPhysicalRecord(strings::ByteRange header, strings::ByteRange record);
   util::Status EmitSingleRecord(RecordType type, StringPiece record);
   util::Status WriteFragmented(StringPiece record);
@@ -26,28 +32,54 @@ class Lst2Impl : public ListWriter::WriterImpl {
   void AddRecordToArray(StringPiece size_enc, StringPiece record);
   util::Status FlushArray();
 
+  // Adds an index entry if the record is the first one that starts in the current block.
+  void IndexRecord(StringPiece record);
+
+  // Adds the record key to the stats of the current block.
+  void UpdateBlockStats(StringPiece record);
+  util::Status WriteIndex();
+
   uint32_t block_size() const { return block_size_; }
 
   std::unique_ptr<uint8[]> array_store_;
   std::unique_ptr<uint8[]> compress_buf_;
 
   uint8 *array_next_ = nullptr, *array_end_ = nullptr;  // wraps array_store_
-  bool init_called_ = false;
+  bool closed_ = false;
 
   uint32_t block_offset_ = 0;  // Current offset in block
   uint32_t array_records_ = 0;
   uint32_t block_size_ = 0;
+
+  struct IndexEntry {
+    uint64_t block;
+    uint64_t first_record;
+    std::string key;
+
+    std::string min_key, max_key;
+    std::vector<uint32_t> key_hashes;  // Bloom filter is built from them when the index is written.
+  };
+
+  uint64_t block_num_ = 0;   // Current block number.
+  uint64_t record_num_ = 0;  // Records written so far, including the meta records.
+  uint32_t meta_records_ = 0;
+  std::vector<IndexEntry> index_;
 };
 
 
 class ReaderImpl : public ListReader::FormatImpl {
  public:
-  using FormatImpl::FormatImpl;
+  explicit ReaderImpl(ListReader::ReaderWrapper* wrapper);
+  ~ReaderImpl();
 
   bool ReadHeader(std::map<std::string, std::string>* dest) final;
 
   bool ReadRecord(StringPiece* record, std::string* scratch) final;
 
+  bool SeekToRecord(uint64_t n) final;
+  bool SeekToKey(StringPiece key, const IndexKeyFn& key_fn) final;
+  bool SetBlockFilter(BlockFilter filter) final;
+
  private:
   enum {
     kEof = kMaxRecordVal + 1,
@@ -57,7 +89,74 @@ class ReaderImpl : public ListReader::FormatImpl {
     // * The record has an invalid CRC (ReadPhysicalRecord reports a drop)
     kBadRecord = kMaxRecordVal + 2
   };
+
+  struct IndexEntry {
+    uint64_t block;
+    uint64_t first_record;
+    std::string key;
+    std::string min_key, max_key, bloom;
+  };
+
+  struct Block;
+
   unsigned ReadPhysicalRecord(StringPiece* dest);
+
+  // Reads the block at file_offset_ into block_buffer_ and advances file_offset_.
+  bool ReadBlock();
+
+  // Same as ReadBlock but takes the next block from the read-ahead blocks.
+  // Read-ahead is not used with a block filter since the filter decides on the next block
+  // only after the current one was read, see SkipFilteredBlocks().
+  bool ReadAheadBlock();
+
+  // Reads upcoming blocks and submits their checksum verification to the decode pool until
+  // wrapper_->read_ahead blocks are in flight.
+  void FillReadAhead();
+
+  // Waits for the blocks in flight and drops them. file_offset_ is set back to the first
+  // block that was not consumed.
+  void ClearReadAhead();
+
+  // Verifies the checksums of the records of the block. Runs on a decode pool thread.
+  void VerifyBlock(Block* block) const;
+
+  // Returns true if VerifyBlock verified the checksum of the record that ends at rec_end.
+  bool IsVerified(const uint8_t* rec_end) const;
+
+  // Returns a block from free_blocks_ or allocates a new one.
+  std::unique_ptr<Block> GetBlock();
+
+  // Loads the record index from the end of the file. Returns false if there is no index.
+  bool LoadIndex();
+
+  // Positions the reader at the first record that starts in the block of the entry.
+  bool SeekToEntry(const IndexEntry& entry);
+
+  // Returns true if block_filter_ accepts the block.
+  bool BlockPasses(uint64_t block) const;
+
+  // Advances file_offset_ past the blocks that block_filter_ rejects.
+  void SkipFilteredBlocks();
+
+  uint32_t meta_records_ = 0;
+
+  bool index_loaded_ = false;
+  uint64_t num_records_ = 0;  // Number of records in the file, excluding the meta records.
+  std::vector<IndexEntry> index_;
+  bool has_stats_ = false;
+
+  BlockFilter block_filter_;
+  bool block_filtered_ = false;  // Record starts in the current block should be skipped.
+  bool skip_tail_ = false;       // Leading fragments belong to a skipped record.
+  unsigned last_type_ = kZeroType;  // Type of the last returned physical record.
+
+  // The record that was read by SeekToKey but has not been returned yet.
+  bool has_pending_ = false;
+  std::string pending_;
+
+  std::deque<std::unique_ptr<Block>> read_ahead_;  // Blocks in flight, in file order.
+  std::vector<std::unique_ptr<Block>> free_blocks_;  // Consumed blocks, reused with their buffers.
+  std::unique_ptr<Block> cur_block_;  // The block of block_buffer_ in read-ahead mode.
 };
 
 }  // namespace lst2
@@ -0,0 +1,373 @@
+// Copyright 2020, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "file/parallel_decompress.h"
+
+#define ZSTD_STATIC_LINKING_ONLY
+
+#include <zlib.h>
+#include <zstd.h>
+#include <cstring>
+
+#include "absl/strings/str_cat.h"
+#include "base/endian.h"
+#include "base/logging.h"
+
+namespace file {
+
+using util::Status;
+using util::StatusCode;
+using util::StatusObject;
+using namespace std;
+
+namespace {
+
+// The output of the decoders grows in chunks of this size.
+constexpr size_t kOutChunk = 1 << 18;
+
+constexpr size_t kGzipHeaderSize = 10;
+constexpr uint32_t kZstdSkippableMask = 0xFFFFFFF0, kZstdSkippableMagic = 0x184D2A50;
+
+}  // namespace
+
+class ParallelDecompressSource::Decoder {
+ public:
+  virtual ~Decoder() {}
+
+  // Decompresses input and appends the result to out. Sets aligned to true if the input ended
+  // exactly at the end of a member/frame.
+  virtual Status Decode(StringPiece input, string* out, bool* aligned) = 0;
+};
+
+namespace {
+
+class GzipDecoder : public ParallelDecompressSource::Decoder {
+ public:
+  GzipDecoder() {
+    memset(&zcontext_, 0, sizeof(zcontext_));
+    CHECK_EQ(Z_OK, inflateInit2(&zcontext_, 15 | 16));
+  }
+
+  ~GzipDecoder() { inflateEnd(&zcontext_); }
+
+  Status Decode(StringPiece input, string* out, bool* aligned) final;
+
+ private:
+  z_stream zcontext_;
+};
+
+Status GzipDecoder::Decode(StringPiece input, string* out, bool* aligned) {
+  zcontext_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+  zcontext_.avail_in = input.size();
+  *aligned = false;
+
+  while (true) {
+    size_t pos = out->size();
+    out->resize(pos + kOutChunk);
+    zcontext_.next_out = reinterpret_cast<Bytef*>(&(*out)[pos]);
+    zcontext_.avail_out = kOutChunk;
+
+    int zerror = inflate(&zcontext_, Z_NO_FLUSH);
+    out->resize(pos + kOutChunk - zcontext_.avail_out);
+
+    if (zerror == Z_STREAM_END) {
+      if (zcontext_.avail_in == 0) {
+        *aligned = true;
+        break;
+      }
+      inflateReset(&zcontext_);  // The next member.
+      continue;
+    }
+
+    if (zerror != Z_OK && zerror != Z_BUF_ERROR) {
+      return Status(StatusCode::IO_ERROR, absl::StrCat("ZLib error ", zerror, ": ",
+                                                       zcontext_.msg ? zcontext_.msg : ""));
+    }
+    if (zcontext_.avail_in == 0 && zcontext_.avail_out > 0)
+      break;
+  }
+  return Status::OK;
+}
+
+class ZstdDecoder : public ParallelDecompressSource::Decoder {
+ public:
+  ZstdDecoder() : dstream_(ZSTD_createDStream()) {
+    size_t res = ZSTD_initDStream(dstream_);
+    CHECK(!ZSTD_isError(res)) << ZSTD_getErrorName(res);
+  }
+
+  ~ZstdDecoder() { ZSTD_freeDStream(dstream_); }
+
+  Status Decode(StringPiece input, string* out, bool* aligned) final;
+
+ private:
+  ZSTD_DStream* dstream_;
+};
+
+Status ZstdDecoder::Decode(StringPiece input, string* out, bool* aligned) {
+  ZSTD_inBuffer in_buf{input.data(), input.size(), 0};
+  size_t res = 0;
+
+  while (true) {
+    size_t pos = out->size();
+    out->resize(pos + kOutChunk);
+    ZSTD_outBuffer out_buf{&(*out)[pos], kOutChunk, 0};
+
+    res = ZSTD_decompressStream(dstream_, &out_buf, &in_buf);
+    out->resize(pos + out_buf.pos);
+    if (ZSTD_isError(res))
+      return Status(StatusCode::IO_ERROR, ZSTD_getErrorName(res));
+
+    if (in_buf.pos == in_buf.size && out_buf.pos < out_buf.size)
+      break;
+  }
+
+  // 0 means that the frame was fully decoded and flushed.
+  *aligned = res == 0;
+  return Status::OK;
+}
+
+}  // namespace
+
+struct ParallelDecompressSource::Segment {
+  string input;
+  bool at_boundary = false;  // whether input starts at a (candidate) member boundary.
+
+  // Set by the decoding task.
+  string output;
+  Status status;
+  bool aligned = false;
+  std::unique_ptr<Decoder> decoder;
+  util::fibers_ext::Done done;
+};
+
+ParallelDecompressSource::ParallelDecompressSource(Format format, util::Source* sub_source,
+                                                   util::fibers_ext::FiberQueueThreadPool* tp,
+                                                   const Options& opts)
+    : format_(format), sub_(sub_source), tp_(tp), opts_(opts) {
+  CHECK_GT(opts_.segment_size, kGzipHeaderSize);
+  CHECK_GT(opts_.max_segments, 0);
+}
+
+ParallelDecompressSource::~ParallelDecompressSource() {
+  // The tasks still reference the segments.
+  for (auto& seg : segments_) {
+    seg->done.Wait();
+  }
+}
+
+ParallelDecompressSource::Decoder* ParallelDecompressSource::NewDecoder() const {
+  if (format_ == GZIP)
+    return new GzipDecoder;
+  return new ZstdDecoder;
+}
+
+StatusObject<size_t> ParallelDecompressSource::ReadInternal(const strings::MutableByteRange& range) {
+  size_t copied = 0;
+  while (copied < range.size()) {
+    if (!cur_ || out_pos_ == cur_->output.size()) {
+      Status st = NextSegment();
+      if (!st.ok())
+        return st;
+      if (!cur_)  // EOF
+        break;
+      continue;
+    }
+
+    size_t sz = std::min(range.size() - copied, cur_->output.size() - out_pos_);
+    memcpy(range.begin() + copied, cur_->output.data() + out_pos_, sz);
+    out_pos_ += sz;
+    copied += sz;
+  }
+  return copied;
+}
+
+Status ParallelDecompressSource::NextSegment() {
+  std::unique_ptr<Segment> prev = std::move(cur_);
+  out_pos_ = 0;
+
+  RETURN_IF_ERROR(Fill());
+  if (segments_.empty())
+    return Status::OK;
+
+  cur_ = std::move(segments_.front());
+  segments_.pop_front();
+  cur_->done.Wait();
+
+  bool continue_prev = prev && !prev->aligned;
+  if (!continue_prev && cur_->at_boundary)
+    return cur_->status;
+
+  // The segment does not start at a member boundary, or was not decoded since we did not know
+  // whether it does. We decode it by continuing the stream of the previous segment,
+  // or with a new decoder if the previous segment ended exactly at the end of a member.
+  Segment* seg = cur_.get();
+  seg->output.clear();
+  seg->decoder.reset(continue_prev ? prev->decoder.release() : NewDecoder());
+
+  util::fibers_ext::Done done;
+  tp_->Add([seg, done]() mutable {
+    seg->status = seg->decoder->Decode(seg->input, &seg->output, &seg->aligned);
+    done.Notify();
+  });
+  done.Wait();
+
+  return seg->status;
+}
+
+Status ParallelDecompressSource::Fill() {
+  while (segments_.size() < opts_.max_segments) {
+    // We read up to 2 segments in order to find a cut point after segment_size.
+    size_t want = opts_.segment_size * 2;
+    if (!input_eof_ && pending_.size() < want) {
+      size_t pos = pending_.size();
+      pending_.resize(want);
+      strings::MutableByteRange range(reinterpret_cast<uint8_t*>(&pending_[pos]), want - pos);
+      auto res = sub_->Read(range);
+      if (!res.ok()) {
+        pending_.resize(pos);
+        return res.status;
+      }
+      pending_.resize(pos + res.obj);
+      input_eof_ = res.obj < range.size();
+    }
+
+    if (pending_.empty())
+      break;
+
+    bool at_boundary = false;
+    size_t cut = FindCut(&at_boundary);
+
+    std::unique_ptr<Segment> seg(new Segment);
+    seg->input = pending_.substr(0, cut);
+    seg->at_boundary = next_at_boundary_;
+    pending_.erase(0, cut);
+    pending_offset_ += cut;
+    next_at_boundary_ = at_boundary;
+
+    Segment* ptr = seg.get();
+    if (ptr->at_boundary) {
+      tp_->Add([this, ptr, done = ptr->done]() mutable {
+        ptr->decoder.reset(NewDecoder());
+        ptr->status = ptr->decoder->Decode(ptr->input, &ptr->output, &ptr->aligned);
+        done.Notify();
+      });
+    } else {
+      ptr->done.Notify();  // Decoded by NextSegment.
+    }
+    segments_.push_back(std::move(seg));
+  }
+  return Status::OK;
+}
+
+size_t ParallelDecompressSource::FindCut(bool* at_boundary) {
+  const size_t size = pending_.size();
+  *at_boundary = false;
+
+  size_t cut = string::npos;
+  if (size > opts_.segment_size) {
+    cut = format_ == GZIP ? FindGzipCut(opts_.segment_size, at_boundary)
+                          : FindZstdCut(opts_.segment_size, at_boundary);
+  }
+
+  if (cut == string::npos) {
+    // The rest of the stream or a long member. In the latter case we cut it arbitrarily and
+    // the following segment continues the member.
+    cut = input_eof_ ? size : std::min(size, opts_.segment_size);
+  }
+  return cut;
+}
+
+size_t ParallelDecompressSource::FindGzipCut(size_t from, bool* at_boundary) {
+  const uint8_t* start = reinterpret_cast<const uint8_t*>(pending_.data());
+  const uint8_t* end = start + pending_.size() - kGzipHeaderSize;
+
+  for (const uint8_t* ptr = start + from; ptr < end; ++ptr) {
+    ptr = reinterpret_cast<const uint8_t*>(memchr(ptr, 0x1f, end - ptr));
+    if (!ptr)
+      break;
+
+    // Magic, deflate method, no reserved flags, known extra flags and OS.
+    if (ptr[1] == 0x8b && ptr[2] == 8 && (ptr[3] & 0xE0) == 0 &&
+        (ptr[8] == 0 || ptr[8] == 2 || ptr[8] == 4) && (ptr[9] <= 13 || ptr[9] == 255)) {
+      *at_boundary = true;
+      return ptr - start;
+    }
+  }
+  return string::npos;
+}
+
+size_t ParallelDecompressSource::FindZstdCut(size_t from, bool* at_boundary) {
+  WalkZstd();
+
+  while (!frame_starts_.empty() && frame_starts_.front() < pending_offset_ + from) {
+    frame_starts_.pop_front();
+  }
+
+  if (frame_starts_.empty() || frame_starts_.front() >= pending_offset_ + pending_.size())
+    return string::npos;
+
+  *at_boundary = true;
+  size_t cut = frame_starts_.front() - pending_offset_;
+  frame_starts_.pop_front();
+  return cut;
+}
+
+void ParallelDecompressSource::WalkZstd() {
+  const uint64_t end = pending_offset_ + pending_.size();
+  if (walk_pos_ < pending_offset_)
+    walk_state_ = WALK_STOPPED;
+
+  while (walk_state_ != WALK_STOPPED && walk_pos_ < end) {
+    const uint8_t* ptr = reinterpret_cast<const uint8_t*>(pending_.data()) +
+                         (walk_pos_ - pending_offset_);
+    size_t avail = end - walk_pos_;
+
+    if (walk_state_ == FRAME_HEADER) {
+      if (avail < 8)
+        return;
+
+      uint32_t magic = LittleEndian::Load32(ptr);
+      if ((magic & kZstdSkippableMask) == kZstdSkippableMagic) {
+        walk_pos_ += 8 + LittleEndian::Load32(ptr + 4);
+        frame_starts_.push_back(walk_pos_);
+        continue;
+      }
+
+      size_t header_size = ZSTD_frameHeaderSize(ptr, avail);
+      if (magic != ZSTD_MAGICNUMBER || ZSTD_isError(header_size)) {
+        LOG(WARNING) << "Unexpected zstd frame at " << walk_pos_;
+        walk_state_ = WALK_STOPPED;
+        return;
+      }
+      if (header_size > avail)
+        return;
+
+      frame_checksum_ = (ptr[4] & 4) != 0;  // Content_Checksum_flag of the frame descriptor.
+      walk_pos_ += header_size;
+      walk_state_ = BLOCK_HEADER;
+      continue;
+    }
+
+    // Block header: Last_Block bit, 2 bits of Block_Type and 21 bits of Block_Size.
+    if (avail < 3)
+      return;
+    uint32_t header = ptr[0] | (ptr[1] << 8) | (ptr[2] << 16);
+    unsigned block_type = (header >> 1) & 3;
+    if (block_type == 3) {
+      LOG(WARNING) << "Invalid zstd block at " << walk_pos_;
+      walk_state_ = WALK_STOPPED;
+      return;
+    }
+
+    // RLE block stores a single byte.
+    walk_pos_ += 3 + (block_type == 1 ? 1 : header >> 3);
+    if (header & 1) {
+      walk_pos_ += frame_checksum_ ? 4 : 0;
+      walk_state_ = FRAME_HEADER;
+      frame_starts_.push_back(walk_pos_);
+    }
+  }
+}
+
+}  // namespace file
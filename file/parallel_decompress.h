@@ -0,0 +1,87 @@
+// Copyright 2020, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <string>
+
+#include "util/fibers/fiberqueue_threadpool.h"
+#include "util/sinksource.h"
+
+namespace file {
+
+// Decompresses gzip and zstd streams that consist of multiple independent gzip members or
+// zstd frames, like the ones written by pigz, pzstd or by concatenation of compressed files.
+//
+// The compressed stream is cut into segments at the member/frame boundaries and the segments
+// are decompressed concurrently in FiberQueueThreadPool, while the output preserves
+// the original order. zstd frame boundaries are found exactly by walking the frame and block
+// headers. gzip members do not store their size, therefore the gzip member headers found
+// in the stream are only candidates. A segment that starts at a false candidate is discarded
+// and decompressed again by continuing the stream of the previous segment.
+// Streams with a single member fall back to the sequential decompression.
+class ParallelDecompressSource : public util::Source {
+ public:
+  enum Format { GZIP, ZSTD };
+
+  struct Options {
+    size_t segment_size = 1 << 20;  // the approximate size of the compressed segment.
+    unsigned max_segments = 8;      // how many segments are decompressed ahead of the reader.
+
+    Options() {}
+  };
+
+  // Takes ownership over sub_source.
+  ParallelDecompressSource(Format format, util::Source* sub_source,
+                           util::fibers_ext::FiberQueueThreadPool* tp,
+                           const Options& opts = Options());
+  ~ParallelDecompressSource();
+
+  class Decoder;
+
+ private:
+  struct Segment;
+
+  util::StatusObject<size_t> ReadInternal(const strings::MutableByteRange& range) final;
+
+  // Reads the compressed data and submits new segments.
+  util::Status Fill();
+
+  // Switches cur_ to the next segment. Sets cur_ to null at EOF.
+  util::Status NextSegment();
+
+  // Returns the offset in pending_ where the next segment starts and whether it starts at
+  // a (candidate) member boundary.
+  size_t FindCut(bool* at_boundary);
+  size_t FindGzipCut(size_t from, bool* at_boundary);
+  size_t FindZstdCut(size_t from, bool* at_boundary);
+
+  // Advances the zstd frame walker over pending_.
+  void WalkZstd();
+
+  Decoder* NewDecoder() const;
+
+  Format format_;
+  std::unique_ptr<util::Source> sub_;
+  util::fibers_ext::FiberQueueThreadPool* tp_;
+  Options opts_;
+
+  std::string pending_;  // compressed data that was not assigned to a segment yet.
+  uint64_t pending_offset_ = 0;  // stream offset of pending_.
+  bool input_eof_ = false, next_at_boundary_ = true;
+
+  // zstd frame walker.
+  enum WalkState { FRAME_HEADER, BLOCK_HEADER, WALK_STOPPED };
+  WalkState walk_state_ = FRAME_HEADER;
+  uint64_t walk_pos_ = 0;  // stream offset of the next header.
+  bool frame_checksum_ = false;
+  std::deque<uint64_t> frame_starts_;
+
+  std::deque<std::unique_ptr<Segment>> segments_;
+  std::unique_ptr<Segment> cur_;
+  size_t out_pos_ = 0;  // read position in cur_ output.
+};
+
+}  // namespace file
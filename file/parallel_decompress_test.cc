@@ -0,0 +1,132 @@
+// Copyright 2020, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "file/parallel_decompress.h"
+
+#include <zlib.h>
+#include <random>
+
+#include "absl/strings/str_cat.h"
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "util/zlib_source.h"
+#include "util/zstd_sinksource.h"
+
+namespace file {
+
+using namespace std;
+using namespace util;
+
+class ParallelDecompressTest : public testing::Test {
+ protected:
+  void SetUp() final { pool_.reset(new fibers_ext::FiberQueueThreadPool(2)); }
+
+  void TearDown() final { pool_.reset(); }
+
+  string Decompress(ParallelDecompressSource::Format format, const string& compressed);
+
+  std::unique_ptr<fibers_ext::FiberQueueThreadPool> pool_;
+};
+
+string ParallelDecompressTest::Decompress(ParallelDecompressSource::Format format,
+                                          const string& compressed) {
+  ParallelDecompressSource::Options opts;
+  opts.segment_size = 1 << 14;
+  opts.max_segments = 3;
+  ParallelDecompressSource src(format, new StringSource(compressed, 1000), pool_.get(), opts);
+
+  string res;
+  uint8_t buf[4096];
+  while (true) {
+    auto read_res = src.Read(strings::MutableByteRange(buf, sizeof(buf)));
+    CHECK(read_res.ok()) << read_res.status;
+    res.append(reinterpret_cast<char*>(buf), read_res.obj);
+    if (read_res.obj < sizeof(buf))
+      break;
+  }
+  return res;
+}
+
+static string GenerateText(unsigned lines, unsigned seed) {
+  std::default_random_engine rd(seed);
+  string res;
+  for (unsigned i = 0; i < lines; ++i) {
+    absl::StrAppend(&res, "line ", i, " ", rd(), " ", rd() % 1000, "\n");
+  }
+  return res;
+}
+
+static string Gzip(const string& data, int level = 1) {
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  CHECK_EQ(Z_OK, deflateInit2(&zs, level, Z_DEFLATED, 15 | 16, 8, Z_DEFAULT_STRATEGY));
+
+  string res(deflateBound(&zs, data.size()), '\0');
+  zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  zs.avail_in = data.size();
+  zs.next_out = reinterpret_cast<Bytef*>(&res.front());
+  zs.avail_out = res.size();
+  CHECK_EQ(Z_STREAM_END, deflate(&zs, Z_FINISH));
+  res.resize(zs.total_out);
+  deflateEnd(&zs);
+
+  return res;
+}
+
+static string Zstd(const string& data) {
+  StringSink* sink = new StringSink;
+  ZStdSink zsink(sink);
+  CHECK_STATUS(zsink.Init(1));
+  CHECK_STATUS(zsink.Append(strings::ToByteRange(data)));
+  CHECK_STATUS(zsink.Flush());
+  return sink->contents();
+}
+
+TEST_F(ParallelDecompressTest, Gzip) {
+  string expected, compressed;
+  for (unsigned i = 0; i < 20; ++i) {
+    string part = GenerateText(1000 + i * 100, i);
+    expected.append(part);
+    compressed.append(Gzip(part));
+  }
+  EXPECT_TRUE(expected == Decompress(ParallelDecompressSource::GZIP, compressed));
+
+  // A single member is decompressed sequentially.
+  EXPECT_TRUE(expected == Decompress(ParallelDecompressSource::GZIP, Gzip(expected)));
+}
+
+TEST_F(ParallelDecompressTest, GzipFalseHeader) {
+  // Stored blocks keep the gzip header that is embedded into the data,
+  // which looks like a member boundary.
+  string fake_member = Gzip("fake");
+  string data = GenerateText(2000, 1);
+  data.insert(data.size() / 2, fake_member);
+
+  string compressed = Gzip(data, 0) + Gzip("tail");
+  EXPECT_TRUE(data + "tail" == Decompress(ParallelDecompressSource::GZIP, compressed));
+}
+
+TEST_F(ParallelDecompressTest, Zstd) {
+  string expected, compressed;
+  for (unsigned i = 0; i < 20; ++i) {
+    string part = GenerateText(1000 + i * 100, i);
+    expected.append(part);
+    compressed.append(Zstd(part));
+  }
+  EXPECT_TRUE(expected == Decompress(ParallelDecompressSource::ZSTD, compressed));
+  EXPECT_TRUE(expected == Decompress(ParallelDecompressSource::ZSTD, Zstd(expected)));
+}
+
+TEST_F(ParallelDecompressTest, Corrupted) {
+  string compressed = Gzip(GenerateText(5000, 1));
+  compressed[compressed.size() / 2] ^= 0xFF;
+
+  ParallelDecompressSource src(ParallelDecompressSource::GZIP, new StringSource(compressed),
+                               pool_.get());
+  string res(1 << 20, '\0');
+  auto read_res = src.Read(strings::MutableByteRange(reinterpret_cast<uint8_t*>(&res[0]),
+                                                     res.size()));
+  EXPECT_FALSE(read_res.ok());
+}
+
+}  // namespace file
@@ -0,0 +1,333 @@
+// Copyright 2020, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "file/uring_file.h"
+
+#include "base/logging.h"
+
+#ifdef USE_URING
+
+#include <fcntl.h>
+#include <liburing.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <deque>
+
+#include "util/asio/uring_proactor.h"
+
+#endif
+
+namespace file {
+using namespace util;
+
+#ifdef USE_URING
+
+namespace {
+
+// How many prefetch requests a file keeps in flight.
+constexpr unsigned kPrefetchInflight = 4;
+
+constexpr size_t kFixedBufSize = UringProactor::kFixedBufSize;
+
+inline Status UringError(int32_t res) {
+  return Status(StatusCode::IO_ERROR, strerror(-res));
+}
+
+class UringReadFile : public ReadonlyFile {
+ public:
+  UringReadFile(ReadonlyFile* next, UringProactor* ring, const FiberReadOptions& opts)
+      : next_(next), ring_(ring), prefetch_size_(opts.prefetch_size), stats_(opts.stats) {}
+
+  ~UringReadFile();
+
+  StatusObject<size_t> Read(size_t offset,
+                            const strings::MutableByteRange& range) final MUST_USE_RESULT;
+
+  Status Close() final;
+
+  size_t Size() const final { return next_->Size(); }
+
+  int Handle() const final { return next_->Handle(); }
+
+ private:
+  struct Chunk {
+    size_t offset = 0;
+    size_t len = 0, consumed = 0;
+    int fixed_index = -1;  // -1 for the heap buffer.
+    bool ready = false;
+
+    uint8_t* buf = nullptr;
+    std::unique_ptr<uint8_t[]> heap;
+    iovec io;
+    UringOp op;
+  };
+
+  // Returns the number of bytes read. It's less than range.size() only on EOF.
+  StatusObject<size_t> ReadDirect(size_t offset, const strings::MutableByteRange& range);
+
+  // Keeps up to kPrefetchInflight chunks in flight, starting from the end of the last chunk or
+  // from offset if there are none.
+  void Prefetch(size_t offset);
+
+  // Returns false if the chunk read failed.
+  bool WaitChunk(Chunk* chunk);
+  void PopChunk();
+
+  // Waits for all the chunks in flight and drops them.
+  void DropChunks();
+
+  std::unique_ptr<ReadonlyFile> next_;
+  UringProactor* ring_;
+  size_t prefetch_size_;
+  FiberReadOptions::Stats* stats_;
+
+  std::deque<Chunk> chunks_;  // deque keeps the addresses of op stable.
+};
+
+UringReadFile::~UringReadFile() {
+  DropChunks();
+}
+
+Status UringReadFile::Close() {
+  DropChunks();
+  return next_->Close();
+}
+
+StatusObject<size_t> UringReadFile::Read(size_t offset, const strings::MutableByteRange& range) {
+  DCHECK(ring_ == UringProactor::ThisThread())
+      << "UringReadFile is used outside of its IoContext thread";
+  if (stats_)
+    ++stats_->read_prefetch_cnt;
+
+  size_t copied = 0;
+  while (copied < range.size() && !chunks_.empty()) {
+    Chunk& chunk = chunks_.front();
+    if (chunk.offset + chunk.consumed != offset + copied || !WaitChunk(&chunk)) {
+      DropChunks();  // Not a sequential read or a failure - we fall back to the direct read.
+      break;
+    }
+
+    size_t sz = std::min(chunk.len - chunk.consumed, range.size() - copied);
+    memcpy(range.data() + copied, chunk.buf + chunk.consumed, sz);
+    chunk.consumed += sz;
+    copied += sz;
+
+    if (chunk.consumed == chunk.len) {
+      bool eof = chunk.len < prefetch_size_;
+      PopChunk();
+      if (eof) {
+        DropChunks();
+        return copied;
+      }
+    }
+  }
+
+  if (copied < range.size()) {
+    strings::MutableByteRange rest(range.data() + copied, range.size() - copied);
+    auto res = ReadDirect(offset + copied, rest);
+    if (!res.ok())
+      return res;
+    copied += res.obj;
+    if (res.obj < rest.size())  // EOF
+      return copied;
+  }
+
+  if (prefetch_size_) {
+    Prefetch(offset + copied);
+  }
+  return copied;
+}
+
+StatusObject<size_t> UringReadFile::ReadDirect(size_t offset,
+                                               const strings::MutableByteRange& range) {
+  int fd = next_->Handle();
+  size_t read = 0;
+
+  while (read < range.size()) {
+    iovec io{range.data() + read, range.size() - read};
+    int32_t res =
+        ring_->Await([&](io_uring_sqe* sqe) { io_uring_prep_readv(sqe, fd, &io, 1, offset + read); });
+    if (res < 0)
+      return UringError(res);
+    if (res == 0)
+      break;
+    read += res;
+  }
+
+  if (stats_) {
+    ++stats_->preempt_cnt;
+    stats_->disk_bytes += read;
+  }
+  return read;
+}
+
+void UringReadFile::Prefetch(size_t offset) {
+  int fd = next_->Handle();
+  size_t file_size = next_->Size();
+  size_t next = chunks_.empty() ? offset : chunks_.back().offset + prefetch_size_;
+
+  while (chunks_.size() < kPrefetchInflight && next < file_size) {
+    chunks_.emplace_back();
+    Chunk& chunk = chunks_.back();
+    chunk.offset = next;
+    if (prefetch_size_ <= kFixedBufSize) {
+      chunk.fixed_index = ring_->GetFixedBuf(&chunk.buf);
+    }
+
+    if (chunk.fixed_index >= 0) {
+      ring_->Submit(&chunk.op, [&](io_uring_sqe* sqe) {
+        io_uring_prep_read_fixed(sqe, fd, chunk.buf, prefetch_size_, next, chunk.fixed_index);
+      });
+    } else {
+      chunk.heap.reset(new uint8_t[prefetch_size_]);
+      chunk.buf = chunk.heap.get();
+      chunk.io = iovec{chunk.buf, prefetch_size_};
+      ring_->Submit(&chunk.op,
+                    [&](io_uring_sqe* sqe) { io_uring_prep_readv(sqe, fd, &chunk.io, 1, next); });
+    }
+    next += prefetch_size_;
+  }
+}
+
+bool UringReadFile::WaitChunk(Chunk* chunk) {
+  if (!chunk->ready) {
+    bool preempted = chunk->op.done.Wait();
+    chunk->ready = true;
+    chunk->len = std::max(chunk->op.res, 0);
+
+    if (stats_) {
+      if (preempted) {
+        ++stats_->preempt_cnt;
+        stats_->disk_bytes += chunk->len;
+      } else {
+        stats_->cache_bytes += chunk->len;
+      }
+    }
+    VLOG_IF(1, chunk->op.res < 0) << "Prefetch failed " << UringError(chunk->op.res);
+  }
+  return chunk->op.res >= 0;
+}
+
+void UringReadFile::PopChunk() {
+  Chunk& chunk = chunks_.front();
+  if (chunk.fixed_index >= 0) {
+    ring_->ReturnFixedBuf(chunk.fixed_index);
+  }
+  chunks_.pop_front();
+}
+
+void UringReadFile::DropChunks() {
+  while (!chunks_.empty()) {
+    Chunk& chunk = chunks_.front();
+    if (!chunk.ready) {
+      chunk.op.done.Wait();  // The kernel may still write into the buffer.
+      chunk.ready = true;
+    }
+    PopChunk();
+  }
+}
+
+class UringWriteFile : public WriteFile {
+ public:
+  UringWriteFile(StringPiece name, bool append, UringProactor* ring)
+      : WriteFile(name), append_(append), ring_(ring) {}
+
+  bool Open() final;
+
+  bool Close() final;
+
+  Status Write(const uint8* buffer, uint64 length) final;
+
+ private:
+  ~UringWriteFile() {}
+
+  int fd_ = -1;
+  bool append_;
+  size_t offset_ = 0;
+  UringProactor* ring_;
+};
+
+bool UringWriteFile::Open() {
+  int flags = O_CREAT | O_WRONLY | O_CLOEXEC | (append_ ? O_APPEND : O_TRUNC);
+  fd_ = open(create_file_name_.c_str(), flags, 0644);
+  if (fd_ < 0) {
+    LOG(ERROR) << "Could not open file " << strerror(errno) << " file " << create_file_name_;
+    return false;
+  }
+  return true;
+}
+
+bool UringWriteFile::Close() {
+  bool res = true;
+  if (fd_ >= 0) {
+    res = close(fd_) == 0;
+  }
+  delete this;
+  return res;
+}
+
+Status UringWriteFile::Write(const uint8* buffer, uint64 length) {
+  DCHECK(ring_ == UringProactor::ThisThread())
+      << "UringWriteFile is used outside of its IoContext thread";
+
+  while (length > 0) {
+    iovec io{const_cast<uint8*>(buffer), length};
+
+    // With O_APPEND the offset is ignored.
+    int32_t res =
+        ring_->Await([&](io_uring_sqe* sqe) { io_uring_prep_writev(sqe, fd_, &io, 1, offset_); });
+    if (res < 0)
+      return UringError(res);
+
+    buffer += res;
+    length -= res;
+    offset_ += res;
+  }
+  return Status::OK;
+}
+
+UringProactor* GetRing(IoContext* io_context) {
+  if (!io_context || !io_context->InContextThread())
+    return nullptr;
+  return UringProactor::ForThisThread(io_context);
+}
+
+}  // namespace
+
+#endif
+
+StatusObject<ReadonlyFile*> OpenUringReadFile(StringPiece name, IoContext* io_context,
+                                              fibers_ext::FiberQueueThreadPool* tp,
+                                              const FiberReadOptions& opts) {
+#ifdef USE_URING
+  if (UringProactor* ring = GetRing(io_context)) {
+    StatusObject<ReadonlyFile*> res = ReadonlyFile::Open(name, opts);
+    if (!res.ok())
+      return res;
+    return new UringReadFile(res.obj, ring, opts);
+  }
+#endif
+
+  return OpenFiberReadFile(name, tp, opts);
+}
+
+StatusObject<WriteFile*> OpenUringWriteFile(StringPiece name, IoContext* io_context,
+                                            fibers_ext::FiberQueueThreadPool* tp,
+                                            const FiberWriteOptions& opts) {
+#ifdef USE_URING
+  if (UringProactor* ring = GetRing(io_context)) {
+    UringWriteFile* wf = new UringWriteFile(name, opts.append, ring);
+    if (!wf->Open()) {
+      wf->Close();
+      return Status(StatusCode::IO_ERROR, "Can not create a file");
+    }
+    return wf;
+  }
+#endif
+
+  return OpenFiberWriteFile(name, tp, opts);
+}
+
+}  // namespace file
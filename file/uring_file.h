@@ -0,0 +1,29 @@
+// Copyright 2020, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include "file/fiber_file.h"
+
+namespace util {
+class IoContext;
+}  // namespace util
+
+namespace file {
+
+// io_uring based files. The requests are submitted and completed by the IoContext thread
+// of the calling fiber, without handing them off to FiberQueueThreadPool threads.
+// Each IoContext thread lazily creates its own ring. The returned files must be used only from
+// that thread.
+//
+// If io_uring is not available or not compiled in (USE_URING) or io_context is null or is not
+// the current thread context, falls back to OpenFiberReadFile/OpenFiberWriteFile with tp.
+util::StatusObject<ReadonlyFile*> OpenUringReadFile(
+    StringPiece name, util::IoContext* io_context, util::fibers_ext::FiberQueueThreadPool* tp,
+    const FiberReadOptions& opts = FiberReadOptions{}) MUST_USE_RESULT;
+
+util::StatusObject<WriteFile*> OpenUringWriteFile(
+    StringPiece name, util::IoContext* io_context, util::fibers_ext::FiberQueueThreadPool* tp,
+    const FiberWriteOptions& opts = FiberWriteOptions()) MUST_USE_RESULT;
+
+}  // namespace file
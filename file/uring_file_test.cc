@@ -0,0 +1,83 @@
+// Copyright 2020, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "file/uring_file.h"
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "file/file_util.h"
+#include "util/asio/io_context_pool.h"
+
+namespace file {
+
+using namespace std;
+using namespace util;
+
+class UringFileTest : public testing::Test {
+ protected:
+  void SetUp() final {
+    pool_.reset(new IoContextPool{1});
+    pool_->Run();
+    fq_.reset(new fibers_ext::FiberQueueThreadPool(1));
+  }
+
+  void TearDown() final {
+    pool_->Stop();
+    fq_.reset();
+  }
+
+  std::unique_ptr<IoContextPool> pool_;
+  std::unique_ptr<fibers_ext::FiberQueueThreadPool> fq_;
+};
+
+TEST_F(UringFileTest, WriteRead) {
+  string path = base::GetTestTempPath("uring.bin");
+  string contents = base::RandStr(1000000);
+  IoContext& io_context = pool_->GetNextContext();
+
+  io_context.AwaitSafe([&] {
+    auto res = OpenUringWriteFile(path, &io_context, fq_.get());
+    ASSERT_TRUE(res.ok()) << res.status;
+    for (size_t i = 0; i < contents.size(); i += 100000) {
+      ASSERT_TRUE(res.obj->Write(StringPiece(contents).substr(i, 100000)).ok());
+    }
+    ASSERT_TRUE(res.obj->Close());
+  });
+
+  for (size_t prefetch_size : {0, 1 << 16, 1 << 18}) {
+    FiberReadOptions::Stats stats;
+    FiberReadOptions opts;
+    opts.prefetch_size = prefetch_size;
+    opts.stats = &stats;
+
+    string read;
+    io_context.AwaitSafe([&] {
+      auto res = OpenUringReadFile(path, &io_context, fq_.get(), opts);
+      ASSERT_TRUE(res.ok()) << res.status;
+      std::unique_ptr<ReadonlyFile> file(res.obj);
+      ASSERT_EQ(contents.size(), file->Size());
+
+      // Reads of different sizes, including one past the end of the file.
+      uint8_t buf[7919];
+      for (size_t offset = 0; offset < contents.size();) {
+        auto read_res = file->Read(offset, strings::MutableByteRange(buf, sizeof(buf)));
+        ASSERT_TRUE(read_res.ok()) << read_res.status;
+        read.append(reinterpret_cast<char*>(buf), read_res.obj);
+        offset += read_res.obj;
+      }
+
+      // Random access drops the prefetched data.
+      auto read_res = file->Read(10, strings::MutableByteRange(buf, 10));
+      ASSERT_TRUE(read_res.ok());
+      EXPECT_EQ(contents.substr(10, 10), string(reinterpret_cast<char*>(buf), 10));
+      ASSERT_TRUE(file->Close().ok());
+    });
+
+    EXPECT_TRUE(contents == read) << prefetch_size;
+    if (prefetch_size) {
+      EXPECT_GE(stats.cache_bytes + stats.disk_bytes, contents.size()) << prefetch_size;
+    }
+  }
+}
+
+}  // namespace file
@@ -2,6 +2,7 @@
 // Author: Roman Gershman (romange@gmail.com)
 //
 #include <google/protobuf/descriptor.h>
+#include <thread>
 
 #include "mr/impl/dest_file_set.h"
 
@@ -16,11 +17,26 @@
 #include "file/proto_writer.h"
 
 #include "util/asio/io_context_pool.h"
+#include "util/aws/s3.h"
 #include "util/gce/gcs.h"
 #include "util/stats/varz_stats.h"
 #include "util/zlib_source.h"
 #include "util/zstd_sinksource.h"
 
+DEFINE_uint32(dest_compress_threads, 0,
+              "Number of threads compressing the output. 0 - half of the cores.");
+DEFINE_uint32(dest_max_pending_chunks, 64,
+              "Maximal number of output chunks that are queued per destination handle "
+              "before the producers block.");
+DEFINE_uint32(dest_gcs_part_mb, 0,
+              "If positive, gcs outputs are uploaded as concurrent part objects of this size "
+              "that are composed on close. 0 uploads each output with a single stream.");
+DEFINE_uint32(dest_gcs_parallel_parts, 4, "Maximal number of part uploads in flight per output.");
+DEFINE_uint32(dest_s3_part_mb, 8,
+              "s3 outputs larger than this are uploaded with multipart upload with parts "
+              "of this size. Must be at least 5.");
+DEFINE_uint32(dest_s3_parallel_parts, 4, "Maximal number of s3 part uploads in flight per output.");
+
 namespace mr3 {
 
 util::VarzMapAverage5m dest_files("dest-files-set");
@@ -35,8 +51,42 @@ namespace {
 
 constexpr size_t kBufLimit = 1 << 16;
 
+// Raw chunk size for compressed outputs. Each chunk is compressed independently,
+// so it should be large enough to keep a good compression ratio.
+constexpr size_t kCompressChunkLimit = 1 << 20;
+
+// Compresses src into a self-contained gzip member or zstd frame.
+// Concatenation of those is a valid compressed stream.
+string CompressChunk(const pb::Output::Compress& compress, const string& src) {
+  StringSink* dest = new StringSink;
+  std::unique_ptr<util::Sink> sink;
+
+  if (compress.type() == pb::Output::GZIP) {
+    sink.reset(new ZlibSink(dest, compress.level()));
+  } else if (compress.type() == pb::Output::ZSTD) {
+    std::unique_ptr<ZStdSink> zsink{new ZStdSink(dest)};
+    CHECK_STATUS(zsink->Init(compress.level()));
+    sink = std::move(zsink);
+  } else {
+    LOG(FATAL) << "Unsupported format " << compress.ShortDebugString();
+  }
+
+  CHECK_STATUS(sink->Append(strings::ToByteRange(src)));
+  CHECK_STATUS(sink->Flush());
+
+  return std::move(dest->contents());
+}
+
 string FileName(StringPiece base, const pb::Output& pb_out, int32 sub_shard) {
   string res(base);
+  if (pb_out.has_incremental_run()) {
+    if (sub_shard >= 0) {
+      absl::StrAppend(&res, "-r", absl::Dec(pb_out.incremental_run(), absl::kZeroPad4));
+    } else {
+      absl::StrAppend(&res, "-r*");
+    }
+  }
+
   if (pb_out.shard_spec().has_max_raw_size_mb()) {
     if (sub_shard >= 0) {
       absl::StrAppend(&res, "-", absl::Dec(sub_shard, absl::kZeroPad3));
@@ -69,9 +119,17 @@ string FileName(StringPiece base, const pb::Output& pb_out, int32 sub_shard) {
   return res;
 }
 
-class CompressHandle : public DestHandle {
-  void AppendThreadLocal(const std::string& val);
+/*! Writes text records, optionally compressed.
 
+    The write path is pipelined into 3 stages: the calling fibers batch the records into
+    raw chunks, the chunks are compressed by the compression pool of the runner and
+    finally they are written by the io queue of the handle. Each chunk is compressed
+    independently into a separate gzip member/zstd frame, hence the chunks of the same file
+    can be compressed in parallel. The compressed chunks are reordered back before they
+    reach the io queue. The number of chunks in flight is bounded per handle, so a slow
+    output device blocks the mapper fibers only when the pipeline is full.
+*/
+class CompressHandle : public DestHandle {
  public:
   CompressHandle(DestFileSet* owner, const ShardId& sid);
   ~CompressHandle() override;
@@ -82,16 +140,45 @@ class CompressHandle : public DestHandle {
   void Close(bool abort_write) override;
 
  private:
-  void InitCompressSink();
+  // An operation on the destination file. The operations are applied by io queue in the order
+  // of their submission.
+  struct Op {
+    enum Type : uint8_t { OPEN, WRITE, CLOSE };
+
+    Type type;
+    uint64_t submit_usec;
+    string data;  // WRITE - the data to write, OPEN - the path of the file.
+  };
 
   void Open() override;
-  void WriteThreadLocal(uint64_t start_usec, string data);
 
+  // Submits the raw chunk that was accumulated so far. Must be called under zmu_.
+  void SubmitChunkLocked();
+
+  // Must be called under zmu_ to preserve the order of the operations.
+  void SubmitLocked(Op op, bool compress);
+
+  // Passes op to the io queue, once all the operations preceding seq were passed to it.
+  void Deliver(uint64_t seq, Op op);
+
+  void ApplyOpLocal(Op op);  // Runs in the io queue.
+
+  const bool is_compressed_;
+  const size_t chunk_limit_;
   size_t start_delta_ = 0;
-  util::StringSink* compress_out_buf_ = nullptr;
-  unique_ptr<util::Sink> compress_sink_;
+  string raw_buf_;
 
-  fibers::mutex zmu_;
+  // Set by Close(true). The io queue drops the pending operations and aborts the file.
+  std::atomic_bool aborted_{false};
+
+  fibers::mutex zmu_;  // Guards raw_buf_, the submission order and the sharding state.
+
+  // Reordering state of the compressed chunks.
+  fibers::mutex order_mu_;
+  fibers::condition_variable order_cv_;
+  uint64_t next_seq_ = 0, deliver_seq_ = 0;
+  bool delivering_ = false;  // Whether some fiber passes the ready operations to the io queue.
+  absl::flat_hash_map<uint64_t, Op> ready_ops_;
 };
 
 class LstHandle : public DestHandle {
@@ -111,48 +198,29 @@ class LstHandle : public DestHandle {
   std::unique_ptr<file::ListWriter> lst_writer_;
 };
 
-CompressHandle::CompressHandle(DestFileSet* owner, const ShardId& sid) : DestHandle(owner, sid) {
+CompressHandle::CompressHandle(DestFileSet* owner, const ShardId& sid)
+    : DestHandle(owner, sid), is_compressed_(owner->output().has_compress()),
+      chunk_limit_(is_compressed_ ? kCompressChunkLimit : kBufLimit) {
   static std::default_random_engine rnd;
 
   // Randomize when we flush first for each handle. That should define uniform flushing cycle
   // for all handles.
-  start_delta_ = rnd() % (kBufLimit - 1);
-
-  if (owner->output().has_compress()) {
-    InitCompressSink();
-  }
+  start_delta_ = rnd() % (chunk_limit_ - 1);
 }
 
 CompressHandle::~CompressHandle() {
-  WaitForPendingToFinish();
-}
-
-void CompressHandle::AppendThreadLocal(const std::string& str) {
-  auto status = CHECK_NOTNULL(write_file_)->Write(str);
-  CHECK_STATUS(status);
-
-  if (raw_limit_ == kuint64max)  // No output size limit
-    return;
-}
-
+  // Wait for the compression stage to pass all the chunks to the io queue.
+  std::unique_lock<fibers::mutex> lk(order_mu_);
+  order_cv_.wait(lk, [this] { return deliver_seq_ == next_seq_ && !delivering_; });
+  lk.unlock();
 
-void CompressHandle::InitCompressSink() {
-  compress_out_buf_ = new StringSink;
-  auto level = owner_->output().compress().level();
-  if (owner_->output().compress().type() == pb::Output::GZIP) {
-    compress_sink_.reset(new ZlibSink(compress_out_buf_, level));
-  } else if (owner_->output().compress().type() == pb::Output::ZSTD) {
-    std::unique_ptr<ZStdSink> zsink{new ZStdSink(compress_out_buf_)};
-    CHECK_STATUS(zsink->Init(level));
-    compress_sink_ = std::move(zsink);
-  } else {
-    LOG(FATAL) << "Unsupported format " << owner_->output().compress().ShortDebugString();
-  }
+  WaitForPendingToFinish();
 }
 
 void CompressHandle::Open() {
   // Do not block on opening the file.
-  io_queue_->Add([this] { this->OpenWriteFileLocal(); });
+  std::lock_guard<fibers::mutex> lk(zmu_);
+  SubmitLocked(Op{Op::OPEN, base::GetMonotonicMicrosFast(), full_path_}, false);
 }
 
 // CompressHandle::Write runs in "other" threads, no necessarily where we write the data into.
@@ -162,114 +230,151 @@ void CompressHandle::Write(StringGenCb cb) {
     tmp_str = cb();
     if (!tmp_str)
       break;
+
+    // We must lock the appending and the submission because the order of the chunks
+    // is important and we need to preserve transactional semantics.
+    std::unique_lock<fibers::mutex> lk(zmu_);
     raw_size_ += tmp_str->size();
+    raw_buf_.append(*tmp_str);
+
+    if (raw_size_ >= raw_limit_) {
+      SubmitChunkLocked();
+      SubmitLocked(Op{Op::CLOSE, base::GetMonotonicMicrosFast(), string{}}, false);
 
-    if (compress_sink_) {
-      this_fiber::yield();
+      ++sub_shard_;
+      raw_size_ = 0;
+      full_path_ = owner_->ShardFilePath(sid_, sub_shard_);
+      SubmitLocked(Op{Op::OPEN, base::GetMonotonicMicrosFast(), full_path_}, false);
+    } else if (start_delta_ + raw_buf_.size() >= chunk_limit_) {
+      SubmitChunkLocked();
+      start_delta_ = 0;
     }
+  }
+}
 
-    // We must lock both the compression and the enquing calls because the order of writing
-    // compressed chunks is important and we need to preserve transactional semantics.
-    // It seems that compressing in the producer thread gives better performance because
-    // the system balances itself: it spends producer CPU on the compression step before
-    // enqueing it into io queue that could be full.
-    std::unique_lock<fibers::mutex> lk(zmu_);
+void CompressHandle::SubmitChunkLocked() {
+  if (raw_buf_.empty())
+    return;
 
-    if (compress_sink_) {
-      strings::ByteRange br = strings::ToByteRange(*tmp_str);
-      auto status = compress_sink_->Append(br);
-      CHECK_STATUS(status);
+  string data;
+  data.reserve(chunk_limit_);
+  data.swap(raw_buf_);
 
-      if (start_delta_ + compress_out_buf_->contents().size() < kBufLimit)
-        continue;
+  SubmitLocked(Op{Op::WRITE, base::GetMonotonicMicrosFast(), std::move(data)}, is_compressed_);
+}
 
-      tmp_str->clear();
-      tmp_str->swap(compress_out_buf_->contents());
-      start_delta_ = 0;
-    }
+void CompressHandle::SubmitLocked(Op op, bool compress) {
+  std::unique_lock<fibers::mutex> lk(order_mu_);
 
+  // Backpressure: blocks the producers once the output can not keep up.
+  order_cv_.wait(lk, [this] { return next_seq_ - deliver_seq_ < FLAGS_dest_max_pending_chunks; });
+  uint64_t seq = next_seq_++;
+  lk.unlock();
+
+  auto submit_start = base::GetMonotonicMicrosFast();
+  if (!compress) {
+    Deliver(seq, std::move(op));
+    dest_files.IncBy("submit", base::GetMonotonicMicrosFast() - submit_start);
+    return;
+  }
+
+  const pb::Output::Compress& pb_compress = owner_->output().compress();
+  owner_->compress_pool()->Add([this, seq, &pb_compress, op = std::move(op)]() mutable {
     auto start = base::GetMonotonicMicrosFast();
-    auto cb = [start, this, str = std::move(*tmp_str)]() mutable {
-      WriteThreadLocal(start, std::move(str));
-    };
+    dest_files.IncBy("compress-queue", start - op.submit_usec);
 
-    bool preempted = io_queue_->Add(std::move(cb));
+    op.data = CompressChunk(pb_compress, op.data);
+    dest_files.IncBy("compress", base::GetMonotonicMicrosFast() - start);
 
-    if (raw_size_ >= raw_limit_) {
-      Close(false);
-      ++sub_shard_;
-      raw_size_ = 0;
-      full_path_ = owner_->ShardFilePath(sid_, sub_shard_);
-      if (compress_sink_) {
-        InitCompressSink();
-      }
-      Open();
-    }
+    Deliver(seq, std::move(op));
+  });
+  dest_files.IncBy("submit", base::GetMonotonicMicrosFast() - submit_start);
+}
 
-    lk.unlock();  // unlock the transaction. Must be after io_queue_->Add call.
+void CompressHandle::Deliver(uint64_t seq, Op op) {
+  std::unique_lock<fibers::mutex> lk(order_mu_);
+  ready_ops_.emplace(seq, std::move(op));
 
-    auto delta = base::GetMonotonicMicrosFast() - start;
-    if (preempted) {
-      dest_files.IncBy("io-submit-preempted", delta);
-    } else {
-      dest_files.IncBy("io-submit-fast", delta);
+  // A single fiber passes the operations to the io queue to preserve their order.
+  if (delivering_)
+    return;
+  delivering_ = true;
+
+  std::vector<Op> batch;
+  while (true) {
+    auto it = ready_ops_.find(deliver_seq_);
+    for (; it != ready_ops_.end(); it = ready_ops_.find(deliver_seq_ + batch.size())) {
+      batch.push_back(std::move(it->second));
+      ready_ops_.erase(it);
+    }
+    if (batch.empty())
+      break;
+
+    // io_queue_->Add blocks when the queue is full, hence we do not hold order_mu_ while
+    // calling it. Otherwise it would stall the compressors that deliver the next chunks.
+    lk.unlock();
+    for (Op& ready : batch) {
+      auto start = base::GetMonotonicMicrosFast();
+      bool preempted = io_queue_->Add(
+          [this, op = std::move(ready)]() mutable { ApplyOpLocal(std::move(op)); });
+      auto delta = base::GetMonotonicMicrosFast() - start;
+      dest_files.IncBy(preempted ? "io-submit-preempted" : "io-submit-fast", delta);
     }
+    lk.lock();
+
+    deliver_seq_ += batch.size();
+    batch.clear();
+    order_cv_.notify_all();  // Unblocks the producers.
   }
-}
+  delivering_ = false;
 
-void CompressHandle::WriteThreadLocal(uint64_t start_usec, string data) {
-  dest_files.IncBy("io-deque", base::GetMonotonicMicrosFast() - start_usec);
+  // Notify under lock since the handle may be destroyed right after we release it.
+  order_cv_.notify_all();
+}
 
-#if 0
-  if (compress_sink_) {
-    if (data.empty()) {
-      CHECK_STATUS(compress_sink_->Flush());
-    } else {
-      strings::ByteRange br = strings::ToByteRange(data);
-      CHECK_STATUS(compress_sink_->Append(br));
+void CompressHandle::ApplyOpLocal(Op op) {
+  dest_files.IncBy("io-deque", base::GetMonotonicMicrosFast() - op.submit_usec);
 
-      if (start_delta_ + compress_out_buf_->contents().size() < kBufLimit)
-        return;
+  if (aborted_.load(std::memory_order_relaxed)) {
+    if (op.type == Op::CLOSE && write_file_) {
+      VLOG(1) << "Aborting file " << write_file_->create_file_name();
+      write_file_->Abort();
+      write_file_ = nullptr;
     }
+    return;
+  }
 
-    data.clear();
-    data.swap(compress_out_buf_->contents());
-    start_delta_ = 0;
+  switch (op.type) {
+    case Op::OPEN:
+      OpenWriteFileLocal(op.data);
+      break;
+    case Op::WRITE: {
+      auto start = base::GetMonotonicMicrosFast();
+      CHECK_STATUS(CHECK_NOTNULL(write_file_)->Write(op.data));
+      dest_files.IncBy("io-write", base::GetMonotonicMicrosFast() - start);
+    } break;
+    case Op::CLOSE:
+      if (write_file_) {
+        VLOG(1) << "Closing file " << write_file_->create_file_name();
+        CHECK(write_file_->Close());
+        write_file_ = nullptr;
+      }
+      break;
   }
-#endif
-  AppendThreadLocal(data);
 }
 
 void CompressHandle::Close(bool abort_write) {
   VLOG(1) << "CompressHandle::Close";
 
-  if (!abort_write) {
-    if (compress_sink_) {
-      CHECK_STATUS(compress_sink_->Flush());
-
-      auto& buf = compress_out_buf_->contents();
-      if (!buf.empty()) {
-        auto start = base::GetMonotonicMicrosFast();
-        auto cb = [start, this, str = std::move(buf)]() mutable {
-          WriteThreadLocal(start, std::move(str));  // Flush and write.
-        };
-        io_queue_->Add(std::move(cb));
-      }
-    }
-  }
-
-  // TODO: to handle abort_write by changing WriteFile interface to allow optionally drop
-  // the pending writes.
   // I do not block on Close to allow fast iteration when closing all the files.
   // During queues shutdown they will block until this handler runs.
-  io_queue_->Add([this] {
-    if (write_file_) {
-      VLOG(1) << "Closing file " << write_file_->create_file_name();
-      CHECK(write_file_->Close());
-      write_file_ = nullptr;
-    }
-  });
-  // I can not reset write_file_ here since some write may be still pending in the IO thread.
+  std::lock_guard<fibers::mutex> lk(zmu_);
+  if (abort_write) {
+    aborted_.store(true, std::memory_order_relaxed);
+  } else {
+    SubmitChunkLocked();
+  }
+  SubmitLocked(Op{Op::CLOSE, base::GetMonotonicMicrosFast(), string{}}, false);
 }
 
 LstHandle::LstHandle(DestFileSet* owner, const ShardId& sid) : DestHandle(owner, sid) {
@@ -297,7 +402,9 @@ void LstHandle::Write(StringGenCb cb) {
           CHECK_STATUS(lst_writer_->AddRecord(v));
         }
       });
-      CHECK_EQ(str_vec.capacity(), kBufSize);  // move does not deallocate the storage.
+      // The storage moved into the queue together with the records.
+      str_vec.clear();
+      str_vec.reserve(kBufSize);
     }
   }
   io_queue_->Add([this, vec = std::move(str_vec)] {
@@ -313,7 +420,7 @@ void LstHandle::Open() {
 }
 
 void LstHandle::OpenThreadLocal() {
-  OpenWriteFileLocal();
+  OpenWriteFileLocal(full_path_);
 
   namespace gpb = google::protobuf;
 
@@ -333,9 +440,25 @@ void LstHandle::OpenThreadLocal() {
 }
 
 void LstHandle::CloseThreadLocal(bool abort_write) {
-  CHECK_STATUS(lst_writer_->Flush());
+  // Both Abort() and Close() delete write_file_, hence we must destroy the writer that
+  // references it beforehand.
+  if (abort_write) {
+    VLOG(1) << "Aborting file " << write_file_->create_file_name();
+    Status st = lst_writer_->Flush();
+    LOG_IF(WARNING, !st.ok()) << "Error flushing aborted file " << full_path_ << ": " << st;
+    lst_writer_.reset();
+
+    write_file_->Abort();
+    write_file_ = nullptr;
+    return;
+  }
+
+  CHECK_STATUS(lst_writer_->Close());
+  lst_writer_.reset();
+
   VLOG(1) << "Closing file " << write_file_->create_file_name();
   CHECK(write_file_->Close());
+  write_file_ = nullptr;
 }
 
 void LstHandle::Close(bool abort_write) {
@@ -345,14 +468,29 @@ void LstHandle::Close(bool abort_write) {
 }  // namespace
 
 DestFileSet::DestFileSet(const std::string& root_dir, const pb::Output& out,
-                         util::IoContextPool* pool, fibers_ext::FiberQueueThreadPool* fq)
-    : root_dir_(root_dir), pb_out_(out), io_pool_(*pool), fq_(*fq) {
+                         util::IoContextPool* pool, fibers_ext::FiberQueueThreadPool* fq,
+                         fibers_ext::FiberQueueThreadPool* compress_pool)
+    : root_dir_(root_dir), pb_out_(out), compress_fq_(compress_pool), io_pool_(*pool), fq_(*fq) {
   is_gcs_dest_ = util::IsGcsPath(root_dir_);
+  is_s3_dest_ = util::IsS3Path(root_dir_);
+
+  if (out.has_compress() && !compress_fq_) {
+    own_compress_fq_.reset(CreateCompressPool());
+    compress_fq_ = own_compress_fq_.get();
+  }
 }
 
 DestFileSet::~DestFileSet() {
 }
 
+fibers_ext::FiberQueueThreadPool* DestFileSet::CreateCompressPool() {
+  unsigned num_threads = FLAGS_dest_compress_threads;
+  if (num_threads == 0) {
+    num_threads = std::max(1U, std::thread::hardware_concurrency() / 2);
+  }
+  return new fibers_ext::FiberQueueThreadPool(num_threads);
+}
+
 // DestHandle is cached in each of the calling IO threads and the only contention happens
 // when a new handle shard is created.
 DestHandle* DestFileSet::GetOrCreate(const ShardId& sid) {
@@ -361,7 +499,7 @@ DestHandle* DestFileSet::GetOrCreate(const ShardId& sid) {
   if (it == dest_files_.end()) {
     std::unique_ptr<DestHandle> dh;
 
-    bool is_local_fs = !is_gcs_dest_;
+    bool is_local_fs = !is_remote_dest();
     if (is_local_fs) {
       string shard_name = sid.ToString(absl::string_view{});
       absl::string_view dir_name = file_util::DirName(shard_name);
@@ -450,7 +588,7 @@ DestHandle::DestHandle(DestFileSet* owner, const ShardId& sid) : owner_(owner),
   queue_index_ = base::Murmur32(full_path_, 120577U);
   io_queue_ = owner_->pool()->GetQueue(queue_index_);
 
-  if (owner_->is_gcs_dest()) {
+  if (owner_->is_remote_dest()) {
     size_t net_index = queue_index_ % owner_->io_pool()->size();
 
     net_context_ = &owner_->io_pool()->at(net_index);
@@ -485,18 +623,30 @@ void DestHandle::GcsWriteFiber(IoContext* io_context) {
   net_queue_->Run();
 }
 
-void DestHandle::OpenWriteFileLocal() {
-  VLOG(1) << "Creating file " << full_path_;
+void DestHandle::OpenWriteFileLocal(const std::string& path) {
+  VLOG(1) << "Creating file " << path;
+
+  if (owner_->is_s3_dest()) {
+    absl::string_view bucket, key_path;
+    CHECK(S3Bucket::SplitToBucketPath(path, &bucket, &key_path)) << path;
 
-  if (is_gcs()) {
+    S3WriteOptions opts;
+    opts.part_size = size_t(FLAGS_dest_s3_part_mb) << 20;
+    opts.max_parallel_parts = FLAGS_dest_s3_parallel_parts;
+    write_file_ =
+        CHECKED_GET(OpenS3WriteFile(key_path, *owner_->aws(), owner_->GetS3BucketPool(), opts));
+  } else if (is_gcs()) {
+    GcsWriteOptions opts;
+    opts.part_size = size_t(FLAGS_dest_gcs_part_mb) << 20;
+    opts.max_parallel_parts = FLAGS_dest_gcs_parallel_parts;
     write_file_ =
-        CHECKED_GET(OpenGcsWriteFile(full_path_, *owner_->gce(), owner_->GetGceApiPool()));
+        CHECKED_GET(OpenGcsWriteFile(path, *owner_->gce(), owner_->GetGceApiPool(), opts));
   } else {
     // I can not use OpenFiberWriteFile here since it supports only synchronous semantics of
     // writing data (i.e. Write(StringPiece) where ownership stays with owner).
     // To support asynchronous writes we need to design an abstract class AsyncWriteFile
     // which should take ownership over data chunks that are passed to it for writing.
-    write_file_ = file::Open(full_path_);
+    write_file_ = file::Open(path);
   }
   CHECK(write_file_);
 }
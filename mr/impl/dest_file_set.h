@@ -17,6 +17,7 @@ namespace util {
 class IoContextPool;
 class IoContext;
 class GCE;
+class AWS;
 
 namespace http {
 class HttpsClientPool;
@@ -37,8 +38,11 @@ class DestFileSet {
   const pb::Output& pb_out_;
 
  public:
+  //! compress_pool is shared by the destinations of the runner. If it is null and the output
+  //! is compressed, DestFileSet creates its own pool.
   DestFileSet(const std::string& root_dir, const pb::Output& out, util::IoContextPool* pool,
-              util::fibers_ext::FiberQueueThreadPool* fq);
+              util::fibers_ext::FiberQueueThreadPool* fq,
+              util::fibers_ext::FiberQueueThreadPool* compress_pool = nullptr);
   ~DestFileSet();
 
   //! Closes and deletes all the handles. If abort_write is true, the manager may
@@ -56,6 +60,12 @@ class DestFileSet {
 
   util::fibers_ext::FiberQueueThreadPool* pool() { return &fq_; }
 
+  //! Returns the pool that compresses the output. Null if the output is not compressed.
+  util::fibers_ext::FiberQueueThreadPool* compress_pool() { return compress_fq_; }
+
+  //! Creates the pool for compressing the outputs, sized by --dest_compress_threads.
+  static util::fibers_ext::FiberQueueThreadPool* CreateCompressPool();
+
   std::vector<ShardId> GetShards() const;
 
   size_t HandleCount() const;
@@ -79,22 +89,42 @@ class DestFileSet {
 
   const util::GCE* gce() const { return gce_; }
 
+  //! S3 api is bucket centric, therefore pool_accessor should return the thread local pool
+  //! connected to the bucket of the destination.
+  void set_aws(const util::AWS* aws, PoolAccessorCb pool_accessor) {
+    aws_ = aws;
+    pool_accessor_ = pool_accessor;
+  }
+
+  /// Returns thread local instance of pool managing connections to the destination bucket.
+  util::http::HttpsClientPool* GetS3BucketPool() { return pool_accessor_(); }
+
+  const util::AWS* aws() const { return aws_; }
+
   bool is_gcs_dest() const { return is_gcs_dest_; }
+  bool is_s3_dest() const { return is_s3_dest_; }
+
+  //! Whether the destination is a cloud storage that we write into via network.
+  bool is_remote_dest() const { return is_gcs_dest_ || is_s3_dest_; }
 
   util::IoContextPool* io_pool() { return &io_pool_; }
 
  private:
   typedef absl::flat_hash_map<ShardId, std::unique_ptr<DestHandle>> HandleMap;
 
+  // Must outlive the handles.
+  std::unique_ptr<util::fibers_ext::FiberQueueThreadPool> own_compress_fq_;
+  util::fibers_ext::FiberQueueThreadPool* compress_fq_ = nullptr;
   HandleMap dest_files_;
   mutable ::boost::fibers::mutex handles_mu_;
 
   const util::GCE* gce_ = nullptr;
+  const util::AWS* aws_ = nullptr;
   PoolAccessorCb pool_accessor_;
 
   util::IoContextPool& io_pool_;
   util::fibers_ext::FiberQueueThreadPool& fq_;
-  bool is_gcs_dest_ = false;
+  bool is_gcs_dest_ = false, is_s3_dest_ = false;
 };
 
 /*! \class mr3::detail::DestHandle
@@ -135,7 +165,7 @@ class DestHandle {
   virtual void Open() = 0;
 
   // Called only from IO thread.
-  void OpenWriteFileLocal();
+  void OpenWriteFileLocal(const std::string& path);
 
   DestFileSet* owner_;
   ShardId sid_;
@@ -0,0 +1,123 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "mr/impl/dest_file_set.h"
+
+#include "absl/strings/str_cat.h"
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "file/file_util.h"
+#include "file/filesource.h"
+#include "file/list_file.h"
+#include "util/asio/io_context_pool.h"
+
+namespace mr3 {
+namespace detail {
+
+using namespace std;
+using namespace util;
+
+class DestFileSetTest : public testing::Test {
+ protected:
+  void SetUp() final {
+    io_pool_.reset(new IoContextPool{1});
+    io_pool_->Run();
+    fq_.reset(new fibers_ext::FiberQueueThreadPool(1));
+
+    const char* test_name = testing::UnitTest::GetInstance()->current_test_info()->name();
+    dir_ = base::GetTestTempPath(absl::StrCat("dest_", test_name));
+    CHECK_STATUS(file_util::CreateSubDirIfNeeded(dir_));
+  }
+
+  void TearDown() final {
+    fq_->Shutdown();
+    io_pool_->Stop();
+  }
+
+  // Writes count records into the handle of the shard.
+  static void WriteRecords(DestFileSet* dfs, const ShardId& sid, unsigned count) {
+    unsigned index = 0;
+    dfs->GetOrCreate(sid)->Write([&]() -> absl::optional<string> {
+      if (index == count)
+        return absl::nullopt;
+      return absl::StrCat("record", index++);
+    });
+  }
+
+  std::unique_ptr<IoContextPool> io_pool_;
+  std::unique_ptr<fibers_ext::FiberQueueThreadPool> fq_;
+  string dir_;
+};
+
+TEST_F(DestFileSetTest, Lst) {
+  pb::Output out;
+  out.set_name("lst");
+  out.mutable_format()->set_type(pb::WireFormat::LST);
+
+  DestFileSet dfs(dir_, out, io_pool_.get(), fq_.get());
+  WriteRecords(&dfs, ShardId{1}, 5000);
+  string path = dfs.ShardFilePath(ShardId{1}, 0);
+  dfs.CloseAllHandles(false);
+
+  file::ListReader reader(path);
+  StringPiece record;
+  string scratch;
+  unsigned index = 0;
+  while (reader.ReadRecord(&record, &scratch)) {
+    ASSERT_EQ(absl::StrCat("record", index), record);
+    ++index;
+  }
+  EXPECT_EQ(5000, index);
+}
+
+TEST_F(DestFileSetTest, AbortLst) {
+  pb::Output out;
+  out.set_name("lst");
+  out.mutable_format()->set_type(pb::WireFormat::LST);
+
+  DestFileSet dfs(dir_, out, io_pool_.get(), fq_.get());
+
+  // The records are still buffered by the writer when the handle is aborted.
+  WriteRecords(&dfs, ShardId{1}, 10);
+  WriteRecords(&dfs, ShardId{2}, 5000);
+  dfs.CloseAllHandles(true);
+  EXPECT_EQ(0, dfs.HandleCount());
+}
+
+TEST_F(DestFileSetTest, CompressedText) {
+  pb::Output out;
+  out.set_name("txt");
+  out.mutable_format()->set_type(pb::WireFormat::TXT);
+  out.mutable_compress()->set_type(pb::Output::GZIP);
+
+  // The destinations of the runner share the compression pool.
+  std::unique_ptr<fibers_ext::FiberQueueThreadPool> compress_pool(
+      DestFileSet::CreateCompressPool());
+  DestFileSet dfs(dir_, out, io_pool_.get(), fq_.get(), compress_pool.get());
+  ASSERT_EQ(compress_pool.get(), dfs.compress_pool());
+
+  // Spans multiple chunks that are compressed in parallel and reordered before the write.
+  constexpr unsigned kCount = 500000;
+  unsigned index = 0;
+  dfs.GetOrCreate(ShardId{1})->Write([&]() -> absl::optional<string> {
+    if (index == kCount)
+      return absl::nullopt;
+    return absl::StrCat("record", index++, "\n");
+  });
+  string path = dfs.ShardFilePath(ShardId{1}, 0);
+  dfs.CloseAllHandles(false);
+
+  file::LineReader reader(path);
+  StringPiece line;
+  string scratch;
+  index = 0;
+  while (reader.Next(&line, &scratch)) {
+    ASSERT_EQ(absl::StrCat("record", index), line);
+    ++index;
+  }
+  EXPECT_EQ(kCount, index);
+  compress_pool->Shutdown();
+}
+
+}  // namespace detail
+}  // namespace mr3
@@ -0,0 +1,265 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "mr/impl/input_cache.h"
+
+#include <sys/time.h>
+#include <cstdio>
+#include <cstring>
+
+#include "absl/strings/str_cat.h"
+#include "base/hash.h"
+#include "base/logging.h"
+#include "file/fiber_file.h"
+#include "file/file_util.h"
+
+namespace mr3 {
+namespace detail {
+
+using namespace std;
+using namespace util;
+
+namespace {
+
+constexpr char kEntrySuffix[] = ".obj";
+constexpr char kTmpSuffix[] = ".tmp";
+
+}  // namespace
+
+// Tees the bytes read from the remote file into a temporary local file.
+// Once the remote file was read fully, the temporary file is committed into the cache.
+class InputCache::FillFile : public file::ReadonlyFile {
+ public:
+  FillFile(InputCache* owner, string key, file::ReadonlyFile* next, file::WriteFile* wf,
+           string tmp_path)
+      : owner_(owner), key_(std::move(key)), next_(next), wf_(wf),
+        tmp_path_(std::move(tmp_path)) {
+  }
+
+  ~FillFile() final;
+
+  StatusObject<size_t> Read(size_t offset, const strings::MutableByteRange& range) final;
+
+  Status Close() final;
+
+  size_t Size() const final { return next_->Size(); }
+
+  int Handle() const final { return next_->Handle(); }
+
+ private:
+  void Abandon();
+
+  InputCache* owner_;
+  const string key_;
+  std::unique_ptr<file::ReadonlyFile> next_;
+  file::WriteFile* wf_;
+  const string tmp_path_;
+  size_t written_ = 0;
+};
+
+InputCache::FillFile::~FillFile() {
+  if (wf_)
+    Abandon();
+}
+
+StatusObject<size_t> InputCache::FillFile::Read(size_t offset,
+                                                 const strings::MutableByteRange& range) {
+  StatusObject<size_t> res = next_->Read(offset, range);
+  if (!wf_ || !res.ok())
+    return res;
+
+  size_t end = offset + res.obj;
+  if (offset > written_) {  // A gap - we can not fill the entry sequentially.
+    Abandon();
+  } else if (end > written_) {
+    size_t skip = written_ - offset;  // The prefix that was already written before.
+    Status st = wf_->Write(range.data() + skip, res.obj - skip);
+    if (st.ok()) {
+      written_ = end;
+    } else {
+      LOG(WARNING) << "Could not write cache entry " << tmp_path_ << " " << st;
+      Abandon();
+    }
+  }
+
+  return res;
+}
+
+Status InputCache::FillFile::Close() {
+  if (wf_) {
+    bool complete = written_ == next_->Size();
+    bool closed = wf_->Close();  // deletes wf_.
+    wf_ = nullptr;
+
+    if (complete && closed) {
+      owner_->Commit(key_, tmp_path_, written_);
+    } else {
+      file::Delete(tmp_path_);
+    }
+  }
+  return next_->Close();
+}
+
+void InputCache::FillFile::Abandon() {
+  VLOG(1) << "Abandoning cache entry " << tmp_path_ << " at " << written_;
+  wf_->Close();
+  wf_ = nullptr;
+  file::Delete(tmp_path_);
+}
+
+InputCache::InputCache(const std::string& dir, size_t max_size,
+                       fibers_ext::FiberQueueThreadPool* fq)
+    : dir_(dir), max_size_(max_size), fq_(fq) {
+}
+
+InputCache::~InputCache() {
+}
+
+Status InputCache::Init() {
+  if (!file::Exists(dir_) && !file_util::RecursivelyCreateDir(dir_, 0750)) {
+    return Status(StatusCode::IO_ERROR, absl::StrCat("Could not create dir ", dir_));
+  }
+
+  // Leftovers of the runs that were interrupted in the middle.
+  string tmp_glob = file_util::JoinPath(dir_, absl::StrCat("*", kTmpSuffix));
+  for (const auto& st : file_util::StatFiles(tmp_glob)) {
+    file::Delete(st.name);
+  }
+
+  std::vector<file_util::StatShort> entries =
+      file_util::StatFiles(file_util::JoinPath(dir_, absl::StrCat("*", kEntrySuffix)));
+  std::sort(entries.begin(), entries.end(), [](const auto& l, const auto& r) {
+    return l.last_modified < r.last_modified;
+  });
+
+  std::lock_guard<::boost::fibers::mutex> lk(mu_);
+  for (const auto& st : entries) {
+    absl::string_view name = file_util::GetNameFromPath(st.name);
+    name.remove_suffix(sizeof(kEntrySuffix) - 1);
+    string key(name);
+
+    lru_.push_front(Entry{key, size_t(st.size)});
+    index_[key] = lru_.begin();
+    total_size_ += st.size;
+  }
+
+  for (const string& path : EvictLocked()) {
+    file::Delete(path);
+  }
+  LOG(INFO) << "Input cache " << dir_ << " has " << index_.size() << " entries, "
+            << total_size_ << " bytes";
+
+  return Status::OK;
+}
+
+std::string InputCache::Key(absl::string_view path, int64_t generation) {
+  uint64_t fp = base::Fingerprint(path.data(), path.size());
+  return absl::StrCat(absl::Hex(fp, absl::kZeroPad16), "-", generation);
+}
+
+auto InputCache::Lookup(const std::string& key, const OpenCb& open_cb)
+    -> StatusObject<file::ReadonlyFile*> {
+  std::unique_lock<::boost::fibers::mutex> lk(mu_);
+  auto it = index_.find(key);
+  if (it == index_.end())
+    return nullptr;
+
+  // Pins the entry, so that a concurrent eviction does not delete the file before we open it.
+  lru_.splice(lru_.begin(), lru_, it->second);
+  ++it->second->pins;
+  lk.unlock();
+
+  string path = EntryPath(key);
+
+  // Refresh the modification time so that LRU order survives between runs.
+  utimes(path.c_str(), nullptr);
+  StatusObject<file::ReadonlyFile*> res = open_cb(path);
+
+  lk.lock();
+  it = index_.find(key);
+  DCHECK(it != index_.end());
+  --it->second->pins;
+  std::vector<string> evicted = EvictLocked();
+  lk.unlock();
+
+  for (const string& evicted_path : evicted) {
+    file::Delete(evicted_path);
+  }
+
+  return res;
+}
+
+file::ReadonlyFile* InputCache::WrapForFill(const std::string& key, file::ReadonlyFile* remote) {
+  string tmp_path = file_util::JoinPath(
+      dir_, absl::StrCat(key, ".", tmp_id_.fetch_add(1, memory_order_relaxed), kTmpSuffix));
+
+  auto res = file::OpenFiberWriteFile(tmp_path, fq_);
+  if (!res.ok()) {
+    LOG(WARNING) << "Could not open cache entry " << tmp_path << " " << res.status;
+    return remote;
+  }
+
+  return new FillFile(this, key, remote, res.obj, std::move(tmp_path));
+}
+
+size_t InputCache::total_size() const {
+  std::lock_guard<::boost::fibers::mutex> lk(mu_);
+  return total_size_;
+}
+
+std::string InputCache::EntryPath(const std::string& key) const {
+  return file_util::JoinPath(dir_, absl::StrCat(key, kEntrySuffix));
+}
+
+void InputCache::Commit(const std::string& key, const std::string& tmp_path, size_t sz) {
+  string path = EntryPath(key);
+  int res = fq_->Await([&] { return rename(tmp_path.c_str(), path.c_str()); });
+  if (res != 0) {
+    LOG(WARNING) << "Could not commit cache entry " << path << " " << strerror(errno);
+    file::Delete(tmp_path);
+    return;
+  }
+
+  std::unique_lock<::boost::fibers::mutex> lk(mu_);
+  auto it = index_.find(key);
+  unsigned pins = 0;
+  if (it != index_.end()) {  // The same object was filled concurrently.
+    total_size_ -= it->second->size;
+    pins = it->second->pins;
+    lru_.erase(it->second);
+  }
+  lru_.push_front(Entry{key, sz, pins});
+  index_[key] = lru_.begin();
+  total_size_ += sz;
+
+  std::vector<string> evicted = EvictLocked();
+  lk.unlock();
+
+  VLOG(1) << "Committed cache entry " << path << " with " << sz << " bytes";
+  for (const string& evicted_path : evicted) {
+    file::Delete(evicted_path);
+  }
+}
+
+std::vector<std::string> InputCache::EvictLocked() {
+  std::vector<string> res;
+  if (lru_.empty())
+    return res;
+
+  // We keep at least the most recent entry even if it's larger than the limit.
+  auto it = lru_.end();
+  while (total_size_ > max_size_ && --it != lru_.begin()) {
+    if (it->pins)  // Evicted once its lookups complete.
+      continue;
+
+    VLOG(1) << "Evicting cache entry " << it->key;
+    res.push_back(EntryPath(it->key));
+    total_size_ -= it->size;
+    index_.erase(it->key);
+    it = lru_.erase(it);
+  }
+  return res;
+}
+
+}  // namespace detail
+}  // namespace mr3
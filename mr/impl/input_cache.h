@@ -0,0 +1,80 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+
+#pragma once
+
+#include <boost/fiber/mutex.hpp>
+#include <functional>
+#include <list>
+
+#include "absl/container/flat_hash_map.h"
+#include "file/file.h"
+#include "util/fibers/fiberqueue_threadpool.h"
+
+namespace mr3 {
+namespace detail {
+
+/*! \brief Local disk cache for remote input objects.
+
+    Entries are content-addressed by the remote object path and its generation, so an object
+    that was rewritten remotely never hits a stale entry. The cache is bounded by size and
+    evicts the least recently used entries. Entries persist between runs - Init() loads
+    whatever was left in the cache directory. Thread-safe.
+*/
+class InputCache {
+ public:
+  InputCache(const std::string& dir, size_t max_size,
+             util::fibers_ext::FiberQueueThreadPool* fq);
+  ~InputCache();
+
+  //! Creates the cache directory if needed and loads the existing entries.
+  util::Status Init();
+
+  //! Returns cache key for the object with the given path and generation.
+  static std::string Key(absl::string_view path, int64_t generation);
+
+  using OpenCb = std::function<util::StatusObject<file::ReadonlyFile*>(const std::string& path)>;
+
+  //! Opens the cached entry with open_cb, which is called with the local path of the entry.
+  //! The entry is not evicted until open_cb returns. Returns nullptr if there is no such entry.
+  util::StatusObject<file::ReadonlyFile*> Lookup(const std::string& key, const OpenCb& open_cb);
+
+  //! Wraps the remote file so that its full sequential read fills the cache entry for key.
+  //! Takes ownership over remote. Partial reads leave the cache intact.
+  file::ReadonlyFile* WrapForFill(const std::string& key, file::ReadonlyFile* remote);
+
+  size_t total_size() const;
+
+ private:
+  class FillFile;
+
+  std::string EntryPath(const std::string& key) const;
+
+  // Moves the fully written tmp_path into the cache under key.
+  void Commit(const std::string& key, const std::string& tmp_path, size_t sz);
+
+  struct Entry {
+    std::string key;
+    size_t size;
+    unsigned pins = 0;  // Number of the lookups that are opening the entry.
+  };
+  using EntryList = std::list<Entry>;
+
+  // Must be called under mu_. Skips the pinned entries. Returns paths of evicted entries.
+  std::vector<std::string> EvictLocked();
+
+  const std::string dir_;
+  const size_t max_size_;
+  util::fibers_ext::FiberQueueThreadPool* fq_;
+
+  mutable ::boost::fibers::mutex mu_;
+
+  EntryList lru_;  // front - most recently used.
+  absl::flat_hash_map<std::string, EntryList::iterator> index_;
+  size_t total_size_ = 0;
+  std::atomic_ulong tmp_id_{0};
+};
+
+}  // namespace detail
+}  // namespace mr3
@@ -0,0 +1,137 @@
+// Copyright 2019, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "mr/impl/input_cache.h"
+
+#include "absl/strings/str_cat.h"
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "file/file_util.h"
+#include "file/test_util.h"
+
+namespace mr3 {
+namespace detail {
+
+using namespace std;
+using namespace util;
+
+class InputCacheTest : public testing::Test {
+ protected:
+  void SetUp() final {
+    fq_.reset(new fibers_ext::FiberQueueThreadPool(1));
+    const char* test_name = testing::UnitTest::GetInstance()->current_test_info()->name();
+    dir_ = base::GetTestTempPath(absl::StrCat("input_cache_", test_name));
+  }
+
+  void TearDown() final { fq_->Shutdown(); }
+
+  // Reads the file sequentially in small chunks and closes it.
+  static void ReadAll(file::ReadonlyFile* fl) {
+    std::unique_ptr<file::ReadonlyFile> guard(fl);
+    uint8_t buf[7];
+    size_t offset = 0;
+    while (offset < fl->Size()) {
+      auto res = fl->Read(offset, strings::MutableByteRange(buf, sizeof(buf)));
+      ASSERT_TRUE(res.ok()) << res.status;
+      ASSERT_GT(res.obj, 0);
+      offset += res.obj;
+    }
+    ASSERT_TRUE(fl->Close().ok());
+  }
+
+  // Returns the contents of the cached entry or an empty string if there is no such entry.
+  static string Lookup(InputCache* cache, const string& key) {
+    auto res =
+        cache->Lookup(key, [](const string& path) { return file::ReadonlyFile::Open(path); });
+    CHECK_STATUS(res.status);
+    if (!res.obj)
+      return string{};
+    return ReadContents(res.obj);
+  }
+
+  static string ReadContents(file::ReadonlyFile* fl) {
+    std::unique_ptr<file::ReadonlyFile> guard(fl);
+    string res(fl->Size(), '\0');
+    auto read_res = fl->Read(0, strings::MutableByteRange(
+                                    reinterpret_cast<uint8_t*>(&res[0]), res.size()));
+    CHECK_STATUS(read_res.status);
+    CHECK_STATUS(fl->Close());
+    return res;
+  }
+
+  std::unique_ptr<fibers_ext::FiberQueueThreadPool> fq_;
+  string dir_;
+};
+
+TEST_F(InputCacheTest, FillAndLookup) {
+  InputCache cache(dir_, 1 << 20, fq_.get());
+  ASSERT_TRUE(cache.Init().ok());
+
+  const string kContents = "Hello world, the quick brown fox";
+  string key = InputCache::Key("gs://bucket/obj", 1);
+  EXPECT_NE(key, InputCache::Key("gs://bucket/obj", 2));
+  EXPECT_TRUE(Lookup(&cache, key).empty());
+
+  ReadAll(cache.WrapForFill(key, new file::ReadonlyStringFile(kContents)));
+
+  EXPECT_EQ(kContents, Lookup(&cache, key));
+  EXPECT_EQ(kContents.size(), cache.total_size());
+
+  // Entries survive between cache instances.
+  InputCache cache2(dir_, 1 << 20, fq_.get());
+  ASSERT_TRUE(cache2.Init().ok());
+  EXPECT_EQ(kContents, Lookup(&cache2, key));
+}
+
+TEST_F(InputCacheTest, PartialRead) {
+  InputCache cache(dir_, 1 << 20, fq_.get());
+  ASSERT_TRUE(cache.Init().ok());
+
+  string key = InputCache::Key("gs://bucket/partial", 1);
+  std::unique_ptr<file::ReadonlyFile> fl(
+      cache.WrapForFill(key, new file::ReadonlyStringFile(string(100, 'a'))));
+  uint8_t buf[10];
+  ASSERT_TRUE(fl->Read(0, strings::MutableByteRange(buf, sizeof(buf))).ok());
+  ASSERT_TRUE(fl->Close().ok());
+
+  EXPECT_TRUE(Lookup(&cache, key).empty());
+}
+
+TEST_F(InputCacheTest, Evict) {
+  InputCache cache(dir_, 150, fq_.get());
+  ASSERT_TRUE(cache.Init().ok());
+
+  string key1 = InputCache::Key("gs://bucket/evict1", 1);
+  string key2 = InputCache::Key("gs://bucket/evict2", 1);
+  ReadAll(cache.WrapForFill(key1, new file::ReadonlyStringFile(string(100, 'a'))));
+  ReadAll(cache.WrapForFill(key2, new file::ReadonlyStringFile(string(100, 'b'))));
+
+  EXPECT_TRUE(Lookup(&cache, key1).empty());
+  EXPECT_FALSE(Lookup(&cache, key2).empty());
+  EXPECT_EQ(100, cache.total_size());
+}
+
+TEST_F(InputCacheTest, EvictPinned) {
+  InputCache cache(dir_, 150, fq_.get());
+  ASSERT_TRUE(cache.Init().ok());
+
+  string key1 = InputCache::Key("gs://bucket/pinned1", 1);
+  string key2 = InputCache::Key("gs://bucket/pinned2", 1);
+  ReadAll(cache.WrapForFill(key1, new file::ReadonlyStringFile(string(100, 'a'))));
+
+  // key2 is committed while key1 is being opened, hence key1 is evicted only after the open.
+  auto res = cache.Lookup(key1, [&](const string& path) {
+    ReadAll(cache.WrapForFill(key2, new file::ReadonlyStringFile(string(100, 'b'))));
+    EXPECT_EQ(200, cache.total_size());
+    return file::ReadonlyFile::Open(path);
+  });
+  ASSERT_TRUE(res.ok()) << res.status;
+  EXPECT_EQ(string(100, 'a'), ReadContents(res.obj));
+
+  EXPECT_TRUE(Lookup(&cache, key1).empty());
+  EXPECT_EQ(string(100, 'b'), Lookup(&cache, key2));
+  EXPECT_EQ(100, cache.total_size());
+}
+
+}  // namespace detail
+}  // namespace mr3
@@ -3,6 +3,7 @@
 //
 #include "mr/local_runner.h"
 
+#include "absl/container/flat_hash_map.h"
 #include "absl/strings/match.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_format.h"
@@ -14,13 +15,16 @@
 #include "file/file_util.h"
 #include "file/filesource.h"
 #include "file/list_file_reader.h"
+#include "file/uring_file.h"
 
 #include "mr/do_context.h"
+#include "mr/impl/input_cache.h"
 #include "mr/impl/local_context.h"
 
 #include "util/asio/io_context_pool.h"
 #include "util/aws/aws.h"
 #include "util/aws/s3.h"
+#include "util/cloud/object_store.h"
 #include "util/fibers/fiberqueue_threadpool.h"
 #include "util/gce/gcs.h"
 #include "util/http/https_client_pool.h"
@@ -31,27 +35,79 @@
 namespace mr3 {
 
 DEFINE_uint32(local_runner_prefetch_size, 1 << 16, "File input prefetch size");
+DEFINE_uint32(local_runner_max_prefetch_size, 1 << 22,
+              "Upper bound of the adaptive read-ahead window of the local input files. "
+              "Values not greater than local_runner_prefetch_size disable the adaptation.");
 DEFINE_bool(local_runner_raw_shortcut_read, false,
             "If true, reads the input without parsing it "
             "into records and calling mappers. Used for testing the IO read path.");
 DEFINE_uint32(cloud_connect_deadline_ms, 2000, "Deadline in milliseconds when connecting to "
                                                "cloud storage");
+DEFINE_uint32(cloud_idle_connection_ms, 15000,
+              "Cloud storage connections that were idle longer than this are closed instead of "
+              "reused, since the servers drop them silently. 0 keeps them forever.");
+DEFINE_uint32(local_runner_warm_gcs_connections, 0,
+              "Number of gcs connections that every IO thread opens during the initialization. "
+              "The handshakes resume the same TLS session, so the first reads do not pay for "
+              "the full handshakes.");
+DEFINE_string(local_runner_input_cache_dir, "",
+              "If set, remote input objects are cached on local disk under this directory "
+              "and reused by later reads of the same object generation.");
+DEFINE_uint32(local_runner_input_cache_mb, 1 << 15, "Size limit of the input cache");
+DEFINE_bool(local_runner_mmap_input, false,
+            "If true, local input files are memory mapped. Uncompressed text files are parsed "
+            "directly from the mapping. Bypasses the adaptive prefetch and crashes with SIGBUS "
+            "if an input file is truncated while it is being read.");
+DEFINE_bool(local_runner_uring_input, false,
+            "If true, local input files are read via io_uring driven by the IO threads. "
+            "Takes precedence over local_runner_mmap_input.");
+DEFINE_bool(local_runner_parallel_decompress, true,
+            "If true, independent gzip members and zstd frames of the compressed inputs are "
+            "decompressed concurrently.");
+DEFINE_uint32(local_runner_gcs_range_mb, 0,
+              "If positive, gcs input objects are fetched with concurrent ranged requests "
+              "of this size. 0 reads each object with a single stream.");
+DEFINE_uint32(local_runner_s3_range_mb, 4,
+              "Size of the ranged requests that read s3 input objects ahead of the consumer. "
+              "Larger requests amortize the request signing and the first byte latency. "
+              "Values below 4 are rounded up to 4. 0 reads each object with a single stream.");
+DEFINE_uint32(local_runner_s3_read_ahead, 4,
+              "Maximal number of ranged requests in flight per s3 input object. Every open "
+              "object buffers up to local_runner_s3_read_ahead + 1 ranges, so the memory "
+              "grows with both flags and with the number of concurrently read inputs.");
+DEFINE_uint32(local_runner_list_parallel, 16,
+              "Maximal number of concurrent listing requests when expanding recursive '**' "
+              "globs of cloud storage. The prefixes are partitioned by their sub-directories. "
+              "0 lists each glob with a single request chain.");
+DEFINE_uint32(local_runner_lst_read_ahead, 8,
+              "Number of lst blocks that are read in advance and decoded concurrently. "
+              "0 disables the read-ahead.");
 
 using namespace util;
 using namespace boost;
 using namespace std;
 using detail::DestFileSet;
+using detail::InputCache;
 using http::HttpsClientPool;
 
 namespace {
 
 using namespace intrusive;
 
+// How much of the input range is claimed at once by the reader of the splittable file.
+constexpr size_t kRangeClaimSize = 1 << 20;
+
 }  // namespace
 
 ostream& operator<<(ostream& os, const file::FiberReadOptions::Stats& stats) {
   os << stats.cache_bytes << "/" << stats.disk_bytes << "/" << stats.read_prefetch_cnt << "/"
-     << stats.preempt_cnt;
+     << stats.preempt_cnt << "/" << stats.prefetch_window;
+  return os;
+}
+
+ostream& operator<<(ostream& os, const S3ReadStats& stats) {
+  os << stats.fetched_bytes << "/" << stats.fetch_cnt << "/" << stats.wait_cnt << "/"
+     << stats.wait_usec / 1000 << "/" << stats.concurrency;
   return os;
 }
 
@@ -62,7 +118,10 @@ struct LocalRunner::Impl {
         varz_stats_("local-runner", [this] { return GetStats(); }) {
   }
 
-  uint64_t ProcessText(const string& fname, file::ReadonlyFile* fd, RawSinkCb cb);
+  void Init();
+
+  uint64_t ProcessText(const string& fname, file::ReadonlyFile* fd, RawSinkCb cb,
+                       FileRange* range);
   uint64_t ProcessLst(file::ReadonlyFile* fd, RawSinkCb cb);
 
   /// Called from the main thread orchestrating the pipeline run.
@@ -72,13 +131,13 @@ struct LocalRunner::Impl {
   void End(ShardFileMap* out_files);
 
   /// The functions below are called from IO threads.
-  void ExpandGCS(absl::string_view glob, ExpandCb cb);
-  void ExpandS3(absl::string_view glob, ExpandCb cb);
+  void ExpandCloud(absl::string_view glob, ExpandCb cb);
 
   StatusObject<file::ReadonlyFile*> OpenLocalFile(const std::string& filename,
                                                   file::FiberReadOptions::Stats* stats);
 
   StatusObject<file::ReadonlyFile*> OpenGcsFile(const std::string& filename);
+  StatusObject<file::ReadonlyFile*> OpenS3File(const std::string& filename, S3ReadStats* stats);
   void ShutDown();
 
   RawContext* NewContext();
@@ -88,6 +147,7 @@ struct LocalRunner::Impl {
   }
 
   void SaveFile(absl::string_view fn, absl::string_view data);
+  StatusObject<bool> LoadFile(absl::string_view fn, std::string* data);
 
   class Source;
 
@@ -95,18 +155,28 @@ struct LocalRunner::Impl {
   void LazyGcsInit();  // Called from IO threads.
   void LazyAwsInit();  // Called from IO threads.
 
+  // Returns the thread local pool connected to the s3 bucket. Called from IO threads.
+  HttpsClientPool* GetS3BucketPool(absl::string_view bucket);
+
+  // Returns the object store of "gs" or "s3" scheme. Called from IO threads.
+  std::unique_ptr<cloud::ObjectStore> NewObjectStore(absl::string_view scheme);
+
   util::VarzValue::Map GetStats() const;
 
   IoContextPool* io_pool_;
   string data_dir;
   fibers_ext::FiberQueueThreadPool fq_pool_;
   std::atomic_bool stop_signal_{false};
-  std::atomic_ulong file_cache_hit_bytes_{0}, input_gcs_conn_{0};
+  std::atomic_ulong file_cache_hit_bytes_{0}, input_gcs_conn_{0}, input_cache_hit_bytes_{0};
+  std::atomic_ulong prefetch_window_{0};  // the window chosen by the last local file.
+  std::atomic_ulong input_s3_bytes_{0}, input_s3_wait_usec_{0};
   const pb::Operator* current_op_ = nullptr;
 
   fibers::mutex cloud_mu_;
+  std::atomic_bool gce_ready_{false};  // set once gce_handle_ is initialized.
   std::unique_ptr<GCE> gce_handle_;
   std::unique_ptr<AWS> aws_handle_;
+  std::unique_ptr<InputCache> input_cache_;
 
   struct PerThread {
     vector<unique_ptr<GCS>> gcs_handles;
@@ -116,6 +186,9 @@ struct LocalRunner::Impl {
     absl::optional<asio::ssl::context> ssl_context;
     absl::optional<HttpsClientPool> api_conn_pool;
 
+    absl::optional<asio::ssl::context> aws_ssl_context;
+    absl::flat_hash_map<string, unique_ptr<HttpsClientPool>> s3_pools;  // by bucket.
+
     void SetupGce(IoContext* io_context);
   };
 
@@ -135,6 +208,9 @@ struct LocalRunner::Impl {
   static thread_local std::unique_ptr<PerThread> per_thread_;
   util::VarzFunction varz_stats_;
 
+  // Compresses the outputs of all the operators. Created lazily and must outlive dest_mgr_.
+  std::unique_ptr<fibers_ext::FiberQueueThreadPool> compress_pool_;
+
   mutable std::mutex dest_mgr_mu_;
   std::unique_ptr<DestFileSet> dest_mgr_;
 
@@ -148,25 +224,33 @@ class LocalRunner::Impl::Source {
 
   Status Open();
 
-  size_t Process(pb::WireFormat::Type type, RawSinkCb cb);
+  size_t Process(pb::WireFormat::Type type, RawSinkCb cb, FileRange* range);
 
  private:
+  // Serves the gcs object from the input cache or fills the cache while reading it.
+  StatusObject<file::ReadonlyFile*> OpenCachedGcs();
+
   LocalRunner::Impl* impl_;
   const string fname_;
   file::FiberReadOptions::Stats stats_;
+  S3ReadStats s3_stats_;
 
   std::unique_ptr<file::ReadonlyFile> rd_file_;
-  bool is_gcs_ = false;
+  bool is_gcs_ = false, is_s3_ = false;
+  bool is_cache_hit_ = false;
 };
 
 thread_local std::unique_ptr<LocalRunner::Impl::PerThread> LocalRunner::Impl::per_thread_;
 
 Status LocalRunner::Impl::Source::Open() {
   is_gcs_ = IsGcsPath(fname_);
+  is_s3_ = IsS3Path(fname_);
 
   StatusObject<file::ReadonlyFile*> fl_res;
   if (is_gcs_) {
-    fl_res = impl_->OpenGcsFile(fname_);
+    fl_res = impl_->input_cache_ ? OpenCachedGcs() : impl_->OpenGcsFile(fname_);
+  } else if (is_s3_) {
+    fl_res = impl_->OpenS3File(fname_, &s3_stats_);
   } else {
     fl_res = impl_->OpenLocalFile(fname_, &stats_);
   }
@@ -177,15 +261,55 @@ Status LocalRunner::Impl::Source::Open() {
   return fl_res.status;
 }
 
-size_t LocalRunner::Impl::Source::Process(pb::WireFormat::Type type, RawSinkCb cb) {
+auto LocalRunner::Impl::Source::OpenCachedGcs() -> StatusObject<file::ReadonlyFile*> {
+  absl::string_view bucket, path;
+  CHECK(GCS::SplitToBucketPath(fname_, &bucket, &path));
+
+  impl_->LazyGcsInit();
+  GCS::ObjectMetaResult meta_res;
+  {
+    auto gcs = impl_->GetGcsHandle();
+    meta_res = gcs->Stat(bucket, path);
+  }
+
+  if (!meta_res.ok()) {
+    LOG(WARNING) << "Could not stat " << fname_ << ", bypassing the cache " << meta_res.status;
+    return impl_->OpenGcsFile(fname_);
+  }
+
+  string key = InputCache::Key(fname_, meta_res.obj.generation);
+  auto open_cb = [this](const string& local_path) {
+    VLOG(1) << "Serving " << fname_ << " from " << local_path;
+    return impl_->OpenLocalFile(local_path, &stats_);
+  };
+  auto cache_res = impl_->input_cache_->Lookup(key, open_cb);
+  if (cache_res.ok() && cache_res.obj) {
+    is_gcs_ = false;
+    is_cache_hit_ = true;
+
+    return cache_res;
+  }
+  LOG_IF(WARNING, !cache_res.ok()) << "Could not open cache entry of " << fname_ << " "
+                                   << cache_res.status;
+
+  auto res = impl_->OpenGcsFile(fname_);
+  if (!res.ok())
+    return res;
+
+  return impl_->input_cache_->WrapForFill(key, res.obj);
+}
+
+size_t LocalRunner::Impl::Source::Process(pb::WireFormat::Type type, RawSinkCb cb,
+                                          FileRange* range) {
   LOG(INFO) << "Processing file " << fname_;
 
   size_t cnt = 0;
   switch (type) {
     case pb::WireFormat::TXT:
-      cnt = impl_->ProcessText(fname_, rd_file_.release(), cb);
+      cnt = impl_->ProcessText(fname_, rd_file_.release(), cb, range);
       break;
     case pb::WireFormat::LST:
+      CHECK(!range || range->start() == 0) << "Can not split lst file " << fname_;
       cnt = impl_->ProcessLst(rd_file_.release(), cb);
       break;
     default:
@@ -195,10 +319,21 @@ size_t LocalRunner::Impl::Source::Process(pb::WireFormat::Type type, RawSinkCb c
 
   if (is_gcs_) {
     impl_->input_gcs_conn_.fetch_sub(1, std::memory_order_acq_rel);
+  } else if (is_s3_) {
+    VLOG(1) << "S3 Read Stats (bytes/requests/waits/wait ms/concurrency): " << s3_stats_;
+
+    impl_->input_s3_bytes_.fetch_add(s3_stats_.fetched_bytes, std::memory_order_relaxed);
+    impl_->input_s3_wait_usec_.fetch_add(s3_stats_.wait_usec, std::memory_order_relaxed);
   } else {  // local file
-    VLOG(1) << "Read Stats (disk read/cached/read_cnt/preempts): " << stats_;
+    VLOG(1) << "Read Stats (disk read/cached/read_cnt/preempts/window): " << stats_;
 
     impl_->file_cache_hit_bytes_.fetch_add(stats_.cache_bytes, std::memory_order_relaxed);
+    if (stats_.prefetch_window)
+      impl_->prefetch_window_.store(stats_.prefetch_window, std::memory_order_relaxed);
+    if (is_cache_hit_) {
+      impl_->input_cache_hit_bytes_.fetch_add(stats_.cache_bytes + stats_.disk_bytes,
+                                              std::memory_order_relaxed);
+    }
   }
 
   return cnt;
@@ -214,6 +349,7 @@ void LocalRunner::Impl::PerThread::SetupGce(IoContext* io_context) {
   api_conn_pool.emplace(GCE::kApiDomain, &ssl_context.value(), io_context);
   api_conn_pool->set_connect_timeout(FLAGS_cloud_connect_deadline_ms);
   api_conn_pool->set_retry_count(3);
+  api_conn_pool->set_idle_timeout(FLAGS_cloud_idle_connection_ms);
 }
 
 auto LocalRunner::Impl::GetGcsHandle() -> unique_ptr<GCS, handle_keeper> {
@@ -257,21 +393,96 @@ VarzValue::Map LocalRunner::Impl::GetStats() const {
 
   map.emplace_back("input-gcs-connections", VarzValue::FromInt(input_gcs_conn_.load()));
   map.emplace_back("total-gcs-connections", VarzValue::FromInt(total_gcs_connections.load()));
+  if (input_cache_) {
+    map.emplace_back("input-cache-hit-bytes", VarzValue::FromInt(input_cache_hit_bytes_.load()));
+    map.emplace_back("input-cache-size", VarzValue::FromInt(input_cache_->total_size()));
+  }
+  map.emplace_back("input-prefetch-window", VarzValue::FromInt(prefetch_window_.load()));
+  map.emplace_back("input-s3-bytes", VarzValue::FromInt(input_s3_bytes_.load()));
+  map.emplace_back("input-s3-wait-ms", VarzValue::FromInt(input_s3_wait_usec_.load() / 1000));
   map.emplace_back("stats-latency", VarzValue::FromInt(base::GetMonotonicMicrosFast() - start));
 
   return map;
 }
 
-uint64_t LocalRunner::Impl::ProcessText(const string& fname, file::ReadonlyFile* fd, RawSinkCb cb) {
-  std::unique_ptr<util::Source> src(file::Source::Uncompressed(fd));
-  uint64_t cnt = 0;
+void LocalRunner::Impl::Init() {
+  if (FLAGS_local_runner_warm_gcs_connections) {
+    io_pool_->AwaitFiberOnAll([this](IoContext&) {
+      LazyGcsInit();
+      unsigned count = per_thread_->api_conn_pool->WarmUp(FLAGS_local_runner_warm_gcs_connections);
+      LOG_IF(WARNING, count < FLAGS_local_runner_warm_gcs_connections)
+          << "Opened only " << count << " gcs connections";
+    });
+  }
 
-  file::LineReader lr(src.release(), TAKE_OWNERSHIP);
+  if (input_cache_ || FLAGS_local_runner_input_cache_dir.empty())
+    return;
+
+  size_t limit = size_t(FLAGS_local_runner_input_cache_mb) << 20;
+  input_cache_.reset(new InputCache(FLAGS_local_runner_input_cache_dir, limit, &fq_pool_));
+  CHECK_STATUS(input_cache_->Init());
+}
+
+uint64_t LocalRunner::Impl::ProcessText(const string& fname, file::ReadonlyFile* fd, RawSinkCb cb,
+                                        FileRange* range) {
+  file::MmapFile* mmap_file = dynamic_cast<file::MmapFile*>(fd);
+
+  // The range is defined in terms of file offsets, so we can process it only for
+  // uncompressed files.
+  std::unique_ptr<util::Source> src;
+  size_t src_offset = 0;
+  bool skip_first = range && range->start() > 0;
+  if (skip_first) {
+    // Lines starting before range->start() belong to the previous range. We start from
+    // the preceding byte and skip the first line, which ends at or after range->start().
+    src_offset = range->start() - 1;
+    src.reset(new file::Source(fd, src_offset));
+  } else {
+    src.reset(file::Source::Uncompressed(
+        fd, FLAGS_local_runner_parallel_decompress ? &fq_pool_ : nullptr));
+  }
+
+  size_t file_size = fd->Size();
+  bool is_uncompressed = dynamic_cast<file::Source*>(src.get()) != nullptr;
+  if (range && is_uncompressed) {
+    range->Enable(file_size);
+  } else {
+    range = nullptr;
+  }
+
+  std::unique_ptr<file::LineReader> line_reader;
+  if (mmap_file && is_uncompressed) {
+    // Parse the lines straight from the mapping. src still owns the file.
+    StringPiece data = mmap_file->data();
+    data.remove_prefix(src_offset);
+    line_reader.reset(new file::LineReader(
+        data, [mmap_file, src_offset](size_t offset) { mmap_file->ReadAhead(src_offset + offset); }));
+  } else {
+    line_reader.reset(new file::LineReader(src.release(), TAKE_OWNERSHIP));
+  }
+
+  uint64_t cnt = 0;
+  file::LineReader& lr = *line_reader;
   StringPiece result;
   string scratch;
 
+  if (skip_first && !lr.Next(&result, &scratch)) {
+    CHECK_STATUS(lr.status()) << "Line reader failed on file " << fname;
+    return 0;
+  }
+
+  size_t limit = range ? range->Claim(src_offset + lr.offset(), kRangeClaimSize) : kuint64max;
   uint64_t start = base::GetMonotonicMicrosFast();
-  while (!stop_signal_.load(std::memory_order_relaxed) && lr.Next(&result, &scratch)) {
+  while (!stop_signal_.load(std::memory_order_relaxed)) {
+    size_t line_offset = src_offset + lr.offset();
+    if (line_offset >= limit) {
+      limit = range->Claim(line_offset, kRangeClaimSize);
+      if (line_offset >= limit)
+        break;
+    }
+
+    if (!lr.Next(&result, &scratch))
+      break;
     if (!FLAGS_local_runner_raw_shortcut_read) {
       string record{result};
 
@@ -308,6 +519,9 @@ uint64_t LocalRunner::Impl::ProcessLst(file::ReadonlyFile* fd, RawSinkCb cb) {
 #else
   file::ListReader list_reader(fd, TAKE_OWNERSHIP, true, error_fn);
 #endif
+  if (FLAGS_local_runner_lst_read_ahead) {
+    list_reader.set_read_ahead(FLAGS_local_runner_lst_read_ahead, &fq_pool_);
+  }
 
   string scratch;
   StringPiece record;
@@ -329,13 +543,18 @@ void LocalRunner::Impl::Start(const pb::Operator* op) {
   CHECK(!dest_mgr_);
   current_op_ = op;
   string out_dir = file_util::JoinPath(data_dir, op->output().name());
-  if (util::IsGcsPath(out_dir)) {
+  if (util::IsGcsPath(out_dir) || util::IsS3Path(out_dir)) {
   } else if (!file::Exists(out_dir)) {
     CHECK(file_util::RecursivelyCreateDir(out_dir, 0750)) << "Could not create dir " << out_dir;
   }
 
+  if (op->output().has_compress() && !compress_pool_) {
+    compress_pool_.reset(DestFileSet::CreateCompressPool());
+  }
+
   lock_guard<mutex> lk(dest_mgr_mu_);
-  dest_mgr_.reset(new DestFileSet(out_dir, op->output(), io_pool_, &fq_pool_));
+  dest_mgr_.reset(
+      new DestFileSet(out_dir, op->output(), io_pool_, &fq_pool_, compress_pool_.get()));
 
   if (util::IsGcsPath(out_dir)) {
     io_pool_->AwaitFiberOnAll([this](IoContext&) { LazyGcsInit(); });
@@ -347,6 +566,13 @@ void LocalRunner::Impl::Start(const pb::Operator* op) {
     };
 
     dest_mgr_->set_gce(gce_handle_.get(), api_pool_cb);
+  } else if (util::IsS3Path(out_dir)) {
+    absl::string_view bucket, path;
+    CHECK(S3Bucket::SplitToBucketPath(out_dir, &bucket, &path));
+    io_pool_->GetNextContext().AwaitSafe([this] { LazyAwsInit(); });
+
+    auto bucket_pool_cb = [this, bucket = string(bucket)] { return GetS3BucketPool(bucket); };
+    dest_mgr_->set_aws(aws_handle_.get(), bucket_pool_cb);
   }
 }
 
@@ -364,60 +590,47 @@ void LocalRunner::Impl::End(ShardFileMap* out_files) {
   current_op_ = nullptr;
 }
 
-void LocalRunner::Impl::ExpandGCS(absl::string_view glob, ExpandCb cb) {
-  absl::string_view bucket, path;
-  CHECK(GCS::SplitToBucketPath(glob, &bucket, &path));
+auto LocalRunner::Impl::NewObjectStore(absl::string_view scheme)
+    -> std::unique_ptr<cloud::ObjectStore> {
+  if (scheme == "gs") {
+    LazyGcsInit();
+    return std::make_unique<cloud::GcsStore>(*gce_handle_, &per_thread_->api_conn_pool.value(),
+                                             FLAGS_local_runner_list_parallel);
+  }
 
-  // Lazy init of gce_handle.
-  LazyGcsInit();
+  CHECK_EQ("s3", scheme);
+  CHECK(io_pool_->GetThisContext()) << "Must run from IO context thread";
+  LazyAwsInit();
 
-  auto cb2 = [cb = std::move(cb), bucket](size_t sz, absl::string_view s) {
-    cb(sz, GCS::ToGcsPath(bucket, s));
+  auto bucket_cb = [this](absl::string_view bucket) {
+    return MakeS3SendCb(*aws_handle_, GetS3BucketPool(bucket));
   };
-  bool recursive = absl::EndsWith(glob, "**");
-  if (recursive) {
-    path.remove_suffix(2);
-  } else if (absl::EndsWith(glob, "*")) {
-    path.remove_suffix(1);
-  }
-
-  auto gcs = GetGcsHandle();
-  bool fs_mode = !recursive;
-  auto status = gcs->List(bucket, path, fs_mode, cb2);
-  CHECK_STATUS(status);
+  return std::make_unique<cloud::S3Store>(std::move(bucket_cb), FLAGS_local_runner_list_parallel);
 }
 
-void LocalRunner::Impl::ExpandS3(absl::string_view glob, ExpandCb cb) {
-  absl::string_view bucket, path;
-
-  // TODO: to extract split to common utils. It's not GCS specific.
-  CHECK(S3Bucket::SplitToBucketPath(glob, &bucket, &path));
+void LocalRunner::Impl::ExpandCloud(absl::string_view glob, ExpandCb cb) {
+  absl::string_view scheme, bucket, path;
+  CHECK(cloud::ObjectStore::SplitUrl(glob, &scheme, &bucket, &path)) << glob;
 
-  IoContext* io_context = io_pool_->GetThisContext();
-  CHECK(io_context) << "Must run from IO context thread";
-
-  // Lazy init of aws_handle.
-  LazyAwsInit();
+  std::unique_ptr<cloud::ObjectStore> store = NewObjectStore(scheme);
+  auto cb2 = [&](size_t sz, absl::string_view key) { cb(sz, store->ToUrl(bucket, key)); };
 
-  auto cb2 = [cb = std::move(cb), bucket](size_t sz, absl::string_view s) {
-    cb(sz, S3Bucket::ToFullPath(bucket, s));
-  };
-  bool recursive = absl::EndsWith(glob, "**");
+  bool recursive = absl::EndsWith(path, "**");
   if (recursive) {
     path.remove_suffix(2);
-  } else if (absl::EndsWith(glob, "*")) {
+  } else if (absl::EndsWith(path, "*")) {
     path.remove_suffix(1);
   }
 
-  string domain = absl::StrCat(bucket, ".", S3Bucket::kRootDomain);
-  ::boost::asio::ssl::context ssl_cntx = AWS::CheckedSslContext();
-  http::HttpsClientPool pool{domain, &ssl_cntx, io_context};
-  pool.set_connect_timeout(FLAGS_cloud_connect_deadline_ms);
-
-  S3Bucket s3{*aws_handle_, &pool};
-  bool fs_mode = !recursive;
-
-  auto status = s3.List(path, fs_mode, cb2);
+  Status status;
+  if (recursive && FLAGS_local_runner_list_parallel) {
+    status = store->List(bucket, path, cb2);
+  } else if (scheme == "gs") {
+    status = GetGcsHandle()->List(bucket, path, !recursive, cb2);
+  } else {
+    S3Bucket s3{*aws_handle_, GetS3BucketPool(bucket)};
+    status = s3.List(path, !recursive, cb2);
+  }
   CHECK_STATUS(status);
 }
 
@@ -427,7 +640,21 @@ StatusObject<file::ReadonlyFile*> LocalRunner::Impl::OpenGcsFile(const std::stri
 
   input_gcs_conn_.fetch_add(1, std::memory_order_acq_rel);
   auto pt = per_thread_.get();
-  return OpenGcsReadFile(filename, *gce_handle_, &pt->api_conn_pool.value());
+  file::ReadonlyFile::Options opts;
+  opts.parallel_range_size = size_t(FLAGS_local_runner_gcs_range_mb) << 20;
+  return OpenGcsReadFile(filename, *gce_handle_, &pt->api_conn_pool.value(), opts);
+}
+
+StatusObject<file::ReadonlyFile*> LocalRunner::Impl::OpenS3File(const std::string& filename,
+                                                                S3ReadStats* stats) {
+  absl::string_view bucket, key_path;
+  CHECK(S3Bucket::SplitToBucketPath(filename, &bucket, &key_path));
+  LazyAwsInit();
+
+  file::ReadonlyFile::Options opts;
+  opts.parallel_range_size = size_t(FLAGS_local_runner_s3_range_mb) << 20;
+  opts.max_parallel_ranges = std::max(1U, FLAGS_local_runner_s3_read_ahead);
+  return OpenS3ReadFile(key_path, *aws_handle_, GetS3BucketPool(bucket), opts, stats);
 }
 
 StatusObject<file::ReadonlyFile*> LocalRunner::Impl::OpenLocalFile(
@@ -439,8 +666,20 @@ StatusObject<file::ReadonlyFile*> LocalRunner::Impl::OpenLocalFile(
 
   file::FiberReadOptions opts;
   opts.prefetch_size = FLAGS_local_runner_prefetch_size;
+  opts.max_prefetch_size = FLAGS_local_runner_max_prefetch_size;
   opts.stats = stats;
 
+  if (FLAGS_local_runner_uring_input) {
+    return file::OpenUringReadFile(filename, io_pool_->GetThisContext(), &fq_pool_, opts);
+  }
+
+  if (FLAGS_local_runner_mmap_input) {
+    auto res = file::OpenMmapFile(filename, &fq_pool_, stats);
+    if (!res.ok())
+      return res.status;
+    return static_cast<file::ReadonlyFile*>(res.obj);
+  }
+
   return file::OpenFiberReadFile(filename, &fq_pool_, opts);
 }
 
@@ -451,6 +690,10 @@ void LocalRunner::Impl::LazyGcsInit() {
   auto* io_context = io_pool_->GetThisContext();
   per_thread_->SetupGce(io_context);
 
+  // Fast path, every gcs file open passes here.
+  if (gce_ready_.load(std::memory_order_acquire))
+    return;
+
   std::lock_guard<fibers::mutex> lk(cloud_mu_);
   if (gce_handle_)
     return;
@@ -458,6 +701,8 @@ void LocalRunner::Impl::LazyGcsInit() {
   gce_handle_.reset(new GCE);
   CHECK_STATUS(gce_handle_->Init());
   CHECK_STATUS(gce_handle_->RefreshAccessToken(io_context).status);
+  gce_handle_->StartTokenRefresher(io_context);
+  gce_ready_.store(true, std::memory_order_release);
 }
 
 void LocalRunner::Impl::LazyAwsInit() {
@@ -471,8 +716,37 @@ void LocalRunner::Impl::LazyAwsInit() {
   CHECK_STATUS(aws_handle_->Init());
 }
 
+HttpsClientPool* LocalRunner::Impl::GetS3BucketPool(absl::string_view bucket) {
+  if (!per_thread_) {
+    per_thread_.reset(new PerThread);
+  }
+  auto* pt = per_thread_.get();
+  if (!pt->aws_ssl_context) {
+    pt->aws_ssl_context = AWS::CheckedSslContext();
+  }
+
+  auto& pool = pt->s3_pools[bucket];
+  if (!pool) {
+    IoContext* io_context = io_pool_->GetThisContext();
+    CHECK(io_context) << "Must run from IO context thread";
+
+    string domain = absl::StrCat(bucket, ".", S3Bucket::kRootDomain);
+    pool.reset(new HttpsClientPool(domain, &pt->aws_ssl_context.value(), io_context));
+    pool->set_connect_timeout(FLAGS_cloud_connect_deadline_ms);
+    pool->set_retry_count(3);
+    pool->set_idle_timeout(FLAGS_cloud_idle_connection_ms);
+  }
+  return pool.get();
+}
+
 void LocalRunner::Impl::ShutDown() {
   fq_pool_.Shutdown();
+  if (compress_pool_) {
+    compress_pool_->Shutdown();
+  }
+  if (gce_handle_) {
+    gce_handle_->StopTokenRefresher();
+  }
 
   auto cb_per_thread = [](IoContext&) {
     if (per_thread_) {
@@ -487,6 +761,9 @@ void LocalRunner::Impl::ShutDown() {
 
   auto cached_bytes = file_cache_hit_bytes_.load();
   LOG_IF(INFO, cached_bytes) << "File cached hit bytes " << cached_bytes;
+
+  auto input_cache_bytes = input_cache_hit_bytes_.load();
+  LOG_IF(INFO, input_cache_bytes) << "Input cache hit bytes " << input_cache_bytes;
 }
 
 RawContext* LocalRunner::Impl::NewContext() {
@@ -501,6 +778,12 @@ void LocalRunner::Impl::SaveFile(absl::string_view fn, absl::string_view data) {
     ::file::WriteFile* f;
     if (util::IsGcsPath(full_fn)) {
       f = CHECKED_GET(OpenGcsWriteFile(full_fn, *gce_handle_, &per_thread_->api_conn_pool.value()));
+    } else if (util::IsS3Path(full_fn)) {
+      LazyAwsInit();
+
+      absl::string_view bucket, key_path;
+      CHECK(S3Bucket::SplitToBucketPath(full_fn, &bucket, &key_path));
+      f = CHECKED_GET(OpenS3WriteFile(key_path, *aws_handle_, GetS3BucketPool(bucket)));
     } else {
       // TODO(ORI): Use OpenFiberWriteFile instead.
       f = file::Open(full_fn);
@@ -511,6 +794,53 @@ void LocalRunner::Impl::SaveFile(absl::string_view fn, absl::string_view data) {
   });
 }
 
+StatusObject<bool> LocalRunner::Impl::LoadFile(absl::string_view fn, std::string* data) {
+  return io_pool_->GetNextContext().AwaitSafe([&]() -> StatusObject<bool> {
+    std::string full_fn = file_util::JoinPath(data_dir, fn);
+    absl::string_view scheme, bucket, path;
+    if (!cloud::ObjectStore::SplitUrl(full_fn, &scheme, &bucket, &path)) {
+      if (!file::Exists(full_fn))
+        return false;
+      if (!file_util::ReadFileToString(full_fn, data))
+        return Status(StatusCode::IO_ERROR, absl::StrCat("Could not read ", full_fn));
+      return true;
+    }
+
+    // Distinguishes the missing file from the failure to read it.
+    std::unique_ptr<cloud::ObjectStore> store = NewObjectStore(scheme);
+    bool exists = false;
+    auto list_cb = [&](size_t sz, absl::string_view key) { exists |= (key == path); };
+    RETURN_IF_ERROR(store->List(bucket, path, list_cb));
+    if (!exists)
+      return false;
+
+    auto res = store->OpenReadFile(bucket, path);
+    if (!res.ok())
+      return res.status;
+
+    std::unique_ptr<file::ReadonlyFile> fl(res.obj);
+    data->resize(fl->Size());
+
+    size_t offset = 0;
+    while (offset < data->size()) {
+      uint8_t* next = reinterpret_cast<uint8_t*>(&data->front()) + offset;
+      auto read_res = fl->Read(offset, strings::MutableByteRange(next, data->size() - offset));
+      if (!read_res.ok())
+        return read_res.status;
+      if (read_res.obj == 0)
+        break;
+      offset += read_res.obj;
+    }
+    RETURN_IF_ERROR(fl->Close());
+
+    if (offset != data->size()) {
+      return Status(StatusCode::IO_ERROR,
+                    absl::StrCat("Read ", offset, " bytes out of ", data->size(), " of ", full_fn));
+    }
+    return true;
+  });
+}
+
 /* LocalRunner implementation
 ********************************************/
 
@@ -522,6 +852,7 @@ LocalRunner::~LocalRunner() {
 }
 
 void LocalRunner::Init() {
+  impl_->Init();
 }
 
 void LocalRunner::Shutdown() {
@@ -542,10 +873,8 @@ void LocalRunner::OperatorEnd(ShardFileMap* out_files) {
 }
 
 void LocalRunner::ExpandGlob(const std::string& glob, ExpandCb cb) {
-  if (util::IsGcsPath(glob)) {
-    impl_->ExpandGCS(glob, cb);
-  } else if (util::IsS3Path(glob)) {
-    impl_->ExpandS3(glob, cb);
+  if (util::IsGcsPath(glob) || util::IsS3Path(glob)) {
+    impl_->ExpandCloud(glob, cb);
   } else {
     std::vector<file_util::StatShort> paths = file_util::StatFiles(glob);
     for (const auto& v : paths) {
@@ -558,11 +887,11 @@ void LocalRunner::ExpandGlob(const std::string& glob, ExpandCb cb) {
 
 // Read file and fill queue. This function must be fiber-friendly.
 size_t LocalRunner::ProcessInputFile(const std::string& filename, pb::WireFormat::Type type,
-                                     RawSinkCb cb) {
+                                     RawSinkCb cb, FileRange* range) {
   Impl::Source src(impl_.get(), filename);
 
   CHECK_STATUS(src.Open()) << filename;
-  size_t cnt = src.Process(type, std::move(cb));
+  size_t cnt = src.Process(type, std::move(cb), range);
 
   return cnt;
 }
@@ -571,6 +900,10 @@ void LocalRunner::SaveFile(absl::string_view fn, absl::string_view data) {
   impl_->SaveFile(fn, data);
 }
 
+StatusObject<bool> LocalRunner::LoadFile(absl::string_view fn, std::string* data) {
+  return impl_->LoadFile(fn, data);
+}
+
 void LocalRunner::Stop() {
   CHECK_NOTNULL(impl_)->Break();
 }
@@ -36,10 +36,12 @@ class LocalRunner : public Runner {
 
   // Read file and fill queue. This function must be fiber-friendly.
   size_t ProcessInputFile(const std::string& filename, pb::WireFormat::Type type,
-                          RawSinkCb cb) final;
+                          RawSinkCb cb, FileRange* range) final;
 
   void SaveFile(absl::string_view fn, absl::string_view data);
 
+  util::StatusObject<bool> LoadFile(absl::string_view fn, std::string* data) final;
+
   void Stop();
 
  private:
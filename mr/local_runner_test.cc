@@ -4,6 +4,7 @@
 
 #include "mr/local_runner.h"
 #include <gmock/gmock.h>
+#include "absl/strings/str_cat.h"
 #include "base/gtest.h"
 #include "base/logging.h"
 #include "mr/do_context.h"
@@ -170,6 +171,29 @@ TEST_F(LocalRunnerTest, CloseShard) {
   ASSERT_THAT(out_files, KeyMatch(shards));
 }
 
+TEST_F(LocalRunnerTest, SplitRange) {
+  string fname = base::GetTestTempPath("split_range.txt");
+  vector<string> lines{"a", "", "bcd", "efghij", "k", "", "", "lmnopq", "r"};
+  string contents;
+  for (size_t i = 0; i < lines.size(); ++i) {
+    absl::StrAppend(&contents, lines[i], i % 3 ? "\n" : "\r\n");
+  }
+  file_util::WriteStringToFileOrDie(contents, fname);
+
+  // Every line must be read exactly once regardless of the split point.
+  for (size_t mid = 1; mid <= contents.size(); ++mid) {
+    vector<string> records;
+    RawSinkCb cb = [&](string&& val) { records.push_back(std::move(val)); };
+    FileRange head(0, mid), tail(mid);
+
+    pool_->GetNextContext().AwaitSafe([&] {
+      runner_->ProcessInputFile(fname, pb::WireFormat::TXT, cb, &head);
+      runner_->ProcessInputFile(fname, pb::WireFormat::TXT, cb, &tail);
+    });
+    EXPECT_EQ(lines, records) << mid;
+  }
+}
+
 using benchmark::DoNotOptimize;
 
 static void BM_ReadTextAndPassIt(benchmark::State& state) {
@@ -3,6 +3,8 @@
 //
 #include "mr/mapper_executor.h"
 
+#include <queue>
+
 #include "absl/strings/str_cat.h"
 #include "base/histogram.h"
 #include "base/logging.h"
@@ -16,6 +18,12 @@
 
 DEFINE_uint32(map_limit, 0, "");
 DEFINE_uint32(map_io_read_factor, 2, "");
+DEFINE_uint32(map_glob_lookahead, 1024,
+              "Number of discovered input files that are held back in order to "
+              "schedule the largest ones first.");
+DEFINE_uint32(map_split_min_mb, 32,
+              "Once all the input files are scheduled, idle readers take over the second half "
+              "of unread ranges that are at least that large. 0 disables the splitting.");
 
 namespace mr3 {
 
@@ -25,6 +33,17 @@ using namespace util;
 
 using fibers::channel_op_status;
 
+namespace {
+
+VarzMapAverage5m map_files("map-files");
+
+}  // namespace
+
+MapperExecutor::ActiveRead::ActiveRead(const FileInput& fi, size_t start, size_t end)
+    : input(fi), range(start, end), start_usec(base::GetMonotonicMicrosFast()),
+      reads_left(std::make_shared<std::atomic_uint>(1)) {
+}
+
 MapperExecutor::MapperExecutor(util::IoContextPool* pool, Runner* runner)
     : OperatorExecutor(pool, runner) {
 }
@@ -63,8 +82,17 @@ void MapperExecutor::SetupPerIoThread(unsigned index, detail::TableBase* tb) {
   CHECK_GT(FLAGS_map_io_read_factor, 0);
   per_io_->process_fd.resize(FLAGS_map_io_read_factor);
 
+  // With work stealing, the map fibers may run on the other threads of the pool. Therefore
+  // each one of them maps into its own context instead of the context of the thread.
+  bool migratable = pool_->steal_group() != nullptr;
   for (auto& fbr : per_io_->process_fd) {
-    fbr = fibers::fiber{&MapperExecutor::IOReadFiber, this, tb};
+    RawContext* map_context = ptr->raw_context.get();
+    if (migratable) {
+      ptr->fiber_contexts.emplace_back(runner_->CreateContext());
+      map_context = ptr->fiber_contexts.back().get();
+      RegisterContext(map_context);
+    }
+    fbr = fibers::fiber{&MapperExecutor::IOReadFiber, this, tb, map_context};
   }
 }
 
@@ -72,7 +100,12 @@ void MapperExecutor::Run(const std::vector<const InputBase*>& inputs, detail::Ta
                          ShardFileMap* out_files) {
   const string& op_name = tb->op().op_name();
 
-  util::VarzFunction varz_func("mapper-executor", [this] { return GetStats(); });
+  util::VarzFunction varz_func("mapper-executor", [this] {
+    util::VarzValue::Map res = GetStats();
+    util::VarzValue::Map read_stats = GetReadStats();
+    std::move(read_stats.begin(), read_stats.end(), std::back_inserter(res));
+    return res;
+  });
 
   file_name_q_.reset(new FileNameQueue{16});
   runner_->OperatorStart(&tb->op());
@@ -93,6 +126,9 @@ void MapperExecutor::Run(const std::vector<const InputBase*>& inputs, detail::Ta
   pool_->AwaitFiberOnAllSerially([&](IoContext&) {
     per_io_->Shutdown();
     FinalizeContext(per_io_->raw_context.get());
+    for (auto& context : per_io_->fiber_contexts) {
+      FinalizeContext(context.get());
+    }
     per_io_.reset();
   });
 
@@ -109,31 +145,67 @@ void MapperExecutor::PushInput(const InputBase* input) {
   CHECK(input && input->msg().file_spec_size() > 0);
   CHECK(input->msg().has_format());
 
-  vector<FileInput> files;
-  pool_->GetNextContext().AwaitSafe([&] {
-    const pb::Input* pb_input = &input->msg();
-    for (int i = 0; i < pb_input->file_spec_size(); ++i) {
+  const pb::Input* pb_input = &input->msg();
+  const unsigned spec_cnt = pb_input->file_spec_size();
+
+  // Each file spec is expanded concurrently in its own IO fiber, and the discovered files
+  // are streamed back via expand_q as soon as they are listed.
+  fibers::buffered_channel<FileInput> expand_q{256};
+  std::atomic_uint specs_left{spec_cnt};
+  fibers_ext::BlockingCounter bc(spec_cnt);
+
+  for (unsigned i = 0; i < spec_cnt; ++i) {
+    pool_->GetNextContext().AsyncFiber([&, i, bc]() mutable {
       const pb::Input::FileSpec& file_spec = pb_input->file_spec(i);
       runner_->ExpandGlob(file_spec.url_glob(), [&](size_t sz, const auto& str) {
-        files.push_back(FileInput{pb_input, size_t(i), sz, str});
+        // Fails with "closed" status if we stopped consuming. In that case we just drop it.
+        expand_q.push(FileInput{pb_input, size_t(i), sz, str, input});
       });
-    }
-  });
 
-  // Sort - bigger sizes first to reduce the variance of the reading phase.
-  std::sort(files.begin(), files.end(),
-            [](const auto& l, auto& r) { return l.file_size > r.file_size; });
+      if (specs_left.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        expand_q.close();
+      bc.Dec();  // Must be last, we can not access the captured references after it.
+    });
+  }
 
-  LOG(INFO) << "Running on input " << input->msg().name() << " with " << files.size() << " files";
-  for (const auto& fl_name : files) {
-    channel_op_status st = file_name_q_->push(fl_name);
-    if (st != channel_op_status::closed) {
+  // We schedule bigger files first to reduce the variance of the reading phase.
+  // Since the files arrive incrementally, we can only order them within the look-ahead window.
+  auto cmp = [](const FileInput& l, const FileInput& r) { return l.file_size < r.file_size; };
+  std::priority_queue<FileInput, vector<FileInput>, decltype(cmp)> window(cmp);
+
+  auto push_largest = [&] {
+    channel_op_status st = file_name_q_->push(window.top());
+    window.pop();
+    if (st == channel_op_status::closed) {
+      expand_q.close();  // Stop the expansion early.
+    } else {
       CHECK_EQ(channel_op_status::success, st);
     }
+  };
+
+  FileInput file_input;
+  size_t file_cnt = 0;
+  const InputBase::FileFilter& filter = input->file_filter();
+  while (expand_q.pop(file_input) == channel_op_status::success) {
+    if (filter && !filter(file_input.file_name, file_input.file_size)) {
+      continue;
+    }
+    ++file_cnt;
+    window.push(std::move(file_input));
+    if (window.size() >= FLAGS_map_glob_lookahead) {
+      push_largest();
+    }
+  }
+
+  while (!window.empty()) {
+    push_largest();
   }
+
+  bc.Wait();
+  LOG(INFO) << "Running on input " << pb_input->name() << " with " << file_cnt << " files";
 }
 
-void MapperExecutor::IOReadFiber(detail::TableBase* tb) {
+void MapperExecutor::IOReadFiber(detail::TableBase* tb, RawContext* map_context) {
   this_fiber::properties<IoFiberProperties>().set_name("IOReadFiber");
 
   PerIoStruct* aux_local = per_io_.get();
@@ -143,36 +215,27 @@ void MapperExecutor::IOReadFiber(detail::TableBase* tb) {
   // contains items pushed from the IORead fiber but not yet processed by MapFiber.
   RecordQueue record_q(256);
 
-  fibers::fiber map_fd(&MapperExecutor::MapFiber, &record_q, tb);
+  bool migratable = map_context != aux_local->raw_context.get();
+  fibers::fiber map_fd(&MapperExecutor::MapFiber, &record_q, tb, map_context, migratable);
 
   VLOG(1) << "Starting MapFiber on " << tb->op().output().DebugString();
 
   while (!aux_local->stop_early) {
+    std::unique_ptr<ActiveRead> read;
+
     channel_op_status st = file_name_q_->pop(file_input);
-    if (st == channel_op_status::closed)
-      break;
+    if (st == channel_op_status::closed) {
+      // All the files were scheduled. Instead of staying idle, we take over
+      // the unread tails of the files that are still being read.
+      read = SplitActiveRead();
+      if (!read)
+        break;
+    } else {
+      CHECK_EQ(channel_op_status::success, st);
+      read.reset(new ActiveRead(file_input, 0, kuint64max));
+    }
 
-    CHECK_EQ(channel_op_status::success, st);
-    const pb::Input* pb_input = file_input.input;
-    pb::WireFormat::Type input_type = pb_input->format().type();
-    bool is_binary = detail::IsBinary(input_type);
-    Record::Operand op = is_binary ? Record::BINARY_FORMAT : Record::TEXT_FORMAT;
-    record_q.Push(op, 0, file_input.file_name);
-    record_q.Push(Record::METADATA, &pb_input->file_spec(file_input.spec_index));
-
-    auto cb = [&, skip = pb_input->skip_header(),
-               file_record_cnt = uint64_t{0}](string&& s) mutable {
-      if (file_record_cnt++ < skip)
-        return;
-      record_q.Push(Record::RECORD, file_record_cnt - 1 - skip, std::move(s));
-      aux_local->raw_context->Inc("fn-calls");
-    };
-
-    size_t records_read =
-        runner_->ProcessInputFile(file_input.file_name, input_type, std::move(cb));
-
-    cnt += records_read;
-    aux_local->raw_context->IncBy("map-input-" + pb_input->name(), records_read);
+    cnt += ProcessRead(read.get(), &record_q);
   }
   VLOG(1) << "IOReadFiber closing after processing " << cnt << " items";
 
@@ -185,22 +248,117 @@ void MapperExecutor::IOReadFiber(detail::TableBase* tb) {
   VLOG(1) << "IOReadFiber after OnShardFinish";
 }
 
-void MapperExecutor::MapFiber(RecordQueue* record_q, detail::TableBase* tb) {
+uint64_t MapperExecutor::ProcessRead(ActiveRead* read, RecordQueue* record_q) {
+  PerIoStruct* aux_local = per_io_.get();
+  const FileInput& file_input = read->input;
+  const pb::Input* pb_input = file_input.input;
+  pb::WireFormat::Type input_type = pb_input->format().type();
+  bool is_binary = detail::IsBinary(input_type);
+  Record::Operand op = is_binary ? Record::BINARY_FORMAT : Record::TEXT_FORMAT;
+  record_q->Push(op, 0, file_input.file_name);
+  record_q->Push(Record::METADATA, &pb_input->file_spec(file_input.spec_index));
+
+  // Only the first range contains the header. Record positions of the split ranges are
+  // relative to the range start.
+  uint32_t skip_header = read->range.start() == 0 ? pb_input->skip_header() : 0;
+  auto cb = [&, skip = skip_header, file_record_cnt = uint64_t{0}](string&& s) mutable {
+    if (file_record_cnt++ < skip)
+      return;
+    record_q->Push(Record::RECORD, file_record_cnt - 1 - skip, std::move(s));
+    aux_local->raw_context->Inc("fn-calls");
+  };
+
+  {
+    std::lock_guard<fibers::mutex> lk(active_mu_);
+    active_reads_.insert(read);
+  }
+
+  size_t records_read = runner_->ProcessInputFile(file_input.file_name, input_type, std::move(cb),
+                                                  &read->range);
+
+  {
+    std::lock_guard<fibers::mutex> lk(active_mu_);
+    active_reads_.erase(read);
+  }
+
+  uint64_t elapsed_ms = (base::GetMonotonicMicrosFast() - read->start_usec) / 1000;
+  map_files.IncBy("elapsed-ms", elapsed_ms);
+  VLOG(1) << "Read " << file_input.file_name << " from " << read->range.start() << " in "
+          << elapsed_ms << "ms";
+
+  aux_local->raw_context->IncBy("map-input-" + pb_input->name(), records_read);
+
+  // The file is consumed once all its ranges were read.
+  if (read->reads_left->fetch_sub(1, std::memory_order_acq_rel) == 1 && !aux_local->stop_early) {
+    const InputBase::FileDoneCb& done_cb = file_input.owner->file_done_cb();
+    if (done_cb)
+      done_cb(file_input.file_name, file_input.file_size);
+  }
+
+  return records_read;
+}
+
+auto MapperExecutor::SplitActiveRead() -> std::unique_ptr<ActiveRead> {
+  if (FLAGS_map_split_min_mb == 0)
+    return nullptr;
+
+  std::lock_guard<fibers::mutex> lk(active_mu_);
+  ActiveRead* largest = nullptr;
+  size_t largest_unclaimed = 0;
+  for (ActiveRead* read : active_reads_) {
+    size_t unclaimed = read->range.unclaimed();
+    if (unclaimed > largest_unclaimed) {
+      largest_unclaimed = unclaimed;
+      largest = read;
+    }
+  }
+
+  size_t start = 0, end = 0;
+  size_t min_size = size_t(FLAGS_map_split_min_mb) << 20;
+  if (!largest || !largest->range.SplitTail(min_size, &start, &end))
+    return nullptr;
+
+  split_cnt_.fetch_add(1, std::memory_order_relaxed);
+  LOG(INFO) << "Taking over " << largest->input.file_name << " range " << start << "-" << end;
+
+  auto res = std::make_unique<ActiveRead>(largest->input, start, end);
+
+  // largest is still active, hence its file can not be done yet.
+  res->reads_left = largest->reads_left;
+  res->reads_left->fetch_add(1, std::memory_order_relaxed);
+  return res;
+}
+
+util::VarzValue::Map MapperExecutor::GetReadStats() {
+  util::VarzValue::Map res;
+  res.emplace_back("split-ranges", util::VarzValue::FromInt(split_cnt_.load()));
+
+  auto now = base::GetMonotonicMicrosFast();
+  std::lock_guard<fibers::mutex> lk(active_mu_);
+  res.emplace_back("active-reads", util::VarzValue::FromInt(active_reads_.size()));
+
+  // The tail of the run is usually dominated by few files, so we report each one of them.
+  for (const ActiveRead* read : active_reads_) {
+    string name = absl::StrCat("read-ms:", read->input.file_name, ":", read->range.start());
+    res.emplace_back(std::move(name), util::VarzValue::FromInt((now - read->start_usec) / 1000));
+  }
+
+  return res;
+}
+
+void MapperExecutor::MapFiber(RecordQueue* record_q, detail::TableBase* tb,
+                              RawContext* raw_context, bool migratable) {
   auto& props = this_fiber::properties<IoFiberProperties>();
   props.set_name("MapFiber");
   props.SetNiceLevel(IoFiberProperties::MAX_NICE_LEVEL);
+  props.set_migratable(migratable);
 
-  PerIoStruct* aux_local = per_io_.get();
-  RawContext* raw_context = aux_local->raw_context.get();
-
+  CHECK(raw_context);
   raw_context->InitPerFiber();
 
-  std::unique_ptr<detail::HandlerWrapperBase> handler{
-      tb->CreateHandler(aux_local->raw_context.get())};
+  std::unique_ptr<detail::HandlerWrapperBase> handler{tb->CreateHandler(raw_context)};
   CHECK_EQ(1, handler->Size());
 
-  CHECK(raw_context);
-
   Record record;
   uint64_t record_num = 0;
   RawSinkCb cb = handler->Get(0);
@@ -4,8 +4,11 @@
 #pragma once
 
 #include <boost/fiber/buffered_channel.hpp>
+#include <atomic>
 #include <functional>
+#include <memory>
 
+#include "absl/container/flat_hash_set.h"
 #include "mr/operator_executor.h"
 #include "util/fibers/simple_channel.h"
 
@@ -17,6 +20,7 @@ class MapperExecutor : public OperatorExecutor {
     size_t spec_index;
     size_t file_size;
     ::std::string file_name;
+    const InputBase* owner;
   };
   using FileNameQueue = ::boost::fibers::buffered_channel<FileInput>;
 
@@ -37,6 +41,18 @@ class MapperExecutor : public OperatorExecutor {
 
   using RecordQueue = util::fibers_ext::SimpleChannel<Record>;
 
+  // A file or its part that is being read by one of IOReadFibers.
+  struct ActiveRead {
+    FileInput input;
+    FileRange range;
+    uint64_t start_usec;
+
+    // Number of the unfinished reads of the file. Shared by the reads of its split ranges.
+    std::shared_ptr<std::atomic_uint> reads_left;
+
+    ActiveRead(const FileInput& fi, size_t start, size_t end);
+  };
+
  public:
   MapperExecutor(util::IoContextPool* pool, Runner* runner);
   ~MapperExecutor();
@@ -54,14 +70,30 @@ class MapperExecutor : public OperatorExecutor {
 
   // Input managing fiber that reads files from disk and pumps data into record_q.
   // One per IO thread.
-  void IOReadFiber(detail::TableBase* tb);
+  // map_context is used by the map fiber that IOReadFiber feeds.
+  void IOReadFiber(detail::TableBase* tb, RawContext* map_context);
 
   // index - io thread index.
   void SetupPerIoThread(unsigned index, detail::TableBase* tb);
 
-  static void MapFiber(RecordQueue* record_q, detail::TableBase* tb);
+  // If migratable, the fiber may be stolen by the other threads of the pool. In that case
+  // raw_context must not be shared with the other fibers.
+  static void MapFiber(RecordQueue* record_q, detail::TableBase* tb, RawContext* raw_context,
+                       bool migratable);
+
+  // Reads the file range and pushes its records into record_q. Returns number of records read.
+  uint64_t ProcessRead(ActiveRead* read, RecordQueue* record_q);
+
+  // Splits off the tail of the largest active read. Returns null if no read can be split.
+  std::unique_ptr<ActiveRead> SplitActiveRead();
+
+  util::VarzValue::Map GetReadStats();
 
   std::unique_ptr<FileNameQueue> file_name_q_;
+
+  ::boost::fibers::mutex active_mu_;
+  absl::flat_hash_set<ActiveRead*> active_reads_;  // guarded by active_mu_
+  std::atomic_ulong split_cnt_{0};
 };
 
 }  // namespace mr3
@@ -2,6 +2,7 @@
 // Author: Roman Gershman (romange@gmail.com)
 //
 #include <gmock/gmock.h>
+#include <google/protobuf/text_format.h>
 
 #include <rapidjson/error/en.h>
 #include <rapidjson/writer.h>
@@ -497,6 +498,45 @@ TEST_F(MrTest, Scope) {
   EXPECT_THAT(runner_.Table("w1"), UnorderedElementsAre(MatchShard(1, stream1)));
 }
 
+TEST_F(MrTest, Incremental) {
+  runner_.AddInputRecords("bar.txt", {"1", "2"});
+  runner_.AddInputRecords("foo.txt", {"3"});
+
+  auto run = [&](const vector<string>& globs) {
+    Pipeline pipeline(pool_.get());
+    PTable<string> table = pipeline.ReadText("read1", globs).set_incremental();
+    table.Write("w1", pb::WireFormat::TXT).WithModNSharding(10, [](const auto&) { return 1; });
+    return pipeline.Run(&runner_);
+  };
+
+  EXPECT_TRUE(run({"bar.txt"}));
+  EXPECT_THAT(runner_.Table("w1"), UnorderedElementsAre(MatchShard(1, {"1", "2"})));
+
+  // Only the new file is mapped.
+  run({"bar.txt", "foo.txt"});
+  EXPECT_THAT(runner_.Table("w1"), UnorderedElementsAre(MatchShard(1, {"3"})));
+
+  run({"bar.txt", "foo.txt"});
+  EXPECT_TRUE(runner_.Table("w1").empty());
+
+  pb::IncrementalState state;
+  ASSERT_TRUE(google::protobuf::TextFormat::ParseFromString(
+      runner_.SavedFile(file_util::JoinPath("w1", "incremental_state.pbtxt")), &state));
+  EXPECT_EQ(3, state.run());
+  EXPECT_EQ(2, state.consumed_size());
+  ASSERT_EQ(1, state.shard_size());
+  EXPECT_EQ(1, state.shard(0).shard_id());
+
+  // The run fails if the state can not be loaded, rather than remapping all the inputs.
+  runner_.load_status = Status(StatusCode::IO_ERROR, "Injected error");
+  EXPECT_FALSE(run({"bar.txt", "foo.txt"}));
+
+  // Neither does a corrupted state abort the process.
+  runner_.load_status = Status::OK;
+  runner_.SaveFile(file_util::JoinPath("w1", "incremental_state.pbtxt"), "run: {");
+  EXPECT_FALSE(run({"bar.txt", "foo.txt"}));
+}
+
 static void BM_ShardAndWrite(benchmark::State& state) {
   IoContextPool pool(1);
   pool.Run();
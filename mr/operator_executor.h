@@ -48,6 +48,9 @@ protected:
     std::vector<::boost::fibers::fiber> process_fd;
     std::unique_ptr<RawContext> raw_context;
 
+    // Contexts of the migratable map fibers, used only by mapper with work stealing.
+    std::vector<std::unique_ptr<RawContext>> fiber_contexts;
+
     long *records_read_ptr = nullptr; // To avoid always looking up "fn-calls", used only by mapper.
     bool stop_early = false; // Used only by mapper.
 
@@ -3,6 +3,10 @@
 //
 #include "mr/pipeline.h"
 
+#include <google/protobuf/text_format.h>
+
+#include "absl/container/flat_hash_set.h"
+#include "absl/strings/str_cat.h"
 #include "absl/strings/str_replace.h"
 #include "base/logging.h"
 #include "file/file_util.h"
@@ -15,6 +19,14 @@ using namespace boost;
 using namespace std;
 using namespace util;
 
+namespace {
+
+string IncrementalStatePath(const pb::Operator& op) {
+  return file_util::JoinPath(op.output().name(), "incremental_state.pbtxt");
+}
+
+}  // namespace
+
 Pipeline::InputSpec::InputSpec(const std::vector<std::string>& globs) {
   for (const auto& s : globs) {
     pb::Input::FileSpec fspec;
@@ -67,6 +79,7 @@ void Pipeline::Stop() {
 
 bool Pipeline::Run(Runner* runner) {
   CHECK(!tables_.empty());
+  bool failed = false;
 
   for (const auto& sptr : tables_) {
     const pb::Operator& op = sptr->op();
@@ -92,7 +105,13 @@ bool Pipeline::Run(Runner* runner) {
 
     executor_->Init(freq_maps_);
     lk.unlock();
-    ProcessTable(sptr.get());
+
+    Status status = ProcessTable(runner, sptr.get());
+    if (!status.ok()) {
+      LOG(ERROR) << op.op_name() << " failed: " << status;
+      failed = true;
+      break;
+    }
   }
 
   VLOG(1) << "Saving counter maps";
@@ -108,21 +127,73 @@ bool Pipeline::Run(Runner* runner) {
   VLOG(1) << "Before Runner::Shutdown";
   runner->Shutdown();
 
-  return !stopped_.load();
+  return !stopped_.load() && !failed;
 }
 
-void Pipeline::ProcessTable(detail::TableBase* tbl) {
+Status Pipeline::ProcessTable(Runner* runner, detail::TableBase* tbl) {
   const pb::Operator& op = tbl->op();
   std::vector<const InputBase*> inputs;
   string input_names;
+  bool incremental = false;
   for (const auto& input_name : op.input_name()) {
     CHECK(!input_name.empty()) << "Empty input found for operator '" << op.op_name() << "'";
 
     absl::StrAppend(&input_names, input_name, ",");
     inputs.push_back(CheckedInput(input_name));
+    incremental |= inputs.back()->msg().incremental();
   }
   input_names.pop_back();
 
+  // In incremental mode we skip the input files that were consumed by the previous runs
+  // and write the new outputs besides the outputs of those runs.
+  pb::IncrementalState inc_state;
+  fibers::mutex inc_mu;  // Guards inc_state during the run.
+  absl::flat_hash_set<std::pair<string, uint64_t>> consumed;
+  if (incremental) {
+    for (const InputBase* ib : inputs) {
+      if (!ib->msg().incremental()) {
+        return Status(StatusCode::INVALID_ARGUMENT,
+                      absl::StrCat("Input ", ib->msg().name(), " of incremental operator ",
+                                   op.op_name(), " must be incremental as well"));
+      }
+    }
+
+    string data;
+    auto load_res = runner->LoadFile(IncrementalStatePath(op), &data);
+    if (!load_res.ok())
+      return load_res.status;
+
+    if (load_res.obj && !google::protobuf::TextFormat::ParseFromString(data, &inc_state)) {
+      return Status(StatusCode::PARSE_ERROR,
+                    absl::StrCat("Corrupted incremental state for ", op.op_name()));
+    }
+    for (const auto& file : inc_state.consumed()) {
+      consumed.emplace(file.name(), file.size());
+    }
+    inc_state.set_run(inc_state.run() + 1);
+    tbl->mutable_op()->mutable_output()->set_incremental_run(inc_state.run());
+
+    for (const auto& input_name : op.input_name()) {
+      InputBase* ib = inputs_[input_name].get();
+
+      // consumed is not modified during the run, hence no locking.
+      ib->set_file_filter([&](const string& file_name, size_t file_size) {
+        return !consumed.contains(std::make_pair(file_name, uint64_t(file_size)));
+      });
+
+      // We record the files once they were read, so that an interrupted run does not mark
+      // the files it did not reach as consumed.
+      ib->set_file_done_cb([&](const string& file_name, size_t file_size) {
+        std::lock_guard<fibers::mutex> lk(inc_mu);
+        auto* file = inc_state.add_consumed();
+        file->set_name(file_name);
+        file->set_size(file_size);
+      });
+    }
+    LOG(INFO) << op.op_name() << " incremental run " << inc_state.run() << ", skipping "
+              << consumed.size() << " consumed files";
+  }
+
   // TODO: To allow skipping of the pipeline - i.e. partial dry run mode. For that we need to
   // scan output directory of each operator for shard files and populate shards from there.
   // In addition we must save freq maps on disk to allow loading them during dry run.
@@ -130,6 +201,22 @@ void Pipeline::ProcessTable(detail::TableBase* tbl) {
   ShardFileMap out_files;
   executor_->Run(inputs, tbl, &out_files);
 
+  if (incremental) {
+    for (const auto& input_name : op.input_name()) {
+      inputs_[input_name]->set_file_filter(nullptr);
+      inputs_[input_name]->set_file_done_cb(nullptr);
+    }
+
+    // Shards of the previous runs stay part of the output even if this run did not write them.
+    for (const auto& fs : inc_state.shard()) {
+      if (fs.shard_id_ref_case() == pb::Input::FileSpec::kShardId) {
+        out_files.emplace(ShardId{fs.shard_id()}, fs.url_glob());
+      } else {
+        out_files.emplace(ShardId{fs.custom_shard_id()}, fs.url_glob());
+      }
+    }
+  }
+
   LOG(INFO) << op.op_name() << " finished run with " << out_files.size() << " output files";
 
   // Fill the corresponsing input with sharded files.
@@ -147,6 +234,18 @@ void Pipeline::ProcessTable(detail::TableBase* tbl) {
     }
   }
 
+  // We commit the state only if the run was completed, otherwise the next run repeats this one.
+  if (incremental && !stopped_) {
+    inc_state.clear_shard();
+    for (const auto& fs : inp_ptr->msg().file_spec()) {
+      inc_state.add_shard()->CopyFrom(fs);
+    }
+
+    string data;
+    CHECK(google::protobuf::TextFormat::PrintToString(inc_state, &data));
+    runner->SaveFile(IncrementalStatePath(op), data);
+  }
+
   for (const auto& k_v : executor_->GetFreqMaps()) {
     auto res = freq_maps_.emplace(k_v.first, k_v.second);
     CHECK(res.second) << "Frequency map " << k_v.first
@@ -154,6 +253,8 @@ void Pipeline::ProcessTable(detail::TableBase* tbl) {
   }
 
   metric_maps_[op.output().name()] = executor_->GetCounterMap();
+
+  return Status::OK;
 }
 
 pb::Input* Pipeline::mutable_input(const std::string& name) {
@@ -7,6 +7,7 @@
 #include "mr/ptable.h"
 
 #include "absl/container/flat_hash_map.h"
+#include "util/status.h"
 
 namespace util {
 class IoContextPool;
@@ -28,6 +29,14 @@ template <typename T> class PInput : public PTable<T> {
     return *this;
   }
 
+  //! Maps only the files that were not mapped by the previous runs. The outputs of the new
+  //! files are added to the shards written by the previous runs.
+  //! All the inputs of an operator must be incremental if one of them is.
+  PInput<T>& set_incremental(bool incremental = true) {
+    input_->mutable_msg()->set_incremental(incremental);
+    return *this;
+  }
+
  private:
   InputBase* input_;
 };
@@ -83,7 +92,8 @@ class Pipeline {
    * @brief Runs the pipeline and blocks the current thread.
    *
    * @param runner
-   * @return true if the pipeline has successfully finished, false if it was stopped in the middle.
+   * @return true if the pipeline has successfully finished, false if it was stopped in the middle
+   *         or failed.
    */
   bool Run(Runner* runner);
 
@@ -109,7 +119,7 @@ class Pipeline {
                            const InputSpec& globs);
 
   const InputBase* CheckedInput(const std::string& name) const;
-  void ProcessTable(detail::TableBase* tbl);
+  util::Status ProcessTable(Runner* runner, detail::TableBase* tbl);
 
   util::IoContextPool* pool_;
   absl::flat_hash_map<std::string, std::unique_ptr<InputBase>> inputs_;
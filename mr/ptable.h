@@ -53,9 +53,23 @@ class InputBase {
 
   const pb::Output* linked_outp() const { return linked_outp_; }
 
+  //! Returns true if the file should be mapped. Set by the pipeline for incremental inputs.
+  using FileFilter = std::function<bool(const std::string& file_name, size_t file_size)>;
+
+  void set_file_filter(FileFilter filter) { file_filter_ = std::move(filter); }
+  const FileFilter& file_filter() const { return file_filter_; }
+
+  //! Called once the file was read fully. Called concurrently from the IO threads.
+  using FileDoneCb = std::function<void(const std::string& file_name, size_t file_size)>;
+
+  void set_file_done_cb(FileDoneCb cb) { file_done_cb_ = std::move(cb); }
+  const FileDoneCb& file_done_cb() const { return file_done_cb_; }
+
  protected:
   const pb::Output* linked_outp_;
   pb::Input input_;
+  FileFilter file_filter_;
+  FileDoneCb file_done_cb_;
 };
 
 template <typename OutT> class PTable {
@@ -3,10 +3,15 @@
 //
 #pragma once
 
+#include <algorithm>
+#include <boost/fiber/mutex.hpp>
+
 #include "absl/container/flat_hash_map.h"
 #include "absl/strings/string_view.h"
+#include "base/integral_types.h"
 #include "mr/mr3.pb.h"
 #include "mr/mr_types.h"
+#include "util/status.h"
 
 namespace mr3 {
 
@@ -17,6 +22,61 @@ using ShardFileMap = absl::flat_hash_map<ShardId, std::string>;
 
 class RawContext;
 
+/*! \brief Byte range of an input file that is processed by a single reader.
+
+    A runner that can process partial files (i.e. uncompressed text files) enables the range
+    before reading. The reader processes the records that start inside the range and claims
+    the range gradually. Idle readers may split off the unclaimed tail of an enabled range and
+    process it themselves. Thread-safe.
+*/
+class FileRange {
+ public:
+  explicit FileRange(size_t start = 0, size_t end = kuint64max)
+      : start_(start), claimed_(start), end_(end) {}
+
+  size_t start() const { return start_; }
+
+  //! Called by the runner that supports processing [start, end) part of the file.
+  void Enable(size_t file_size) {
+    std::lock_guard<::boost::fibers::mutex> lk(mu_);
+    end_ = std::min(end_, file_size);
+    enabled_ = true;
+  }
+
+  //! Called by the reader when a record starting at pos reaches the limit claimed before.
+  //! Returns the new limit. Records starting at or after the limit must not be processed.
+  size_t Claim(size_t pos, size_t claim_size) {
+    std::lock_guard<::boost::fibers::mutex> lk(mu_);
+    claimed_ = std::min(end_, std::max(claimed_, pos + claim_size));
+    return claimed_;
+  }
+
+  //! Splits off the second half of the unclaimed part if it is at least min_size bytes long.
+  //! Returns the tail range that should be processed by the caller.
+  bool SplitTail(size_t min_size, size_t* tail_start, size_t* tail_end) {
+    std::lock_guard<::boost::fibers::mutex> lk(mu_);
+    if (!enabled_ || end_ - claimed_ < min_size)
+      return false;
+
+    *tail_start = claimed_ + (end_ - claimed_) / 2;
+    *tail_end = end_;
+    end_ = *tail_start;
+    return true;
+  }
+
+  //! Returns the number of bytes that were not claimed yet. 0 for disabled ranges.
+  size_t unclaimed() const {
+    std::lock_guard<::boost::fibers::mutex> lk(mu_);
+    return enabled_ ? end_ - claimed_ : 0;
+  }
+
+ private:
+  mutable ::boost::fibers::mutex mu_;
+  const size_t start_;
+  size_t claimed_, end_;
+  bool enabled_ = false;
+};
+
 class Runner {
  public:
   virtual ~Runner();
@@ -39,10 +99,16 @@ class Runner {
 
   // Read file and fill queue. This function must be fiber-friendly.
   // Returns number of records processed.
+  // If range is set, its start offset must be honored. Runners that can process partial files
+  // enable the range and stop at its end.
   virtual size_t ProcessInputFile(const std::string& filename, pb::WireFormat::Type type,
-                                  RawSinkCb cb) = 0;
+                                  RawSinkCb cb, FileRange* range = nullptr) = 0;
 
   virtual void SaveFile(absl::string_view fn, absl::string_view data) = 0;
+
+  // Loads the file previously saved with SaveFile. Returns false if it does not exist
+  // and an error status if it could not be read.
+  virtual util::StatusObject<bool> LoadFile(absl::string_view fn, std::string* data) = 0;
 };
 
 }  // namespace mr3
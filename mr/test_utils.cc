@@ -35,7 +35,7 @@ RawContext* TestRunner::CreateContext() {
   CHECK(!op_->output().name().empty());
   last_out_name_ = op_->output().name();
   auto& res = out_tables_[last_out_name_];
-  if (!res)
+  if (!res || res->is_finished)  // The same output can be written by a subsequent run.
     res.reset(new OutputShardSet);
 
   return new TestContext(this, res.get());
@@ -65,7 +65,7 @@ void TestRunner::OperatorEnd(ShardFileMap* out_files) {
 
 // Read file and fill queue. This function must be fiber-friendly.
 size_t TestRunner::ProcessInputFile(const std::string& filename, pb::WireFormat::Type type,
-                                    RawSinkCb cb) {
+                                    RawSinkCb cb, FileRange* range) {
   auto it = input_fs_.find(filename);
   CHECK(it != input_fs_.end());
   for (const auto& str : it->second) {
@@ -82,6 +82,17 @@ const ShardedOutput& TestRunner::Table(const std::string& tb_name) const {
   return it->second->s_out;
 }
 
+util::StatusObject<bool> TestRunner::LoadFile(absl::string_view fn, std::string* data) {
+  if (!load_status.ok())
+    return load_status;
+
+  auto it = out_files_.find(fn);
+  if (it == out_files_.end())
+    return false;
+  *data = it->second;
+  return true;
+}
+
 const std::string& TestRunner::SavedFile(const std::string& fn) const {
   auto it = out_files_.find(fn);
   CHECK(it != out_files_.end()) << "Missing extra file " << fn;
@@ -90,7 +101,7 @@ const std::string& TestRunner::SavedFile(const std::string& fn) const {
 }
 
 size_t EmptyRunner::ProcessInputFile(const std::string& filename, pb::WireFormat::Type type,
-                                     RawSinkCb cb) {
+                                     RawSinkCb cb, FileRange* range) {
   CHECK(gen_fn);
   string val;
   unsigned cnt = 0;
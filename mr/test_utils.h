@@ -67,7 +67,7 @@ class TestRunner : public Runner {
 
   // Read file and fill queue. This function must be fiber-friendly.
   size_t ProcessInputFile(const std::string& filename, pb::WireFormat::Type type,
-                          RawSinkCb cb) final;
+                          RawSinkCb cb, FileRange* range) final;
 
   void OperatorStart(const pb::Operator* op) final { op_ = op; }
   void OperatorEnd(ShardFileMap* out_files) final;
@@ -80,11 +80,16 @@ class TestRunner : public Runner {
     out_files_[fn] = std::string(data);
   }
 
+  util::StatusObject<bool> LoadFile(absl::string_view fn, std::string* data) final;
+
   const ShardedOutput& Table(const std::string& tb_name) const;
   const std::string& SavedFile(const std::string& fn) const;
 
   std::atomic_int parse_errors{0}, write_calls{0};
 
+  // If set, LoadFile fails with this status.
+  util::Status load_status;
+
  private:
   const pb::Operator* op_ = nullptr;
   absl::flat_hash_map<std::string, std::vector<std::string>> input_fs_;
@@ -117,9 +122,10 @@ class EmptyRunner : public Runner {
   void OperatorEnd(ShardFileMap* out_files) final  {}
 
   size_t ProcessInputFile(const std::string& filename, pb::WireFormat::Type type,
-                          RawSinkCb cb) final;
+                          RawSinkCb cb, FileRange* range) final;
 
   void SaveFile(absl::string_view, absl::string_view) final {}
+  util::StatusObject<bool> LoadFile(absl::string_view, std::string*) final { return false; }
 };
 
 }  // namespace mr3
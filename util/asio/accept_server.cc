@@ -3,14 +3,23 @@
 //
 #include "util/asio/accept_server.h"
 
+#include <unistd.h>
+
 #include <boost/fiber/mutex.hpp>
+#include <deque>
 
 #include "base/logging.h"
 #include "base/walltime.h"
 #include "util/asio/io_context_pool.h"
+#include "util/asio/uring_proactor.h"
 #include "util/asio/yield.h"
+#include "util/fibers/event_count.h"
 #include "util/fibers/fibers_ext.h"
 
+#ifdef USE_URING
+#include <liburing.h>
+#endif
+
 namespace util {
 
 using namespace boost;
@@ -20,6 +29,108 @@ using asio::ip::tcp;
 using ListType = detail::slist<ConnectionHandler, ConnectionHandler::member_hook_t,
                                detail::constant_time_size<false>, detail::cache_last<false>>;
 
+// Multishot accept of the listener socket. The accepted sockets are queued until
+// AcceptConnection picks them.
+struct AcceptServer::UringAccept {
+  UringProactor* proactor;
+  UringOp op;
+  std::deque<int> fds;
+  fibers_ext::EventCount ev;
+
+  // The final result of the request, -errno.
+  int32_t res = 0;
+  bool armed = false, accepted = false, closed = false;
+
+  explicit UringAccept(UringProactor* p);
+  ~UringAccept();
+
+  // Returns the accepted socket or -1 with ec set.
+  int Next(int listen_fd, system::error_code* ec);
+
+  void Cancel();
+};
+
+#ifdef USE_URING
+
+AcceptServer::UringAccept::UringAccept(UringProactor* p) : proactor(p) {
+  op.cb = [this](int32_t cqe_res, uint32_t flags) {
+    if (cqe_res >= 0) {
+      fds.push_back(cqe_res);
+      accepted = true;
+    }
+
+    if ((flags & IORING_CQE_F_MORE) == 0) {
+      armed = false;
+      if (cqe_res < 0)
+        res = cqe_res;
+    }
+    ev.notifyAll();
+  };
+}
+
+AcceptServer::UringAccept::~UringAccept() {
+  DCHECK(!armed);
+  for (int fd : fds) {
+    close(fd);
+  }
+}
+
+int AcceptServer::UringAccept::Next(int listen_fd, system::error_code* ec) {
+  while (fds.empty()) {
+    if (closed) {
+      *ec = asio::error::operation_aborted;
+      return -1;
+    }
+
+    if (res < 0) {
+      if (res == -EAGAIN || res == -ECONNABORTED) {
+        // Transient errors, the request is rearmed below.
+        res = 0;
+        *ec = asio::error::try_again;
+      } else {
+        *ec = system::error_code(-res, system::system_category());
+      }
+      return -1;
+    }
+
+    if (!armed) {
+      armed = true;
+      proactor->Submit(&op, [&](io_uring_sqe* sqe) {
+        io_uring_prep_multishot_accept(sqe, listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+      });
+    }
+    ev.await([this] { return !fds.empty() || !armed || closed; });
+  }
+
+  int fd = fds.front();
+  fds.pop_front();
+  return fd;
+}
+
+void AcceptServer::UringAccept::Cancel() {
+  closed = true;
+  if (armed) {
+    proactor->CancelOp(&op);
+  }
+  ev.notifyAll();
+}
+
+#else
+
+AcceptServer::UringAccept::UringAccept(UringProactor* p) : proactor(p) {
+}
+
+AcceptServer::UringAccept::~UringAccept() = default;
+
+int AcceptServer::UringAccept::Next(int listen_fd, system::error_code* ec) {
+  LOG(FATAL) << "Built without io_uring support";
+  return -1;
+}
+
+void AcceptServer::UringAccept::Cancel() {
+}
+
+#endif
 
 AcceptServer::ListenerWrapper::ListenerWrapper(const endpoint& ep, IoContext* io_context,
                                                ListenerInterface* si)
@@ -34,6 +145,20 @@ AcceptServer::ListenerWrapper::ListenerWrapper(const endpoint& ep, IoContext* io
   port = acceptor.local_endpoint().port();
 }
 
+AcceptServer::ListenerWrapper::ListenerWrapper(ListenerWrapper&&) = default;
+
+AcceptServer::ListenerWrapper::~ListenerWrapper() {
+}
+
+void AcceptServer::ListenerWrapper::Close() {
+  acceptor.close();
+
+  // Closing the descriptor does not stop io_uring request that references it.
+  if (uring_accept) {
+    uring_accept->Cancel();
+  }
+}
+
 AcceptServer::AcceptServer(IoContextPool* pool)
     : pool_(pool), signals_(pool->GetNextContext().raw_context(), SIGINT, SIGTERM), ref_bc_(1) {
 
@@ -45,7 +170,7 @@ AcceptServer::AcceptServer(IoContextPool* pool)
     VLOG(1) << "Signal with ec " << ec << " " << ec.message();
     for (auto& l : listeners_) {
       if (l.acceptor.is_open()) {
-        asio::post(l.acceptor.get_executor(), [acc = &l.acceptor]() mutable { acc->close(); });
+        asio::post(l.acceptor.get_executor(), [wrapper = &l] { wrapper->Close(); });
       }
     }
 
@@ -105,6 +230,15 @@ void AcceptServer::AcceptInIOThread(ListenerWrapper* wrapper) {
   system::error_code ec;
   util::ConnectionHandler* handler = nullptr;
 
+  UringProactor* proactor = UringProactor::NetThisThread();
+  if (proactor && proactor->multishot_accept() && wrapper->acceptor.is_open()) {
+    // io_uring fails the accept on non-blocking listener instead of waiting for a connection.
+    wrapper->acceptor.native_non_blocking(false, ec);
+    if (!ec) {
+      wrapper->uring_accept.reset(new UringAccept(proactor));
+    }
+  }
+
   // We release intrusive pointer in our thread by delegating the code to accpt_cntxt.
   // Please note that since we update clist in the same thread, we do not need mutex
   // to protect the state.
@@ -153,6 +287,13 @@ void AcceptServer::AcceptInIOThread(ListenerWrapper* wrapper) {
     LOG(WARNING) << ": caught exception : " << ex.what();
   }
 
+  if (wrapper->uring_accept) {
+    UringAccept* ua = wrapper->uring_accept.get();
+    ua->Cancel();
+    ua->ev.await([ua] { return !ua->armed; });
+    wrapper->uring_accept.reset();
+  }
+
   wrapper->listener->PreShutdown();
 
   if (!clist_ptr->clist.empty()) {
@@ -198,7 +339,22 @@ auto AcceptServer::AcceptConnection(ListenerWrapper* wrapper) -> AcceptResult {
   system::error_code ec;
   tcp::socket sock(io_cntx.raw_context());
 
-  wrapper->acceptor.async_accept(sock, fibers_ext::yield[ec]);
+  if (UringAccept* ua = wrapper->uring_accept.get()) {
+    int fd = ua->Next(wrapper->acceptor.native_handle(), &ec);
+    if (ec == std::errc::invalid_argument && !ua->accepted) {
+      // The kernel does not support multishot accept, we fall back to asio.
+      ua->proactor->DisableMultishotAccept();
+      wrapper->uring_accept.reset();
+      return AcceptResult(nullptr, asio::error::try_again);
+    }
+    if (!ec) {
+      sock.assign(tcp::v4(), fd, ec);
+      if (ec)
+        close(fd);
+    }
+  } else {
+    wrapper->acceptor.async_accept(sock, fibers_ext::yield[ec]);
+  }
   if (!ec && !sock.is_open())
     ec = asio::error::try_again;
   if (ec)
@@ -47,6 +47,7 @@ class AcceptServer {
   using acceptor = ::boost::asio::ip::tcp::acceptor;
   using endpoint = ::boost::asio::ip::tcp::endpoint;
   struct ListenerWrapper;
+  struct UringAccept;
 
   void AcceptInIOThread(ListenerWrapper* listener);
 
@@ -65,8 +66,16 @@ class AcceptServer {
     ListenerInterface* listener;
     unsigned short port;
 
+    // Multishot accept, set if the listener thread runs the io_uring backend.
+    std::unique_ptr<UringAccept> uring_accept;
+
     ListenerWrapper(const endpoint& ep, IoContext* io_context,
                     ListenerInterface* si);
+    ListenerWrapper(ListenerWrapper&&);
+    ~ListenerWrapper();
+
+    // Must be called from the listener thread.
+    void Close();
   };
 
   ::boost::asio::signal_set signals_;
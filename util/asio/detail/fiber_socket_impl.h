@@ -3,15 +3,30 @@
 //
 #pragma once
 
+#include <sys/uio.h>
+
 #include <boost/asio/ip/tcp.hpp>
 
 #include "util/asio/yield.h"
 
 namespace util {
 class IoContext;
+class UringProactor;
 
 namespace detail {
 
+// Fills dest with up to max buffers of bufs. Returns the number of filled entries.
+template <typename BS> unsigned ToIoVec(const BS& bufs, iovec* dest, unsigned max) {
+  using namespace boost;
+  unsigned n = 0;
+  auto end = asio::buffer_sequence_end(bufs);
+  for (auto it = asio::buffer_sequence_begin(bufs); it != end && n < max; ++it) {
+    asio::const_buffer buf(*it);
+    dest[n++] = iovec{const_cast<void*>(buf.data()), buf.size()};
+  }
+  return n;
+}
+
 class FiberSocketImpl {
  public:
   using error_code = ::boost::system::error_code;
@@ -75,10 +90,24 @@ class FiberSocketImpl {
 
   void ClientWorker();
 
+  // Returns the proactor of the socket thread if the server socket should use io_uring.
+  // Client sockets are served by the asio reactor.
+  UringProactor* NetProactor() const;
+
+  size_t UringReadSome(UringProactor* proactor, const iovec* v, unsigned len, error_code& ec);
+  size_t UringWriteSome(UringProactor* proactor, const iovec* v, unsigned len, error_code& ec);
+
+  // Multishot receive state.
+  struct UringRecv;
+  size_t CopyRecvChunks(const iovec* v, unsigned len);
+  void StopUringRecv();
+
   void WakeWorker();
   error_code Reconnect(const std::string& hname, const std::string& service);
   void SetStatus(const error_code& ec, const char* where);
 
+  static constexpr unsigned kMaxIoVec = 16;
+
   error_code status_;
 
   // socket.is_open() is unreliable and does not reflect close() status even if is called
@@ -97,6 +126,8 @@ class FiberSocketImpl {
   // Stuff related to client sockets.
   struct ClientData;
   std::unique_ptr<ClientData> clientsock_data_;
+
+  std::unique_ptr<UringRecv> uring_recv_;
 };
 
 template <typename MBS> size_t FiberSocketImpl::read_some(const MBS& bufs, error_code& ec) {
@@ -122,11 +153,17 @@ template <typename MBS> size_t FiberSocketImpl::read_some(const MBS& bufs, error
   size_t user_size = asio::buffer_size(bufs);
   auto new_seq = make_buffer_seq(bufs, asio::mutable_buffer(rbuf_.get(), rbuf_size_));
 
-  size_t read_size = sock_.read_some(new_seq, ec);
-  if (ec == asio::error::would_block) {
-    read_state_ = READ_ACTIVE;
-    read_size = sock_.async_read_some(new_seq, fibers_ext::yield[ec]);
-    read_state_ = READ_IDLE;
+  size_t read_size;
+  if (UringProactor* proactor = NetProactor()) {
+    iovec v[kMaxIoVec];
+    read_size = UringReadSome(proactor, v, ToIoVec(new_seq, v, kMaxIoVec), ec);
+  } else {
+    read_size = sock_.read_some(new_seq, ec);
+    if (ec == asio::error::would_block) {
+      read_state_ = READ_ACTIVE;
+      read_size = sock_.async_read_some(new_seq, fibers_ext::yield[ec]);
+      read_state_ = READ_IDLE;
+    }
   }
   if (ec) {
     SetStatus(ec, "read_some");
@@ -142,6 +179,11 @@ template <typename MBS> size_t FiberSocketImpl::read_some(const MBS& bufs, error
 }
 
 template <typename BS> size_t FiberSocketImpl::write_some(const BS& bufs, error_code& ec) {
+  if (UringProactor* proactor = NetProactor()) {
+    iovec v[kMaxIoVec];
+    return UringWriteSome(proactor, v, ToIoVec(bufs, v, kMaxIoVec), ec);
+  }
+
   size_t res = sock_.write_some(bufs, ec);
   if (ec == ::boost::asio::error::would_block) {
     return sock_.async_write_some(bufs, fibers_ext::yield[ec]);
@@ -5,12 +5,18 @@
 
 #include <boost/asio/connect.hpp>
 #include <chrono>
+#include <deque>
 
 #include "absl/base/attributes.h"
 #include "base/logging.h"
 #include "util/asio/io_context.h"
+#include "util/asio/uring_proactor.h"
 #include "util/fibers/event_count.h"
 
+#ifdef USE_URING
+#include <liburing.h>
+#endif
+
 #define VSOCK(verbosity) VLOG(verbosity) << "sock[" << native_handle() << "] "
 #define DVSOCK(verbosity) DVLOG(verbosity) << "sock[" << native_handle() << "] "
 
@@ -42,6 +48,80 @@ struct FiberSocketImpl::ClientData {
   }
 };
 
+#ifdef USE_URING
+
+// Multishot receive of a server socket. The kernel picks the buffers from the provided buffer
+// ring of the proactor and we hold them until read_some copies them out.
+struct FiberSocketImpl::UringRecv {
+  struct Chunk {
+    uint16_t bid;
+    uint32_t len, consumed;
+  };
+
+  UringProactor* proactor;
+  UringOp op;
+  std::deque<Chunk> chunks;
+  fibers_ext::EventCount ev;
+
+  // The final result of the request: 0 on EOF, -errno on failure.
+  int32_t res = 1;
+  bool armed = false, received = false, starved = false;
+
+  explicit UringRecv(UringProactor* p);
+
+  ~UringRecv() { DCHECK(!armed && chunks.empty()); }
+
+  void Arm(int fd);
+};
+
+FiberSocketImpl::UringRecv::UringRecv(UringProactor* p) : proactor(p) {
+  op.cb = [this](int32_t cqe_res, uint32_t flags) {
+    if (cqe_res > 0) {
+      DCHECK(flags & IORING_CQE_F_BUFFER);
+      chunks.push_back(Chunk{uint16_t(flags >> IORING_CQE_BUFFER_SHIFT), uint32_t(cqe_res), 0});
+      received = true;
+    }
+
+    if ((flags & IORING_CQE_F_MORE) == 0) {
+      armed = false;
+
+      // The kernel stops the request when it runs out of the provided buffers.
+      if (cqe_res == -ENOBUFS)
+        starved = true;
+      else if (cqe_res <= 0)
+        res = cqe_res;
+    }
+    ev.notifyAll();
+  };
+}
+
+void FiberSocketImpl::UringRecv::Arm(int fd) {
+  armed = true;
+  proactor->Submit(&op, [&](io_uring_sqe* sqe) {
+    io_uring_prep_recv_multishot(sqe, fd, nullptr, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = proactor->buf_group();
+  });
+}
+
+static size_t UringResult(int32_t res, bool eof_on_zero, system::error_code& ec) {
+  if (res > 0)
+    return res;
+  if (res == 0) {
+    if (eof_on_zero)
+      ec = asio::error::eof;
+    return 0;
+  }
+  ec = system::error_code(-res, system::system_category());
+  return 0;
+}
+
+#else
+
+struct FiberSocketImpl::UringRecv {};
+
+#endif
+
 FiberSocketImpl::~FiberSocketImpl() {
   VLOG(1) << "FiberSocketImpl::~FiberSocketImpl";
 
@@ -77,6 +157,7 @@ void FiberSocketImpl::Shutdown(error_code& ec) {
     is_open_ = false;
     sock_.cancel(ec);
     sock_.shutdown(socket_t::shutdown_both, ec);
+    StopUringRecv();
     VSOCK(1) << "Sock Shutdown ";
     if (clientsock_data_) {
       DVSOCK(1) << "Sock Closed";
@@ -96,6 +177,138 @@ void FiberSocketImpl::Shutdown(error_code& ec) {
   }
 }
 
+UringProactor* FiberSocketImpl::NetProactor() const {
+  return clientsock_data_ ? nullptr : UringProactor::NetThisThread();
+}
+
+#ifdef USE_URING
+
+size_t FiberSocketImpl::UringReadSome(UringProactor* proactor, const iovec* v, unsigned len,
+                                      error_code& ec) {
+  int fd = sock_.native_handle();
+
+  if (!uring_recv_ && proactor->multishot_recv()) {
+    uring_recv_.reset(new UringRecv(proactor));
+  }
+
+  if (uring_recv_) {
+    UringRecv* recv = uring_recv_.get();
+    while (recv->chunks.empty() && !recv->starved) {
+      if (recv->res <= 0) {
+        if (recv->res == -EINVAL && !recv->received) {
+          // The kernel does not support multishot receive, we switch to single shot requests.
+          proactor->DisableMultishotRecv();
+          uring_recv_.reset();
+          break;
+        }
+        return UringResult(recv->res, true, ec);
+      }
+      if (!recv->armed) {
+        recv->Arm(fd);
+      }
+      recv->ev.await([recv] { return !recv->chunks.empty() || !recv->armed; });
+    }
+
+    if (uring_recv_) {
+      if (!recv->chunks.empty())
+        return CopyRecvChunks(v, len);
+
+      // Other connections hold all the provided buffers. Rather than rearming into the empty
+      // ring, we receive directly into the caller buffers and rearm on the next read.
+      recv->starved = false;
+    }
+  }
+
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = const_cast<iovec*>(v);
+  msg.msg_iovlen = len;
+
+  int32_t res =
+      proactor->Await([&](io_uring_sqe* sqe) { io_uring_prep_recvmsg(sqe, fd, &msg, 0); });
+  return UringResult(res, true, ec);
+}
+
+size_t FiberSocketImpl::CopyRecvChunks(const iovec* v, unsigned len) {
+  UringRecv* recv = uring_recv_.get();
+  size_t copied = 0;
+  unsigned index = 0;
+  size_t offset = 0;  // offset in v[index].
+
+  while (index < len && !recv->chunks.empty()) {
+    UringRecv::Chunk& chunk = recv->chunks.front();
+    size_t sz = std::min<size_t>(chunk.len - chunk.consumed, v[index].iov_len - offset);
+    const uint8_t* src = recv->proactor->ProvidedBuf(chunk.bid) + chunk.consumed;
+    memcpy(static_cast<uint8_t*>(v[index].iov_base) + offset, src, sz);
+
+    copied += sz;
+    chunk.consumed += sz;
+    offset += sz;
+
+    if (chunk.consumed == chunk.len) {
+      recv->proactor->ReturnProvidedBuf(chunk.bid);
+      recv->chunks.pop_front();
+    }
+    if (offset == v[index].iov_len) {
+      ++index;
+      offset = 0;
+    }
+  }
+  return copied;
+}
+
+void FiberSocketImpl::StopUringRecv() {
+  UringRecv* recv = uring_recv_.get();
+  if (!recv)
+    return;
+
+  // The request references the socket state, therefore we wait for its final completion.
+  if (recv->armed) {
+    recv->proactor->CancelOp(&recv->op);
+    recv->ev.await([recv] { return !recv->armed; });
+  }
+  if (recv->res > 0)
+    recv->res = -ECANCELED;
+
+  // The socket may be destroyed in another thread, so we return the buffers here.
+  for (const UringRecv::Chunk& c : recv->chunks) {
+    recv->proactor->ReturnProvidedBuf(c.bid);
+  }
+  recv->chunks.clear();
+}
+
+size_t FiberSocketImpl::UringWriteSome(UringProactor* proactor, const iovec* v, unsigned len,
+                                       error_code& ec) {
+  int fd = sock_.native_handle();
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = const_cast<iovec*>(v);
+  msg.msg_iovlen = len;
+
+  int32_t res = proactor->Await(
+      [&](io_uring_sqe* sqe) { io_uring_prep_sendmsg(sqe, fd, &msg, MSG_NOSIGNAL); });
+  return UringResult(res, false, ec);
+}
+
+#else
+
+size_t FiberSocketImpl::UringReadSome(UringProactor* proactor, const iovec* v, unsigned len,
+                                      error_code& ec) {
+  LOG(FATAL) << "Built without io_uring support";
+  return 0;
+}
+
+size_t FiberSocketImpl::UringWriteSome(UringProactor* proactor, const iovec* v, unsigned len,
+                                       error_code& ec) {
+  LOG(FATAL) << "Built without io_uring support";
+  return 0;
+}
+
+void FiberSocketImpl::StopUringRecv() {
+}
+
+#endif
+
 void FiberSocketImpl::SetStatus(const error_code& ec, const char* where) {
   status_ = ec;
   if (ec) {
@@ -12,8 +12,11 @@
 #include "base/logging.h"
 
 #include "util/asio/asio_utils.h"
+#include "util/asio/uring_proactor.h"
 #include "util/http/http_testing.h"
 
+DECLARE_bool(io_context_uring);
+
 namespace util {
 
 using namespace boost;
@@ -141,4 +144,52 @@ TEST_F(SocketTest, Reconnect) {
   });
 }
 
+// The server runs io_uring backend. The tests are skipped if io_uring is not available.
+class UringSocketTest : public HttpBaseTest {
+ protected:
+  void SetUp() final {
+    FLAGS_io_context_uring = true;
+    HttpBaseTest::SetUp();
+    FLAGS_io_context_uring = false;
+  }
+};
+
+TEST_F(UringSocketTest, Requests) {
+  bool uring = pool_->GetNextContext().AwaitSafe(
+      [] { return UringProactor::NetThisThread() != nullptr; });
+  if (!uring) {
+    LOG(WARNING) << "io_uring is not available, skipping the test";
+    return;
+  }
+
+  string body(1 << 18, 'a');
+  listener_.RegisterCb("/large", false,
+                       [&](const http::QueryArgs& args, HttpHandler::SendFunction* send) {
+                         StringResponse resp = MakeStringResponse(h2::status::ok);
+                         resp.body() = body;
+                         return send->Invoke(std::move(resp));
+                       });
+
+  FiberSyncSocket sock("localhost", std::to_string(port_), &pool_->GetNextContext());
+  system::error_code ec = sock.ClientWaitToConnect(1000);
+  ASSERT_FALSE(ec) << ec.message();
+
+  sock.context().AwaitSafe([&] {
+    for (unsigned i = 0; i < 10; ++i) {
+      h2::request<h2::string_body> req{h2::verb::get, i % 2 ? "/large" : "/", 11};
+      h2::write(sock, req, ec);
+      ASSERT_FALSE(ec) << ec.message();
+
+      beast::flat_buffer buffer;
+      h2::response<h2::string_body> resp;
+      h2::read(sock, buffer, resp, ec);
+      ASSERT_FALSE(ec) << ec.message();
+      EXPECT_EQ(h2::status::ok, resp.result());
+      if (i % 2) {
+        EXPECT_EQ(body, resp.body());
+      }
+    }
+  });
+}
+
 }  // namespace util
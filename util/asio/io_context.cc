@@ -5,7 +5,10 @@
 #include <boost/asio/steady_timer.hpp>
 #include <boost/fiber/mutex.hpp>
 #include <boost/fiber/operations.hpp>
+#include <boost/fiber/detail/spinlock.hpp>
 #include <boost/fiber/scheduler.hpp>
+#include <deque>
+#include <mutex>
 
 #include "base/logging.h"
 #include "base/walltime.h"
@@ -32,6 +35,55 @@ class IoFiberPropertiesMgr {
   void set_awaken_ts(uint64_t ts) { io_props.awaken_ts_ = ts; }
 };
 
+struct FiberStealGroup::Queue {
+  fibers::detail::spinlock lock;
+  std::deque<fibers::context*> fibers;  // guarded by lock, detached from their scheduler.
+
+  std::atomic_size_t depth{0};
+  std::atomic<uint64_t> steals{0};
+
+  // Set by the thread when it blocks on IO with nothing to run. Both idle and depth are accessed
+  // with sequential consistency, so either the thread that queues a surplus sees the idle
+  // thread or the idle thread sees the surplus before it blocks.
+  std::atomic_bool idle{false};
+  asio::io_context* io_context = nullptr;
+
+  size_t Push(fibers::context* ctx) {
+    std::lock_guard<fibers::detail::spinlock> lk(lock);
+    fibers.push_back(ctx);
+    depth.store(fibers.size());
+    return fibers.size();
+  }
+
+  fibers::context* Pop() {
+    std::lock_guard<fibers::detail::spinlock> lk(lock);
+    if (fibers.empty())
+      return nullptr;
+    fibers::context* ctx = fibers.front();
+    fibers.pop_front();
+    depth.store(fibers.size(), std::memory_order_relaxed);
+    return ctx;
+  }
+};
+
+FiberStealGroup::FiberStealGroup(unsigned size) : queues_(new Queue[size]), size_(size) {}
+
+FiberStealGroup::~FiberStealGroup() {
+  for (unsigned i = 0; i < size_; ++i) {
+    DCHECK(queues_[i].fibers.empty()) << "Thread " << i << " left migratable fibers";
+  }
+}
+
+uint64_t FiberStealGroup::steal_count(unsigned index) const {
+  return queues_[index].steals.load(std::memory_order_relaxed);
+}
+
+size_t FiberStealGroup::queue_depth(unsigned index) const {
+  return queues_[index].depth.load(std::memory_order_relaxed);
+}
+
+auto FiberStealGroup::queue(unsigned index) -> Queue* { return &queues_[index]; }
+
 namespace {
 constexpr unsigned MAIN_NICE_LEVEL = 0;
 constexpr unsigned DISPATCH_LEVEL = IoFiberProperties::NUM_NICE_LEVELS;
@@ -61,13 +113,32 @@ class AsioScheduler final : public fibers::algo::algorithm_with_properties<IoFib
   fibers::context* main_loop_ctx_ = nullptr;
   chrono::steady_clock::time_point suspend_tp_ = STEADY_PT_MAX;
 
-  enum : uint8_t { LOOP_RUN_ONE = 1, MAIN_LOOP_SUSPEND = 2, MAIN_LOOP_FINISHED = 4 };
+  enum : uint8_t {
+    LOOP_RUN_ONE = 1,
+    MAIN_LOOP_SUSPEND = 2,
+    MAIN_LOOP_FINISHED = 4,
+    // The dispatcher must run before the main loop blocks, see MainLoop(). Set only with work
+    // stealing.
+    DISPATCH_PENDING = 8,
+  };
   uint8_t mask_ = 0;
 
+  // Work stealing, null if disabled.
+  FiberStealGroup* steal_group_ = nullptr;
+  FiberStealGroup::Queue* steal_q_ = nullptr;
+  unsigned steal_index_ = 0;
+
  public:
   //[asio_rr_ctor
-  AsioScheduler(const std::shared_ptr<asio::io_context>& io_svc)
-      : io_context_(io_svc), suspend_timer_(new asio::steady_timer(*io_svc)) {}
+  AsioScheduler(const std::shared_ptr<asio::io_context>& io_svc, FiberStealGroup* steal_group,
+                unsigned steal_index)
+      : io_context_(io_svc), suspend_timer_(new asio::steady_timer(*io_svc)),
+        steal_group_(steal_group), steal_index_(steal_index) {
+    if (steal_group) {
+      steal_q_ = steal_group->queue(steal_index);
+      steal_q_->io_context = io_svc.get();
+    }
+  }
 
   ~AsioScheduler();
 
@@ -101,7 +172,9 @@ class AsioScheduler final : public fibers::algo::algorithm_with_properties<IoFib
     awakened(ctx, props);
   }
 
-  bool has_ready_fibers() const noexcept final { return 0 < ready_cnt_; }
+  bool has_ready_fibers() const noexcept final {
+    return 0 < ready_cnt_ || (steal_q_ && steal_q_->depth.load(std::memory_order_relaxed));
+  }
 
   // suspend_until halts the thread in case there are no active fibers to run on it.
   // This is done by dispatcher fiber.
@@ -148,6 +221,7 @@ class AsioScheduler final : public fibers::algo::algorithm_with_properties<IoFib
               << ", abstime: " << abs_time.time_since_epoch().count();
     }
     CHECK_EQ(0, mask_ & LOOP_RUN_ONE) << "Deadlock detected";
+    mask_ &= ~DISPATCH_PENDING;
 
     // Awake main_loop_ctx_ in WaitTillFibersSuspend().
     main_loop_ctx_->get_scheduler()->schedule(main_loop_ctx_);
@@ -175,6 +249,17 @@ class AsioScheduler final : public fibers::algo::algorithm_with_properties<IoFib
     }
   }
   void WaitTillFibersSuspend();
+
+  // Wakes main_loop_ctx_ if the worker fibers ran for too long without yielding to IO.
+  void MaybeWakeMainLoop(unsigned nice, uint64_t now);
+
+  // Queues a ready migratable fiber and wakes an idle thread if we have a surplus.
+  void PushMigratable(fibers::context* ctx);
+
+  // Pops a migratable fiber from our queue or steals one from the deepest queue of the group.
+  fibers::context* PopMigratable();
+
+  bool CanSteal() const;
 };
 
 AsioScheduler::~AsioScheduler() {}
@@ -184,7 +269,12 @@ void AsioScheduler::MainLoop() {
   main_loop_ctx_ = fibers::context::active();
 
   while (!io_cntx->stopped()) {
-    if (has_ready_fibers()) {
+    // The dispatcher readies the sleeping and the remotely awakened fibers and arms the timer of
+    // the sleeping ones. Without work stealing, the main loop blocks only after the dispatcher
+    // ran out of fibers. A migratable fiber, however, may be stolen before it runs, so we
+    // might have no ready fibers while the dispatcher did not finish its round.
+    // DISPATCH_PENDING is set only by the schedulers that steal.
+    if (has_ready_fibers() || (mask_ & DISPATCH_PENDING)) {
       while (io_cntx->poll())
         ;
 
@@ -197,16 +287,29 @@ void AsioScheduler::MainLoop() {
       continue;
     }
 
+    if (steal_q_) {
+      steal_q_->idle.store(true);
+
+      if (CanSteal()) {
+        // pick_next steals the fiber once we suspend.
+        steal_q_->idle.store(false);
+        WaitTillFibersSuspend();
+        continue;
+      }
+    }
+
     // run one handler inside io_context
     // if no handler available, blocks this thread
     DVLOG(2) << "MainLoop::RunOneStart";
     mask_ |= LOOP_RUN_ONE;
-    if (!io_cntx->run_one()) {
-      mask_ &= ~LOOP_RUN_ONE;
+    bool ran = io_cntx->run_one();
+    mask_ &= ~LOOP_RUN_ONE;
+    if (steal_q_)
+      steal_q_->idle.store(false, std::memory_order_relaxed);
+
+    if (!ran)
       break;
-    }
     DVLOG(2) << "MainLoop::RunOneEnd";
-    mask_ &= ~LOOP_RUN_ONE;
   }
 
   VLOG(1) << "MainLoop exited";
@@ -250,6 +353,18 @@ void AsioScheduler::WaitTillFibersSuspend() {
 void AsioScheduler::awakened(fibers::context* ctx, IoFiberProperties& props) noexcept {
   DCHECK(!ctx->ready_is_linked());
 
+  if (steal_q_ && props.migratable() && !ctx->is_context(fibers::type::pinned_context)) {
+    uint64_t now = base::GetMonotonicMicrosFast();
+    IoFiberPropertiesMgr{&props}.set_awaken_ts(now);
+    MaybeWakeMainLoop(props.nice_level(), now);
+
+    // The fiber is detached while it waits in the queue, so any thread of the group can run it.
+    ctx->detach();
+    PushMigratable(ctx);
+    mask_ |= DISPATCH_PENDING;
+    return;
+  }
+
   ready_queue_type* rq;
   if (ctx->is_context(fibers::type::dispatcher_context)) {
     rq = rqueue_arr_ + DISPATCH_LEVEL;
@@ -265,27 +380,7 @@ void AsioScheduler::awakened(fibers::context* ctx, IoFiberProperties& props) noe
 
     uint64_t now = base::GetMonotonicMicrosFast();
     IoFiberPropertiesMgr{&props}.set_awaken_ts(now);
-
-    // In addition, we wake main_loop_ctx_ is too many switches ocurred
-    // while it was suspended.
-    // It's a convenient place to wake because we are sure there is a least
-    // one ready worker in addition to main_loop_ctx_ and it won't stuck in
-    // run_one().
-    // * main_loop_ctx_->ready_is_linked() could be linked already in the previous invocations
-    // of awakened before pick_next resumed it.
-    if (nice > MAIN_NICE_LEVEL && (mask_ & MAIN_LOOP_SUSPEND) && switch_cnt_ > 0 &&
-        !main_loop_ctx_->ready_is_linked()) {
-      if (now - main_suspend_ts_ > 5000) {  // 5ms {
-        DVLOG(2) << "Wake MAIN_LOOP_SUSPEND " << fibers_ext::short_id(main_loop_ctx_)
-                 << ", r/s: " << ready_cnt_ << "/" << switch_cnt_;
-
-        switch_cnt_ = 0;
-        ++ready_cnt_;
-        main_loop_ctx_->ready_link(rqueue_arr_[MAIN_NICE_LEVEL]);
-        last_nice_level_ = MAIN_NICE_LEVEL;
-        ++main_loop_wakes_;
-      }
-    }
+    MaybeWakeMainLoop(nice, now);
 
     DVLOG(2) << "Ready: " << fibers_ext::short_id(ctx) << "/" << props.name()
              << ", nice/rdc: " << nice << "/" << ready_cnt_;
@@ -294,6 +389,85 @@ void AsioScheduler::awakened(fibers::context* ctx, IoFiberProperties& props) noe
   ctx->ready_link(*rq); /*< fiber, enqueue on ready queue >*/
 }
 
+void AsioScheduler::MaybeWakeMainLoop(unsigned nice, uint64_t now) {
+  // In addition, we wake main_loop_ctx_ is too many switches ocurred
+  // while it was suspended.
+  // It's a convenient place to wake because we are sure there is a least
+  // one ready worker in addition to main_loop_ctx_ and it won't stuck in
+  // run_one(). A migratable worker might be stolen meanwhile, see DISPATCH_PENDING.
+  // * main_loop_ctx_->ready_is_linked() could be linked already in the previous invocations
+  // of awakened before pick_next resumed it.
+  if (nice > MAIN_NICE_LEVEL && (mask_ & MAIN_LOOP_SUSPEND) && switch_cnt_ > 0 &&
+      !main_loop_ctx_->ready_is_linked()) {
+    if (now - main_suspend_ts_ > 5000) {  // 5ms {
+      DVLOG(2) << "Wake MAIN_LOOP_SUSPEND " << fibers_ext::short_id(main_loop_ctx_)
+               << ", r/s: " << ready_cnt_ << "/" << switch_cnt_;
+
+      switch_cnt_ = 0;
+      ++ready_cnt_;
+      main_loop_ctx_->ready_link(rqueue_arr_[MAIN_NICE_LEVEL]);
+      last_nice_level_ = MAIN_NICE_LEVEL;
+      if (steal_q_)
+        mask_ |= DISPATCH_PENDING;
+      ++main_loop_wakes_;
+    }
+  }
+}
+
+void AsioScheduler::PushMigratable(fibers::context* ctx) {
+  // A single fiber is run by this thread once the pinned fibers yield, we wake an idle thread
+  // only if there is more to run.
+  if (steal_q_->Push(ctx) < 2)
+    return;
+
+  unsigned size = steal_group_->size();
+  for (unsigned i = 1; i < size; ++i) {
+    FiberStealGroup::Queue* q = steal_group_->queue((steal_index_ + i) % size);
+    bool idle = true;
+    if (q->idle.compare_exchange_strong(idle, false)) {
+      // Breaks the thread from run_one(). Its main loop steals before it blocks again.
+      asio::post(*q->io_context, [] {});
+      break;
+    }
+  }
+}
+
+fibers::context* AsioScheduler::PopMigratable() {
+  fibers::context* ctx = steal_q_->Pop();
+
+  // We do not steal during the shutdown, since we could not run the fibers that we steal.
+  if (!ctx && (mask_ & MAIN_LOOP_FINISHED) == 0) {
+    FiberStealGroup::Queue* victim = nullptr;
+    size_t max_depth = 0;
+    for (unsigned i = 0; i < steal_group_->size(); ++i) {
+      FiberStealGroup::Queue* q = steal_group_->queue(i);
+      size_t depth = q->depth.load(std::memory_order_relaxed);
+      if (q != steal_q_ && depth > max_depth) {
+        max_depth = depth;
+        victim = q;
+      }
+    }
+    if (victim && (ctx = victim->Pop())) {
+      steal_q_->steals.fetch_add(1, std::memory_order_relaxed);
+      RAW_VLOG(2, "Stole %x", fibers_ext::short_id(ctx));
+    }
+  }
+
+  if (ctx) {
+    fibers::context::active()->attach(ctx);
+  }
+  return ctx;
+}
+
+bool AsioScheduler::CanSteal() const {
+  for (unsigned i = 0; i < steal_group_->size(); ++i) {
+    FiberStealGroup::Queue* q = steal_group_->queue(i);
+    if (q != steal_q_ && q->depth.load() > 0)
+      return true;
+  }
+  return false;
+}
+
 fibers::context* AsioScheduler::pick_next() noexcept {
   fibers::context* ctx(nullptr);
   using fibers_ext::short_id;
@@ -350,6 +524,17 @@ fibers::context* AsioScheduler::pick_next() noexcept {
 
   DCHECK_EQ(0, ready_cnt_);
 
+  // Migratable fibers run after the pinned ones.
+  if (steal_q_ && (ctx = PopMigratable())) {
+    IoFiberPropertiesMgr{ctx->get_properties()}.set_resume_ts(now);
+    if (mask_ & MAIN_LOOP_SUSPEND)
+      ++switch_cnt_;
+    mask_ |= DISPATCH_PENDING;
+
+    RAW_VLOG(3, "pick_next migratable: %x", short_id(ctx));
+    return ctx;
+  }
+
   auto& dispatch_q = rqueue_arr_[DISPATCH_LEVEL];
   if (!dispatch_q.empty()) {
     fibers::context* ctx = &dispatch_q.front();
@@ -406,10 +591,11 @@ void IoFiberProperties::SetNiceLevel(unsigned p) {
   }
 }
 
-void IoContext::StartLoop(BlockingCounter* bc) {
+void IoContext::StartLoop(BlockingCounter* bc, FiberStealGroup* steal_group,
+                          unsigned steal_index) {
   // I do not use use_scheduling_algorithm because I want to retain access to the scheduler.
   // fibers::use_scheduling_algorithm<AsioScheduler>(io_ptr);
-  AsioScheduler* scheduler = new AsioScheduler(context_ptr_);
+  AsioScheduler* scheduler = new AsioScheduler(context_ptr_, steal_group, steal_index);
   fibers::context::active()->get_scheduler()->set_algo(scheduler);
   this_fiber::properties<IoFiberProperties>().set_name("io_loop");
   this_fiber::properties<IoFiberProperties>().SetNiceLevel(MAIN_NICE_LEVEL);
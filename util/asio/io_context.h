@@ -7,6 +7,7 @@
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/post.hpp>
 
+#include <memory>
 #include <thread>
 
 #include "util/fibers/fibers_ext.h"
@@ -43,10 +44,51 @@ class IoFiberProperties : public boost::fibers::fiber_properties {
 
   uint64_t awaken_ts() const { return awaken_ts_; }
 
+  //! Migratable fibers may be stolen by idle threads of IoContextPool that enabled work
+  //! stealing, see FiberStealGroup. Only compute fibers should be marked: a migratable fiber
+  //! must not use thread-local state or objects bound to its IoContext, like sockets and timers.
+  //! Should be called by the fiber itself.
+  void set_migratable(bool m) { migratable_ = m; }
+
+  bool migratable() const { return migratable_; }
+
  private:
   std::string name_;
   uint64_t resume_ts_ = 0, awaken_ts_ = 0;
   unsigned nice_;
+  bool migratable_ = false;
+};
+
+/*! @brief Shares the migratable fibers between IoContext threads.
+ *
+ * Each thread queues its ready migratable fibers separately from the pinned ones and runs them
+ * after the pinned fibers. A thread that has nothing else to run steals from the deepest queue
+ * of the group. When a thread queues more migratable fibers than it can run next, it wakes an
+ * idle thread of the group. The pinned fibers never leave their thread.
+ */
+class FiberStealGroup {
+ public:
+  struct Queue;
+
+  explicit FiberStealGroup(unsigned size);
+  ~FiberStealGroup();
+
+  FiberStealGroup(const FiberStealGroup&) = delete;
+  void operator=(const FiberStealGroup&) = delete;
+
+  unsigned size() const { return size_; }
+
+  //! Number of fibers that thread index stole from the other threads.
+  uint64_t steal_count(unsigned index) const;
+
+  //! Number of ready migratable fibers in the queue of thread index.
+  size_t queue_depth(unsigned index) const;
+
+  Queue* queue(unsigned index);
+
+ private:
+  std::unique_ptr<Queue[]> queues_;
+  unsigned size_;
 };
 
 namespace asio_ext {
@@ -166,7 +208,8 @@ class IoContext {
   }
 
  private:
-  void StartLoop(fibers_ext::BlockingCounter* bc);
+  void StartLoop(fibers_ext::BlockingCounter* bc, FiberStealGroup* steal_group = nullptr,
+                 unsigned steal_index = 0);
 
   using CancellablePair = std::pair<std::unique_ptr<Cancellable>, ::boost::fibers::fiber>;
 
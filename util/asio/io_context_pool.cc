@@ -9,19 +9,27 @@
 #include <boost/fiber/mutex.hpp>
 #include <boost/fiber/scheduler.hpp>
 
+#include "absl/strings/str_cat.h"
 #include "base/logging.h"
 #include "base/pthread_utils.h"
+#include "util/asio/uring_proactor.h"
+#include "util/stats/varz_stats.h"
 
 using namespace boost;
 using std::thread;
 
 DEFINE_uint32(io_context_threads, 0, "Number of io threads in the pool");
+DEFINE_bool(io_context_uring, false, "If true, the pools serve their sockets via io_uring");
+DEFINE_bool(io_context_work_stealing, false,
+            "If true, idle threads of the pools steal the migratable fibers of the loaded ones");
 
 namespace util {
 
 thread_local size_t IoContextPool::context_indx_ = 0;
 
-IoContextPool::IoContextPool(size_t pool_size, std::vector<size_t> cpus) {
+IoContextPool::IoContextPool(size_t pool_size, std::vector<size_t> cpus)
+    : backend_(FLAGS_io_context_uring ? URING : EPOLL),
+      work_stealing_(FLAGS_io_context_work_stealing) {
   if (pool_size == 0) {
     pool_size =
         FLAGS_io_context_threads > 0 ? FLAGS_io_context_threads : thread::hardware_concurrency();
@@ -44,7 +52,7 @@ void IoContextPool::WrapLoop(size_t index, fibers_ext::BlockingCounter* bc) {
   auto& context = context_arr_[index];
   VLOG(1) << "Starting io thread " << index;
 
-  context.StartLoop(bc);
+  context.StartLoop(bc, steal_group_.get(), index);
 
   VLOG(1) << "Finished io thread " << index;
 }
@@ -59,6 +67,11 @@ void IoContextPool::Run() {
   fibers_ext::BlockingCounter bc(thread_arr_.size());
   char buf[32];
 
+  if (work_stealing_) {
+    steal_group_.reset(new FiberStealGroup(thread_arr_.size()));
+    steal_varz_.reset(new VarzFunction("io-pool-steal", [this] { return GetStealStats(); }));
+  }
+
   for (size_t i = 0; i < thread_arr_.size(); ++i) {
     thread_arr_[i].work.emplace(asio::make_work_guard(*context_arr_[i].context_ptr_));
     snprintf(buf, sizeof(buf), "IoPool%lu", i);
@@ -79,6 +92,10 @@ void IoContextPool::Run() {
 
   LOG(INFO) << "Running " << thread_arr_.size() << " io threads";
   state_ = RUN;
+
+  if (backend_ == URING) {
+    AwaitOnAll([](IoContext& context) { UringProactor::EnableNet(&context); });
+  }
 }
 
 void IoContextPool::Stop() {
@@ -98,9 +115,25 @@ void IoContextPool::Stop() {
     pthread_join(thread_arr_[i].tid, nullptr);
     VLOG(2) << "Thread " << i << " has joined";
   }
+  steal_varz_.reset();
+  steal_group_.reset();
   state_ = STOPPED;
 }
 
+VarzValue::Map IoContextPool::GetStealStats() const {
+  VarzValue::Map res;
+  uint64_t steals = 0;
+  for (unsigned i = 0; i < steal_group_->size(); ++i) {
+    uint64_t count = steal_group_->steal_count(i);
+    steals += count;
+    res.emplace_back(absl::StrCat("steals-", i), VarzValue::FromInt(count));
+    res.emplace_back(absl::StrCat("depth-", i), VarzValue::FromInt(steal_group_->queue_depth(i)));
+  }
+  res.emplace_back("steals", VarzValue::FromInt(steals));
+
+  return res;
+}
+
 IoContext& IoContextPool::GetNextContext() {
   // Use a round-robin scheme to choose the next io_context to use.
   DCHECK_LT(next_io_context_, context_arr_.size());
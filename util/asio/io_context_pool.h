@@ -14,9 +14,12 @@
 #include "base/type_traits.h"
 #include "util/asio/io_context.h"
 #include "util/fibers/fibers_ext.h"
+#include "util/stats/varz_value.h"
 
 namespace util {
 
+class VarzFunction;
+
 /** @brief A pool of IoContext objects, representing and managing CPU resources of the system.
  *  @author Roman Gershman
  *
@@ -31,6 +34,11 @@ class IoContextPool {
  public:
   using io_context = ::boost::asio::io_context;
 
+  //! EPOLL - the sockets are served by asio reactor.
+  //! URING - the server sockets and the accepts are served by io_uring proactor of each thread,
+  //! see UringProactor. Falls back to EPOLL if io_uring is not available.
+  enum Backend { EPOLL, URING };
+
   IoContextPool(const IoContextPool&) = delete;
   void operator=(const IoContextPool&) = delete;
 
@@ -40,6 +48,20 @@ class IoContextPool {
 
   ~IoContextPool();
 
+  //! Selects the IO backend of the pool. Must be called before Run(). The default is set by
+  //! --io_context_uring flag.
+  void set_backend(Backend backend) { backend_ = backend; }
+  Backend backend() const { return backend_; }
+
+  //! Enables stealing of the migratable fibers between the threads of the pool, see
+  //! IoFiberProperties::set_migratable. Must be called before Run(). The default is set by
+  //! --io_context_work_stealing flag. The steal counts and the queue depths are exported to
+  //! "io-pool-steal" varz.
+  void set_work_stealing(bool enable) { work_stealing_ = enable; }
+
+  //! Returns nullptr if work stealing is disabled.
+  const FiberStealGroup* steal_group() const { return steal_group_.get(); }
+
   //! Starts running all IoContext objects in the pool. Does not block.
   void Run();
 
@@ -208,6 +230,7 @@ class IoContextPool {
  private:
   void WrapLoop(size_t index, fibers_ext::BlockingCounter* bc);
   void CheckRunningState();
+  VarzValue::Map GetStealStats() const;
 
   typedef ::boost::asio::executor_work_guard<IoContext::io_context::executor_type> work_guard_t;
 
@@ -224,6 +247,11 @@ class IoContextPool {
   std::atomic_uint_fast32_t next_io_context_{0};
   thread_local static size_t context_indx_;
   enum State { STOPPED, RUN } state_ = STOPPED;
+  Backend backend_;
+  bool work_stealing_;
+
+  std::unique_ptr<FiberStealGroup> steal_group_;
+  std::unique_ptr<VarzFunction> steal_varz_;
 };
 
 }  // namespace util
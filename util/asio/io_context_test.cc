@@ -417,6 +417,55 @@ TEST_F(IoContextTest, ThreadsNotify) {
   }
 }
 
+TEST_F(IoContextTest, WorkStealing) {
+  constexpr size_t kSz = 2;
+  constexpr unsigned kNumFibers = 8;
+
+  IoContextPool pool(kSz);
+  pool.set_work_stealing(true);
+  pool.Run();
+
+  std::atomic_uint moved{0};
+  std::thread::id pinned_id;
+  bool pinned_moved = false;
+  fibers::fiber fbs[kNumFibers], pinned;
+
+  auto compute_cb = [&] {
+    this_fiber::properties<IoFiberProperties>().set_migratable(true);
+    std::thread::id start = std::this_thread::get_id();
+    bool did_move = false;
+
+    for (auto end = steady_clock::now() + 50ms; steady_clock::now() < end;) {
+      this_fiber::yield();
+      did_move |= start != std::this_thread::get_id();
+    }
+    moved += did_move;
+  };
+
+  pool[0].Await([&] {
+    for (unsigned i = 0; i < kNumFibers; ++i) {
+      fbs[i] = fibers::fiber(compute_cb);
+    }
+    pinned = fibers::fiber([&] {
+      pinned_id = std::this_thread::get_id();
+      for (unsigned i = 0; i < 1000; ++i) {
+        this_fiber::yield();
+        pinned_moved |= pinned_id != std::this_thread::get_id();
+      }
+    });
+  });
+
+  for (auto& fb : fbs) {
+    fb.join();
+  }
+  pinned.join();
+
+  EXPECT_FALSE(pinned_moved);
+  EXPECT_GT(moved, 0);
+  EXPECT_GT(pool.steal_group()->steal_count(1), 0);
+  EXPECT_EQ(0, pool.steal_group()->queue_depth(0));
+}
+
 static void BM_RunOneNoLock(benchmark::State& state) {
   io_context cntx(1);  // no locking
 
@@ -0,0 +1,326 @@
+// Copyright 2020, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/asio/uring_proactor.h"
+
+#include "base/logging.h"
+
+#ifdef USE_URING
+
+#include <liburing.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <boost/fiber/operations.hpp>
+#include <cstring>
+
+#include "util/asio/yield.h"
+
+#endif
+
+namespace util {
+
+using namespace boost;
+
+#ifdef USE_URING
+
+namespace {
+
+constexpr unsigned kRingDepth = 256;
+
+// Multishot requests may produce many completions per submission.
+constexpr unsigned kCqDepth = 4096;
+
+// Registered buffers that are used for file prefetching. Registration saves the kernel
+// from mapping the user pages on every request.
+constexpr unsigned kNumFixedBufs = 32;
+
+// Must be a power of 2.
+constexpr unsigned kNumProvidedBufs = 256;
+
+thread_local UringProactor* local_proactor = nullptr;
+thread_local bool uring_unavailable = false;
+
+}  // namespace
+
+constexpr size_t UringProactor::kFixedBufSize;
+constexpr size_t UringProactor::kProvidedBufSize;
+constexpr uint16_t UringProactor::kBufGroup;
+
+UringProactor::UringProactor(IoContext* io_context)
+    : io_context_(io_context), ring_(new io_uring), sd_(io_context->raw_context()) {
+}
+
+UringProactor::~UringProactor() {
+  if (buf_ring_) {
+    io_uring_unregister_buf_ring(ring_.get(), kBufGroup);
+    munmap(buf_ring_, kNumProvidedBufs * sizeof(io_uring_buf));
+  }
+  if (ring_inited_) {
+    io_uring_queue_exit(ring_.get());  // Also unregisters the eventfd that sd_ closes.
+  }
+}
+
+UringProactor* UringProactor::ThisThread() {
+  return local_proactor;
+}
+
+UringProactor* UringProactor::ForThisThread(IoContext* io_context) {
+  DCHECK(io_context->InContextThread());
+
+  if (local_proactor || uring_unavailable)
+    return local_proactor;
+
+  std::unique_ptr<UringProactor> proactor(new UringProactor(io_context));
+  if (!proactor->Init()) {
+    uring_unavailable = true;
+    return nullptr;
+  }
+  local_proactor = proactor.get();
+  io_context->AttachCancellable(proactor.release());
+
+  return local_proactor;
+}
+
+void UringProactor::EnableNet(IoContext* io_context) {
+  UringProactor* proactor = ForThisThread(io_context);
+  if (!proactor) {
+    LOG(WARNING) << "io_uring is not available, sockets fall back to epoll";
+    return;
+  }
+  proactor->net_enabled_ = true;
+}
+
+bool UringProactor::Init() {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = kCqDepth;
+
+  int res = io_uring_queue_init_params(kRingDepth, ring_.get(), &params);
+  if (res < 0) {
+    LOG(WARNING) << "io_uring is not available: " << strerror(-res);
+    return false;
+  }
+  ring_inited_ = true;
+
+  // Unlike the ring descriptor, the eventfd is signaled on every completion, so a completion
+  // that arrives after we reaped is never lost.
+  int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (efd < 0) {
+    LOG(WARNING) << "Could not create eventfd: " << strerror(errno);
+    return false;
+  }
+
+  system::error_code ec;
+  sd_.assign(efd, ec);
+  if (ec) {
+    close(efd);
+    LOG(WARNING) << "Could not watch eventfd: " << ec.message();
+    return false;
+  }
+
+  res = io_uring_register_eventfd(ring_.get(), efd);
+  if (res < 0) {
+    LOG(WARNING) << "Could not register eventfd: " << strerror(-res);
+    return false;
+  }
+
+  fixed_arena_.reset(new uint8_t[kNumFixedBufs * kFixedBufSize]);
+  iovec iov[kNumFixedBufs];
+  for (unsigned i = 0; i < kNumFixedBufs; ++i) {
+    iov[i].iov_base = fixed_arena_.get() + i * kFixedBufSize;
+    iov[i].iov_len = kFixedBufSize;
+  }
+
+  // Usually fails due to RLIMIT_MEMLOCK. We can live without registered buffers.
+  res = io_uring_register_buffers(ring_.get(), iov, kNumFixedBufs);
+  if (res < 0) {
+    LOG(WARNING) << "Could not register io_uring buffers: " << strerror(-res);
+    fixed_arena_.reset();
+  } else {
+    for (int i = kNumFixedBufs - 1; i >= 0; --i) {
+      free_bufs_.push_back(i);
+    }
+  }
+  InitProvidedBufs();
+
+  return true;
+}
+
+void UringProactor::InitProvidedBufs() {
+  // The ring of the buffer descriptors is shared with the kernel and must be page aligned.
+  size_t ring_size = kNumProvidedBufs * sizeof(io_uring_buf);
+  void* ptr = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (ptr == MAP_FAILED) {
+    LOG(WARNING) << "Could not allocate buffer ring: " << strerror(errno);
+    return;
+  }
+
+  io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = reinterpret_cast<uint64_t>(ptr);
+  reg.ring_entries = kNumProvidedBufs;
+  reg.bgid = kBufGroup;
+
+  // Buffer rings are supported since 5.19. Without them the sockets receive with single shot
+  // requests.
+  int res = io_uring_register_buf_ring(ring_.get(), &reg, 0);
+  if (res < 0) {
+    VLOG(1) << "Could not register buffer ring: " << strerror(-res);
+    munmap(ptr, ring_size);
+    return;
+  }
+
+  buf_ring_ = reinterpret_cast<io_uring_buf_ring*>(ptr);
+  provided_arena_.reset(new uint8_t[kNumProvidedBufs * kProvidedBufSize]);
+
+  io_uring_buf_ring_init(buf_ring_);
+  unsigned mask = io_uring_buf_ring_mask(kNumProvidedBufs);
+  for (unsigned i = 0; i < kNumProvidedBufs; ++i) {
+    io_uring_buf_ring_add(buf_ring_, ProvidedBuf(i), kProvidedBufSize, i, mask, i);
+  }
+  io_uring_buf_ring_advance(buf_ring_, kNumProvidedBufs);
+  multishot_recv_ = true;
+}
+
+void UringProactor::Run() {
+  system::error_code ec;
+  uint64_t cnt;
+
+  while (!stop_) {
+    Reap();
+
+    // The completions that arrive from now on signal the eventfd after we start waiting,
+    // since the loop polls it only when this fiber is suspended.
+    if (io_uring_cq_ready(ring_.get()))
+      continue;
+
+    sd_.async_wait(asio::posix::stream_descriptor::wait_read, fibers_ext::yield[ec]);
+    if (ec) {
+      LOG_IF(ERROR, ec != asio::error::operation_aborted)
+          << "Error waiting for io_uring: " << ec.message();
+      break;
+    }
+
+    // Resets the counter. Fails with EAGAIN if it was already reset.
+    ssize_t res = read(sd_.native_handle(), &cnt, sizeof(cnt));
+    (void)res;
+  }
+
+  // The posted flush references this object.
+  while (flush_posted_) {
+    this_fiber::yield();
+  }
+  Reap();
+  LOG_IF(ERROR, inflight_) << "io_uring stopped with " << inflight_ << " pending requests";
+  local_proactor = nullptr;
+}
+
+void UringProactor::Cancel() {
+  stop_ = true;
+
+  system::error_code ec;
+  sd_.cancel(ec);
+}
+
+void UringProactor::CancelOp(UringOp* op) {
+  io_uring_sqe* sqe = GetSqe();
+  io_uring_prep_cancel(sqe, op, 0);
+  io_uring_sqe_set_data(sqe, nullptr);  // Its own completion is ignored.
+  PostFlush();
+}
+
+void UringProactor::ReturnProvidedBuf(uint16_t bid) {
+  DCHECK(buf_ring_);
+  io_uring_buf_ring_add(buf_ring_, ProvidedBuf(bid), kProvidedBufSize, bid,
+                        io_uring_buf_ring_mask(kNumProvidedBufs), 0);
+  io_uring_buf_ring_advance(buf_ring_, 1);
+}
+
+int UringProactor::GetFixedBuf(uint8_t** buf) {
+  if (free_bufs_.empty())
+    return -1;
+
+  int index = free_bufs_.back();
+  free_bufs_.pop_back();
+  *buf = fixed_arena_.get() + index * kFixedBufSize;
+  return index;
+}
+
+io_uring_sqe* UringProactor::GetSqe() {
+  io_uring_sqe* sqe;
+  while ((sqe = io_uring_get_sqe(ring_.get())) == nullptr) {
+    // The submission queue is full, we submit the batch without waiting for the loop.
+    // The kernel rejects it with EBUSY while the completion queue overflows, in that case
+    // we let the reaping fiber drain it and retry.
+    int res = io_uring_submit(ring_.get());
+    CHECK(res >= 0 || res == -EBUSY || res == -EAGAIN)
+        << "io_uring_submit failed: " << strerror(-res);
+    if (res <= 0)
+      this_fiber::yield();
+  }
+  return sqe;
+}
+
+void UringProactor::Commit(io_uring_sqe* sqe, UringOp* op) {
+  io_uring_sqe_set_data(sqe, op);
+  ++inflight_;
+  PostFlush();
+}
+
+void UringProactor::Flush() {
+  flush_posted_ = false;
+
+  int res = io_uring_submit(ring_.get());
+  if (res == -EBUSY || res == -EAGAIN) {
+    // The completion queue overflows. We retry after the reaping fiber drains it.
+    if (!stop_)
+      PostFlush();
+    return;
+  }
+  CHECK_GE(res, 0) << "io_uring_submit failed: " << strerror(-res);
+}
+
+void UringProactor::Reap() {
+  io_uring_cqe* cqe = nullptr;
+
+  while (io_uring_peek_cqe(ring_.get(), &cqe) == 0) {
+    UringOp* op = reinterpret_cast<UringOp*>(io_uring_cqe_get_data(cqe));
+    int32_t res = cqe->res;
+    uint32_t flags = cqe->flags;
+    io_uring_cqe_seen(ring_.get(), cqe);
+
+    if (!op)  // Cancel requests.
+      continue;
+
+    if ((flags & IORING_CQE_F_MORE) == 0)
+      --inflight_;
+
+    if (op->cb) {
+      op->cb(res, flags);
+    } else {
+      op->res = res;
+      op->done.Notify();
+    }
+  }
+}
+
+#else
+
+UringProactor* UringProactor::ThisThread() {
+  return nullptr;
+}
+
+UringProactor* UringProactor::ForThisThread(IoContext* io_context) {
+  return nullptr;
+}
+
+void UringProactor::EnableNet(IoContext* io_context) {
+  LOG(WARNING) << "Built without io_uring support, sockets fall back to epoll";
+}
+
+#endif
+
+}  // namespace util
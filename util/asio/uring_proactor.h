@@ -0,0 +1,157 @@
+// Copyright 2020, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#pragma once
+
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "util/asio/io_context.h"
+
+// liburing types. We keep liburing.h out of the header, so that only the code that prepares
+// the requests depends on it.
+struct io_uring;
+struct io_uring_sqe;
+struct io_uring_buf_ring;
+
+namespace util {
+
+// io_uring request. Single shot requests set res and notify done. Multishot requests call cb
+// for every completion instead. cb runs in the reaping fiber and must not block.
+struct UringOp {
+  std::function<void(int32_t res, uint32_t flags)> cb;
+
+  int32_t res = 0;
+  fibers_ext::Done done;
+};
+
+/*! @brief io_uring proactor of IoContext thread.
+ *
+ * The ring descriptor is watched by the asio loop and the completions are reaped by a fiber,
+ * so the requests run behind the same fiber scheduler as the rest of IoContext. The submissions
+ * are batched: the requests that the fibers prepare until they yield to the IO loop are
+ * submitted with a single io_uring_enter call.
+ *
+ * Besides the files, the proactor serves the sockets of IoContextPool that runs
+ * IoContextPool::URING backend. In that case the server sockets receive with multishot requests
+ * into the provided buffer ring, so the idle connections do not hold receive buffers.
+ * All the methods must be called from the IoContext thread.
+ *
+ * io_uring is compiled in only if USE_URING is defined. Otherwise the proactor is never created
+ * and its users fall back to the asio reactor and to the thread pool files.
+ */
+class UringProactor : public IoContext::Cancellable {
+ public:
+  ~UringProactor();
+
+  //! Returns the proactor of the current thread or nullptr if it was not created.
+  static UringProactor* ThisThread();
+
+  //! Returns the proactor of io_context thread, creating it lazily, or nullptr if io_uring is
+  //! not available. Must be called from io_context thread.
+  static UringProactor* ForThisThread(IoContext* io_context);
+
+  //! Routes the socket IO of io_context thread via its proactor. Falls back to asio reactor if
+  //! io_uring is not available. Must be called from io_context thread.
+  static void EnableNet(IoContext* io_context);
+
+  //! Returns the proactor of the current thread if the sockets of the thread should use it.
+  static UringProactor* NetThisThread() {
+    UringProactor* p = ThisThread();
+    return p && p->net_enabled_ ? p : nullptr;
+  }
+
+  void Run() final;
+  void Cancel() final;
+
+  //! Queues the request prepared by prep. op is notified when the request completes.
+  template <typename F> void Submit(UringOp* op, F&& prep);
+
+  //! Submits the request and suspends the calling fiber until it completes. Returns cqe->res.
+  template <typename F> int32_t Await(F&& prep) {
+    UringOp op;
+    Submit(&op, std::forward<F>(prep));
+    op.done.Wait();
+    return op.res;
+  }
+
+  //! Cancels the request of op. op still receives its final completion, usually -ECANCELED.
+  void CancelOp(UringOp* op);
+
+  //! Returns the index of a free registered buffer of kFixedBufSize bytes or -1 if none left.
+  int GetFixedBuf(uint8_t** buf);
+  void ReturnFixedBuf(int index) { free_bufs_.push_back(index); }
+
+  //! Provided buffers are picked by the kernel for the requests that set IOSQE_BUFFER_SELECT
+  //! with buf_group(). The completion returns the buffer id in its flags.
+  uint8_t* ProvidedBuf(uint16_t bid) { return provided_arena_.get() + bid * kProvidedBufSize; }
+  void ReturnProvidedBuf(uint16_t bid);
+  uint16_t buf_group() const { return kBufGroup; }
+
+  //! Multishot requests require kernel 5.19+ for accept and 6.0+ for recv. The users disable
+  //! them once the kernel rejects them.
+  bool multishot_accept() const { return multishot_accept_; }
+  bool multishot_recv() const { return multishot_recv_; }
+
+  void DisableMultishotAccept() { multishot_accept_ = false; }
+  void DisableMultishotRecv() { multishot_recv_ = false; }
+
+  static constexpr size_t kFixedBufSize = 1 << 17;
+  static constexpr size_t kProvidedBufSize = 1 << 12;
+
+ private:
+  explicit UringProactor(IoContext* io_context);
+
+  bool Init();
+  void InitProvidedBufs();
+
+  // Returns a free submission entry. If the submission queue is full, submits it and yields
+  // until the kernel accepts the requests.
+  io_uring_sqe* GetSqe();
+
+  // Queues the prepared request of op.
+  void Commit(io_uring_sqe* sqe, UringOp* op);
+
+  // Submits all the queued requests.
+  void Flush();
+
+  void PostFlush() {
+    if (!flush_posted_) {
+      // Runs after the ready fibers yield to the loop, so their requests are submitted together.
+      flush_posted_ = true;
+      io_context_->Async([this] { Flush(); });
+    }
+  }
+
+  // Must not preempt. Otherwise we could miss the completions that arrive before we wait for
+  // the eventfd again.
+  void Reap();
+
+  static constexpr uint16_t kBufGroup = 0;
+
+  IoContext* io_context_;
+  std::unique_ptr<io_uring> ring_;
+  bool ring_inited_ = false, stop_ = false, flush_posted_ = false;
+  bool net_enabled_ = false, multishot_accept_ = true, multishot_recv_ = false;
+  unsigned inflight_ = 0;
+
+  // Watches the eventfd that the kernel signals on every completion.
+  ::boost::asio::posix::stream_descriptor sd_;
+
+  std::unique_ptr<uint8_t[]> fixed_arena_;
+  std::vector<int> free_bufs_;
+
+  io_uring_buf_ring* buf_ring_ = nullptr;
+  std::unique_ptr<uint8_t[]> provided_arena_;
+};
+
+template <typename F> void UringProactor::Submit(UringOp* op, F&& prep) {
+  io_uring_sqe* sqe = GetSqe();
+
+  prep(sqe);
+  Commit(sqe, op);
+}
+
+}  // namespace util
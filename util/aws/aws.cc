@@ -80,6 +80,10 @@ constexpr char kAlgo[] = "AWS4-HMAC-SHA256";
 
 }  // namespace
 
+const char AWS::kEmptyPayloadHash[] =
+    "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855";
+const char AWS::kUnsignedPayload[] = "UNSIGNED-PAYLOAD";
+
 ::boost::asio::ssl::context AWS::CheckedSslContext() {
   system::error_code ec;
   asio::ssl::context cntx{asio::ssl::context::tlsv12_client};
@@ -129,13 +133,10 @@ Status AWS::Init() {
 // TODO: to support date refreshes - i.e. to update sign_key_, credential_scope_
 // if the current has changed.
 void AWS::Sign(absl::string_view domain,
-               ::boost::beast::http::header<true, ::boost::beast::http::fields>* req) const {
+               ::boost::beast::http::header<true, ::boost::beast::http::fields>* req,
+               absl::string_view payload_hash) const {
   req->set(h2::field::host, domain);
 
-  // Below is the hexdigest of sha256 of the empty body.
-  // TODO: to support non-empty body requests - should be hexdigest of sha256(body).
-  const char kPayloadHash[] = "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855";
-
   time_t now = time(nullptr);  // Must be recent (upto 900sec skew is allowed vs amazon servers).
 
   struct tm tm_s;
@@ -147,7 +148,7 @@ void AWS::Sign(absl::string_view domain,
   VLOG(1) << "Time now: " << now;
 
   string canonical_headers = absl::StrCat("host", ":", domain, "\n");
-  absl::StrAppend(&canonical_headers, "x-amz-content-sha256", ":", kPayloadHash, "\n");
+  absl::StrAppend(&canonical_headers, "x-amz-content-sha256", ":", payload_hash, "\n");
   absl::StrAppend(&canonical_headers, "x-amz-date", ":", amz_date, "\n");
 
   size_t pos = req->target().find('?');
@@ -159,16 +160,21 @@ void AWS::Sign(absl::string_view domain,
     query_string = absl_sv(req->target().substr(pos + 1));
 
     // We must sign query string with params in alphabetical order
-    vector<absl::string_view> params = absl::StrSplit(query_string, "&");
+    vector<string> params = absl::StrSplit(query_string, "&");
+    for (string& param : params) {
+      // Params without value, like "?uploads", are signed with an empty value.
+      if (param.find('=') == string::npos)
+        param.push_back('=');
+    }
     sort(params.begin(), params.end());
     canonical_querystring = absl::StrJoin(params, "&");
   }
 
-  constexpr char kMethod[] = "GET";
-
-  string canonical_request = absl::StrCat(kMethod, "\n", url, "\n", canonical_querystring, "\n");
+  string canonical_request = absl::StrCat(absl_sv(req->method_string()), "\n", url, "\n",
+                                          canonical_querystring, "\n");
   string signed_headers = "host;x-amz-content-sha256;x-amz-date";
-  absl::StrAppend(&canonical_request, canonical_headers, "\n", signed_headers, "\n", kPayloadHash);
+  absl::StrAppend(&canonical_request, canonical_headers, "\n", signed_headers, "\n",
+                  payload_hash);
   VLOG(1) << "CanonicalRequest:\n" << canonical_request << "\n-------------------\n";
 
   char hexdigest[65];
@@ -186,8 +192,15 @@ void AWS::Sign(absl::string_view domain,
                    ",SignedHeaders=", signed_headers, ",Signature=", hexdigest);
 
   req->set("x-amz-date", amz_date);
-  req->set("x-amz-content-sha256", kPayloadHash);
+  req->set("x-amz-content-sha256", payload_hash);
   req->set(h2::field::authorization, authorization_header);
 }
 
+string AWS::PayloadHash(absl::string_view payload) {
+  char hexdigest[65];
+  sha256_string(payload, hexdigest);
+
+  return string(hexdigest, 64);
+}
+
 }  // namespace util
@@ -19,10 +19,23 @@ class AWS {
       : region_id_(region_id), service_(service) {
   }
 
+  //! Hexdigest of sha256 of the empty payload.
+  static const char kEmptyPayloadHash[];
+
+  //! Signals that the payload is not covered by the signature. Allowed by S3 over https.
+  static const char kUnsignedPayload[];
+
   Status Init();
 
+  //! Signs the request with AWS Signature Version 4.
+  //! payload_hash should be the hexdigest of sha256 of the request body, kEmptyPayloadHash
+  //! for the requests without body or kUnsignedPayload.
   void Sign(absl::string_view domain,
-            ::boost::beast::http::header<true, ::boost::beast::http::fields>* req) const;
+            ::boost::beast::http::header<true, ::boost::beast::http::fields>* req,
+            absl::string_view payload_hash = kEmptyPayloadHash) const;
+
+  //! Returns the hexdigest of sha256 of payload.
+  static std::string PayloadHash(absl::string_view payload);
 
   static ::boost::asio::ssl::context CheckedSslContext();
  private:
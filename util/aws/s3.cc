@@ -8,8 +8,10 @@
 #include <boost/asio/ssl/error.hpp>
 #include <boost/beast/http/empty_body.hpp>
 #include <boost/beast/http/string_body.hpp>
+#include <boost/fiber/operations.hpp>
 
 #include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_format.h"
 #include "absl/strings/strip.h"
@@ -21,11 +23,16 @@
 #include "util/aws/s3.h"
 #include "util/http/https_client.h"
 #include "util/http/https_client_pool.h"
+#include "util/http/parallel_lister.h"
 
 namespace util {
 
 using file::ReadonlyFile;
 using http::HttpsClientPool;
+using http::ParallelLister;
+using http::ParallelRangeReader;
+using http::ParseObjectSize;
+using http::SetRange;
 
 using namespace boost;
 namespace h2 = beast::http;
@@ -57,17 +64,240 @@ std::ostream& operator<<(std::ostream& os, const h2::response<h2::buffer_body>&
   return os;
 }
 
-// TODO: the same as in GCS. Can be implemented in terms of static 64 bytes buffer.
-inline void SetRange(size_t from, size_t to, h2::fields* flds) {
-  string tmp = absl::StrCat("bytes=", from, "-");
-  if (to < kuint64max) {
-    absl::StrAppend(&tmp, to - 1);
+inline const char* as_char(const xmlChar* var) {
+  return reinterpret_cast<const char*>(var);
+}
+
+// Larger payloads are not hashed when signing the requests - https protects them anyway.
+constexpr size_t kMaxSignedPayload = 1 << 16;
+
+constexpr unsigned kNumRetries = 3;
+
+StatusObject<S3Response> SendSigned(const AWS& aws, HttpsClientPool* pool, S3Request* req) {
+  const string& body = req->body();
+  string payload_hash;
+  if (body.empty()) {
+    payload_hash = AWS::kEmptyPayloadHash;
+  } else if (body.size() > kMaxSignedPayload) {
+    payload_hash = AWS::kUnsignedPayload;
+  } else {
+    payload_hash = AWS::PayloadHash(body);
   }
-  flds->set(h2::field::range, std::move(tmp));
+
+  aws.Sign(pool->domain(), req, payload_hash);
+
+  HttpsClientPool::ClientHandle handle = pool->GetHandle();
+  S3Response resp;
+  system::error_code ec = handle->Send(*req, &resp);
+  if (ec) {
+    return ToStatus(ec);
+  }
+
+  if (!resp.keep_alive()) {
+    handle->schedule_reconnect();
+  }
+
+  return resp;
 }
 
-inline const char* as_char(const xmlChar* var) {
-  return reinterpret_cast<const char*>(var);
+// Returns the text of the child element of node with the given name.
+string ChildContent(xmlNodePtr node, const char* name) {
+  string res;
+  for (xmlNodePtr cur = node->children; cur; cur = cur->next) {
+    if (cur->type != XML_ELEMENT_NODE || !xmlStrEqual(cur->name, BAD_CAST name))
+      continue;
+    xmlChar* content = xmlNodeGetContent(cur);
+    if (content) {
+      res = as_char(content);
+      xmlFree(content);
+    }
+    break;
+  }
+  return res;
+}
+
+// Calls cb for each node that matches xpath expression.
+template <typename Cb> void ForEachNode(xmlXPathContextPtr ctx, const char* expr, Cb&& cb) {
+  xmlXPathObjectPtr xpathObj = xmlXPathEvalExpression(BAD_CAST expr, ctx);
+  CHECK(xpathObj);
+  xmlNodeSetPtr nodes = xpathObj->nodesetval;
+  if (nodes) {
+    for (int i = 0; i < nodes->nodeNr; ++i) {
+      cb(nodes->nodeTab[i]);
+    }
+  }
+  xmlXPathFreeObject(xpathObj);
+}
+
+/* Parses a page of ListObjectsV2 response. Fills next_token with the continuation token
+   or clears it if the page is the last one.
+*/
+Status ParseListPage(const string& xml, const ParallelLister::ObjectCb& obj_cb,
+                     const ParallelLister::PrefixCb& prefix_cb, string* next_token) {
+  xmlDocPtr doc = xmlReadMemory(xml.data(), xml.size(), NULL, NULL, 0);
+  if (!doc)
+    return Status(StatusCode::PARSE_ERROR, "Could not parse list response");
+
+  xmlXPathContextPtr xpathCtx = xmlXPathNewContext(doc);
+  auto register_res = xmlXPathRegisterNs(xpathCtx, BAD_CAST "NS",
+                                         BAD_CAST "http://s3.amazonaws.com/doc/2006-03-01/");
+  CHECK_EQ(register_res, 0);
+
+  Status status;
+  ForEachNode(xpathCtx, "/NS:ListBucketResult/NS:Contents", [&](xmlNodePtr node) {
+    string key = ChildContent(node, "Key");
+    size_t size = 0;
+    if (key.empty() || !absl::SimpleAtoi(ChildContent(node, "Size"), &size)) {
+      status = Status(StatusCode::PARSE_ERROR, "Bad list entry");
+      return;
+    }
+    obj_cb(size, key);
+  });
+
+  ForEachNode(xpathCtx, "/NS:ListBucketResult/NS:CommonPrefixes", [&](xmlNodePtr node) {
+    prefix_cb(ChildContent(node, "Prefix"));
+  });
+
+  next_token->clear();
+  ForEachNode(xpathCtx, "/NS:ListBucketResult", [&](xmlNodePtr node) {
+    if (ChildContent(node, "IsTruncated") == "true")
+      *next_token = ChildContent(node, "NextContinuationToken");
+  });
+
+  xmlXPathFreeContext(xpathCtx);
+  xmlFreeDoc(doc);
+
+  return status;
+}
+
+/* Lists all the pages of the objects under prefix. If delimiter is true, lists only
+   the objects directly under prefix and passes the '/' sub-prefixes to prefix_cb.
+*/
+Status ListPrefix(const S3SendCb& send_cb, absl::string_view prefix, bool delimiter,
+                  const ParallelLister::ObjectCb& obj_cb,
+                  const ParallelLister::PrefixCb& prefix_cb) {
+  string url{"/?list-type=2&prefix="};
+  strings::AppendEncodedUrl(prefix, &url);
+  if (delimiter) {
+    url.append("&delimiter=%2F");
+  }
+
+  string token;
+  do {
+    string target = url;
+    if (!token.empty()) {
+      target.append("&continuation-token=");
+      strings::AppendEncodedUrl(token, &target);
+    }
+
+    S3Request req{h2::verb::get, target, 11};
+    auto res = send_cb(&req);
+    if (!res.ok())
+      return res.status;
+
+    if (res.obj.result() != h2::status::ok) {
+      LOG(INFO) << "ListError: " << res.obj;
+      return Status(StatusCode::IO_ERROR, string(res.obj.reason()));
+    }
+    VLOG(1) << "ListResp: " << res.obj;
+
+    RETURN_IF_ERROR(ParseListPage(res.obj.body(), obj_cb, prefix_cb, &token));
+  } while (!token.empty());
+
+  return Status::OK;
+}
+
+/* Fetches [offset, offset + range.size()) of the object with a ranged GET request.
+   Retries from the point where the connection broke. If obj_size is not null, fills it with
+   the object size from the response headers. The connection returns to the pool once
+   the response is read fully, so that the next requests reuse it.
+*/
+StatusObject<size_t> FetchRange(const AWS& aws, HttpsClientPool* pool, const string& url,
+                                size_t offset, const strings::MutableByteRange& range,
+                                size_t* obj_size) {
+  using Parser = h2::response_parser<h2::buffer_body>;
+  constexpr unsigned kMaxRetries = 3;
+
+  size_t fetched = 0;
+  unsigned retries = 0;
+
+  while (fetched < range.size()) {
+    h2::request<h2::empty_body> req{h2::verb::get, url, 11};
+    SetRange(offset + fetched, offset + range.size(), &req);
+    aws.Sign(pool->domain(), &req);
+
+    HttpsClientPool::ClientHandle handle = pool->GetHandle();
+    system::error_code ec = handle->Send(req);
+    if (ec) {
+      return ToStatus(ec);
+    }
+
+    Parser parser;
+    parser.body_limit(kuint64max);
+    ec = handle->ReadHeader(&parser);
+    if (ec) {
+      return ToStatus(ec);
+    }
+
+    const auto& msg = parser.get();
+    if (msg.result() == h2::status::range_not_satisfiable && obj_size) {
+      // The object is empty.
+      handle->schedule_reconnect();
+      *obj_size = 0;
+      return 0;
+    }
+
+    if (msg.result() != h2::status::ok && msg.result() != h2::status::partial_content) {
+      handle->schedule_reconnect();
+      unsigned code = msg.result_int();
+      if ((code == 500 || code == 503) && ++retries <= kMaxRetries) {
+        this_fiber::sleep_for(std::chrono::milliseconds(100 << retries));
+        continue;
+      }
+      LOG(INFO) << "FetchRangeError: " << msg;
+      return Status(StatusCode::IO_ERROR, string(msg.reason()));
+    }
+
+    if (obj_size) {
+      Status st = ParseObjectSize(msg, obj_size);
+      if (!st.ok()) {
+        handle->schedule_reconnect();
+        return st;
+      }
+      obj_size = nullptr;
+    }
+
+    while (fetched < range.size() && !parser.is_done()) {
+      auto& body = parser.get().body();
+      size_t left = range.size() - fetched;
+      body.data = range.data() + fetched;
+      body.size = left;
+
+      ec = handle->Read(&parser);
+      fetched += left - body.size;
+      if (ec && ec != h2::error::need_buffer)
+        break;
+      ec.clear();
+    }
+
+    if (!ec) {
+      if (!parser.is_done()) {
+        // We prefer closing the connection to draining the rest of the object.
+        handle->schedule_reconnect();
+      }
+      break;  // Either the range is full or the object ended.
+    }
+
+    if ((ec != h2::error::partial_message && ec != asio::ssl::error::stream_truncated) ||
+        ++retries > kMaxRetries) {
+      LOG(ERROR) << "ec: " << ec << "/" << ec.message() << " at " << offset + fetched;
+      return ToStatus(ec);
+    }
+    VLOG(1) << "Range of " << url << " truncated at " << offset + fetched << ", reconnecting";
+    handle->schedule_reconnect();
+  }
+
+  return fetched;
 }
 
 class S3ReadFile : public ReadonlyFile {
@@ -76,8 +306,10 @@ class S3ReadFile : public ReadonlyFile {
   using Parser = h2::response_parser<h2::buffer_body>;
 
   // does not own gcs object, only wraps it with ReadonlyFile interface.
-  S3ReadFile(const AWS& aws, HttpsClientPool* pool, string read_obj_url)
-      : aws_(aws), pool_(pool), read_obj_url_(std::move(read_obj_url)) {
+  S3ReadFile(const AWS& aws, HttpsClientPool* pool, string read_obj_url,
+             const ReadonlyFile::Options& opts, S3ReadStats* stats)
+      : aws_(aws), pool_(pool), read_obj_url_(std::move(read_obj_url)), opts_(opts),
+        stats_(stats) {
   }
 
   virtual ~S3ReadFile() final;
@@ -105,11 +337,17 @@ class S3ReadFile : public ReadonlyFile {
     return &parser_;
   }
 
+  // Opens the file in the read-ahead mode.
+  Status OpenParallel();
+
   const AWS& aws_;
   HttpsClientPool* pool_;
 
   const string read_obj_url_;
+  ReadonlyFile::Options opts_;
+  S3ReadStats* stats_;
   HttpsClientPool::ClientHandle https_handle_;
+  std::unique_ptr<ParallelRangeReader> range_reader_;
 
   Parser parser_;
   size_t size_ = 0, offs_ = 0;
@@ -119,6 +357,9 @@ S3ReadFile::~S3ReadFile() {
 }
 
 Status S3ReadFile::Open() {
+  if (opts_.parallel_range_size && !range_reader_)
+    return OpenParallel();
+
   string url = absl::StrCat("/", read_obj_url_);
   h2::request<h2::empty_body> req{h2::verb::get, url, 11};
 
@@ -169,9 +410,35 @@ Status S3ReadFile::Open() {
   return Status::OK;
 }
 
+Status S3ReadFile::OpenParallel() {
+  ParallelRangeReader::Options ropts;
+  ropts.range_size = std::max(opts_.parallel_range_size, kMinS3RangeSize);
+  ropts.max_concurrency = opts_.max_parallel_ranges;
+  ropts.stats = stats_;
+
+  string url = absl::StrCat("/", read_obj_url_);
+  std::unique_ptr<uint8_t[]> buf(new uint8_t[ropts.range_size]);
+  auto res = FetchRange(aws_, pool_, url, 0, strings::MutableByteRange(buf.get(), ropts.range_size),
+                        &size_);
+  if (!res.ok())
+    return res.status;
+
+  auto fetch_cb = [this, url](size_t offset, const strings::MutableByteRange& range) {
+    return FetchRange(aws_, pool_, url, offset, range, nullptr);
+  };
+  range_reader_.reset(new ParallelRangeReader(size_, std::move(fetch_cb), ropts));
+  range_reader_->Prefill(std::move(buf), res.obj);
+
+  return Status::OK;
+}
+
 StatusObject<size_t> S3ReadFile::Read(size_t offset, const strings::MutableByteRange& range) {
   CHECK(!range.empty());
 
+  if (range_reader_) {
+    return range_reader_->Read(offset, range);
+  }
+
   if (offset != offs_) {
     return Status(StatusCode::INVALID_ARGUMENT, "Only sequential access supported");
   }
@@ -244,50 +511,119 @@ Status S3ReadFile::Close() {
     }
   }
   https_handle_.reset();
+  range_reader_.reset();  // Waits for the requests in flight.
 
   return Status::OK;
 }
 
-}  // namespace
+// Fetches the range with a single request via send_cb. Sets obj_size if it's not null.
+StatusObject<size_t> FetchRange(const S3SendCb& send_cb, const string& url, size_t offset,
+                                const strings::MutableByteRange& range, size_t* obj_size) {
+  S3Request req{h2::verb::get, url, 11};
+  SetRange(offset, offset + range.size(), &req);
 
+  auto res = send_cb(&req);
+  if (!res.ok())
+    return res.status;
 
-const char* S3Bucket::kRootDomain = "s3.amazonaws.com";
+  const S3Response& resp = res.obj;
+  if (resp.result() == h2::status::range_not_satisfiable && obj_size) {
+    *obj_size = 0;  // The object is empty.
+    return 0;
+  }
 
-S3Bucket::S3Bucket(const AWS& aws, http::HttpsClientPool* pool) : aws_(aws), pool_(pool) {
-}
+  if (resp.result() != h2::status::ok && resp.result() != h2::status::partial_content) {
+    LOG(INFO) << "FetchRangeError: " << resp.result_int() << " " << resp.body();
+    return Status(StatusCode::IO_ERROR, string(resp.reason()));
+  }
 
-auto S3Bucket::List(absl::string_view glob, bool fs_mode, ListObjectCb cb) -> ListObjectResult {
-  HttpsClientPool::ClientHandle handle = pool_->GetHandle();
+  if (obj_size) {
+    if (resp.result() == h2::status::ok) {
+      // The server ignored the range and sent the whole object.
+      *obj_size = resp.body().size();
+    } else {
+      RETURN_IF_ERROR(ParseObjectSize(resp, obj_size));
+    }
+  }
 
-  string url{"/?prefix="};
-  strings::AppendEncodedUrl(glob, &url);
+  // Skips the prefix of the whole object if the range was ignored.
+  const string& body = resp.body();
+  size_t start = resp.result() == h2::status::ok ? std::min(offset, body.size()) : 0;
+  size_t len = std::min(range.size(), body.size() - start);
+  memcpy(range.data(), body.data() + start, len);
 
-  if (fs_mode) {
-    url.append("&delimeter=");
-    strings::AppendEncodedUrl("/", &url);
+  return len;
+}
+
+// Reads the object with ranged requests sent via S3SendCb.
+class S3RangeReadFile : public ReadonlyFile {
+ public:
+  S3RangeReadFile(S3SendCb send_cb, string url, const ParallelRangeReader::Options& opts)
+      : send_cb_(std::move(send_cb)), url_(std::move(url)), opts_(opts) {
   }
 
-  h2::request<h2::empty_body> req{h2::verb::get, url, 11};
-  h2::response<h2::string_body> resp;
+  StatusObject<size_t> Read(size_t offset, const strings::MutableByteRange& range) final {
+    return range_reader_->Read(offset, range);
+  }
 
-  aws_.Sign(pool_->domain(), &req);
+  Status Close() final {
+    range_reader_.reset();  // Waits for the requests in flight.
+    return Status::OK;
+  }
 
-  system::error_code ec = handle->Send(req, &resp);
+  size_t Size() const final {
+    return size_;
+  }
 
-  if (ec) {
-    return ToStatus(ec);
+  int Handle() const final {
+    return -1;
   }
 
-  if (resp.result() != h2::status::ok) {
-    LOG(INFO) << "ListError: " << resp;
+  Status Open();
 
-    return Status(StatusCode::IO_ERROR, string(resp.reason()));
-  }
+ private:
+  S3SendCb send_cb_;
+  const string url_;
+  ParallelRangeReader::Options opts_;
+  std::unique_ptr<ParallelRangeReader> range_reader_;
+  size_t size_ = 0;
+};
+
+Status S3RangeReadFile::Open() {
+  // The first range also tells us the object size.
+  std::unique_ptr<uint8_t[]> buf(new uint8_t[opts_.range_size]);
+  auto res = FetchRange(send_cb_, url_, 0, strings::MutableByteRange(buf.get(), opts_.range_size),
+                        &size_);
+  if (!res.ok())
+    return res.status;
+
+  auto fetch_cb = [this](size_t offset, const strings::MutableByteRange& range) {
+    return FetchRange(send_cb_, url_, offset, range, nullptr);
+  };
+  range_reader_.reset(new ParallelRangeReader(size_, std::move(fetch_cb), opts_));
+  range_reader_->Prefill(std::move(buf), res.obj);
 
-  VLOG(1) << "ListResp: " << resp;
   return Status::OK;
 }
 
+}  // namespace
+
+
+const char* S3Bucket::kRootDomain = "s3.amazonaws.com";
+
+S3Bucket::S3Bucket(const AWS& aws, http::HttpsClientPool* pool) : aws_(aws), pool_(pool) {
+}
+
+auto S3Bucket::List(absl::string_view glob, bool fs_mode, ListObjectCb cb) -> ListObjectResult {
+  // In fs_mode the sub-prefixes are skipped like in GCS::List.
+  return ListPrefix(MakeS3SendCb(aws_, pool_), glob, fs_mode, cb, [](absl::string_view) {});
+}
+
+auto S3Bucket::ListParallel(absl::string_view prefix, unsigned max_parallel, ListObjectCb cb)
+    -> ListObjectResult {
+  return ListS3Parallel(MakeS3SendCb(aws_, pool_), prefix, max_parallel, std::move(cb));
+}
+
 bool S3Bucket::SplitToBucketPath(absl::string_view input, absl::string_view* bucket,
                                  absl::string_view* path) {
   if (!absl::ConsumePrefix(&input, kS3Url))
@@ -364,18 +700,76 @@ ListS3BucketResult ListS3Buckets(const AWS& aws, http::HttpsClientPool* pool) {
 
 StatusObject<file::ReadonlyFile*> OpenS3ReadFile(absl::string_view key_path, const AWS& aws,
                                                  http::HttpsClientPool* pool,
-                                                 const file::ReadonlyFile::Options& opts) {
+                                                 const file::ReadonlyFile::Options& opts,
+                                                 S3ReadStats* stats) {
   CHECK(opts.sequential && pool);
 
   absl::string_view bucket, obj_path;
 
   string read_obj_url{key_path};
-  std::unique_ptr<S3ReadFile> fl(new S3ReadFile(aws, pool, std::move(read_obj_url)));
+  std::unique_ptr<S3ReadFile> fl(new S3ReadFile(aws, pool, std::move(read_obj_url), opts, stats));
+  RETURN_IF_ERROR(fl->Open());
+
+  return fl.release();
+}
+
+StatusObject<file::ReadonlyFile*> OpenS3ReadFile(absl::string_view key_path, S3SendCb send_cb,
+                                                 const file::ReadonlyFile::Options& opts,
+                                                 S3ReadStats* stats) {
+  CHECK(opts.sequential);
+
+  ParallelRangeReader::Options ropts;
+  ropts.range_size = opts.parallel_range_size ? opts.parallel_range_size : kMinS3RangeSize;
+  ropts.max_concurrency = opts.parallel_range_size ? opts.max_parallel_ranges : 1;
+  ropts.stats = stats;
+
+  std::unique_ptr<S3RangeReadFile> fl(
+      new S3RangeReadFile(std::move(send_cb), absl::StrCat("/", key_path), ropts));
   RETURN_IF_ERROR(fl->Open());
 
   return fl.release();
 }
 
+S3SendCb RetryingS3SendCb(S3SendCb send_cb) {
+  return [send_cb = std::move(send_cb)](S3Request* req) -> StatusObject<S3Response> {
+    for (unsigned iter = 0;; ++iter) {
+      auto res = send_cb(req);
+      if (!res.ok())
+        return res;
+
+      // S3 asks to retry the requests that failed with internal errors or throttling.
+      unsigned code = res.obj.result_int();
+      if ((code == 500 || code == 503) && iter < kNumRetries) {
+        VLOG(1) << "Retrying " << req->method_string() << " " << req->target() << " after "
+                << code;
+        this_fiber::sleep_for(std::chrono::milliseconds(100 << iter));
+        continue;
+      }
+
+      return res;
+    }
+  };
+}
+
+S3SendCb MakeS3SendCb(const AWS& aws, http::HttpsClientPool* pool) {
+  CHECK(pool);
+
+  return RetryingS3SendCb([&aws, pool](S3Request* req) { return SendSigned(aws, pool, req); });
+}
+
+Status ListS3Parallel(S3SendCb send_cb, absl::string_view prefix, unsigned max_parallel,
+                      S3Bucket::ListObjectCb cb) {
+  auto list_cb = [send_cb = std::move(send_cb)](absl::string_view level, const auto& obj_cb,
+                                                const auto& prefix_cb) {
+    return ListPrefix(send_cb, level, true, obj_cb, prefix_cb);
+  };
+
+  ParallelLister::Options opts;
+  opts.max_concurrency = max_parallel;
+  ParallelLister lister(std::move(list_cb), opts);
+
+  return lister.List(prefix, std::move(cb));
+}
 
 bool IsS3Path(absl::string_view path) {
   return absl::StartsWith(path, kS3Url);
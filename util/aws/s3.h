@@ -2,7 +2,11 @@
 // Author: Roman Gershman (romange@gmail.com)
 //
 
+#include <boost/beast/http/message.hpp>
+#include <boost/beast/http/string_body.hpp>
+
 #include "file/file.h"
+#include "util/http/range_reader.h"
 #include "util/status.h"
 
 #pragma once
@@ -41,6 +45,11 @@ class S3Bucket {
   */
   ListObjectResult List(absl::string_view glob, bool fs_mode, ListObjectCb cb);
 
+  //! Lists recursively all the objects under prefix with up to max_parallel concurrent
+  //! requests. See ListS3Parallel() below.
+  ListObjectResult ListParallel(absl::string_view prefix, unsigned max_parallel,
+                                ListObjectCb cb);
+
   static bool SplitToBucketPath(absl::string_view input, absl::string_view* bucket,
                                 absl::string_view* path);
 
@@ -57,19 +66,102 @@ using ListS3BucketResult = util::StatusObject<std::vector<std::string>>;
 //! pool should be connected to s3.amazonaws.com
 ListS3BucketResult ListS3Buckets(const AWS& aws, http::HttpsClientPool* pool);
 
+using S3Request = ::boost::beast::http::request<::boost::beast::http::string_body>;
+using S3Response = ::boost::beast::http::response<::boost::beast::http::string_body>;
+
+//! Sends a request to the bucket endpoint and returns its response. Called concurrently
+//! from several fibers of the calling thread.
+using S3SendCb = std::function<StatusObject<S3Response>(S3Request* req)>;
+
+//! Returns the callback that signs the requests with aws and sends them via the pool
+//! connections. The requests that failed with S3 internal errors or throttling are retried.
+S3SendCb MakeS3SendCb(const AWS& aws, http::HttpsClientPool* pool);
+
+//! Wraps send_cb with the retries of the requests that failed with S3 internal errors or
+//! throttling.
+S3SendCb RetryingS3SendCb(S3SendCb send_cb);
+
+//! Per-file statistics of the read-ahead mode.
+using S3ReadStats = http::ParallelRangeReader::Stats;
+
+//! The minimal size of the read-ahead requests.
+constexpr size_t kMinS3RangeSize = 1 << 22;
+
 /**
  * @brief Opens an s3 object for sequential reading.
  *
+ * If opts.parallel_range_size is set, the file reads ahead of the consumer with up to
+ * opts.max_parallel_ranges ranged GET requests in flight on the keep-alive connections
+ * of the pool. Each request is signed and pays the first byte latency, therefore the range
+ * size is at least kMinS3RangeSize. Otherwise the object is read with a single stream.
+ *
  * @param key_path an object path without bucket prefix. The bucket is already predefined in
  *                 pool connection.
  * @param aws      an AWS handler
  * @param pool     a pool handling https connections to the bucket.
  * @param opts     ReadonlyFile::Options argument.
+ * @param stats    if not null, is updated with the read-ahead statistics.
  * @return StatusObject<file::ReadonlyFile*>
  */
 StatusObject<file::ReadonlyFile*> OpenS3ReadFile(
     absl::string_view key_path, const AWS& aws, http::HttpsClientPool* pool,
-    const file::ReadonlyFile::Options& opts = file::ReadonlyFile::Options{});
+    const file::ReadonlyFile::Options& opts = file::ReadonlyFile::Options{},
+    S3ReadStats* stats = nullptr);
+
+/**
+ * @brief Same as above but reads the object with ranged GET requests sent via send_cb.
+ *
+ * Allows reading from S3 compatible endpoints. Without opts.parallel_range_size the object
+ * is fetched sequentially, kMinS3RangeSize bytes per request.
+ */
+StatusObject<file::ReadonlyFile*> OpenS3ReadFile(
+    absl::string_view key_path, S3SendCb send_cb,
+    const file::ReadonlyFile::Options& opts = file::ReadonlyFile::Options{},
+    S3ReadStats* stats = nullptr);
+
+struct S3WriteOptions {
+  //! Objects larger than part_size are uploaded with multipart upload.
+  //! S3 requires parts of at least 5MB except the last one.
+  size_t part_size = 1 << 23;
+
+  //! Maximal number of part uploads in flight.
+  unsigned max_parallel_parts = 4;
+};
+
+/**
+ * @brief Lists recursively all the objects under prefix with concurrent requests.
+ *
+ * S3 pages through a listing sequentially with continuation tokens. Here the key space is
+ * partitioned by the '/' sub-prefixes that are listed concurrently with up to max_parallel
+ * requests in flight (see http::ParallelLister). Must be called from the IoContext thread
+ * of the send_cb connections. cb is called from the listing fibers with (size, key) pairs.
+ */
+Status ListS3Parallel(S3SendCb send_cb, absl::string_view prefix, unsigned max_parallel,
+                      S3Bucket::ListObjectCb cb);
+
+/**
+ * @brief Opens an s3 object for writing.
+ *
+ * The object is uploaded with a single request if it's smaller than opts.part_size. Otherwise,
+ * the data is uploaded with multipart upload with up to opts.max_parallel_parts parts in flight.
+ * The object becomes visible only when the file is closed successfully. Upon failure or
+ * Abort() the multipart upload is aborted, so that S3 drops the uploaded parts.
+ * Must be used from the IoContext thread of the pool.
+ *
+ * @param key_path an object path without bucket prefix. The bucket is already predefined in
+ *                 pool connection.
+ * @param aws      an AWS handler
+ * @param pool     a pool handling https connections to the bucket.
+ * @param opts     S3WriteOptions argument.
+ */
+StatusObject<file::WriteFile*> OpenS3WriteFile(absl::string_view key_path, const AWS& aws,
+                                               http::HttpsClientPool* pool,
+                                               const S3WriteOptions& opts = S3WriteOptions{});
+
+//! Same as above but sends the unsigned requests via send_cb.
+//! Allows writing into S3 compatible endpoints.
+StatusObject<file::WriteFile*> OpenS3WriteFile(absl::string_view key_path, S3SendCb send_cb,
+                                               const S3WriteOptions& opts = S3WriteOptions{});
 
 bool IsS3Path(absl::string_view path);
 
@@ -0,0 +1,425 @@
+// Copyright 2020, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/aws/s3_stand_in.h"
+
+#include <boost/beast/core/flat_buffer.hpp>
+#include <boost/beast/http/read.hpp>
+#include <boost/beast/http/write.hpp>
+#include <boost/fiber/operations.hpp>
+
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "base/logging.h"
+#include "util/asio/fiber_socket.h"
+
+namespace util {
+
+using namespace boost;
+using namespace std;
+namespace h2 = beast::http;
+
+namespace {
+
+constexpr char kXmlHeader[] = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+constexpr char kXmlNs[] = "xmlns=\"http://s3.amazonaws.com/doc/2006-03-01/\"";
+
+string UrlDecode(absl::string_view src) {
+  string res;
+  for (size_t i = 0; i < src.size(); ++i) {
+    if (src[i] == '%' && i + 2 < src.size()) {
+      res.push_back(char(std::stoi(string(src.substr(i + 1, 2)), nullptr, 16)));
+      i += 2;
+    } else {
+      res.push_back(src[i]);
+    }
+  }
+  return res;
+}
+
+S3Response ErrorResponse(h2::status st, const char* code) {
+  S3Response resp{st, 11};
+  resp.body() = absl::StrCat("<Error><Code>", code, "</Code></Error>");
+  return resp;
+}
+
+// Parses "bytes=from-to" or "bytes=from-" range into [from, to).
+bool ParseRange(absl::string_view val, size_t size, size_t* from, size_t* to) {
+  if (!absl::ConsumePrefix(&val, "bytes="))
+    return false;
+  size_t pos = val.find('-');
+  if (pos == absl::string_view::npos || !absl::SimpleAtoi(val.substr(0, pos), from))
+    return false;
+
+  *to = size;
+  if (pos + 1 < val.size()) {
+    if (!absl::SimpleAtoi(val.substr(pos + 1), to))
+      return false;
+    *to = std::min(*to + 1, size);  // the range is inclusive.
+  }
+  return true;
+}
+
+class StandInHandler : public ConnectionHandler {
+ public:
+  StandInHandler(S3StandIn* s3, IoContext* cntx) : ConnectionHandler(cntx), s3_(s3) {}
+
+  system::error_code HandleRequest() final;
+
+ private:
+  // Simulates the transfer time of len bytes.
+  void Throttle(size_t len);
+
+  S3StandIn* s3_;
+  beast::flat_buffer buffer_;
+};
+
+system::error_code StandInHandler::HandleRequest() {
+  h2::request_parser<h2::string_body> parser;
+  parser.body_limit(kuint64max);
+
+  system::error_code ec;
+  h2::read(*socket_, buffer_, parser, ec);
+  if (ec == h2::error::end_of_stream)
+    return asio::error::eof;
+  if (ec)
+    return ec;
+
+  S3Request req = parser.release();
+  Throttle(req.body().size());
+
+  S3Response resp = s3_->Handle(req);
+  resp.keep_alive(req.keep_alive());
+  resp.prepare_payload();
+  Throttle(resp.body().size());
+  h2::write(*socket_, resp, ec);
+
+  return ec;
+}
+
+void StandInHandler::Throttle(size_t len) {
+  size_t bandwidth = s3_->options().bandwidth;
+  if (bandwidth && len) {
+    this_fiber::sleep_for(chrono::microseconds(len * 1000000 / bandwidth));
+  }
+}
+
+// Sends the requests over keep-alive plain http connections.
+class StandInClient {
+ public:
+  StandInClient(IoContext* io_context, uint16_t port, absl::string_view bucket)
+      : io_context_(io_context), port_(std::to_string(port)), bucket_(bucket) {}
+
+  StatusObject<S3Response> Send(S3Request* req);
+
+ private:
+  IoContext* io_context_;
+  string port_, bucket_;
+  vector<unique_ptr<FiberSyncSocket>> idle_;
+};
+
+StatusObject<S3Response> StandInClient::Send(S3Request* req) {
+  unique_ptr<FiberSyncSocket> socket;
+  system::error_code ec;
+  if (idle_.empty()) {
+    socket.reset(new FiberSyncSocket("localhost", port_, io_context_));
+    ec = socket->ClientWaitToConnect(2000);
+    if (ec)
+      return Status(StatusCode::IO_ERROR, ec.message());
+  } else {
+    socket = std::move(idle_.back());
+    idle_.pop_back();
+  }
+
+  // The stand-in uses path-style addressing. The request may be resent, so we restore
+  // its original target.
+  string target(req->target());
+  req->target(absl::StrCat("/", bucket_, target));
+  req->set(h2::field::host, "localhost");
+  req->keep_alive(true);
+  h2::write(*socket, *req, ec);
+  req->target(target);
+
+  h2::response_parser<h2::string_body> parser;
+  parser.body_limit(kuint64max);
+  beast::flat_buffer buffer;
+  if (!ec)
+    h2::read(*socket, buffer, parser, ec);
+  if (ec)
+    return Status(StatusCode::IO_ERROR, ec.message());
+
+  S3Response resp = parser.release();
+  if (resp.keep_alive()) {
+    idle_.push_back(std::move(socket));
+  } else {
+    socket->Shutdown(ec);
+  }
+  return resp;
+}
+
+}  // namespace
+
+S3StandIn::S3StandIn(const Options& opts) : opts_(opts), rand_(opts.seed) {}
+
+ConnectionHandler* S3StandIn::NewConnection(IoContext& cntx) {
+  return new StandInHandler(this, &cntx);
+}
+
+S3Response S3StandIn::Handle(const S3Request& req) {
+  stats_.requests.fetch_add(1, std::memory_order_relaxed);
+
+  absl::string_view target(req.target().data(), req.target().size());
+  size_t pos = target.find('?');
+  bool is_part = req.method() == h2::verb::put && pos != absl::string_view::npos &&
+                 absl::StrContains(target.substr(pos), "uploadId=");
+
+  if (is_part) {
+    unsigned inflight = stats_.inflight_parts.fetch_add(1) + 1;
+    unsigned prev = stats_.max_inflight_parts.load();
+    while (prev < inflight && !stats_.max_inflight_parts.compare_exchange_weak(prev, inflight)) {
+    }
+  }
+  if (opts_.latency_ms) {
+    this_fiber::sleep_for(chrono::milliseconds(opts_.latency_ms));
+  }
+  if (is_part) {
+    stats_.inflight_parts.fetch_sub(1);
+  }
+
+  if (InjectError()) {
+    stats_.injected_errors.fetch_add(1, std::memory_order_relaxed);
+    return ErrorResponse(h2::status::service_unavailable, "SlowDown");
+  }
+  if (opts_.fail_cb && opts_.fail_cb(req)) {
+    return ErrorResponse(h2::status::internal_server_error, "InternalError");
+  }
+
+  absl::string_view path = target.substr(0, pos);
+  if (!absl::ConsumePrefix(&path, "/") || path.empty())
+    return ErrorResponse(h2::status::bad_request, "InvalidURI");
+
+  size_t slash = path.find('/');
+  string bucket_name(path.substr(0, slash));
+  string key = slash == absl::string_view::npos ? string{} : string(path.substr(slash + 1));
+
+  Args args;
+  if (pos != absl::string_view::npos) {
+    for (absl::string_view arg : absl::StrSplit(target.substr(pos + 1), '&')) {
+      size_t eq = arg.find('=');
+      args[string(arg.substr(0, eq))] =
+          eq == absl::string_view::npos ? string{} : UrlDecode(arg.substr(eq + 1));
+    }
+  }
+
+  auto id_it = args.find("uploadId");
+  if (req.method() == h2::verb::put && id_it != args.end()) {
+    unsigned number = 0;
+    if (!absl::SimpleAtoi(args["partNumber"], &number))
+      return ErrorResponse(h2::status::bad_request, "InvalidArgument");
+    return UploadPart(id_it->second, number, req.body());
+  }
+
+  std::lock_guard<std::mutex> lk(mu_);
+  Bucket& bucket = buckets_[bucket_name];
+
+  switch (req.method()) {
+    case h2::verb::get:
+      if (key.empty())
+        return List(bucket, &args);
+      return GetObject(bucket, key, req);
+    case h2::verb::put:
+      bucket[key] = req.body();
+      return S3Response{h2::status::ok, 11};
+    case h2::verb::post:
+      if (args.count("uploads")) {
+        string id = absl::StrCat("upload-", next_upload_++);
+        uploads_[id] = Upload{bucket_name, key, {}};
+        stats_.uploads.fetch_add(1, std::memory_order_relaxed);
+
+        S3Response resp{h2::status::ok, 11};
+        resp.body() = absl::StrCat(kXmlHeader, "<InitiateMultipartUploadResult ", kXmlNs,
+                                   "><Bucket>", bucket_name, "</Bucket><Key>", key,
+                                   "</Key><UploadId>", id,
+                                   "</UploadId></InitiateMultipartUploadResult>");
+        return resp;
+      }
+      if (id_it != args.end())
+        return Complete(id_it->second, req.body());
+      break;
+    case h2::verb::delete_:
+      if (id_it == args.end()) {
+        bucket.erase(key);
+        return S3Response{h2::status::no_content, 11};
+      }
+      if (!uploads_.erase(id_it->second))
+        return ErrorResponse(h2::status::not_found, "NoSuchUpload");
+      stats_.aborted_uploads.fetch_add(1, std::memory_order_relaxed);
+      return S3Response{h2::status::no_content, 11};
+    default:
+      break;
+  }
+
+  return ErrorResponse(h2::status::bad_request, "InvalidRequest");
+}
+
+S3Response S3StandIn::GetObject(const Bucket& bucket, const string& key, const S3Request& req) {
+  auto it = bucket.find(key);
+  if (it == bucket.end())
+    return ErrorResponse(h2::status::not_found, "NoSuchKey");
+
+  const string& data = it->second;
+  auto range_it = req.find(h2::field::range);
+  if (range_it == req.end()) {
+    S3Response resp{h2::status::ok, 11};
+    resp.body() = data;
+    return resp;
+  }
+
+  size_t from = 0, to = 0;
+  absl::string_view range(range_it->value().data(), range_it->value().size());
+  if (!ParseRange(range, data.size(), &from, &to))
+    return ErrorResponse(h2::status::bad_request, "InvalidArgument");
+  if (from >= data.size())
+    return ErrorResponse(h2::status::range_not_satisfiable, "InvalidRange");
+
+  S3Response resp{h2::status::partial_content, 11};
+  resp.set(h2::field::content_range,
+           absl::StrCat("bytes ", from, "-", to - 1, "/", data.size()));
+  resp.body() = data.substr(from, to - from);
+  return resp;
+}
+
+S3Response S3StandIn::List(const Bucket& bucket, Args* args) {
+  if (!args->count("list-type"))
+    return ErrorResponse(h2::status::bad_request, "InvalidRequest");
+  stats_.lists.fetch_add(1, std::memory_order_relaxed);
+
+  const string& prefix = (*args)["prefix"];
+  const string& token = (*args)["continuation-token"];
+  bool delimiter = args->count("delimiter");
+
+  S3Response resp{h2::status::ok, 11};
+  string& body = resp.body();
+  body = absl::StrCat(kXmlHeader, "<ListBucketResult ", kXmlNs, ">");
+
+  // The continuation token is the last key of the previous page.
+  auto it = token.empty() ? bucket.lower_bound(prefix) : bucket.upper_bound(token);
+  string last;
+  bool truncated = false;
+  for (unsigned count = 0; it != bucket.end() && absl::StartsWith(it->first, prefix); ++count) {
+    if (count == opts_.list_page_size) {
+      truncated = true;
+      break;
+    }
+
+    size_t pos = delimiter ? it->first.find('/', prefix.size()) : string::npos;
+    if (pos == string::npos) {
+      absl::StrAppend(&body, "<Contents><Key>", it->first, "</Key><Size>", it->second.size(),
+                      "</Size></Contents>");
+      last = it->first;
+      ++it;
+      continue;
+    }
+
+    string common = it->first.substr(0, pos + 1);
+    absl::StrAppend(&body, "<CommonPrefixes><Prefix>", common, "</Prefix></CommonPrefixes>");
+    for (; it != bucket.end() && absl::StartsWith(it->first, common); ++it) {
+      last = it->first;
+    }
+  }
+
+  if (truncated) {
+    absl::StrAppend(&body, "<IsTruncated>true</IsTruncated><NextContinuationToken>", last,
+                    "</NextContinuationToken>");
+  } else {
+    body.append("<IsTruncated>false</IsTruncated>");
+  }
+  body.append("</ListBucketResult>");
+
+  return resp;
+}
+
+S3Response S3StandIn::UploadPart(const string& id, unsigned number, const string& body) {
+  std::lock_guard<std::mutex> lk(mu_);
+
+  auto it = uploads_.find(id);
+  if (it == uploads_.end())
+    return ErrorResponse(h2::status::not_found, "NoSuchUpload");
+
+  it->second.parts[number] = body;
+
+  S3Response resp{h2::status::ok, 11};
+  resp.set(h2::field::etag, absl::StrCat("\"etag-", number, "\""));
+  return resp;
+}
+
+S3Response S3StandIn::Complete(const string& id, const string& body) {
+  auto upload_it = uploads_.find(id);
+  if (upload_it == uploads_.end())
+    return ErrorResponse(h2::status::not_found, "NoSuchUpload");
+
+  Upload& upload = upload_it->second;
+  string object;
+  unsigned number = 0;
+
+  // Verifies that the parts are listed in order with their etags.
+  for (absl::string_view part : absl::StrSplit(body, "<Part>", absl::SkipEmpty())) {
+    if (!absl::StartsWith(part, "<PartNumber>"))
+      continue;
+    ++number;
+    string expected = absl::StrCat("<PartNumber>", number, "</PartNumber><ETag>\"etag-", number,
+                                   "\"</ETag></Part>");
+    auto it = upload.parts.find(number);
+    if (!absl::StartsWith(part, expected) || it == upload.parts.end())
+      return ErrorResponse(h2::status::bad_request, "InvalidPart");
+    object.append(it->second);
+  }
+
+  buckets_[upload.bucket][upload.key] = std::move(object);
+  uploads_.erase(upload_it);
+
+  S3Response resp{h2::status::ok, 11};
+  resp.body() = absl::StrCat(kXmlHeader, "<CompleteMultipartUploadResult ", kXmlNs,
+                             "><ETag>\"etag\"</ETag></CompleteMultipartUploadResult>");
+  return resp;
+}
+
+bool S3StandIn::InjectError() {
+  if (opts_.error_rate <= 0)
+    return false;
+
+  std::lock_guard<std::mutex> lk(mu_);
+  return std::uniform_real_distribution<double>{}(rand_) < opts_.error_rate;
+}
+
+void S3StandIn::PutObject(absl::string_view bucket, absl::string_view key, string data) {
+  std::lock_guard<std::mutex> lk(mu_);
+  buckets_[string(bucket)][string(key)] = std::move(data);
+}
+
+bool S3StandIn::GetObject(absl::string_view bucket, absl::string_view key, string* data) const {
+  std::lock_guard<std::mutex> lk(mu_);
+  auto it = buckets_.find(bucket);
+  if (it == buckets_.end())
+    return false;
+  auto obj_it = it->second.find(string(key));
+  if (obj_it == it->second.end())
+    return false;
+  *data = obj_it->second;
+  return true;
+}
+
+size_t S3StandIn::ObjectCount(absl::string_view bucket) const {
+  std::lock_guard<std::mutex> lk(mu_);
+  auto it = buckets_.find(bucket);
+  return it == buckets_.end() ? 0 : it->second.size();
+}
+
+S3SendCb MakeStandInSendCb(IoContext* io_context, uint16_t port, absl::string_view bucket) {
+  auto client = std::make_shared<StandInClient>(io_context, port, bucket);
+  return [client](S3Request* req) { return client->Send(req); };
+}
+
+}  // namespace util
@@ -0,0 +1,96 @@
+// Copyright 2020, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <random>
+
+#include "util/asio/connection_handler.h"
+#include "util/aws/s3.h"
+
+namespace util {
+
+/*! @brief In-memory S3 compatible server that runs on plain http.
+ *
+ * Serves PutObject, ranged GetObject, DeleteObject, multipart uploads and ListObjectsV2 with
+ * path-style addressing: "/bucket/key". Allows reproducible benchmarks and tests of the cloud
+ * IO path without the real clouds. The server can inject request latency, per connection
+ * bandwidth limits and errors. Register it with AcceptServer::AddListener().
+ */
+class S3StandIn : public ListenerInterface {
+ public:
+  struct Options {
+    unsigned latency_ms = 0;    // added before every response.
+    size_t bandwidth = 0;       // bytes per second of every connection. 0 - unlimited.
+    double error_rate = 0;      // fraction of the requests that fail with 503 SlowDown.
+    unsigned list_page_size = 1000;
+    uint32_t seed = 1;          // seeds the error injection.
+
+    //! If set, the requests for which it returns true fail with 500 InternalError.
+    std::function<bool(const S3Request&)> fail_cb;
+
+    Options() {}
+  };
+
+  struct Stats {
+    std::atomic_uint requests{0}, injected_errors{0}, lists{0};
+    std::atomic_uint uploads{0}, aborted_uploads{0};
+    std::atomic_uint inflight_parts{0}, max_inflight_parts{0};
+  };
+
+  explicit S3StandIn(const Options& opts = Options());
+
+  ConnectionHandler* NewConnection(IoContext& cntx) final;
+
+  //! Handles a single request. Thread-safe. Blocks the calling fiber for the latency.
+  S3Response Handle(const S3Request& req);
+
+  void PutObject(absl::string_view bucket, absl::string_view key, std::string data);
+
+  //! Returns false if the object does not exist.
+  bool GetObject(absl::string_view bucket, absl::string_view key, std::string* data) const;
+
+  size_t ObjectCount(absl::string_view bucket) const;
+
+  const Stats& stats() const { return stats_; }
+
+  const Options& options() const { return opts_; }
+
+ private:
+  struct Upload {
+    std::string bucket, key;
+    std::map<unsigned, std::string> parts;
+  };
+
+  using Bucket = std::map<std::string, std::string>;
+  using Args = std::map<std::string, std::string>;
+
+  S3Response GetObject(const Bucket& bucket, const std::string& key, const S3Request& req);
+  S3Response List(const Bucket& bucket, Args* args);
+  S3Response UploadPart(const std::string& id, unsigned number, const std::string& body);
+  S3Response Complete(const std::string& id, const std::string& body);
+
+  bool InjectError();
+
+  Options opts_;
+  Stats stats_;
+
+  mutable std::mutex mu_;
+  std::map<std::string, Bucket, std::less<>> buckets_;
+  std::map<std::string, Upload> uploads_;
+  unsigned next_upload_ = 0;
+  std::mt19937 rand_;
+};
+
+/*! @brief Returns the callback that sends the requests to the bucket of S3StandIn server.
+ *
+ * Keeps the idle connections open for the next requests. The callback must be used from
+ * io_context thread.
+ */
+S3SendCb MakeStandInSendCb(IoContext* io_context, uint16_t port, absl::string_view bucket);
+
+}  // namespace util
@@ -0,0 +1,215 @@
+// Copyright 2020, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/aws/s3.h"
+
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "util/asio/accept_server.h"
+#include "util/asio/io_context_pool.h"
+#include "util/aws/s3_stand_in.h"
+
+namespace util {
+
+using namespace boost;
+using namespace std;
+namespace h2 = beast::http;
+
+class S3WriteFileTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    pool_.reset(new IoContextPool);
+    pool_->Run();
+
+    S3StandIn::Options opts;
+    opts.latency_ms = 5;  // So that the concurrent requests overlap.
+    opts.list_page_size = list_page_size_;
+    opts.fail_cb = [this](const S3Request& req) {
+      absl::string_view target(req.target().data(), req.target().size());
+      return fail_part_ && absl::StrContains(target, absl::StrCat("partNumber=", fail_part_, "&"));
+    };
+    s3_.reset(new S3StandIn(opts));
+
+    server_.reset(new AcceptServer(pool_.get()));
+    port_ = server_->AddListener(0, s3_.get());
+    server_->Run();
+  }
+
+  void TearDown() override {
+    server_.reset();
+    pool_->Stop();
+  }
+
+  // Writes data in chunks and closes the file.
+  bool WriteObject(const string& key, const string& data, const S3WriteOptions& opts);
+
+  S3SendCb SendCb(IoContext* io_context) {
+    return MakeStandInSendCb(io_context, port_, "test");
+  }
+
+  string Object(const string& key) {
+    string res;
+    EXPECT_TRUE(s3_->GetObject("test", key, &res)) << key;
+    return res;
+  }
+
+  unsigned list_page_size_ = 1000, fail_part_ = 0;
+  std::unique_ptr<S3StandIn> s3_;
+  std::unique_ptr<AcceptServer> server_;
+  std::unique_ptr<IoContextPool> pool_;
+  uint16_t port_ = 0;
+};
+
+bool S3WriteFileTest::WriteObject(const string& key, const string& data,
+                                  const S3WriteOptions& opts) {
+  IoContext& io_context = pool_->GetNextContext();
+
+  return io_context.AwaitSafe([&] {
+    auto res = OpenS3WriteFile(key, SendCb(&io_context), opts);
+    CHECK_STATUS(res.status);
+
+    file::WriteFile* fl = res.obj;
+    for (size_t i = 0; i < data.size(); i += 10000) {
+      if (!fl->Write(absl::string_view(data).substr(i, 10000)).ok())
+        break;
+    }
+    return fl->Close();
+  });
+}
+
+static string GenerateData(size_t size) {
+  string res;
+  for (unsigned i = 0; res.size() < size; ++i) {
+    absl::StrAppend(&res, "line ", i, "\n");
+  }
+  return res;
+}
+
+TEST_F(S3WriteFileTest, Small) {
+  string data = GenerateData(1000);
+  ASSERT_TRUE(WriteObject("dir/small", data, S3WriteOptions{}));
+
+  EXPECT_EQ(0, s3_->stats().uploads);
+  EXPECT_EQ(data, Object("dir/small"));
+}
+
+TEST_F(S3WriteFileTest, Multipart) {
+  S3WriteOptions opts;
+  opts.part_size = 1 << 16;
+  opts.max_parallel_parts = 4;
+
+  string data = GenerateData((10 << 16) + 17);
+  ASSERT_TRUE(WriteObject("dir/large", data, opts));
+
+  EXPECT_EQ(1, s3_->stats().uploads);
+  EXPECT_TRUE(data == Object("dir/large"));
+  EXPECT_GT(s3_->stats().max_inflight_parts, 1);
+  EXPECT_LE(s3_->stats().max_inflight_parts, 4);
+}
+
+class S3PartFailureTest : public S3WriteFileTest {
+ protected:
+  void SetUp() override {
+    fail_part_ = 3;
+    S3WriteFileTest::SetUp();
+  }
+};
+
+TEST_F(S3PartFailureTest, PartFailure) {
+  S3WriteOptions opts;
+  opts.part_size = 1 << 16;
+
+  EXPECT_FALSE(WriteObject("dir/failed", GenerateData(10 << 16), opts));
+
+  // The upload is aborted and the object is not created.
+  EXPECT_EQ(1, s3_->stats().aborted_uploads);
+  EXPECT_EQ(0, s3_->ObjectCount("test"));
+}
+
+TEST_F(S3WriteFileTest, Abort) {
+  S3WriteOptions opts;
+  opts.part_size = 1 << 16;
+  string data = GenerateData(5 << 16);
+
+  IoContext& io_context = pool_->GetNextContext();
+  io_context.AwaitSafe([&] {
+    file::WriteFile* fl = CHECKED_GET(OpenS3WriteFile("dir/aborted", SendCb(&io_context), opts));
+    CHECK_STATUS(fl->Write(data));
+    EXPECT_TRUE(fl->Abort());
+  });
+
+  EXPECT_EQ(1, s3_->stats().aborted_uploads);
+  EXPECT_EQ(0, s3_->ObjectCount("test"));
+}
+
+class S3ListTest : public S3WriteFileTest {
+ protected:
+  void SetUp() override {
+    list_page_size_ = 3;
+    S3WriteFileTest::SetUp();
+  }
+};
+
+TEST_F(S3ListTest, ListParallel) {
+  std::map<string, size_t> objects;
+  for (unsigned i = 0; i < 10; ++i) {
+    objects[absl::StrCat("list/file", i)] = i;
+    for (unsigned j = 0; j < 20; ++j) {
+      objects[absl::StrCat("list/d", i, "/e", j % 4, "/obj", j)] = 4;
+    }
+  }
+  for (const auto& k_v : objects) {
+    s3_->PutObject("test", k_v.first, string(k_v.second, 'a'));
+  }
+  s3_->PutObject("test", "other/obj", "data");
+
+  std::map<string, size_t> listed;
+  IoContext& io_context = pool_->GetNextContext();
+  Status st = io_context.AwaitSafe([&] {
+    return ListS3Parallel(SendCb(&io_context), "list/", 4, [&](size_t sz, absl::string_view key) {
+      EXPECT_TRUE(listed.emplace(key, sz).second) << key;
+    });
+  });
+  ASSERT_TRUE(st.ok()) << st;
+  EXPECT_EQ(objects, listed);
+
+  // Every partition is listed with several pages.
+  EXPECT_GT(s3_->stats().lists, 51);
+}
+
+class S3ReadFileTest : public S3WriteFileTest {};
+
+TEST_F(S3ReadFileTest, ReadRanges) {
+  string data = GenerateData((3 << 16) + 17);
+  s3_->PutObject("test", "dir/obj", data);
+  s3_->PutObject("test", "dir/empty", "");
+
+  file::ReadonlyFile::Options opts;
+  opts.parallel_range_size = 1 << 14;
+  opts.max_parallel_ranges = 4;
+
+  IoContext& io_context = pool_->GetNextContext();
+  io_context.AwaitSafe([&] {
+    file::ReadonlyFile* fl = CHECKED_GET(OpenS3ReadFile("dir/obj", SendCb(&io_context), opts));
+    ASSERT_EQ(data.size(), fl->Size());
+
+    string res(data.size() + 10, '\0');
+    auto read_res =
+        fl->Read(0, strings::MutableByteRange(reinterpret_cast<uint8_t*>(&res[0]), res.size()));
+    ASSERT_TRUE(read_res.ok()) << read_res.status;
+    res.resize(read_res.obj);
+    EXPECT_TRUE(data == res);
+    CHECK_STATUS(fl->Close());
+    delete fl;
+
+    fl = CHECKED_GET(OpenS3ReadFile("dir/empty", SendCb(&io_context), opts));
+    EXPECT_EQ(0, fl->Size());
+    delete fl;
+
+    EXPECT_FALSE(OpenS3ReadFile("dir/missing", SendCb(&io_context), opts).ok());
+  });
+}
+
+}  // namespace util
@@ -0,0 +1,287 @@
+// Copyright 2020, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+
+#include <libxml/xpath.h>
+#include <libxml/xpathInternals.h>
+
+#include "absl/strings/str_cat.h"
+#include "base/logging.h"
+#include "strings/escaping.h"
+
+#include "util/aws/s3.h"
+#include "util/cloud/part_uploader.h"
+
+namespace util {
+
+using file::WriteFile;
+
+using namespace boost;
+namespace h2 = beast::http;
+using std::string;
+
+namespace {
+
+// S3 limits the number of parts of a single upload.
+constexpr size_t kMaxParts = 10000;
+
+// Finds the text of the first element with the given name regardless of its namespace,
+// since S3 compatible servers do not always specify the S3 namespace.
+bool FindXmlElement(const string& xml, const char* name, string* dest) {
+  xmlDocPtr doc = xmlReadMemory(xml.data(), xml.size(), NULL, NULL, 0);
+  if (!doc)
+    return false;
+
+  xmlXPathContextPtr xpathCtx = xmlXPathNewContext(doc);
+  CHECK(xpathCtx);
+
+  string expr = absl::StrCat("//*[local-name()='", name, "']");
+  xmlXPathObjectPtr xpathObj = xmlXPathEvalExpression(BAD_CAST expr.c_str(), xpathCtx);
+  bool found = false;
+  if (xpathObj && xpathObj->nodesetval && xpathObj->nodesetval->nodeNr > 0) {
+    xmlChar* content = xmlNodeGetContent(xpathObj->nodesetval->nodeTab[0]);
+    if (content) {
+      dest->assign(reinterpret_cast<const char*>(content));
+      xmlFree(content);
+      found = true;
+    }
+  }
+
+  xmlXPathFreeObject(xpathObj);
+  xmlXPathFreeContext(xpathCtx);
+  xmlFreeDoc(doc);
+
+  return found;
+}
+
+Status ResponseError(const char* op, const S3Response& resp) {
+  string msg = absl::StrCat(op, " failed with status ", resp.result_int());
+  string code;
+  if (FindXmlElement(resp.body(), "Code", &code)) {
+    absl::StrAppend(&msg, ": ", code);
+  }
+  return Status(StatusCode::IO_ERROR, msg);
+}
+
+class S3WriteFile : public WriteFile {
+ public:
+  S3WriteFile(absl::string_view key_path, S3SendCb send_cb, const S3WriteOptions& opts);
+
+  bool Close() final;
+
+  // Aborts the multipart upload.
+  bool Abort() final;
+
+  bool Open() final;
+
+  Status Write(const uint8* buffer, uint64 length) final;
+
+ private:
+  // Starts uploading buf_ as the next part. Blocks while max_parallel_parts uploads
+  // are in flight.
+  Status FlushPart();
+
+  Status InitiateUpload();
+  Status UploadPart(unsigned number, string body, string* etag);
+  Status CompleteUpload();
+  void AbortUpload();
+
+  // Sends the request and converts unsuccessful responses into errors.
+  StatusObject<S3Response> Send(h2::verb verb, string target, string body, const char* op);
+
+  const string url_;
+  S3SendCb send_cb_;
+  S3WriteOptions opts_;
+
+  string buf_;
+  bool multipart_ = false;
+  string upload_id_, upload_query_;
+  cloud::PartUploader parts_;  // The part ids are etags.
+};
+
+S3WriteFile::S3WriteFile(absl::string_view key_path, S3SendCb send_cb, const S3WriteOptions& opts)
+    : WriteFile(key_path), url_(absl::StrCat("/", key_path)), send_cb_(std::move(send_cb)),
+      opts_(opts), parts_(opts.max_parallel_parts) {
+  CHECK_GT(opts_.part_size, 0);
+  CHECK_GT(opts_.max_parallel_parts, 0);
+
+  buf_.reserve(opts_.part_size);
+}
+
+bool S3WriteFile::Open() {
+  LOG(FATAL) << "Should not be called";
+
+  return true;
+}
+
+Status S3WriteFile::Write(const uint8* buffer, uint64 length) {
+  while (length) {
+    size_t sz = std::min<size_t>(length, opts_.part_size - buf_.size());
+    buf_.append(reinterpret_cast<const char*>(buffer), sz);
+    buffer += sz;
+    length -= sz;
+
+    if (buf_.size() == opts_.part_size) {
+      RETURN_IF_ERROR(FlushPart());
+    }
+  }
+
+  return Status::OK;
+}
+
+Status S3WriteFile::FlushPart() {
+  multipart_ = true;
+  if (upload_id_.empty()) {
+    RETURN_IF_ERROR(InitiateUpload());
+  }
+
+  if (parts_.size() == kMaxParts) {
+    return Status(StatusCode::IO_ERROR, "Too many parts");
+  }
+
+  unsigned number = parts_.size() + 1;  // S3 part numbers start from 1.
+
+  string body;
+  body.swap(buf_);
+  buf_.reserve(opts_.part_size);
+
+  return parts_.Add([this, number, body = std::move(body)](string* etag) mutable {
+    return UploadPart(number, std::move(body), etag);
+  });
+}
+
+bool S3WriteFile::Close() {
+  Status res;
+  if (!multipart_) {
+    // Small object - uploaded with a single request.
+    res = Send(h2::verb::put, url_, std::move(buf_), "PutObject").status;
+  } else {
+    if (buf_.size())
+      res = FlushPart();
+    Status wait_res = parts_.Wait();
+    if (res.ok())
+      res = wait_res;
+    if (res.ok())
+      res = CompleteUpload();
+    if (!res.ok())
+      AbortUpload();
+  }
+
+  if (res.ok()) {
+    VLOG(1) << "Closed file " << create_file_name() << " with " << parts_.size() << " parts";
+  } else {
+    LOG(ERROR) << "Error closing S3 file " << create_file_name() << ", status " << res;
+  }
+  delete this;
+
+  return res.ok();
+}
+
+bool S3WriteFile::Abort() {
+  parts_.Wait();
+  AbortUpload();
+
+  VLOG(1) << "Aborted file " << create_file_name();
+  delete this;
+
+  return true;
+}
+
+Status S3WriteFile::InitiateUpload() {
+  auto res = Send(h2::verb::post, absl::StrCat(url_, "?uploads"), string{},
+                  "CreateMultipartUpload");
+  if (!res.ok())
+    return res.status;
+
+  if (!FindXmlElement(res.obj.body(), "UploadId", &upload_id_) || upload_id_.empty()) {
+    return Status(StatusCode::PARSE_ERROR, "Can not find UploadId");
+  }
+  upload_query_ = "uploadId=";
+  strings::AppendEncodedUrl(upload_id_, &upload_query_);
+  VLOG(1) << "Started upload " << upload_id_ << " for " << create_file_name();
+
+  return Status::OK;
+}
+
+Status S3WriteFile::UploadPart(unsigned number, string body, string* etag) {
+  string target = absl::StrCat(url_, "?partNumber=", number, "&", upload_query_);
+  auto res = Send(h2::verb::put, std::move(target), std::move(body), "UploadPart");
+  if (!res.ok())
+    return res.status;
+
+  auto it = res.obj.find(h2::field::etag);
+  if (it == res.obj.end()) {
+    return Status(StatusCode::PARSE_ERROR, "Can not find etag header");
+  }
+  *etag = string(it->value());
+  VLOG(1) << "Uploaded part " << number << " of " << create_file_name();
+
+  return Status::OK;
+}
+
+Status S3WriteFile::CompleteUpload() {
+  string body = "<CompleteMultipartUpload>";
+  for (size_t i = 0; i < parts_.size(); ++i) {
+    absl::StrAppend(&body, "<Part><PartNumber>", i + 1, "</PartNumber><ETag>", parts_.id(i),
+                    "</ETag></Part>");
+  }
+  body.append("</CompleteMultipartUpload>");
+
+  auto res = Send(h2::verb::post, absl::StrCat(url_, "?", upload_query_), std::move(body),
+                  "CompleteMultipartUpload");
+  if (!res.ok())
+    return res.status;
+
+  // S3 may fail the completion after it has sent 200 OK. The error is passed in the body then.
+  string code;
+  if (FindXmlElement(res.obj.body(), "Code", &code)) {
+    return ResponseError("CompleteMultipartUpload", res.obj);
+  }
+  return Status::OK;
+}
+
+void S3WriteFile::AbortUpload() {
+  if (upload_id_.empty())
+    return;
+
+  auto res = Send(h2::verb::delete_, absl::StrCat(url_, "?", upload_query_), string{},
+                  "AbortMultipartUpload");
+  LOG_IF(WARNING, !res.ok()) << "Could not abort upload of " << create_file_name() << ": "
+                             << res.status;
+}
+
+StatusObject<S3Response> S3WriteFile::Send(h2::verb verb, string target, string body,
+                                           const char* op) {
+  S3Request req{verb, target, 11};
+  req.body() = std::move(body);
+  req.prepare_payload();
+
+  auto res = send_cb_(&req);
+  if (!res.ok())
+    return res.status;
+
+  if (h2::to_status_class(res.obj.result()) != h2::status_class::successful) {
+    LOG(ERROR) << op << " " << target << " failed: " << res.obj.result_int() << " "
+               << res.obj.body();
+    return ResponseError(op, res.obj);
+  }
+
+  return res;
+}
+
+}  // namespace
+
+StatusObject<file::WriteFile*> OpenS3WriteFile(absl::string_view key_path, const AWS& aws,
+                                               http::HttpsClientPool* pool,
+                                               const S3WriteOptions& opts) {
+  CHECK(pool);
+
+  return OpenS3WriteFile(key_path, MakeS3SendCb(aws, pool), opts);
+}
+
+StatusObject<file::WriteFile*> OpenS3WriteFile(absl::string_view key_path, S3SendCb send_cb,
+                                               const S3WriteOptions& opts) {
+  return new S3WriteFile(key_path, std::move(send_cb), opts);
+}
+
+}  // namespace util
@@ -0,0 +1,84 @@
+// Copyright 2020, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+
+#include "util/cloud/object_store.h"
+
+#include "util/gce/gcs.h"
+
+namespace util {
+namespace cloud {
+
+using namespace std;
+
+ObjectStore::~ObjectStore() {
+}
+
+bool ObjectStore::SplitUrl(absl::string_view url, absl::string_view* scheme,
+                           absl::string_view* bucket, absl::string_view* key) {
+  size_t pos = url.find("://");
+  if (pos == absl::string_view::npos)
+    return false;
+
+  *scheme = url.substr(0, pos);
+  if (*scheme != "gs" && *scheme != "s3")
+    return false;
+
+  url.remove_prefix(pos + 3);
+  pos = url.find('/');
+  *bucket = url.substr(0, pos);
+  *key = (pos == absl::string_view::npos) ? absl::string_view{} : url.substr(pos + 1);
+
+  return !bucket->empty();
+}
+
+Status GcsStore::List(absl::string_view bucket, absl::string_view prefix, ListCb cb) {
+  return ListGcsParallel(gce_, pool_, bucket, prefix, max_parallel_list_, std::move(cb));
+}
+
+StatusObject<file::ReadonlyFile*> GcsStore::OpenReadFile(absl::string_view bucket,
+                                                         absl::string_view key,
+                                                         const file::ReadonlyFile::Options& opts) {
+  return OpenGcsReadFile(ToUrl(bucket, key), gce_, pool_, opts);
+}
+
+StatusObject<file::WriteFile*> GcsStore::OpenWriteFile(absl::string_view bucket,
+                                                       absl::string_view key,
+                                                       const ObjectWriteOptions& opts) {
+  GcsWriteOptions gcs_opts;
+  gcs_opts.part_size = opts.part_size;
+  gcs_opts.max_parallel_parts = opts.max_parallel_parts;
+
+  return OpenGcsWriteFile(ToUrl(bucket, key), gce_, pool_, gcs_opts);
+}
+
+string GcsStore::ToUrl(absl::string_view bucket, absl::string_view key) const {
+  return GCS::ToGcsPath(bucket, key);
+}
+
+Status S3Store::List(absl::string_view bucket, absl::string_view prefix, ListCb cb) {
+  return ListS3Parallel(bucket_cb_(bucket), prefix, max_parallel_list_, std::move(cb));
+}
+
+StatusObject<file::ReadonlyFile*> S3Store::OpenReadFile(absl::string_view bucket,
+                                                        absl::string_view key,
+                                                        const file::ReadonlyFile::Options& opts) {
+  return OpenS3ReadFile(key, bucket_cb_(bucket), opts);
+}
+
+StatusObject<file::WriteFile*> S3Store::OpenWriteFile(absl::string_view bucket,
+                                                      absl::string_view key,
+                                                      const ObjectWriteOptions& opts) {
+  S3WriteOptions s3_opts;
+  s3_opts.part_size = opts.part_size;
+  s3_opts.max_parallel_parts = opts.max_parallel_parts;
+
+  return OpenS3WriteFile(key, bucket_cb_(bucket), s3_opts);
+}
+
+string S3Store::ToUrl(absl::string_view bucket, absl::string_view key) const {
+  return S3Bucket::ToFullPath(bucket, key);
+}
+
+}  // namespace cloud
+}  // namespace util
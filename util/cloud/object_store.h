@@ -0,0 +1,121 @@
+// Copyright 2020, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+
+#pragma once
+
+#include <functional>
+
+#include "file/file.h"
+#include "util/aws/s3.h"
+#include "util/status.h"
+
+namespace util {
+
+class GCE;
+
+namespace cloud {
+
+struct ObjectWriteOptions {
+  //! Objects larger than part_size are uploaded as parts that are composed on Close():
+  //! GCS composes the part objects, S3 completes the multipart upload.
+  size_t part_size = 1 << 23;
+
+  //! Maximal number of part uploads in flight.
+  unsigned max_parallel_parts = 4;
+};
+
+/*! @brief Common interface of the cloud object stores.
+ *
+ * Objects are addressed by (bucket, key) pairs. All the calls must be made from the IoContext
+ * thread that sponsors the connections of the store. The store does not own the returned
+ * files.
+ */
+class ObjectStore {
+ public:
+  //! Called with (size, key) pairs.
+  using ListCb = std::function<void(size_t, absl::string_view)>;
+
+  virtual ~ObjectStore();
+
+  //! Lists recursively all the objects under prefix with concurrent requests.
+  virtual Status List(absl::string_view bucket, absl::string_view prefix, ListCb cb) = 0;
+
+  //! Opens the object for sequential reading. If opts.parallel_range_size is set, the object
+  //! is fetched ahead with concurrent ranged requests.
+  virtual StatusObject<file::ReadonlyFile*> OpenReadFile(
+      absl::string_view bucket, absl::string_view key,
+      const file::ReadonlyFile::Options& opts = file::ReadonlyFile::Options{}) = 0;
+
+  //! Opens the object for streaming writes. The object becomes visible when the file is
+  //! closed successfully.
+  virtual StatusObject<file::WriteFile*> OpenWriteFile(
+      absl::string_view bucket, absl::string_view key,
+      const ObjectWriteOptions& opts = ObjectWriteOptions{}) = 0;
+
+  //! Returns the url of the object, i.e. "gs://bucket/key".
+  virtual std::string ToUrl(absl::string_view bucket, absl::string_view key) const = 0;
+
+  /*! @brief Splits "gs://bucket/key" or "s3://bucket/key" url.
+   *
+   * Returns false if the url does not belong to a cloud store. scheme is set to "gs" or "s3".
+   * key is empty if the url has only the bucket.
+   */
+  static bool SplitUrl(absl::string_view url, absl::string_view* scheme,
+                       absl::string_view* bucket, absl::string_view* key);
+};
+
+//! GCS backend. Sends the requests via the api connections of pool.
+class GcsStore : public ObjectStore {
+ public:
+  GcsStore(const GCE& gce, http::HttpsClientPool* pool, unsigned max_parallel_list = 16)
+      : gce_(gce), pool_(pool), max_parallel_list_(max_parallel_list) {
+  }
+
+  Status List(absl::string_view bucket, absl::string_view prefix, ListCb cb) final;
+
+  StatusObject<file::ReadonlyFile*> OpenReadFile(absl::string_view bucket, absl::string_view key,
+                                                 const file::ReadonlyFile::Options& opts) final;
+
+  StatusObject<file::WriteFile*> OpenWriteFile(absl::string_view bucket, absl::string_view key,
+                                               const ObjectWriteOptions& opts) final;
+
+  std::string ToUrl(absl::string_view bucket, absl::string_view key) const final;
+
+ private:
+  const GCE& gce_;
+  http::HttpsClientPool* pool_;
+  unsigned max_parallel_list_;
+};
+
+/*! @brief S3 backend.
+ *
+ * S3 api is bucket centric, therefore the requests are sent via the callback that
+ * bucket_cb returns for the bucket. Works with any S3 compatible endpoint, including
+ * S3StandIn server.
+ */
+class S3Store : public ObjectStore {
+ public:
+  using BucketCb = std::function<S3SendCb(absl::string_view bucket)>;
+
+  explicit S3Store(BucketCb bucket_cb, unsigned max_parallel_list = 16)
+      : bucket_cb_(std::move(bucket_cb)), max_parallel_list_(max_parallel_list) {
+  }
+
+  Status List(absl::string_view bucket, absl::string_view prefix, ListCb cb) final;
+
+  StatusObject<file::ReadonlyFile*> OpenReadFile(absl::string_view bucket, absl::string_view key,
+                                                 const file::ReadonlyFile::Options& opts) final;
+
+  StatusObject<file::WriteFile*> OpenWriteFile(absl::string_view bucket, absl::string_view key,
+                                               const ObjectWriteOptions& opts) final;
+
+  std::string ToUrl(absl::string_view bucket, absl::string_view key) const final;
+
+ private:
+  BucketCb bucket_cb_;
+  unsigned max_parallel_list_;
+};
+
+}  // namespace cloud
+}  // namespace util
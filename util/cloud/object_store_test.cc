@@ -0,0 +1,151 @@
+// Copyright 2020, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/cloud/object_store.h"
+
+#include "absl/strings/str_cat.h"
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "util/asio/accept_server.h"
+#include "util/asio/io_context_pool.h"
+#include "util/aws/s3_stand_in.h"
+
+namespace util {
+namespace cloud {
+
+using namespace std;
+
+class ObjectStoreTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    pool_.reset(new IoContextPool);
+    pool_->Run();
+  }
+
+  void TearDown() override {
+    server_.reset();
+    pool_->Stop();
+  }
+
+  void StartServer(const S3StandIn::Options& opts) {
+    s3_.reset(new S3StandIn(opts));
+    server_.reset(new AcceptServer(pool_.get()));
+    port_ = server_->AddListener(0, s3_.get());
+    server_->Run();
+  }
+
+  S3Store::BucketCb BucketCb(IoContext* io_context) {
+    return [this, io_context](absl::string_view bucket) {
+      return RetryingS3SendCb(MakeStandInSendCb(io_context, port_, bucket));
+    };
+  }
+
+  // Writes and reads back the object via store.
+  void WriteRead(ObjectStore* store, const string& key, const string& data);
+
+  std::unique_ptr<S3StandIn> s3_;
+  std::unique_ptr<AcceptServer> server_;
+  std::unique_ptr<IoContextPool> pool_;
+  uint16_t port_ = 0;
+};
+
+static string GenerateData(size_t size) {
+  string res;
+  for (unsigned i = 0; res.size() < size; ++i) {
+    absl::StrAppend(&res, "line ", i, "\n");
+  }
+  return res;
+}
+
+void ObjectStoreTest::WriteRead(ObjectStore* store, const string& key, const string& data) {
+  ObjectWriteOptions wopts;
+  wopts.part_size = 1 << 16;
+
+  file::WriteFile* wf = CHECKED_GET(store->OpenWriteFile("bucket", key, wopts));
+  for (size_t i = 0; i < data.size(); i += 10000) {
+    CHECK_STATUS(wf->Write(absl::string_view(data).substr(i, 10000)));
+  }
+  ASSERT_TRUE(wf->Close());
+
+  file::ReadonlyFile::Options ropts;
+  ropts.parallel_range_size = 1 << 15;
+  ropts.max_parallel_ranges = 4;
+  std::unique_ptr<file::ReadonlyFile> rf(CHECKED_GET(store->OpenReadFile("bucket", key, ropts)));
+  ASSERT_EQ(data.size(), rf->Size());
+
+  string res(data.size(), '\0');
+  auto read_res =
+      rf->Read(0, strings::MutableByteRange(reinterpret_cast<uint8_t*>(&res[0]), res.size()));
+  ASSERT_TRUE(read_res.ok()) << read_res.status;
+  EXPECT_EQ(data.size(), read_res.obj);
+  EXPECT_TRUE(data == res);
+  CHECK_STATUS(rf->Close());
+}
+
+TEST_F(ObjectStoreTest, SplitUrl) {
+  absl::string_view scheme, bucket, key;
+  ASSERT_TRUE(ObjectStore::SplitUrl("gs://bucket/dir/obj", &scheme, &bucket, &key));
+  EXPECT_EQ("gs", scheme);
+  EXPECT_EQ("bucket", bucket);
+  EXPECT_EQ("dir/obj", key);
+
+  ASSERT_TRUE(ObjectStore::SplitUrl("s3://bucket", &scheme, &bucket, &key));
+  EXPECT_EQ("s3", scheme);
+  EXPECT_EQ("bucket", bucket);
+  EXPECT_TRUE(key.empty());
+
+  EXPECT_FALSE(ObjectStore::SplitUrl("/tmp/file", &scheme, &bucket, &key));
+  EXPECT_FALSE(ObjectStore::SplitUrl("http://host/path", &scheme, &bucket, &key));
+  EXPECT_FALSE(ObjectStore::SplitUrl("s3:///path", &scheme, &bucket, &key));
+}
+
+TEST_F(ObjectStoreTest, S3) {
+  S3StandIn::Options opts;
+  opts.latency_ms = 2;
+  opts.list_page_size = 5;
+  StartServer(opts);
+
+  IoContext& io_context = pool_->GetNextContext();
+  io_context.AwaitSafe([&] {
+    S3Store store(BucketCb(&io_context), 4);
+    EXPECT_EQ("s3://bucket/dir/obj", store.ToUrl("bucket", "dir/obj"));
+
+    string data = GenerateData((5 << 16) + 17);
+    WriteRead(&store, "dir/large", data);
+    WriteRead(&store, "dir/small", "small");
+
+    for (unsigned i = 0; i < 20; ++i) {
+      s3_->PutObject("bucket", absl::StrCat("dir/sub", i % 3, "/obj", i), "data");
+    }
+
+    std::map<string, size_t> listed;
+    Status st = store.List("bucket", "dir/", [&](size_t sz, absl::string_view key) {
+      listed.emplace(key, sz);
+    });
+    ASSERT_TRUE(st.ok()) << st;
+    EXPECT_EQ(22, listed.size());
+    EXPECT_EQ(data.size(), listed["dir/large"]);
+  });
+
+  EXPECT_EQ(1, s3_->stats().uploads);
+}
+
+TEST_F(ObjectStoreTest, InjectedErrors) {
+  S3StandIn::Options opts;
+  opts.error_rate = 0.1;
+  opts.bandwidth = 50 << 20;
+  StartServer(opts);
+
+  IoContext& io_context = pool_->GetNextContext();
+  io_context.AwaitSafe([&] {
+    S3Store store(BucketCb(&io_context));
+
+    // The failed requests are retried.
+    WriteRead(&store, "obj", GenerateData(10 << 16));
+  });
+
+  EXPECT_GT(s3_->stats().injected_errors, 0);
+}
+
+}  // namespace cloud
+}  // namespace util
@@ -0,0 +1,56 @@
+// Copyright 2020, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/cloud/part_uploader.h"
+
+#include <boost/fiber/fiber.hpp>
+
+#include "base/logging.h"
+
+namespace util {
+namespace cloud {
+
+using namespace boost;
+
+PartUploader::PartUploader(unsigned max_parallel) : max_parallel_(max_parallel) {
+  CHECK_GT(max_parallel_, 0);
+}
+
+PartUploader::~PartUploader() {
+  Wait();
+}
+
+Status PartUploader::Add(UploadCb cb) {
+  if (parts_.size() - waited_parts_ >= max_parallel_) {
+    Part& oldest = parts_[waited_parts_++];
+    oldest.done.Wait();
+    RETURN_IF_ERROR(oldest.status);
+  }
+
+  parts_.emplace_back();
+  Part* part = &parts_.back();
+
+  // The fiber keeps its own reference to done since the uploader may be destroyed as soon as
+  // done is notified.
+  fibers::fiber([part, cb = std::move(cb), done = part->done]() mutable {
+    part->status = cb(&part->id);
+    done.Notify();
+  }).detach();
+
+  return Status::OK;
+}
+
+Status PartUploader::Wait() {
+  for (; waited_parts_ < parts_.size(); ++waited_parts_) {
+    parts_[waited_parts_].done.Wait();
+  }
+
+  for (const Part& part : parts_) {
+    if (!part.status.ok())
+      return part.status;
+  }
+  return Status::OK;
+}
+
+}  // namespace cloud
+}  // namespace util
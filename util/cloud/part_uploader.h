@@ -0,0 +1,60 @@
+// Copyright 2020, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <string>
+
+#include "util/fibers/fibers_ext.h"
+#include "util/status.h"
+
+namespace util {
+namespace cloud {
+
+/*! @brief Uploads the parts of an object concurrently.
+ *
+ * Each part is uploaded in its own fiber, and at most max_parallel uploads are in flight.
+ * Used by the object writers that upload large objects as parts: GCS part objects and
+ * S3 multipart uploads. Must be used from a single fiber.
+ */
+class PartUploader {
+ public:
+  //! Uploads a part. May set the id of the uploaded part that is needed to assemble
+  //! the object, for example S3 etag. Runs in the upload fiber of the part.
+  using UploadCb = std::function<Status(std::string* id)>;
+
+  explicit PartUploader(unsigned max_parallel);
+
+  //! Waits for the uploads in flight.
+  ~PartUploader();
+
+  //! Starts the upload of the next part. Blocks while max_parallel uploads are in flight.
+  //! Returns the error of the upload it waited for.
+  Status Add(UploadCb cb);
+
+  //! Waits for all the uploads. Returns the first error.
+  Status Wait();
+
+  //! Number of the added parts.
+  size_t size() const { return parts_.size(); }
+
+  //! Id of the part with the given 0-based index. Valid after Wait() succeeded.
+  const std::string& id(size_t index) const { return parts_[index].id; }
+
+ private:
+  struct Part {
+    std::string id;
+    Status status;
+    fibers_ext::Done done;
+  };
+
+  const unsigned max_parallel_;
+  std::deque<Part> parts_;  // deque keeps the part addresses stable for the upload fibers.
+  size_t waited_parts_ = 0;
+};
+
+}  // namespace cloud
+}  // namespace util
@@ -0,0 +1,48 @@
+// Copyright 2020, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/cloud/part_uploader.h"
+
+#include <boost/fiber/operations.hpp>
+
+#include "absl/strings/str_cat.h"
+#include "base/gtest.h"
+
+namespace util {
+namespace cloud {
+
+using namespace std;
+using namespace boost;
+
+TEST(PartUploaderTest, Parallel) {
+  PartUploader uploader(2);
+  unsigned in_flight = 0, max_in_flight = 0;
+  for (unsigned i = 0; i < 10; ++i) {
+    Status st = uploader.Add([&, i](string* id) {
+      max_in_flight = std::max(max_in_flight, ++in_flight);
+      this_fiber::sleep_for(chrono::milliseconds(1));
+      --in_flight;
+      *id = absl::StrCat("part", i);
+      return Status::OK;
+    });
+    ASSERT_TRUE(st.ok());
+  }
+  ASSERT_TRUE(uploader.Wait().ok());
+  EXPECT_EQ(2, max_in_flight);
+  EXPECT_EQ(10, uploader.size());
+  EXPECT_EQ("part7", uploader.id(7));
+}
+
+TEST(PartUploaderTest, Error) {
+  PartUploader uploader(1);
+  Status st = uploader.Add([](string*) { return Status(StatusCode::IO_ERROR, "failed"); });
+  ASSERT_TRUE(st.ok());
+
+  // The next part waits for the failed one.
+  st = uploader.Add([](string*) { return Status::OK; });
+  EXPECT_EQ(StatusCode::IO_ERROR, st.code());
+  EXPECT_EQ(StatusCode::IO_ERROR, uploader.Wait().code());
+}
+
+}  // namespace cloud
+}  // namespace util
@@ -6,6 +6,7 @@
 
 #include <boost/fiber/operations.hpp>
 
+#include "absl/strings/strip.h"
 #include "base/logging.h"
 #include "base/walltime.h"
 #include "util/http/https_client.h"
@@ -79,7 +80,10 @@ StatusObject<HttpsClientPool::ClientHandle> ApiSenderBase::SendGeneric(unsigned
     }
 
     if (ec == asio::error::no_permission) {
-      auto token_res = gce_.RefreshAccessToken(&pool_->io_context());
+      absl::string_view rejected = absl_sv(req[h2::field::authorization]);
+      absl::ConsumePrefix(&rejected, "Bearer ");
+
+      auto token_res = gce_.RefreshAccessToken(&pool_->io_context(), string(rejected));
       if (!token_res.ok())
         return token_res.status;
 
@@ -155,6 +159,11 @@ auto ApiSenderBufferBody::SendRequestIterative(const Request& req, http::HttpsCl
     return ec;
   }
 
+  // The ranged reads handle it, the response is already drained.
+  if (msg.result() == h2::status::range_not_satisfiable) {
+    return error_code{};
+  }
+
   if (DoesServerPushback(msg.result())) {
     LOG(INFO) << "Retrying(" << client->native_handle() << ") with " << msg;
 
@@ -177,6 +186,59 @@ auto ApiSenderBufferBody::SendRequestIterative(const Request& req, http::HttpsCl
   return h2::error::bad_status;
 }
 
+auto ApiSenderDynamicBody::SendRequestIterative(const Request& req, http::HttpsClient* client)
+    -> error_code {
+  system::error_code ec = client->Send(req);
+  if (ec) {
+    VLOG(1) << "Error sending to socket " << client->native_handle() << " " << ec;
+    return ec;
+  }
+
+  parser_.emplace();  // .body_limit(kuint64max);
+  ec = client->Read(&parser_.value());
+  if (ec) {
+    return ec;
+  }
+
+  if (!parser_->keep_alive()) {
+    client->schedule_reconnect();
+    LOG(INFO) << "Scheduling reconnect due to conn-close header";
+  }
+
+  const auto& msg = parser_->get();
+  VLOG(1) << "HeaderResp(" << client->native_handle() << "): " << msg;
+
+  // 308 or http ok are both good responses. 204 is returned by object deletions.
+  if (msg.result() == h2::status::ok || msg.result() == h2::status::permanent_redirect ||
+      msg.result() == h2::status::no_content) {
+    return error_code{};  // all is good.
+  }
+
+  if (DoesServerPushback(msg.result())) {
+    LOG(INFO) << "Retrying(" << client->native_handle() << ") with " << msg;
+
+    this_fiber::sleep_for(1s);
+    return asio::error::try_again;  // retry
+  }
+
+  if (IsUnauthorized(msg)) {
+    return asio::error::no_permission;
+  } else if (msg.result() == h2::status::gone) {
+    const Request::header_type& header = req;
+
+    LOG(INFO) << "Closing(" << client->native_handle() << ") with " << msg << " for request "
+              << header;
+
+    this_fiber::sleep_for(1s);
+
+    return system::errc::make_error_code(system::errc::connection_refused);
+  }
+
+  LOG(ERROR) << "Unexpected status " << msg;
+
+  return h2::error::bad_status;
+}
+
 static once_flag gcs_write_set_flag;
 
 void InitVarzStats() {
@@ -75,6 +75,8 @@ class ApiSenderBase {
   http::HttpsClientPool* const pool_;
 };
 
+// Reads the response headers, the body is read by the caller. Succeeds on 200 and 206 responses
+// and on 416 of the ranged reads, which is drained.
 class ApiSenderBufferBody : public ApiSenderBase {
  public:
   using Parser = h2::response_parser<h2::buffer_body>;
@@ -89,6 +91,21 @@ class ApiSenderBufferBody : public ApiSenderBase {
   absl::optional<Parser> parser_;
 };
 
+// Reads the whole response into a dynamic body.
+class ApiSenderDynamicBody : public ApiSenderBase {
+ public:
+  using Parser = h2::response_parser<h2::dynamic_body>;
+
+  using ApiSenderBase::ApiSenderBase;
+
+  //! Can be called only SendGeneric returned success.
+  Parser* parser() { return parser_.has_value() ? &parser_.value() : nullptr; }
+
+ private:
+  error_code SendRequestIterative(const Request& req, http::HttpsClient* client) final;
+  absl::optional<Parser> parser_;
+};
+
 
 extern ::std::unique_ptr<VarzQps> gcs_writes;
 extern ::std::unique_ptr<VarzMapAverage5m> gcs_latency;
@@ -21,10 +21,13 @@
 #include "absl/strings/str_split.h"
 #include "absl/strings/strip.h"
 #include "base/logging.h"
+#include "base/walltime.h"
 #include "file/file_util.h"
 #include "file/filesource.h"
 #include "util/asio/fiber_socket.h"
+#include "util/asio/periodic_task.h"
 #include "util/http/https_client.h"
+#include "util/stats/varz_stats.h"
 
 namespace util {
 using namespace std;
@@ -36,6 +39,11 @@ using tcp = asio::ip::tcp;
 
 static const char kMetaDataHost[] = "metadata.google.internal";
 
+// How often the background refresher checks the token expiry.
+constexpr unsigned kRefreshCheckSec = 10;
+
+static VarzMapAverage5m token_refresh("gce-token-refresh");
+
 static Status ToStatus(const system::error_code& ec) {
   return Status(StatusCode::IO_ERROR, absl::StrCat(ec.value(), ": ", ec.message()));
 }
@@ -212,12 +220,83 @@ util::Status GCE::ReadDevCreds(const std::string& root_path) {
   return Status::OK;
 }
 
+GCE::GCE() : metadata_host_(kMetaDataHost), metadata_port_("80") {
+}
+
+GCE::~GCE() {
+  StopTokenRefresher();
+}
+
 std::string GCE::access_token() const {
-  std::lock_guard<fibers::mutex> lk(mu_);
-  return access_token_;
+  auto token = std::atomic_load(&token_);
+  return token ? token->value : string{};
+}
+
+StatusObject<std::string> GCE::RefreshAccessToken(IoContext* context,
+                                                  const std::string& rejected) const {
+  unsigned fetch_cnt = fetch_cnt_.load(std::memory_order_acquire);
+
+  std::lock_guard<fibers::mutex> lk(refresh_mu_);
+  auto current = std::atomic_load(&token_);
+  bool fetched = fetch_cnt != fetch_cnt_.load(std::memory_order_relaxed);
+
+  // The metadata server may return the same token again, therefore we also share the result
+  // of a successful fetch that finished while we waited.
+  if (current && (current->value != rejected || (fetched && fetch_status_.ok()))) {
+    return current->value;
+  }
+
+  if (fetched) {
+    // The fetch that finished while we waited has failed. We share its error rather than
+    // repeat the same request from every waiter.
+    return fetch_status_;
+  }
+
+  uint64_t start = base::GetMonotonicMicrosFast();
+  auto res = FetchAccessToken(context);
+  token_refresh.IncBy(res.ok() ? "ok" : "error", base::GetMonotonicMicrosFast() - start);
+
+  fetch_status_ = res.status;
+  fetch_cnt_.fetch_add(1, std::memory_order_release);
+
+  return res;
+}
+
+void GCE::StartTokenRefresher(IoContext* context) {
+  CHECK(!refresher_);
+
+  refresher_.reset(new PeriodicTask(*context, chrono::seconds(kRefreshCheckSec)));
+  refresher_->Start([this, context](int ticks) {
+    auto token = std::atomic_load(&token_);
+    uint64_t deadline = base::GetMonotonicMicrosFast() + kRefreshMarginSec * 1000000ULL;
+    if (!token || !token->expire_usec || deadline < token->expire_usec)
+      return;
+    if (refreshing_.exchange(true))
+      return;
+
+    // PeriodicTask callbacks must not block, therefore we refresh in a separate fiber.
+    refresh_done_ = fibers_ext::Done{};
+    fibers::fiber([this, context, token, done = refresh_done_]() mutable {
+      auto res = RefreshAccessToken(context, token->value);
+      LOG_IF(ERROR, !res.ok()) << "Could not refresh access token: " << res.status;
+      refreshing_.store(false);
+      done.Notify();
+    }).detach();
+  });
 }
 
-StatusObject<std::string> GCE::RefreshAccessToken(IoContext* context) const {
+void GCE::StopTokenRefresher() {
+  if (!refresher_)
+    return;
+
+  refresher_->Cancel();
+  refresher_.reset();
+  if (refreshing_.load())
+    refresh_done_.Wait();
+}
+
+StatusObject<std::string> GCE::FetchAccessToken(IoContext* context) const {
+  uint64_t start = base::GetMonotonicMicrosFast();
   h2::response<h2::string_body> resp;
   error_code ec;
 
@@ -225,9 +304,9 @@ StatusObject<std::string> GCE::RefreshAccessToken(IoContext* context) const {
     h2::request<h2::empty_body> req{
         h2::verb::get, "/computeMetadata/v1/instance/service-accounts/default/token", 11};
     req.set("Metadata-Flavor", "Google");
-    req.set(h2::field::host, kMetaDataHost);
+    req.set(h2::field::host, metadata_host_);
 
-    FiberSyncSocket socket{kMetaDataHost, "80", context};
+    FiberSyncSocket socket{metadata_host_, metadata_port_, context};
     ec = socket.ClientWaitToConnect(2000);
     RETURN_ON_ERROR;
 
@@ -268,10 +347,11 @@ StatusObject<std::string> GCE::RefreshAccessToken(IoContext* context) const {
   }
   VLOG(1) << "Resp: " << resp;
 
-  return ParseTokenResponse(std::move(resp.body()));
+  return ParseTokenResponse(std::move(resp.body()), start);
 }
 
-util::StatusObject<std::string> GCE::ParseTokenResponse(std::string&& response) const {
+util::StatusObject<std::string> GCE::ParseTokenResponse(std::string&& response,
+                                                        uint64_t start_usec) const {
   rj::Document doc;
   constexpr unsigned kFlags = rj::kParseTrailingCommasFlag | rj::kParseCommentsFlag;
   doc.ParseInsitu<kFlags>(&response.front());
@@ -280,27 +360,38 @@ util::StatusObject<std::string> GCE::ParseTokenResponse(std::string&& response)
     return Status(rj::GetParseError_En(doc.GetParseError()));
   }
 
-  string access_token, token_type;
+  auto token = std::make_shared<Token>();
+  string token_type;
   for (auto it = doc.MemberBegin(); it != doc.MemberEnd(); ++it) {
     if (it->name == "access_token") {
-      access_token = it->value.GetString();
+      token->value = it->value.GetString();
     } else if (it->name == "token_type") {
       token_type = it->value.GetString();
+    } else if (it->name == "expires_in" && it->value.IsUint()) {
+      // The lifetime is counted from the request start to be on the safe side.
+      token->expire_usec = start_usec + it->value.GetUint() * 1000000ULL;
     }
   }
-  if (token_type != "Bearer" || access_token.empty()) {
+  if (token_type != "Bearer" || token->value.empty()) {
     return Status(absl::StrCat("Bad json response: ", doc.GetString()));
   }
 
-  std::lock_guard<fibers::mutex> lk(mu_);
-  access_token_ = access_token;
+  string access_token = token->value;
+  std::atomic_store(&token_, std::shared_ptr<const Token>(std::move(token)));
 
   return access_token;
 }
 
 void GCE::Test_InjectAcessToken(std::string access_token) {
-  std::lock_guard<fibers::mutex> lk(mu_);
-  access_token_.swap(access_token);
+  auto token = std::make_shared<Token>();
+  token->value.swap(access_token);
+  std::atomic_store(&token_, std::shared_ptr<const Token>(std::move(token)));
+}
+
+void GCE::Test_SetMetadataServer(std::string host, std::string port) {
+  metadata_host_ = std::move(host);
+  metadata_port_ = std::move(port);
+  is_prod_env_ = true;
 }
 
 }  // namespace util
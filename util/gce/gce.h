@@ -6,19 +6,23 @@
 
 #include <boost/asio/ssl.hpp>
 #include <boost/fiber/mutex.hpp>
+#include <atomic>
 #include <memory>
 
+#include "util/fibers/fibers_ext.h"
 #include "util/status.h"
 
 namespace util {
 class IoContext;
+class PeriodicTask;
 
 class GCE {
  public:
   using SslContext = ::boost::asio::ssl::context;
   using error_code = ::boost::system::error_code;
 
-  GCE() = default;
+  GCE();
+  ~GCE();
 
   Status Init();
 
@@ -35,24 +39,69 @@ class GCE {
 
   static ::boost::asio::ssl::context CheckedSslContext();
 
-  //! Returns cached access_token.
+  //! Returns cached access_token. Does not lock, can be called from any thread.
   //! Must be called after RefreshAccessToken has been called.
   std::string access_token() const;
 
-  StatusObject<std::string> RefreshAccessToken(IoContext* context) const;
+  //! Fetches a new access token instead of the rejected one and publishes it to access_token().
+  //! Concurrent refreshes are coalesced: if another fiber has already replaced the rejected
+  //! token, returns the current one. The callers that waited for a fetch in flight share its
+  //! result, including its failure.
+  StatusObject<std::string> RefreshAccessToken(IoContext* context,
+                                               const std::string& rejected) const;
+
+  //! Replaces the current access token.
+  StatusObject<std::string> RefreshAccessToken(IoContext* context) const {
+    return RefreshAccessToken(context, access_token());
+  }
   bool is_prod_env() const { return is_prod_env_; }
 
+  /*! @brief Renews the access token in the background before it expires.
+   *
+   * Checks the token expiry periodically in context thread and refreshes the token
+   * kRefreshMarginSec before it expires, so that the requests do not fail with 401 and
+   * refresh it on demand. Must be called after RefreshAccessToken. The refresher must be
+   * stopped before context stops. The destructor stops it as well.
+   */
+  void StartTokenRefresher(IoContext* context);
+
+  //! Blocks until the refresh in flight finishes. Should not be called from IO fiber.
+  void StopTokenRefresher();
+
+  static constexpr unsigned kRefreshMarginSec = 300;
+
   void Test_InjectAcessToken(std::string access_token);
 
+  //! Fetches the access tokens from the metadata server at host:port.
+  void Test_SetMetadataServer(std::string host, std::string port);
+
  private:
+  struct Token {
+    std::string value;
+    uint64_t expire_usec = 0;  // monotonic time of the expiry, 0 if unknown.
+  };
+
   util::Status ParseDefaultConfig();
   util::Status ReadDevCreds(const std::string& root_path);
-  util::StatusObject<std::string> ParseTokenResponse(std::string&& response) const;
+  util::StatusObject<std::string> FetchAccessToken(IoContext* context) const;
+  util::StatusObject<std::string> ParseTokenResponse(std::string&& response,
+                                                     uint64_t start_usec) const;
 
   std::string project_id_, client_id_, client_secret_, account_id_, refresh_token_;
 
-  mutable ::boost::fibers::mutex mu_;
-  mutable std::string access_token_;
+  std::string metadata_host_, metadata_port_;
+
+  // Serializes the refreshes. The readers access token_ with std::atomic_load.
+  mutable ::boost::fibers::mutex refresh_mu_;
+  mutable std::shared_ptr<const Token> token_;
+
+  // The number of the finished fetches and the error of the last one. Guarded by refresh_mu_.
+  mutable std::atomic_uint fetch_cnt_{0};
+  mutable Status fetch_status_;
+
+  std::unique_ptr<PeriodicTask> refresher_;
+  std::atomic_bool refreshing_{false};
+  fibers_ext::Done refresh_done_;
 
   std::unique_ptr<SslContext> ssl_ctx_;
   bool is_prod_env_ = false;
@@ -0,0 +1,107 @@
+// Copyright 2020, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/gce/gce.h"
+
+#include <boost/fiber/operations.hpp>
+
+#include "absl/strings/str_cat.h"
+#include "base/logging.h"
+#include "util/http/http_testing.h"
+
+namespace util {
+
+using namespace boost;
+using namespace std;
+using namespace http;
+namespace h2 = beast::http;
+
+constexpr char kTokenPath[] = "/computeMetadata/v1/instance/service-accounts/default/token";
+
+// Serves the access tokens like the metadata server of GCE instances.
+class GceTest : public HttpBaseTest {
+ protected:
+  void SetUp() override;
+
+  // Refreshes the rejected token concurrently from num fibers.
+  vector<StatusObject<string>> Refresh(unsigned num, const string& rejected);
+
+  GCE gce_;
+  std::atomic_uint fetches_{0};
+  std::atomic_bool fail_{false};
+};
+
+void GceTest::SetUp() {
+  HttpBaseTest::SetUp();
+
+  auto cb = [this](const QueryArgs& args, HttpHandler::SendFunction* send) {
+    unsigned index = fetches_.fetch_add(1);
+
+    // Keeps the fetch in flight while the other refreshes wait for it.
+    this_fiber::sleep_for(20ms);
+    if (fail_)
+      return send->Invoke(MakeStringResponse(h2::status::internal_server_error));
+
+    StringResponse resp = MakeStringResponse(h2::status::ok);
+    resp.body() = absl::StrCat(R"({"access_token": "token)", index,
+                               R"(", "expires_in": 3600, "token_type": "Bearer"})");
+    return send->Invoke(std::move(resp));
+  };
+  listener_.RegisterCb(kTokenPath, false, cb);
+
+  gce_.Test_SetMetadataServer("localhost", std::to_string(port_));
+}
+
+vector<StatusObject<string>> GceTest::Refresh(unsigned num, const string& rejected) {
+  IoContext& io_context = pool_->GetNextContext();
+  vector<StatusObject<string>> res(num);
+
+  io_context.AwaitSafe([&] {
+    vector<fibers::fiber> fbs;
+    for (unsigned i = 0; i < num; ++i) {
+      fbs.emplace_back([&, i] { res[i] = gce_.RefreshAccessToken(&io_context, rejected); });
+    }
+    for (auto& fb : fbs)
+      fb.join();
+  });
+  return res;
+}
+
+TEST_F(GceTest, Coalesce) {
+  gce_.Test_InjectAcessToken("old");
+
+  for (const auto& res : Refresh(10, "old")) {
+    ASSERT_TRUE(res.ok()) << res.status;
+    EXPECT_EQ("token0", res.obj);
+  }
+  EXPECT_EQ(1, fetches_.load());
+  EXPECT_EQ("token0", gce_.access_token());
+
+  // The token was already replaced.
+  auto res = Refresh(1, "old");
+  EXPECT_EQ("token0", res[0].obj);
+  EXPECT_EQ(1, fetches_.load());
+
+  res = Refresh(1, "token0");
+  EXPECT_EQ("token1", res[0].obj);
+  EXPECT_EQ(2, fetches_.load());
+}
+
+TEST_F(GceTest, CoalesceFailure) {
+  gce_.Test_InjectAcessToken("old");
+  fail_ = true;
+
+  for (const auto& res : Refresh(10, "old")) {
+    EXPECT_FALSE(res.ok());
+  }
+  EXPECT_EQ(1, fetches_.load());
+  EXPECT_EQ("old", gce_.access_token());
+
+  // The later refreshes fetch again.
+  fail_ = false;
+  auto res = Refresh(1, "old");
+  ASSERT_TRUE(res[0].ok()) << res[0].status;
+  EXPECT_EQ("token1", res[0].obj);
+}
+
+}  // namespace util
@@ -22,6 +22,8 @@
 #include "util/gce/detail/gcs_utils.h"
 #include "util/http/beast_rj_utils.h"
 #include "util/http/https_client.h"
+#include "util/http/https_client_pool.h"
+#include "util/http/parallel_lister.h"
 #include "util/stats/varz_stats.h"
 
 namespace util {
@@ -88,6 +90,84 @@ inline void SetRange(size_t from, size_t to, h2::fields* flds) {
   flds->set(h2::field::range, std::move(tmp));
 }
 
+// GCS returns int64 values as json strings. Returns false if the field is missing or malformed.
+template <typename T> bool ParseIntField(const rj::Value& obj, const char* name, T* dest) {
+  auto it = obj.FindMember(name);
+  if (it == obj.MemberEnd() || !it->value.IsString())
+    return false;
+  return absl::SimpleAtoi(absl::string_view{it->value.GetString(), it->value.GetStringLength()},
+                          dest);
+}
+
+// Passes the objects of a json listing page to cb.
+void ParseListItems(const rj::Value& items, const GCS::ListObjectCb& cb) {
+  CHECK(items.IsArray());
+  auto array = items.GetArray();
+
+  for (size_t i = 0; i < array.Size(); ++i) {
+    const auto& item = array[i];
+    auto it = item.FindMember("name");
+    CHECK(it != item.MemberEnd());
+    absl::string_view key_name(it->value.GetString(), it->value.GetStringLength());
+    it = item.FindMember("size");
+    CHECK(it != item.MemberEnd());
+    absl::string_view sz_str(it->value.GetString(), it->value.GetStringLength());
+    size_t item_size = 0;
+    CHECK(absl::SimpleAtoi(sz_str, &item_size));
+    cb(item_size, key_name);
+  }
+}
+
+// Lists all the pages of the objects and the sub-prefixes directly under prefix.
+Status ListGcsLevel(const GCE& gce, http::HttpsClientPool* pool, absl::string_view bucket,
+                    absl::string_view prefix, const http::ParallelLister::ObjectCb& obj_cb,
+                    const http::ParallelLister::PrefixCb& prefix_cb) {
+  string url = absl::StrCat("/storage/v1/b/", bucket, "/o?prefix=");
+  strings::AppendEncodedUrl(prefix, &url);
+  absl::StrAppend(&url, "&delimiter=%2f&fields=items(name,size),prefixes,nextPageToken");
+
+  detail::ApiSenderDynamicBody sender("list", gce, pool);
+  string target = url;
+  rj::Document doc;
+
+  while (true) {
+    auto req = detail::PrepareGenericRequest(h2::verb::get, target, gce.access_token());
+    auto handle_res = sender.SendGeneric(3, std::move(req));
+    if (!handle_res.ok())
+      return handle_res.status;
+
+    const auto& msg = sender.parser()->get();
+    http::RjBufSequenceStream is(msg.body().data());
+    doc.ParseStream<rj::kParseDefaultFlags>(is);
+
+    if (doc.HasParseError()) {
+      LOG(ERROR) << rj::GetParseError_En(doc.GetParseError()) << " for " << target;
+      return Status(StatusCode::PARSE_ERROR, "Could not parse json response");
+    }
+
+    auto it = doc.FindMember("items");
+    if (it != doc.MemberEnd())
+      ParseListItems(it->value, obj_cb);
+
+    it = doc.FindMember("prefixes");
+    if (it != doc.MemberEnd()) {
+      CHECK(it->value.IsArray());
+      for (const auto& val : it->value.GetArray()) {
+        prefix_cb(absl::string_view(val.GetString(), val.GetStringLength()));
+      }
+    }
+
+    it = doc.FindMember("nextPageToken");
+    if (it == doc.MemberEnd())
+      break;
+
+    target = absl::StrCat(url, "&pageToken=");
+    strings::AppendEncodedUrl(absl::string_view(it->value.GetString(),
+                                                it->value.GetStringLength()), &target);
+  }
+  return Status::OK;
+}
+
 }  // namespace
 
 std::ostream& operator<<(std::ostream& os, const h2::response<h2::buffer_body>& msg) {
@@ -224,22 +304,8 @@ auto GCS::List(absl::string_view bucket, absl::string_view prefix, bool fs_mode,
     if (it == doc.MemberEnd())
       break;
 
-    const auto& val = it->value;
-    CHECK(val.IsArray());
-    auto array = val.GetArray();
+    ParseListItems(it->value, cb);
 
-    for (size_t i = 0; i < array.Size(); ++i) {
-      const auto& item = array[i];
-      auto it = item.FindMember("name");
-      CHECK(it != item.MemberEnd());
-      absl::string_view key_name(it->value.GetString(), it->value.GetStringLength());
-      it = item.FindMember("size");
-      CHECK(it != item.MemberEnd());
-      absl::string_view sz_str(it->value.GetString(), it->value.GetStringLength());
-      size_t item_size = 0;
-      CHECK(absl::SimpleAtoi(sz_str, &item_size));
-      cb(item_size, key_name);
-    }
     it = doc.FindMember("nextPageToken");
     if (it == doc.MemberEnd()) {
       break;
@@ -275,6 +341,43 @@ auto GCS::Read(absl::string_view bucket, absl::string_view obj_path, size_t ofs,
   return range.size() - left_available;  // how much written
 }
 
+auto GCS::Stat(absl::string_view bucket, absl::string_view obj_path) -> ObjectMetaResult {
+  RETURN_IF_ERROR(PrepareConnection());
+
+  string url{"/storage/v1/b/"};
+  absl::StrAppend(&url, bucket, "/o/");
+  strings::AppendEncodedUrl(obj_path, &url);
+  absl::StrAppend(&url, "?fields=size,generation");
+
+  auto http_req = PrepareRequest(h2::verb::get, url, access_token_header_);
+  h2::response<h2::dynamic_body> resp_msg;
+
+  RETURN_IF_ERROR(SendWithToken(&http_req, &resp_msg));
+  if (resp_msg.result() != h2::status::ok) {
+    return HttpError(resp_msg);
+  }
+
+  http::RjBufSequenceStream is(resp_msg.body().data());
+
+  rj::Document doc;
+  doc.ParseStream<rj::kParseDefaultFlags>(is);
+  if (doc.HasParseError()) {
+    LOG(ERROR) << rj::GetParseError_En(doc.GetParseError()) << resp_msg;
+    return Status(StatusCode::PARSE_ERROR, "Could not parse json response");
+  }
+
+  ObjectMeta meta;
+  if (!doc.IsObject() || !ParseIntField(doc, "size", &meta.size)) {
+    return Status(StatusCode::PARSE_ERROR, "Could not find size");
+  }
+
+  if (!ParseIntField(doc, "generation", &meta.generation)) {
+    return Status(StatusCode::PARSE_ERROR, "Could not find generation");
+  }
+
+  return meta;
+}
+
 
 string GCS::BuildGetObjUrl(absl::string_view bucket, absl::string_view obj_path) {
   string read_obj_url{"/storage/v1/b/"};
@@ -292,7 +395,10 @@ Status GCS::PrepareConnection() {
 
 
 Status GCS::RefreshToken(Request* req) {
-  auto res = gce_.RefreshAccessToken(&io_context_);
+  absl::string_view rejected = access_token_header_;
+  absl::ConsumePrefix(&rejected, "Bearer ");
+
+  auto res = gce_.RefreshAccessToken(&io_context_, string(rejected));
   if (!res.ok())
     return res.status;
 
@@ -303,6 +409,13 @@ Status GCS::RefreshToken(Request* req) {
 }
 
 template <typename RespBody> Status GCS::SendWithToken(Request* req, Response<RespBody>* resp) {
+  // The token could have been renewed by the background refresher.
+  string header = absl::StrCat("Bearer ", gce_.access_token());
+  if (header != access_token_header_) {
+    access_token_header_ = std::move(header);
+    req->set(h2::field::authorization, access_token_header_);
+  }
+
   for (unsigned i = 0; i < 2; ++i) {  // Iterate for possible token refresh.
     VLOG(1) << "HttpReq" << i << ": " << *req << ", socket " << native_handle();
 
@@ -347,4 +460,20 @@ uint32_t GCS::native_handle() { return https_client_->client()->next_layer().nat
 
 bool IsGcsPath(absl::string_view path) { return absl::StartsWith(path, kGsUrl); }
 
+Status ListGcsParallel(const GCE& gce, http::HttpsClientPool* pool, absl::string_view bucket,
+                       absl::string_view prefix, unsigned max_parallel, GCS::ListObjectCb cb) {
+  CHECK(!bucket.empty());
+
+  auto list_cb = [&gce, pool, bucket](absl::string_view level, const auto& obj_cb,
+                                      const auto& prefix_cb) {
+    return ListGcsLevel(gce, pool, bucket, level, obj_cb, prefix_cb);
+  };
+
+  http::ParallelLister::Options opts;
+  opts.max_concurrency = max_parallel;
+  http::ParallelLister lister(std::move(list_cb), opts);
+
+  return lister.List(prefix, std::move(cb));
+}
+
 }  // namespace util
@@ -4,11 +4,13 @@
 
 #pragma once
 
+#include <functional>
 #include <memory>
 
 #include <boost/asio/ssl.hpp>
 #include <boost/beast/core/flat_buffer.hpp>
 #include <boost/beast/http/buffer_body.hpp>
+#include <boost/beast/http/dynamic_body.hpp>
 #include <boost/beast/http/empty_body.hpp>
 #include <boost/beast/http/parser.hpp>
 
@@ -60,6 +62,15 @@ class GCS {
   ReadObjectResult Read(absl::string_view bucket, absl::string_view path, size_t ofs,
                         const strings::MutableByteRange& range);
 
+  struct ObjectMeta {
+    size_t size = 0;
+    int64_t generation = 0;  // Changes every time the object is rewritten.
+  };
+  using ObjectMetaResult = util::StatusObject<ObjectMeta>;
+
+  //! Fetches object metadata without reading its contents.
+  ObjectMetaResult Stat(absl::string_view bucket, absl::string_view path);
+
   //! Input: full gcs uri path that starts with "gs://"
   //! fills correspondent bucket and object paths. Returns true if succeeds and false otherwise.
   static bool SplitToBucketPath(absl::string_view input, absl::string_view* bucket,
@@ -93,26 +104,62 @@ class GCS {
 
 bool IsGcsPath(absl::string_view path);
 
+//! Request to the gcs json or upload api.
+using GcsRequest = ::boost::beast::http::request<::boost::beast::http::dynamic_body>;
+
+//! Sends a request to the gcs api server and returns its status. Called concurrently from
+//! several fibers of the calling thread.
+using GcsSendCb = std::function<Status(GcsRequest req)>;
+
+//! Returns the callback that authorizes the requests with the access token of gce and sends
+//! them via the pool connections. The requests that failed with server errors are retried.
+GcsSendCb MakeGcsSendCb(const GCE& gce, http::HttpsClientPool* pool);
+
+struct GcsWriteOptions {
+  //! If positive, the object is written as part objects of part_size bytes that are uploaded
+  //! concurrently and are composed into the destination object on Close().
+  //! Otherwise the object is written with a single resumable upload.
+  //!
+  //! The parts are named "<object>.part-<N>" and the intermediate results of composing more
+  //! than 32 parts "<object>.compose-<level>-<N>". Close() and Abort() delete them, but they
+  //! are left behind if the process crashes. Use a bucket lifecycle rule to expire them.
+  size_t part_size = 0;
+
+  //! Bounds the number of part uploads in flight. The file buffers at most
+  //! (max_parallel_parts + 1) * part_size bytes.
+  unsigned max_parallel_parts = 4;
+};
+
 /**
  * @brief Opens a new GCS file for writes.
  *
  * Must be called from the IO thread that manages 'pool'. All accesses to this file
- * must be done from the same IO thread.
+ * must be done from the same IO thread. WriteFile::Abort() cancels the upload and deletes
+ * the uploaded parts.
  *
  * @param full_path - aka "gs://somebucket/path_to_obj"
  * @param gce
  * @param pool - https connection pool connected to google api server.
+ * @param opts
  * @return StatusObject<file::WriteFile*>
  */
 StatusObject<file::WriteFile*> OpenGcsWriteFile(
-    absl::string_view full_path, const GCE& gce, http::HttpsClientPool* pool);
+    absl::string_view full_path, const GCE& gce, http::HttpsClientPool* pool,
+    const GcsWriteOptions& opts = GcsWriteOptions{});
+
+//! Same as above but sends the requests of the part uploads via send_cb.
+//! opts.part_size must be positive. Allows writing into a stand-in of gcs api.
+StatusObject<file::WriteFile*> OpenGcsWriteFile(absl::string_view full_path, GcsSendCb send_cb,
+                                                const GcsWriteOptions& opts);
 
 
 /**
  * @brief Opens read-only, GCS-backed file.
  *
  * It's single threaded and fiber-friendly. Must be called within IoContext thread sponsoring
- * HttpsClientPool. Only sequential read files are currently supported.
+ * HttpsClientPool. Reads must be sequential, forward seeks reopen the object at the new offset.
+ * If opts.parallel_range_size is set, the object is fetched with up to opts.max_parallel_ranges
+ * concurrent ranged requests on the pool connections (see http::ParallelRangeReader).
  *
  * @param full_path - aka "gs://my_bucket/path/obj_name"
  * @param gce
@@ -123,4 +170,16 @@ StatusObject<file::WriteFile*> OpenGcsWriteFile(
 StatusObject<file::ReadonlyFile*> OpenGcsReadFile(
     absl::string_view full_path, const GCE& gce, http::HttpsClientPool* pool,
     const file::ReadonlyFile::Options& opts = file::ReadonlyFile::Options{});
+
+/**
+ * @brief Lists recursively all the objects under prefix with concurrent requests.
+ *
+ * Unlike GCS::List, that pages through the listing with a single connection, the key space
+ * is partitioned by the '/' sub-prefixes that are listed concurrently on up to max_parallel
+ * connections of the pool (see http::ParallelLister). Must be called within IoContext thread
+ * sponsoring the pool. cb is called from the listing fibers with (size, object_path) pairs.
+ */
+Status ListGcsParallel(const GCE& gce, http::HttpsClientPool* pool, absl::string_view bucket,
+                       absl::string_view prefix, unsigned max_parallel, GCS::ListObjectCb cb);
+
 }  // namespace util
@@ -12,6 +12,7 @@
 #include "util/gce/detail/gcs_utils.h"
 #include "util/http/https_client.h"
 #include "util/http/https_client_pool.h"
+#include "util/http/range_reader.h"
 
 namespace util {
 
@@ -20,6 +21,8 @@ using namespace ::std;
 namespace h2 = beast::http;
 using file::ReadonlyFile;
 using http::HttpsClientPool;
+using http::ParallelRangeReader;
+using http::SetRange;
 
 namespace {
 
@@ -32,12 +35,81 @@ string BuildGetObjUrl(absl::string_view bucket, absl::string_view obj_path) {
   return read_obj_url;
 }
 
-inline void SetRange(size_t from, size_t to, h2::fields* flds) {
-  string tmp = absl::StrCat("bytes=", from, "-");
-  if (to < kuint64max) {
-    absl::StrAppend(&tmp, to - 1);
+/* Fetches [offset, offset + range.size()) of the object with a ranged GET request.
+   Retries from the point where the connection broke. If obj_size is not null, fills it with
+   the object size from the response headers.
+*/
+StatusObject<size_t> FetchRange(const GCE& gce, HttpsClientPool* pool, const string& url,
+                                size_t offset, const strings::MutableByteRange& range,
+                                size_t* obj_size) {
+  constexpr unsigned kMaxReconnects = 3;
+
+  detail::ApiSenderBufferBody sender("read", gce, pool);
+  size_t fetched = 0;
+  unsigned reconnects = 0;
+
+  while (fetched < range.size()) {
+    auto req = detail::PrepareGenericRequest(h2::verb::get, url, gce.access_token());
+    SetRange(offset + fetched, offset + range.size(), &req);
+
+    auto handle_res = sender.SendGeneric(3, std::move(req));
+    if (!handle_res.ok())
+      return handle_res.status;
+
+    auto& handle = handle_res.obj;
+    auto* parser = sender.parser();
+    const auto& msg = parser->get();
+
+    if (msg.result() == h2::status::range_not_satisfiable) {
+      // The response was drained by the sender.
+      if (obj_size) {
+        *obj_size = 0;  // The object is empty.
+        return 0;
+      }
+      return Status(StatusCode::IO_ERROR, absl::StrCat("Range not satisfiable at ", offset));
+    }
+
+    if (obj_size) {
+      Status st = http::ParseObjectSize(msg, obj_size);
+      if (!st.ok()) {
+        handle->schedule_reconnect();
+        return st;
+      }
+      obj_size = nullptr;
+    }
+
+    system::error_code ec;
+    while (fetched < range.size() && !parser->is_done()) {
+      auto& body = parser->get().body();
+      size_t left = range.size() - fetched;
+      body.data = range.data() + fetched;
+      body.size = left;
+
+      ec = handle->Read(parser);
+      fetched += left - body.size;
+      if (ec && ec != h2::error::need_buffer)
+        break;
+      ec.clear();
+    }
+
+    if (!ec) {
+      if (!parser->is_done()) {
+        // We prefer closing the connection to draining the rest of the object.
+        handle->schedule_reconnect();
+      }
+      break;  // Either the range is full or the object ended.
+    }
+
+    if ((ec != h2::error::partial_message && ec != asio::ssl::error::stream_truncated) ||
+        ++reconnects > kMaxReconnects) {
+      LOG(ERROR) << "ec: " << ec << "/" << ec.message() << " at " << offset + fetched;
+      return detail::ToStatus(ec);
+    }
+    VLOG(1) << "Range of " << url << " truncated at " << offset + fetched << ", reconnecting";
+    handle->schedule_reconnect();
   }
-  flds->set(h2::field::range, std::move(tmp));
+
+  return fetched;
 }
 
 class GcsReadFile : public ReadonlyFile, private detail::ApiSenderBufferBody {
@@ -45,8 +117,10 @@ class GcsReadFile : public ReadonlyFile, private detail::ApiSenderBufferBody {
   using error_code = ::boost::system::error_code;
 
   // does not own gcs object, only wraps it with ReadonlyFile interface.
-  GcsReadFile(const GCE& gce, HttpsClientPool* pool, string read_obj_url)
-      : detail::ApiSenderBufferBody("read", gce, pool), read_obj_url_(std::move(read_obj_url)) {}
+  GcsReadFile(const GCE& gce, HttpsClientPool* pool, string read_obj_url,
+              const ReadonlyFile::Options& opts)
+      : detail::ApiSenderBufferBody("read", gce, pool), read_obj_url_(std::move(read_obj_url)),
+        opts_(opts) {}
 
   virtual ~GcsReadFile() final;
 
@@ -65,8 +139,13 @@ class GcsReadFile : public ReadonlyFile, private detail::ApiSenderBufferBody {
   Status Open();
 
  private:
+  // Fetches the first range and switches to the parallel ranged reads.
+  Status OpenParallel();
+
   const string read_obj_url_;
+  const ReadonlyFile::Options opts_;
   HttpsClientPool::ClientHandle https_handle_;
+  std::unique_ptr<ParallelRangeReader> range_reader_;
 
   size_t size_ = 0,offs_ = 0;
 };
@@ -74,6 +153,9 @@ class GcsReadFile : public ReadonlyFile, private detail::ApiSenderBufferBody {
 GcsReadFile::~GcsReadFile() {}
 
 Status GcsReadFile::Open() {
+  if (opts_.parallel_range_size)
+    return OpenParallel();
+
   string token = gce_.access_token();
 
   auto req = detail::PrepareGenericRequest(h2::verb::get, read_obj_url_, token);
@@ -85,6 +167,10 @@ Status GcsReadFile::Open() {
     return handle_res.status;
 
   const auto& msg = parser()->get();
+  if (msg.result() == h2::status::range_not_satisfiable) {
+    return Status(StatusCode::IO_ERROR,
+                  absl::StrCat("Object ", read_obj_url_, " shrank below ", offs_));
+  }
   auto content_len_it = msg.find(h2::field::content_length);
   if (content_len_it != msg.end()) {
     size_t content_sz = 0;
@@ -100,11 +186,46 @@ Status GcsReadFile::Open() {
   return Status::OK;
 }
 
+Status GcsReadFile::OpenParallel() {
+  ParallelRangeReader::Options ropts;
+  ropts.range_size = opts_.parallel_range_size;
+  ropts.max_concurrency = opts_.max_parallel_ranges;
+
+  std::unique_ptr<uint8_t[]> buf(new uint8_t[ropts.range_size]);
+  auto res = FetchRange(gce_, pool_, read_obj_url_, 0,
+                        strings::MutableByteRange(buf.get(), ropts.range_size), &size_);
+  if (!res.ok())
+    return res.status;
+
+  auto fetch_cb = [this](size_t offset, const strings::MutableByteRange& range) {
+    return FetchRange(gce_, pool_, read_obj_url_, offset, range, nullptr);
+  };
+  range_reader_.reset(new ParallelRangeReader(size_, std::move(fetch_cb), ropts));
+  range_reader_->Prefill(std::move(buf), res.obj);
+
+  return Status::OK;
+}
+
 StatusObject<size_t> GcsReadFile::Read(size_t offset, const strings::MutableByteRange& range) {
   CHECK(!range.empty());
 
+  if (range_reader_) {
+    return range_reader_->Read(offset, range);
+  }
+
   if (offset != offs_) {
-    return Status(StatusCode::INVALID_ARGUMENT, "Only sequential access supported");
+    if (offset < offs_) {
+      return Status(StatusCode::INVALID_ARGUMENT, "Only forward access supported");
+    }
+    if (offset >= size_) {
+      return 0;
+    }
+
+    // Forward seek - we reopen the object at the requested offset.
+    VLOG(1) << "Seeking " << read_obj_url_ << " from " << offs_ << " to " << offset;
+    RETURN_IF_ERROR(Close());
+    offs_ = offset;
+    RETURN_IF_ERROR(Open());
   }
 
   // We can not cache parser() into local var because Open() below recreates the parser instance.
@@ -168,6 +289,8 @@ StatusObject<size_t> GcsReadFile::Read(size_t offset, const strings::MutableByte
 
 // releases the system handle for this file.
 Status GcsReadFile::Close() {
+  range_reader_.reset();  // Waits for the requests in flight.
+
   if (https_handle_ && parser()) {
     if (!parser()->is_done()) {
       // We prefer closing the connection to draining.
@@ -192,7 +315,7 @@ StatusObject<ReadonlyFile*> OpenGcsReadFile(absl::string_view full_path, const G
 
   string read_obj_url = BuildGetObjUrl(bucket, obj_path);
 
-  std::unique_ptr<GcsReadFile> fl(new GcsReadFile(gce, pool, std::move(read_obj_url)));
+  std::unique_ptr<GcsReadFile> fl(new GcsReadFile(gce, pool, std::move(read_obj_url), opts));
   RETURN_IF_ERROR(fl->Open());
 
   return fl.release();
@@ -0,0 +1,262 @@
+// Copyright 2020, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/gce/gcs.h"
+
+#include <boost/beast/core/buffers_to_string.hpp>
+#include <boost/fiber/operations.hpp>
+#include <map>
+#include <mutex>
+
+#include <rapidjson/document.h>
+
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/strip.h"
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "util/asio/io_context_pool.h"
+
+namespace util {
+
+using namespace boost;
+using namespace std;
+namespace h2 = beast::http;
+namespace rj = rapidjson;
+
+namespace {
+
+constexpr char kBucketPrefix[] = "/storage/v1/b/test/o/";
+constexpr char kUploadPrefix[] = "/upload/storage/v1/b/test/o?uploadType=media&name=";
+
+string DecodeUrl(absl::string_view src) {
+  string res;
+  for (size_t i = 0; i < src.size(); ++i) {
+    if (src[i] == '%' && i + 2 < src.size()) {
+      res.push_back(char(std::stoi(string(src.substr(i + 1, 2)), nullptr, 16)));
+      i += 2;
+    } else {
+      res.push_back(src[i]);
+    }
+  }
+  return res;
+}
+
+}  // namespace
+
+/* In-memory stand-in of the gcs api that serves the requests of the parts writer:
+   media uploads, compose and delete requests of the "test" bucket.
+*/
+class GcsStandIn {
+ public:
+  Status Send(GcsRequest req);
+
+  //! Returns false if the object does not exist.
+  bool GetObject(const string& name, string* data) const;
+
+  size_t ObjectCount() const {
+    std::lock_guard<std::mutex> lk(mu_);
+    return objects_.size();
+  }
+
+  unsigned composes() const { return composes_; }
+  unsigned deletes() const { return deletes_; }
+
+  //! If set, the requests for which it returns true fail.
+  std::function<bool(const GcsRequest&)> fail_cb;
+
+ private:
+  Status Compose(const string& dest, const string& body);
+
+  mutable std::mutex mu_;
+  std::map<string, string> objects_;
+  unsigned composes_ = 0, deletes_ = 0;
+};
+
+Status GcsStandIn::Send(GcsRequest req) {
+  // Lets the other fibers run, so that the requests overlap like the real ones.
+  this_fiber::yield();
+
+  if (fail_cb && fail_cb(req))
+    return Status(StatusCode::IO_ERROR, "Injected error");
+
+  absl::string_view target(req.target().data(), req.target().size());
+  string body = beast::buffers_to_string(req.body().data());
+
+  if (req.method() == h2::verb::post && absl::ConsumePrefix(&target, kUploadPrefix)) {
+    std::lock_guard<std::mutex> lk(mu_);
+    objects_[DecodeUrl(target)] = std::move(body);
+    return Status::OK;
+  }
+
+  if (!absl::ConsumePrefix(&target, kBucketPrefix))
+    return Status(StatusCode::INVALID_ARGUMENT, string(target));
+
+  if (req.method() == h2::verb::post && absl::ConsumeSuffix(&target, "/compose"))
+    return Compose(DecodeUrl(target), body);
+
+  if (req.method() == h2::verb::delete_) {
+    std::lock_guard<std::mutex> lk(mu_);
+    ++deletes_;
+    if (objects_.erase(DecodeUrl(target)) == 0)
+      return Status(StatusCode::IO_ERROR, "Not found");
+    return Status::OK;
+  }
+
+  return Status(StatusCode::INVALID_ARGUMENT, string(target));
+}
+
+Status GcsStandIn::Compose(const string& dest, const string& body) {
+  rj::Document doc;
+  doc.Parse(body.c_str());
+  CHECK(!doc.HasParseError()) << body;
+
+  const auto& sources = doc["sourceObjects"];
+  if (sources.Size() > 32)
+    return Status(StatusCode::INVALID_ARGUMENT, "Too many source objects");
+
+  std::lock_guard<std::mutex> lk(mu_);
+  string res;
+  for (const auto& src : sources.GetArray()) {
+    auto it = objects_.find(src["name"].GetString());
+    if (it == objects_.end())
+      return Status(StatusCode::IO_ERROR, "Source not found");
+    res.append(it->second);
+  }
+  objects_[dest] = std::move(res);
+  ++composes_;
+
+  return Status::OK;
+}
+
+bool GcsStandIn::GetObject(const string& name, string* data) const {
+  std::lock_guard<std::mutex> lk(mu_);
+  auto it = objects_.find(name);
+  if (it == objects_.end())
+    return false;
+  *data = it->second;
+  return true;
+}
+
+class GcsWriteFileTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    pool_.reset(new IoContextPool{1});
+    pool_->Run();
+  }
+
+  void TearDown() override { pool_->Stop(); }
+
+  // Writes data in chunks and closes the file.
+  bool WriteObject(const string& name, const string& data, const GcsWriteOptions& opts);
+
+  GcsSendCb SendCb() {
+    return [this](GcsRequest req) { return gcs_.Send(std::move(req)); };
+  }
+
+  string Object(const string& name) {
+    string res;
+    EXPECT_TRUE(gcs_.GetObject(name, &res)) << name;
+    return res;
+  }
+
+  GcsStandIn gcs_;
+  std::unique_ptr<IoContextPool> pool_;
+};
+
+bool GcsWriteFileTest::WriteObject(const string& name, const string& data,
+                                   const GcsWriteOptions& opts) {
+  return pool_->GetNextContext().AwaitSafe([&] {
+    file::WriteFile* fl = CHECKED_GET(OpenGcsWriteFile("gs://test/" + name, SendCb(), opts));
+    for (size_t i = 0; i < data.size(); i += 1000) {
+      if (!fl->Write(absl::string_view(data).substr(i, 1000)).ok())
+        break;
+    }
+    return fl->Close();
+  });
+}
+
+static string GenerateData(size_t size) {
+  string res;
+  for (unsigned i = 0; res.size() < size; ++i) {
+    absl::StrAppend(&res, "line ", i, "\n");
+  }
+  return res;
+}
+
+TEST_F(GcsWriteFileTest, Small) {
+  GcsWriteOptions opts;
+  opts.part_size = 1 << 16;
+
+  string data = GenerateData(1000);
+  ASSERT_TRUE(WriteObject("dir/small", data, opts));
+
+  EXPECT_EQ(0, gcs_.composes());
+  EXPECT_EQ(data, Object("dir/small"));
+  EXPECT_EQ(1, gcs_.ObjectCount());
+}
+
+TEST_F(GcsWriteFileTest, Compose) {
+  GcsWriteOptions opts;
+  opts.part_size = 1 << 12;
+
+  string data = GenerateData(10 * opts.part_size + 17);
+  ASSERT_TRUE(WriteObject("dir/obj", data, opts));
+
+  EXPECT_EQ(1, gcs_.composes());
+  EXPECT_TRUE(data == Object("dir/obj"));
+
+  // The parts are deleted.
+  EXPECT_EQ(1, gcs_.ObjectCount());
+  EXPECT_EQ(11, gcs_.deletes());
+}
+
+TEST_F(GcsWriteFileTest, HierarchicalCompose) {
+  GcsWriteOptions opts;
+  opts.part_size = 1 << 10;
+
+  // 70 parts are composed via 3 intermediate objects.
+  string data = GenerateData(70 * opts.part_size);
+  data.resize(70 * opts.part_size);
+  ASSERT_TRUE(WriteObject("dir/obj", data, opts));
+
+  EXPECT_EQ(4, gcs_.composes());
+  EXPECT_TRUE(data == Object("dir/obj"));
+
+  // Both the parts and the intermediate objects are deleted.
+  EXPECT_EQ(1, gcs_.ObjectCount());
+  EXPECT_EQ(73, gcs_.deletes());
+}
+
+TEST_F(GcsWriteFileTest, ComposeFailure) {
+  gcs_.fail_cb = [](const GcsRequest& req) {
+    return absl::EndsWith(absl::string_view(req.target().data(), req.target().size()),
+                          "/compose");
+  };
+  GcsWriteOptions opts;
+  opts.part_size = 1 << 12;
+
+  EXPECT_FALSE(WriteObject("dir/obj", GenerateData(5 * opts.part_size), opts));
+
+  // The object is not created and the parts are deleted.
+  EXPECT_EQ(0, gcs_.ObjectCount());
+}
+
+TEST_F(GcsWriteFileTest, Abort) {
+  GcsWriteOptions opts;
+  opts.part_size = 1 << 12;
+  string data = GenerateData(5 * opts.part_size + 17);
+
+  pool_->GetNextContext().AwaitSafe([&] {
+    file::WriteFile* fl = CHECKED_GET(OpenGcsWriteFile("gs://test/dir/aborted", SendCb(), opts));
+    CHECK_STATUS(fl->Write(data));
+    EXPECT_TRUE(fl->Abort());
+  });
+
+  // The uploaded parts are deleted and the object is not created.
+  EXPECT_EQ(0, gcs_.ObjectCount());
+  EXPECT_EQ(5, gcs_.deletes());
+  EXPECT_EQ(0, gcs_.composes());
+}
+
+}  // namespace util
@@ -7,15 +7,22 @@
 
 #include "util/gce/gcs.h"
 
+#include <boost/beast/core/ostream.hpp>
 #include <boost/beast/http/dynamic_body.hpp>
+#include <boost/fiber/fiber.hpp>
 #include <boost/fiber/operations.hpp>
 
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include "absl/strings/match.h"
 #include "absl/strings/strip.h"
 #include "base/logging.h"
 #include "base/walltime.h"
 #include "strings/escaping.h"
 
 #include "util/asio/io_context.h"
+#include "util/cloud/part_uploader.h"
 #include "util/gce/detail/gcs_utils.h"
 #include "util/http/https_client.h"
 #include "util/http/https_client_pool.h"
@@ -33,11 +40,16 @@ using namespace boost;
 using namespace ::std;
 namespace h2 = detail::h2;
 using base::GetMonotonicMicrosFast;
+using detail::ApiSenderDynamicBody;
 using file::WriteFile;
 using http::HttpsClientPool;
+namespace rj = rapidjson;
 
 namespace {
 
+// GCS composes at most 32 source objects with a single request.
+constexpr size_t kMaxComposeSources = 32;
+
 //! [from, to) limited range out of total. If total is < 0 then it's unknown.
 string ContentRangeHeader(size_t from, size_t to, ssize_t total) {
   CHECK_LE(from, to);
@@ -59,20 +71,6 @@ string ContentRangeHeader(size_t from, size_t to, ssize_t total) {
   return tmp;
 }
 
-class ApiSenderDynamicBody : public detail::ApiSenderBase {
- public:
-  using Parser = h2::response_parser<h2::dynamic_body>;
-
-  using ApiSenderBase::ApiSenderBase;
-
-  //! Can be called only SendGeneric returned success.
-  Parser* parser() { return parser_.has_value() ? &parser_.value() : nullptr; }
-
- private:
-  error_code SendRequestIterative(const Request& req, http::HttpsClient* client) final;
-  absl::optional<Parser> parser_;
-};
-
 class GcsWriteFile : public WriteFile, protected ApiSenderDynamicBody {
  public:
   /**
@@ -86,6 +84,9 @@ class GcsWriteFile : public WriteFile, protected ApiSenderDynamicBody {
 
   bool Close() final;
 
+  // Cancels the resumable upload.
+  bool Abort() final;
+
   bool Open() final;
 
   Status Write(const uint8* buffer, uint64 length) final;
@@ -132,6 +133,23 @@ bool GcsWriteFile::Close() {
   return res.ok();
 }
 
+bool GcsWriteFile::Abort() {
+  CHECK(pool_->io_context().InContextThread());
+
+  Request req(h2::verb::delete_, obj_url_, 11);
+  req.prepare_payload();
+
+  // GCS answers with 499 status on successful cancellation, so we can not distinguish it from
+  // a failure. Unfinished resumable uploads expire anyway.
+  if (!FLAGS_gcs_dry_write) {
+    Status st = SendGeneric(1, std::move(req)).status;
+    VLOG(1) << "Cancelled upload " << create_file_name() << ": " << st;
+  }
+  delete this;
+
+  return true;
+}
+
 bool GcsWriteFile::Open() {
   LOG(FATAL) << "Should not be called";
 
@@ -219,62 +237,277 @@ auto GcsWriteFile::PrepareRequest(size_t to, ssize_t total) -> Request {
   return req;
 }
 
-auto ApiSenderDynamicBody::SendRequestIterative(const Request& req, http::HttpsClient* client)
-    -> error_code {
-  system::error_code ec = client->Send(req);
-  if (ec) {
-    VLOG(1) << "Error sending to socket " << client->native_handle() << " " << ec;
-    return ec;
+/* Writes the object as part objects of part_size bytes. Each part is uploaded with a single
+   media upload request in its own fiber, so several parts are uploaded concurrently over
+   different pool connections. Close() composes the parts into the destination object
+   and deletes them. GCS composes up to 32 objects per request, therefore larger objects
+   are composed hierarchically via intermediate objects.
+*/
+class GcsPartsWriteFile : public WriteFile {
+ public:
+  GcsPartsWriteFile(absl::string_view name, GcsSendCb send_cb, const GcsWriteOptions& opts);
+
+  bool Close() final;
+
+  // Deletes the uploaded parts.
+  bool Abort() final;
+
+  bool Open() final;
+
+  Status Write(const uint8* buffer, uint64 length) final;
+
+ private:
+  // Starts uploading buf_ as the next part. Blocks while max_parallel_parts uploads
+  // are in flight.
+  Status FlushPart();
+
+  Status ComposeParts();
+
+  Status UploadObject(const string& name, beast::multi_buffer body);
+  Status Compose(const vector<string>& sources, const string& dest);
+  void DeleteObjects(const vector<string>& names);
+
+  GcsSendCb send_cb_;
+  GcsWriteOptions opts_;
+  string bucket_, obj_path_;
+
+  beast::multi_buffer buf_;
+  cloud::PartUploader parts_;
+  vector<string> part_names_;
+  vector<string> tmp_objects_;  // intermediate compose results.
+};
+
+GcsPartsWriteFile::GcsPartsWriteFile(absl::string_view name, GcsSendCb send_cb,
+                                     const GcsWriteOptions& opts)
+    : WriteFile(name), send_cb_(std::move(send_cb)), opts_(opts), buf_(opts.part_size),
+      parts_(opts.max_parallel_parts) {
+  CHECK_GT(opts_.part_size, 0);
+  CHECK_GT(opts_.max_parallel_parts, 0);
+
+  absl::string_view bucket, obj_path;
+  CHECK(GCS::SplitToBucketPath(name, &bucket, &obj_path));
+  bucket_ = string(bucket);
+  obj_path_ = string(obj_path);
+}
+
+bool GcsPartsWriteFile::Open() {
+  LOG(FATAL) << "Should not be called";
+
+  return true;
+}
+
+Status GcsPartsWriteFile::Write(const uint8* buffer, uint64 length) {
+  while (length) {
+    size_t sz = std::min<size_t>(length, buf_.max_size() - buf_.size());
+    size_t copied = asio::buffer_copy(buf_.prepare(sz), asio::buffer(buffer, sz));
+    buf_.commit(copied);
+    buffer += copied;
+    length -= copied;
+
+    if (buf_.size() == buf_.max_size()) {
+      RETURN_IF_ERROR(FlushPart());
+    }
   }
 
-  parser_.emplace();  // .body_limit(kuint64max);
-  ec = client->Read(&parser_.value());
-  if (ec) {
-    return ec;
+  return Status::OK;
+}
+
+Status GcsPartsWriteFile::FlushPart() {
+  string name = absl::StrCat(obj_path_, ".part-", part_names_.size());
+
+  beast::multi_buffer body(opts_.part_size);
+  swap(body, buf_);
+
+  RETURN_IF_ERROR(parts_.Add([this, name, body = std::move(body)](string*) mutable {
+    return UploadObject(name, std::move(body));
+  }));
+  part_names_.push_back(std::move(name));
+
+  return Status::OK;
+}
+
+bool GcsPartsWriteFile::Close() {
+  Status res;
+  if (part_names_.empty()) {
+    // Small object - no need to compose.
+    res = UploadObject(obj_path_, std::move(buf_));
+  } else {
+    if (buf_.size())
+      res = FlushPart();
+    Status wait_res = parts_.Wait();
+    if (res.ok())
+      res = wait_res;
+    if (res.ok())
+      res = ComposeParts();
+
+    vector<string> names = part_names_;
+    names.insert(names.end(), tmp_objects_.begin(), tmp_objects_.end());
+    DeleteObjects(names);
   }
 
-  if (!parser_->keep_alive()) {
-    client->schedule_reconnect();
-    LOG(INFO) << "Scheduling reconnect due to conn-close header";
+  if (res.ok()) {
+    VLOG(1) << "Closed file " << create_file_name() << " with " << parts_.size() << " parts";
+  } else {
+    LOG(ERROR) << "Error closing GCS file " << create_file_name() << ", status " << res;
   }
+  delete this;
 
-  const auto& msg = parser_->get();
-  VLOG(1) << "HeaderResp(" << client->native_handle() << "): " << msg;
+  return res.ok();
+}
 
-  // 308 or http ok are both good responses.
-  if (msg.result() == h2::status::ok || msg.result() == h2::status::permanent_redirect) {
-    return error_code{};  // all is good.
-  }
+bool GcsPartsWriteFile::Abort() {
+  parts_.Wait();
+  DeleteObjects(part_names_);
 
-  if (detail::DoesServerPushback(msg.result())) {
-    LOG(INFO) << "Retrying(" << client->native_handle() << ") with " << msg;
+  VLOG(1) << "Aborted file " << create_file_name();
+  delete this;
 
-    this_fiber::sleep_for(1s);
-    return asio::error::try_again;  // retry
+  return true;
+}
+
+Status GcsPartsWriteFile::ComposeParts() {
+  vector<string> sources = part_names_;
+
+  for (unsigned level = 0; sources.size() > kMaxComposeSources; ++level) {
+    vector<string> next;
+    for (size_t i = 0; i < sources.size(); i += kMaxComposeSources) {
+      auto end = sources.begin() + std::min(sources.size(), i + kMaxComposeSources);
+      vector<string> group(sources.begin() + i, end);
+      if (group.size() == 1) {
+        next.push_back(std::move(group.front()));
+        continue;
+      }
+
+      string name = absl::StrCat(obj_path_, ".compose-", level, "-", next.size());
+      tmp_objects_.push_back(name);
+      RETURN_IF_ERROR(Compose(group, name));
+      next.push_back(std::move(name));
+    }
+    sources.swap(next);
   }
 
-  if (detail::IsUnauthorized(msg)) {
-    return asio::error::no_permission;
-  } else if (msg.result() == h2::status::gone) {
-    const Request::header_type& header = req;
+  return Compose(sources, obj_path_);
+}
+
+Status GcsPartsWriteFile::UploadObject(const string& name, beast::multi_buffer body) {
+  if (FLAGS_gcs_dry_write)
+    return Status::OK;
 
-    LOG(INFO) << "Closing(" << client->native_handle() << ") with " << msg << " for request "
-              << header;
+  string url = absl::StrCat("/upload/storage/v1/b/", bucket_, "/o?uploadType=media&name=");
+  strings::AppendEncodedUrl(name, &url);
 
-    this_fiber::sleep_for(1s);
+  GcsRequest req(h2::verb::post, url, 11);
+  req.body() = std::move(body);
+  req.set(h2::field::content_type, "application/octet-stream");
+  req.prepare_payload();
 
-    return system::errc::make_error_code(system::errc::connection_refused);
+  Status res = send_cb_(std::move(req));
+  VLOG(1) << "Uploaded " << name << ": " << res;
+
+  return res;
+}
+
+Status GcsPartsWriteFile::Compose(const vector<string>& sources, const string& dest) {
+  if (FLAGS_gcs_dry_write)
+    return Status::OK;
+
+  string url = absl::StrCat("/storage/v1/b/", bucket_, "/o/");
+  strings::AppendEncodedUrl(dest, &url);
+  absl::StrAppend(&url, "/compose");
+
+  rj::StringBuffer json;
+  rj::Writer<rj::StringBuffer> writer(json);
+  writer.StartObject();
+  writer.Key("sourceObjects");
+  writer.StartArray();
+  for (const string& src : sources) {
+    writer.StartObject();
+    writer.Key("name");
+    writer.String(src.data(), src.size());
+    writer.EndObject();
   }
+  writer.EndArray();
+  writer.Key("destination");
+  writer.StartObject();
+  writer.Key("contentType");
+  writer.String("application/octet-stream");
+  writer.EndObject();
+  writer.EndObject();
+
+  GcsRequest req(h2::verb::post, url, 11);
+  beast::ostream(req.body()) << json.GetString();
+  req.set(h2::field::content_type, "application/json");
+  req.prepare_payload();
+
+  Status res = send_cb_(std::move(req));
+  VLOG(1) << "Composed " << sources.size() << " objects into " << dest << ": " << res;
 
-  LOG(ERROR) << "Unexpected status " << msg;
+  return res;
+}
 
-  return h2::error::bad_status;
+void GcsPartsWriteFile::DeleteObjects(const vector<string>& names) {
+  if (FLAGS_gcs_dry_write)
+    return;
+
+  // Deletes the objects concurrently with max_parallel_parts fibers.
+  size_t next = 0;
+  unsigned num_fibers = std::min<size_t>(opts_.max_parallel_parts, names.size());
+  fibers_ext::BlockingCounter bc(num_fibers);
+
+  for (unsigned i = 0; i < num_fibers; ++i) {
+    fibers::fiber([&, bc]() mutable {
+      for (; next < names.size();) {
+        const string& name = names[next++];
+        string url = absl::StrCat("/storage/v1/b/", bucket_, "/o/");
+        strings::AppendEncodedUrl(name, &url);
+
+        GcsRequest req(h2::verb::delete_, url, 11);
+        req.prepare_payload();
+        Status st = send_cb_(std::move(req));
+        LOG_IF(WARNING, !st.ok()) << "Could not delete " << name << ": " << st;
+      }
+      bc.Dec();
+    }).detach();
+  }
+  bc.Wait();
 }
 
 }  // namespace
 
+GcsSendCb MakeGcsSendCb(const GCE& gce, http::HttpsClientPool* pool) {
+  return [&gce, pool](GcsRequest req) {
+    bool is_upload = absl::StartsWith(detail::absl_sv(req.target()), "/upload/");
+    const char* name = "compose";  // The name of the latency metric.
+    if (is_upload) {
+      name = "write";
+    } else if (req.method() == h2::verb::delete_) {
+      name = "delete";
+    }
+
+    req.set(h2::field::host, GCE::kApiDomain);
+    detail::AddBearer(gce.access_token(), &req);
+
+    ApiSenderDynamicBody sender(name, gce, pool);
+    Status res = sender.SendGeneric(3, std::move(req)).status;
+    if (res.ok() && is_upload)
+      detail::gcs_writes->Inc();
+    return res;
+  };
+}
+
+StatusObject<file::WriteFile*> OpenGcsWriteFile(absl::string_view full_path, GcsSendCb send_cb,
+                                                const GcsWriteOptions& opts) {
+  return new GcsPartsWriteFile(full_path, std::move(send_cb), opts);
+}
+
 StatusObject<file::WriteFile*> OpenGcsWriteFile(absl::string_view full_path, const GCE& gce,
-                                                http::HttpsClientPool* pool) {
+                                                http::HttpsClientPool* pool,
+                                                const GcsWriteOptions& opts) {
+  if (opts.part_size) {
+    CHECK(pool->io_context().InContextThread());
+    return new GcsPartsWriteFile(full_path, MakeGcsSendCb(gce, pool), opts);
+  }
+
   absl::string_view bucket, obj_path;
   CHECK(GCS::SplitToBucketPath(full_path, &bucket, &obj_path));
 
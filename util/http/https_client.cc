@@ -6,6 +6,7 @@
 
 #include "base/logging.h"
 #include "util/asio/io_context.h"
+#include "util/stats/varz_stats.h"
 
 #ifdef BOOST_ASIO_SEPARATE_COMPILATION
 #include <boost/asio/ssl/impl/src.hpp>
@@ -27,6 +28,8 @@ namespace h2 = beast::http;
 namespace {
 constexpr const char kPort[] = "443";
 
+VarzMapCount https_handshakes("https-handshakes");
+
 ::boost::system::error_code SslConnect(SslStream* stream, unsigned ms) {
   system::error_code ec;
   for (unsigned i = 0; i < 2; ++i) {
@@ -80,6 +83,39 @@ SslContextResult CreateClientSslContext(absl::string_view cert_string) {
   return SslContextResult(std::move(cntx));
 }
 
+TlsSessionCache::~TlsSessionCache() {
+  if (session_)
+    SSL_SESSION_free(session_);
+}
+
+bool TlsSessionCache::Resume(SSL* ssl) const {
+  if (!session_)
+    return false;
+
+  SSL_SESSION* copy = SSL_SESSION_dup(session_);
+  if (!copy)
+    return false;
+
+  int res = SSL_set_session(ssl, copy);
+  SSL_SESSION_free(copy);  // ssl holds its own reference.
+
+  return res == 1;
+}
+
+void TlsSessionCache::Update(SSL* ssl) {
+  SSL_SESSION* session = SSL_get_session(ssl);
+  if (!session || !SSL_SESSION_is_resumable(session))
+    return;
+
+  SSL_SESSION* copy = SSL_SESSION_dup(session);
+  if (!copy)
+    return;
+
+  if (session_)
+    SSL_SESSION_free(session_);
+  session_ = copy;
+}
+
 HttpsClient::HttpsClient(absl::string_view host, IoContext* context,
                          ::boost::asio::ssl::context* ssl_ctx)
     : io_context_(*context), ssl_cntx_(*ssl_ctx), host_name_(host) {
@@ -109,10 +145,20 @@ auto HttpsClient::InitSslClient() -> error_code {
     LOG(FATAL) << "Could not set hostname: " << buf;
   }
 
+  SSL* ssl = client_->native_handle();
+  if (session_cache_) {
+    session_cache_->Resume(ssl);
+  }
+
   ec = SslConnect(client_.get(), reconnect_msec_);
   if (!ec) {
     reconnect_needed_ = false;
+    https_handshakes.Inc(SSL_session_reused(ssl) ? "resumed" : "full");
+    // Our contexts are TLS 1.2 only, so the session ticket is received during the handshake.
+    if (session_cache_ && !SSL_session_reused(ssl))
+      session_cache_->Update(ssl);
   } else {
+    https_handshakes.Inc("error");
     VLOG(1) << "Error connecting " << ec << ", socket " << client_->next_layer().native_handle();
   }
   return ec;
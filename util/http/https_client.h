@@ -25,6 +25,31 @@ namespace http {
 using SslContextResult = absl::variant<::boost::system::error_code, ::boost::asio::ssl::context>;
 SslContextResult CreateClientSslContext(absl::string_view cert_string);
 
+/*! @brief Keeps the last resumable TLS session of the connections to the same host.
+ *
+ * New connections resume the cached session with an abbreviated handshake that saves
+ * a round trip and the certificate verification. Single threaded like the pool that owns it.
+ * The connections get copies of the session since openssl invalidates the session
+ * of a connection that was not shut down gracefully.
+ */
+class TlsSessionCache {
+ public:
+  TlsSessionCache() = default;
+  TlsSessionCache(const TlsSessionCache&) = delete;
+  ~TlsSessionCache();
+
+  bool empty() const { return session_ == nullptr; }
+
+  //! Sets the cached session on ssl before its handshake. Returns false if there is none.
+  bool Resume(SSL* ssl) const;
+
+  //! Stores the session of ssl if it can be resumed.
+  void Update(SSL* ssl);
+
+ private:
+  SSL_SESSION* session_ = nullptr;
+};
+
 class HttpsClient {
  public:
   using error_code = ::boost::system::error_code;
@@ -43,6 +68,9 @@ class HttpsClient {
 
   error_code Connect(unsigned msec);
 
+  //! If set, the connection handshakes try to resume the cached session and update the cache.
+  void set_session_cache(TlsSessionCache* cache) { session_cache_ = cache; }
+
   /*! @brief Sends http request but does not read response back.
    *
    *  Possibly retries and reconnects if there are problems with connection.
@@ -106,6 +134,7 @@ class HttpsClient {
 
   std::string host_name_;
   std::unique_ptr<SslStream> client_;
+  TlsSessionCache* session_cache_ = nullptr;
 
   uint32_t reconnect_msec_ = 1000;
   bool reconnect_needed_ = true;
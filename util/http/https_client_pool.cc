@@ -3,26 +3,30 @@
 //
 #include "util/http/https_client_pool.h"
 
+#include <boost/fiber/fiber.hpp>
+
 #include "base/logging.h"
-#include "util/http/https_client.h"
+#include "base/walltime.h"
+#include "util/fibers/fibers_ext.h"
+#include "util/stats/varz_stats.h"
 
 namespace util {
 
 namespace http {
 
+using namespace boost;
+
+namespace {
+
+VarzMapCount https_pool("https-pool");
+
+}  // namespace
+
 void HttpsClientPool::HandleGuard::operator()(HttpsClient* client) {
   CHECK(client);
+  CHECK(pool_);
 
-  CHECK_GT(pool_->existing_handles_, 0);
-
-  if (client->status()) {
-    VLOG(1) << "Deleting client " << client->native_handle() << " due to " << client->status();
-    --pool_->existing_handles_;
-    delete client;
-  } else {
-    CHECK(pool_);
-    pool_->available_handles_.emplace_back(client);
-  }
+  pool_->Release(client);
 }
 
 HttpsClientPool::HttpsClientPool(const std::string& domain, ::boost::asio::ssl::context* ssl_ctx,
@@ -30,23 +34,35 @@ HttpsClientPool::HttpsClientPool(const std::string& domain, ::boost::asio::ssl::
     : ssl_cntx_(*ssl_ctx), io_cntx_(*io_cntx), domain_(domain) {}
 
 HttpsClientPool::~HttpsClientPool() {
-  for (auto* ptr : available_handles_) {
-    delete ptr;
+  for (const auto& handle : available_handles_) {
+    delete handle.client;
   }
 }
 
 auto HttpsClientPool::GetHandle() -> ClientHandle {
+  uint64_t now = base::GetMonotonicMicrosFast();
+
   while (!available_handles_.empty()) {
     // Pulling the oldest handles first.
-    std::unique_ptr<HttpsClient> ptr{std::move(available_handles_.front())};
+    IdleHandle handle = available_handles_.front();
+    std::unique_ptr<HttpsClient> ptr{handle.client};
 
     available_handles_.pop_front();
 
     if (ptr->status()) {
+      --existing_handles_;
       continue;  // we just throw a connection with error status.
     }
 
+    if (idle_msec_ && now - handle.since_usec > idle_msec_ * 1000ULL) {
+      VLOG(1) << "Evicting idle https client " << ptr->native_handle();
+      https_pool.Inc("evict-idle");
+      --existing_handles_;
+      continue;
+    }
+
     VLOG(1) << "Reusing https client " << ptr->native_handle();
+    https_pool.Inc("reuse");
 
     // pass it further with custom deleter.
     return ClientHandle(ptr.release(), HandleGuard{this});
@@ -55,15 +71,69 @@ auto HttpsClientPool::GetHandle() -> ClientHandle {
   // available_handles_ are empty - create a new connection.
   VLOG(1) << "Creating a new https client";
 
+  return ClientHandle{NewHandle().release(), HandleGuard{this}};
+}
+
+unsigned HttpsClientPool::WarmUp(unsigned count) {
+  unsigned opened = 0;
+  if (!count)
+    return opened;
+
+  // Without a cached session the concurrent handshakes would all be full ones.
+  if (session_cache_.empty()) {
+    HttpsClient* client = NewHandle().release();
+    bool failed = bool(client->status());
+    Release(client);
+    if (failed)
+      return opened;
+    ++opened;
+  }
+
+  fibers_ext::BlockingCounter bc(count - opened);
+  std::vector<HttpsClient*> clients(count - opened, nullptr);
+  for (auto& dest : clients) {
+    fibers::fiber([this, bc, &dest]() mutable {
+      dest = NewHandle().release();
+      bc.Dec();
+    }).detach();
+  }
+  bc.Wait();
+
+  for (HttpsClient* client : clients) {
+    if (!client->status())
+      ++opened;
+    Release(client);
+  }
+  https_pool.IncBy("warmup", opened);
+  VLOG(1) << "Warmed up " << opened << " connections to " << domain_;
+
+  return opened;
+}
+
+std::unique_ptr<HttpsClient> HttpsClientPool::NewHandle() {
   std::unique_ptr<HttpsClient> client(new HttpsClient{domain_, &io_cntx_, &ssl_cntx_});
   client->set_retry_count(retry_cnt_);
+  client->set_session_cache(&session_cache_);
 
   auto ec = client->Connect(connect_msec_);
 
   LOG_IF(WARNING, ec) << "HttpsClientPool: Could not connect " << ec;
   ++existing_handles_;
+  https_pool.Inc("create");
 
-  return ClientHandle{client.release(), HandleGuard{this}};
+  return client;
+}
+
+void HttpsClientPool::Release(HttpsClient* client) {
+  CHECK_GT(existing_handles_, 0);
+
+  if (client->status()) {
+    VLOG(1) << "Deleting client " << client->native_handle() << " due to " << client->status();
+    --existing_handles_;
+    delete client;
+  } else {
+    available_handles_.push_back(IdleHandle{client, base::GetMonotonicMicrosFast()});
+  }
 }
 
 }  // namespace http
@@ -8,14 +8,14 @@
 #include <deque>
 #include <memory>
 
+#include "util/http/https_client.h"
+
 namespace util {
 
 class IoContext;
 
 namespace http {
 
-class HttpsClient;
-
 // IoContext specific, thread-local pool that manages a set of https connections.
 class HttpsClientPool {
  public:
@@ -50,6 +50,21 @@ class HttpsClientPool {
   //! Sets number of retries for https client handles.
   void set_retry_count(uint32_t cnt) { retry_cnt_ = cnt; }
 
+  /*! @brief Connections that stayed in the pool longer than msec are closed instead of reused.
+   *
+   * Servers drop idle connections silently, and reusing them costs a failed request.
+   * 0 disables the eviction.
+   */
+  void set_idle_timeout(unsigned msec) { idle_msec_ = msec; }
+
+  /*! @brief Opens count connections in advance and puts them into the pool.
+   *
+   * Must be called withing IoContext thread. The first connection performs the full TLS
+   * handshake and the rest resume its session concurrently. Returns number of connections
+   * that were opened successfully.
+   */
+  unsigned WarmUp(unsigned count);
+
   IoContext& io_context() { return io_cntx_; }
 
   //! Number of existing handles created by this pool.
@@ -60,13 +75,24 @@ class HttpsClientPool {
  private:
   using SslContext = ::boost::asio::ssl::context;
 
+  struct IdleHandle {
+    HttpsClient* client;
+    uint64_t since_usec;
+  };
+
+  // Creates and connects a new client.
+  std::unique_ptr<HttpsClient> NewHandle();
+
+  void Release(HttpsClient* client);
+
   SslContext& ssl_cntx_;
   IoContext& io_cntx_;
   std::string domain_;
-  unsigned connect_msec_ = 1000, retry_cnt_ = 1;
+  unsigned connect_msec_ = 1000, retry_cnt_ = 1, idle_msec_ = 0;
   int existing_handles_ = 0;
 
-  std::deque<HttpsClient*> available_handles_;  // Using queue to allow round-robin access.
+  TlsSessionCache session_cache_;  // Shared by all the connections of the pool.
+  std::deque<IdleHandle> available_handles_;  // Using queue to allow round-robin access.
 };
 
 }  // namespace http
@@ -0,0 +1,76 @@
+// Copyright 2020, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/http/parallel_lister.h"
+
+#include <boost/fiber/fiber.hpp>
+
+#include "base/logging.h"
+#include "util/fibers/fibers_ext.h"
+
+namespace util {
+namespace http {
+
+using namespace boost;
+using namespace std;
+
+ParallelLister::ParallelLister(ListLevelCb cb, const Options& opts)
+    : list_cb_(std::move(cb)), opts_(opts) {
+  CHECK_GT(opts_.max_concurrency, 0);
+}
+
+Status ParallelLister::List(absl::string_view prefix, ObjectCb cb) {
+  CHECK(pending_.empty() && active_ == 0);
+
+  obj_cb_ = std::move(cb);
+  prefix_cb_ = [this](absl::string_view sub_prefix) {
+    pending_.emplace_back(sub_prefix);
+    ec_.notify();
+  };
+  pending_.emplace_back(prefix);
+  partition_count_ = 0;
+  status_ = Status::OK;
+
+  fibers_ext::BlockingCounter bc(opts_.max_concurrency);
+  for (unsigned i = 0; i < opts_.max_concurrency; ++i) {
+    fibers::fiber([this, bc]() mutable {
+      RunWorker();
+      bc.Dec();
+    }).detach();
+  }
+  bc.Wait();
+
+  pending_.clear();
+  obj_cb_ = nullptr;
+  VLOG(1) << "Listed " << partition_count_ << " partitions of " << prefix;
+
+  return status_;
+}
+
+void ParallelLister::RunWorker() {
+  while (true) {
+    // Exits when there is nothing to list and no listing in flight can discover more.
+    ec_.await([this] { return !pending_.empty() || active_ == 0; });
+    if (pending_.empty() || !status_.ok())
+      break;
+
+    string prefix = std::move(pending_.front());
+    pending_.pop_front();
+    ++active_;
+    ++partition_count_;
+
+    Status st = list_cb_(prefix, obj_cb_, prefix_cb_);
+    --active_;
+
+    if (!st.ok()) {
+      LOG(ERROR) << "Error listing " << prefix << ": " << st;
+      if (status_.ok())
+        status_ = st;
+      pending_.clear();
+    }
+    ec_.notifyAll();
+  }
+}
+
+}  // namespace http
+}  // namespace util
@@ -0,0 +1,75 @@
+// Copyright 2020, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <string>
+
+#include "absl/strings/string_view.h"
+#include "util/fibers/event_count.h"
+#include "util/status.h"
+
+namespace util {
+namespace http {
+
+/*! @brief Lists all the objects under a prefix of an object store with concurrent requests.
+ *
+ * Object stores page through a listing sequentially with continuation tokens, therefore
+ * listing millions of objects with a single request chain is bound by the round trip latency.
+ * ParallelLister partitions the key space by the sub-prefixes that delimiter listings discover
+ * and lists up to max_concurrency of them at once, each in its own fiber. The results of all
+ * the partitions are merged into the same callback.
+ *
+ * Single threaded and fiber-friendly: the listing fibers run in the thread that calls List().
+ */
+class ParallelLister {
+ public:
+  //! Called with (size, key_name) pairs.
+  using ObjectCb = std::function<void(size_t, absl::string_view)>;
+  using PrefixCb = std::function<void(absl::string_view)>;
+
+  //! Lists all the pages of the objects directly under prefix. Passes the objects to obj_cb
+  //! and the sub-prefixes that end with the delimiter to prefix_cb.
+  //! Is called concurrently from several fibers.
+  using ListLevelCb = std::function<Status(absl::string_view prefix, const ObjectCb& obj_cb,
+                                           const PrefixCb& prefix_cb)>;
+
+  struct Options {
+    unsigned max_concurrency = 16;  // the maximal number of listings in flight.
+
+    Options() {}
+  };
+
+  explicit ParallelLister(ListLevelCb cb, const Options& opts = Options());
+
+  /*! @brief Lists recursively all the objects under prefix.
+   *
+   * The objects of different partitions are interleaved, and the objects of the same
+   * partition are passed in the order of the store. Returns the first error. The partitions
+   * that have not started by then are skipped.
+   */
+  Status List(absl::string_view prefix, ObjectCb cb);
+
+  //! Number of the partitions listed by the last List() call.
+  size_t partition_count() const { return partition_count_; }
+
+ private:
+  void RunWorker();
+
+  ListLevelCb list_cb_;
+  Options opts_;
+
+  ObjectCb obj_cb_;
+  PrefixCb prefix_cb_;
+  std::deque<std::string> pending_;
+  unsigned active_ = 0;
+  size_t partition_count_ = 0;
+  Status status_;
+  fibers_ext::EventCount ec_;
+};
+
+}  // namespace http
+}  // namespace util
@@ -0,0 +1,133 @@
+// Copyright 2020, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/http/parallel_lister.h"
+
+#include <boost/fiber/operations.hpp>
+#include <map>
+#include <set>
+
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace util {
+namespace http {
+
+using namespace boost;
+using namespace std;
+
+class ParallelListerTest : public testing::Test {
+ protected:
+  void SetUp() override;
+
+  // Lists the keys directly under prefix like object stores do with '/' delimiter.
+  Status ListLevel(absl::string_view prefix, const ParallelLister::ObjectCb& obj_cb,
+                   const ParallelLister::PrefixCb& prefix_cb);
+
+  ParallelLister::ListLevelCb ListCb() {
+    return [this](absl::string_view prefix, const auto& obj_cb, const auto& prefix_cb) {
+      return ListLevel(prefix, obj_cb, prefix_cb);
+    };
+  }
+
+  std::set<string> keys_;
+  string fail_prefix_;
+  unsigned inflight_ = 0, max_inflight_ = 0;
+};
+
+void ParallelListerTest::SetUp() {
+  for (unsigned i = 0; i < 10; ++i) {
+    keys_.insert(absl::StrCat("data/file", i));
+    for (unsigned j = 0; j < 5; ++j) {
+      for (unsigned k = 0; k < 20; ++k) {
+        keys_.insert(absl::StrCat("data/d", i, "/e", j, "/obj", k));
+      }
+    }
+  }
+  keys_.insert("other/obj");
+}
+
+Status ParallelListerTest::ListLevel(absl::string_view prefix,
+                                     const ParallelLister::ObjectCb& obj_cb,
+                                     const ParallelLister::PrefixCb& prefix_cb) {
+  max_inflight_ = std::max(++inflight_, max_inflight_);
+
+  // Simulates the request latency, so that the listings overlap.
+  this_fiber::sleep_for(1ms);
+  --inflight_;
+
+  if (prefix == fail_prefix_)
+    return Status(StatusCode::IO_ERROR, "Listing failed");
+
+  string last_prefix;
+  for (auto it = keys_.lower_bound(string(prefix)); it != keys_.end(); ++it) {
+    absl::string_view key = *it;
+    if (!absl::StartsWith(key, prefix))
+      break;
+
+    size_t pos = key.find('/', prefix.size());
+    if (pos == absl::string_view::npos) {
+      obj_cb(key.size(), key);
+    } else if (key.substr(0, pos + 1) != last_prefix) {
+      last_prefix = string(key.substr(0, pos + 1));
+      prefix_cb(last_prefix);
+    }
+  }
+  return Status::OK;
+}
+
+TEST_F(ParallelListerTest, List) {
+  ParallelLister::Options opts;
+  opts.max_concurrency = 8;
+  ParallelLister lister(ListCb(), opts);
+
+  std::map<string, size_t> listed;
+  Status st = lister.List("data/", [&](size_t sz, absl::string_view key) {
+    EXPECT_TRUE(listed.emplace(key, sz).second) << key;
+  });
+  ASSERT_TRUE(st.ok()) << st;
+
+  EXPECT_EQ(keys_.size() - 1, listed.size());
+  for (const auto& k_v : listed) {
+    EXPECT_EQ(1, keys_.count(k_v.first));
+    EXPECT_EQ(k_v.first.size(), k_v.second);
+  }
+
+  // data/, 10 directories and 50 sub-directories.
+  EXPECT_EQ(61, lister.partition_count());
+  EXPECT_GT(max_inflight_, 1);
+  EXPECT_LE(max_inflight_, 8);
+}
+
+TEST_F(ParallelListerTest, Prefix) {
+  ParallelLister lister(ListCb());
+
+  // The prefix does not have to end with the delimiter.
+  std::set<string> listed;
+  Status st = lister.List("data/d1", [&](size_t, absl::string_view key) {
+    listed.emplace(key);
+  });
+  ASSERT_TRUE(st.ok()) << st;
+  EXPECT_EQ(100, listed.size());
+  EXPECT_EQ(1, listed.count("data/d1/e4/obj19"));
+}
+
+TEST_F(ParallelListerTest, Error) {
+  ParallelLister lister(ListCb());
+  fail_prefix_ = "data/d3/";
+
+  Status st = lister.List("data/", [](size_t, absl::string_view) {});
+  EXPECT_FALSE(st.ok());
+
+  // The lister can be reused.
+  fail_prefix_.clear();
+  size_t count = 0;
+  st = lister.List("other/", [&](size_t, absl::string_view) { ++count; });
+  ASSERT_TRUE(st.ok()) << st;
+  EXPECT_EQ(1, count);
+}
+
+}  // namespace http
+}  // namespace util
@@ -0,0 +1,233 @@
+// Copyright 2020, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/http/range_reader.h"
+
+#include <boost/fiber/fiber.hpp>
+
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "base/integral_types.h"
+#include "base/logging.h"
+#include "base/walltime.h"
+
+namespace util {
+namespace http {
+
+using namespace boost;
+using namespace std;
+namespace h2 = beast::http;
+
+namespace {
+
+inline absl::string_view absl_sv(const beast::string_view s) {
+  return absl::string_view{s.data(), s.size()};
+}
+
+}  // namespace
+
+void SetRange(size_t from, size_t to, h2::fields* flds) {
+  string tmp = absl::StrCat("bytes=", from, "-");
+  if (to < kuint64max) {
+    absl::StrAppend(&tmp, to - 1);
+  }
+  flds->set(h2::field::range, std::move(tmp));
+}
+
+Status ParseObjectSize(const h2::fields& flds, size_t* size) {
+  auto it = flds.find(h2::field::content_range);
+  if (it != flds.end()) {
+    absl::string_view val = absl_sv(it->value());
+    size_t pos = val.rfind('/');
+    if (pos == absl::string_view::npos || !absl::SimpleAtoi(val.substr(pos + 1), size))
+      return Status(StatusCode::IO_ERROR, absl::StrCat("Bad content range ", val));
+    return Status::OK;
+  }
+
+  it = flds.find(h2::field::content_length);
+  if (it == flds.end())
+    return Status(StatusCode::IO_ERROR, "Missing object size");
+  if (!absl::SimpleAtoi(absl_sv(it->value()), size))
+    return Status(StatusCode::IO_ERROR, absl::StrCat("Bad content length ", absl_sv(it->value())));
+  return Status::OK;
+}
+
+ParallelRangeReader::ParallelRangeReader(size_t size, FetchCb cb, const Options& opts)
+    : size_(size), cb_(std::move(cb)), opts_(opts) {
+  CHECK_GT(opts_.range_size, 0);
+  CHECK_GT(opts_.max_concurrency, 0);
+
+  concurrency_ = std::min(concurrency_, opts_.max_concurrency);
+  if (opts_.stats)
+    opts_.stats->concurrency = concurrency_;
+}
+
+ParallelRangeReader::~ParallelRangeReader() {
+  DropChunks();
+}
+
+void ParallelRangeReader::Prefill(std::unique_ptr<uint8_t[]> buf, size_t len) {
+  CHECK(chunks_.empty() && next_fetch_ == 0);
+
+  chunks_.emplace_back();
+  Chunk& chunk = chunks_.back();
+  chunk.len = std::min(opts_.range_size, size_);
+  chunk.ready = true;
+  chunk.res = std::min(len, chunk.len);
+  chunk.buf = std::move(buf);
+  next_fetch_ = chunk.len;
+}
+
+StatusObject<size_t> ParallelRangeReader::Read(size_t offset,
+                                               const strings::MutableByteRange& range) {
+  CHECK(!range.empty());
+
+  if (offset != pos_) {
+    if (offset < pos_) {
+      return Status(StatusCode::INVALID_ARGUMENT, "Only forward access supported");
+    }
+
+    // Forward seek - we drop the ranges that end before offset.
+    while (!chunks_.empty() && chunks_.front().offset + chunks_.front().len <= offset) {
+      WaitChunk(&chunks_.front());
+      PopChunk();
+    }
+    if (chunks_.empty())
+      next_fetch_ = offset;
+    pos_ = offset;
+  }
+
+  size_t copied = 0;
+  while (copied < range.size() && pos_ < size_) {
+    Schedule();
+
+    Chunk& chunk = chunks_.front();
+    WaitChunk(&chunk);
+
+    if (!chunk.res.ok()) {
+      Status st = chunk.res.status;
+      DropChunks();  // The next Read() will retry from pos_.
+      return st;
+    }
+
+    size_t end = chunk.offset + chunk.res.obj;
+    if (pos_ >= end) {
+      DropChunks();
+      return Status(StatusCode::IO_ERROR, "Object is shorter than expected");
+    }
+
+    size_t sz = std::min(end - pos_, range.size() - copied);
+    memcpy(range.data() + copied, chunk.buf.get() + (pos_ - chunk.offset), sz);
+    copied += sz;
+    pos_ += sz;
+
+    if (pos_ == chunk.offset + chunk.len) {
+      PopChunk();
+    }
+  }
+
+  Schedule();
+  return copied;
+}
+
+void ParallelRangeReader::Schedule() {
+  if (chunks_.empty())
+    next_fetch_ = pos_;
+
+  while (chunks_.size() < concurrency_ && next_fetch_ < size_) {
+    chunks_.emplace_back();
+    Chunk& chunk = chunks_.back();
+    chunk.offset = next_fetch_;
+    chunk.len = std::min(opts_.range_size, size_ - next_fetch_);
+    if (free_bufs_.empty()) {
+      chunk.buf.reset(new uint8_t[opts_.range_size]);
+    } else {
+      chunk.buf = std::move(free_bufs_.back());
+      free_bufs_.pop_back();
+    }
+    next_fetch_ += chunk.len;
+
+    if (round_start_ == 0)
+      round_start_ = base::GetMonotonicMicrosFast();
+
+    // We must keep a reference to done in the callback because of the shutdown flow.
+    Chunk* ptr = &chunk;
+    fibers::fiber([this, ptr, done = chunk.done]() mutable {
+      ptr->res = cb_(ptr->offset, strings::MutableByteRange(ptr->buf.get(), ptr->len));
+      if (ptr->res.ok())
+        OnFetched(ptr->res.obj);
+      done.Notify();
+    }).detach();
+  }
+}
+
+void ParallelRangeReader::WaitChunk(Chunk* chunk) {
+  if (chunk->ready)
+    return;
+
+  uint64_t start = base::GetMonotonicMicrosFast();
+  if (chunk->done.Wait()) {
+    round_waited_ = true;
+    if (opts_.stats) {
+      ++opts_.stats->wait_cnt;
+      opts_.stats->wait_usec += base::GetMonotonicMicrosFast() - start;
+    }
+  }
+  chunk->ready = true;
+}
+
+void ParallelRangeReader::PopChunk() {
+  Chunk& chunk = chunks_.front();
+  if (free_bufs_.size() < concurrency_) {
+    free_bufs_.push_back(std::move(chunk.buf));
+  }
+  chunks_.pop_front();
+}
+
+void ParallelRangeReader::DropChunks() {
+  while (!chunks_.empty()) {
+    WaitChunk(&chunks_.front());  // The fetch fiber still writes into the buffer.
+    PopChunk();
+  }
+}
+
+void ParallelRangeReader::OnFetched(size_t bytes) {
+  if (opts_.stats) {
+    opts_.stats->fetched_bytes += bytes;
+    ++opts_.stats->fetch_cnt;
+  }
+
+  round_bytes_ += bytes;
+  if (++round_fetches_ < concurrency_)
+    return;
+
+  uint64_t now = base::GetMonotonicMicrosFast();
+  double rate = double(round_bytes_) / std::max<uint64_t>(1, now - round_start_);
+
+  if (rate > best_rate_ * 1.1) {
+    best_rate_ = rate;
+    best_concurrency_ = concurrency_;
+
+    // The reader waits for the data and more requests helped so far - we try more.
+    if (round_waited_ && concurrency_ < opts_.max_concurrency) {
+      concurrency_ = std::min(concurrency_ * 2, opts_.max_concurrency);
+    }
+  } else {
+    // More requests did not improve the throughput - we retreat to the best known concurrency.
+    // The best rate decays, so that we keep adapting to the changing network conditions.
+    if (concurrency_ > best_concurrency_)
+      concurrency_ = best_concurrency_;
+    best_rate_ *= 0.9;
+  }
+  VLOG(1) << "Fetch rate " << rate << " bytes/usec, concurrency " << concurrency_;
+  if (opts_.stats)
+    opts_.stats->concurrency = concurrency_;
+
+  round_start_ = now;
+  round_bytes_ = 0;
+  round_fetches_ = 0;
+  round_waited_ = false;
+}
+
+}  // namespace http
+}  // namespace util
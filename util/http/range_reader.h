@@ -0,0 +1,123 @@
+// Copyright 2020, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+
+#pragma once
+
+#include <boost/beast/http/fields.hpp>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "strings/stringpiece.h"
+#include "util/fibers/fibers_ext.h"
+#include "util/status.h"
+
+namespace util {
+namespace http {
+
+//! Sets the range header of [from, to) bytes. The range is open if to is kuint64max.
+void SetRange(size_t from, size_t to, ::boost::beast::http::fields* flds);
+
+/*! @brief Parses the object size from the response to a ranged GET request.
+ *
+ * Uses "Content-Range: bytes 0-1023/146515" or, if the server ignored the range and sent
+ * the whole object, Content-Length. Returns IO_ERROR if neither is valid.
+ */
+Status ParseObjectSize(const ::boost::beast::http::fields& flds, size_t* size);
+
+/*! @brief Reads a remote object sequentially with concurrent ranged requests.
+ *
+ * A single http stream is capped by the bandwidth of one TCP connection. ParallelRangeReader
+ * splits the object into ranges of range_size bytes and fetches up to concurrency() of them
+ * ahead of the reader, each in its own fiber. The fetched ranges are kept in a reorder buffer
+ * and are served in order. The concurrency adapts to the observed throughput: it grows
+ * while the reader waits for the data and more requests improve the throughput, and retreats
+ * when they do not.
+ *
+ * Single threaded and fiber-friendly: the fetch fibers run in the thread that calls Read().
+ */
+class ParallelRangeReader {
+ public:
+  //! Fetches [offset, offset + range.size()) into range. Returns the number of bytes fetched,
+  //! which can be less than range.size() only at the end of the object.
+  //! Is called concurrently from several fibers.
+  using FetchCb =
+      std::function<StatusObject<size_t>(size_t offset, const strings::MutableByteRange& range)>;
+
+  struct Stats {
+    size_t fetched_bytes = 0;
+    size_t fetch_cnt = 0;
+    size_t wait_cnt = 0;       // how many times the reader blocked on a request in flight.
+    uint64_t wait_usec = 0;    // how long the reader was blocked.
+    unsigned concurrency = 0;  // the last concurrency chosen by the reader.
+  };
+
+  struct Options {
+    size_t range_size = 1 << 23;   // bytes fetched by a single request.
+    unsigned max_concurrency = 16;  // the maximal number of requests in flight.
+
+    Stats* stats = nullptr;  // if set, is updated by the reader.
+
+    Options() {}
+  };
+
+  ParallelRangeReader(size_t size, FetchCb cb, const Options& opts = Options());
+
+  //! Waits for the requests in flight.
+  ~ParallelRangeReader();
+
+  /*! @brief Provides the data at offset 0 that was fetched before the reader was created.
+   *
+   * Must be called before the first Read(). buf must have range_size bytes.
+   */
+  void Prefill(std::unique_ptr<uint8_t[]> buf, size_t len);
+
+  //! Same semantics as ReadonlyFile::Read. Only forward reads are supported.
+  StatusObject<size_t> Read(size_t offset, const strings::MutableByteRange& range);
+
+  size_t size() const { return size_; }
+
+  unsigned concurrency() const { return concurrency_; }
+
+ private:
+  struct Chunk {
+    size_t offset = 0, len = 0;
+    bool ready = false;
+    StatusObject<size_t> res;
+    std::unique_ptr<uint8_t[]> buf;
+    fibers_ext::Done done;
+  };
+
+  // Keeps concurrency_ requests in flight.
+  void Schedule();
+
+  void WaitChunk(Chunk* chunk);
+  void PopChunk();
+  void DropChunks();
+
+  // Called when a request completes. Adapts the concurrency once per round of requests.
+  void OnFetched(size_t bytes);
+
+  const size_t size_;
+  FetchCb cb_;
+  Options opts_;
+
+  size_t pos_ = 0, next_fetch_ = 0;
+  unsigned concurrency_ = 2;
+
+  std::deque<Chunk> chunks_;  // deque keeps the chunk addresses stable.
+  std::vector<std::unique_ptr<uint8_t[]>> free_bufs_;
+
+  // Throughput measurement of the current round.
+  uint64_t round_start_ = 0, round_bytes_ = 0;
+  unsigned round_fetches_ = 0;
+  bool round_waited_ = false;
+
+  double best_rate_ = 0;  // bytes per usec.
+  unsigned best_concurrency_ = 0;
+};
+
+}  // namespace http
+}  // namespace util
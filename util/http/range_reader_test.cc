@@ -0,0 +1,254 @@
+// Copyright 2020, Beeri 15.  All rights reserved.
+// Author: Roman Gershman (romange@gmail.com)
+//
+#include "util/http/range_reader.h"
+
+#include <boost/beast/core/buffers_to_string.hpp>
+#include <boost/fiber/operations.hpp>
+
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "base/integral_types.h"
+#include "base/logging.h"
+#include "util/asio/io_context.h"
+#include "util/http/http_client.h"
+#include "util/http/http_testing.h"
+
+namespace util {
+namespace http {
+
+using namespace boost;
+using namespace std;
+namespace h2 = beast::http;
+
+// Serves ranges of object_ over http like the object stores do. Ranges are passed as query
+// arguments since the test http listener does not expose the request headers.
+class RangeReaderTest : public HttpBaseTest {
+ protected:
+  void SetUp() override;
+
+  // Fetches the range and fills obj_size if it's not null.
+  StatusObject<size_t> Fetch(IoContext* io_context, size_t offset,
+                             const strings::MutableByteRange& range, size_t* obj_size);
+
+  ParallelRangeReader::FetchCb FetchCb(IoContext* io_context);
+
+  string object_;
+  unsigned fail_offset_ = kuint32max;
+};
+
+void RangeReaderTest::SetUp() {
+  HttpBaseTest::SetUp();
+
+  for (unsigned i = 0; object_.size() < (3 << 20) + 17; ++i) {
+    absl::StrAppend(&object_, "line ", i, "\n");
+  }
+
+  auto cb = [this](const QueryArgs& args, HttpHandler::SendFunction* send) {
+    size_t offset = 0, len = 0;
+    for (const auto& k_v : args) {
+      if (k_v.first == "offset")
+        CHECK(absl::SimpleAtoi(k_v.second, &offset));
+      else if (k_v.first == "len")
+        CHECK(absl::SimpleAtoi(k_v.second, &len));
+    }
+
+    // Simulates the request latency, so that the throughput grows with the concurrency.
+    this_fiber::sleep_for(2ms);
+
+    if (offset == fail_offset_)
+      return send->Invoke(MakeStringResponse(h2::status::internal_server_error));
+
+    if (offset >= object_.size()) {
+      StringResponse resp = MakeStringResponse(h2::status::range_not_satisfiable);
+      resp.set(h2::field::content_range, absl::StrCat("bytes */", object_.size()));
+      return send->Invoke(std::move(resp));
+    }
+
+    StringResponse resp = MakeStringResponse(h2::status::partial_content);
+    resp.body() = object_.substr(offset, len);
+    resp.set(h2::field::content_range, absl::StrCat("bytes ", offset, "-",
+                                                    offset + resp.body().size() - 1, "/",
+                                                    object_.size()));
+    return send->Invoke(std::move(resp));
+  };
+  listener_.RegisterCb("/obj", false, cb);
+}
+
+StatusObject<size_t> RangeReaderTest::Fetch(IoContext* io_context, size_t offset,
+                                             const strings::MutableByteRange& range,
+                                             size_t* obj_size) {
+  Client client(io_context);
+  auto ec = client.Connect("localhost", std::to_string(port_));
+  if (ec)
+    return Status(StatusCode::IO_ERROR, ec.message());
+
+  Client::Response resp;
+  ec = client.Send(h2::verb::get, absl::StrCat("/obj?offset=", offset, "&len=", range.size()),
+                   &resp);
+  if (ec)
+    return Status(StatusCode::IO_ERROR, ec.message());
+
+  if (resp.result() == h2::status::range_not_satisfiable) {
+    if (obj_size)
+      *obj_size = 0;
+    return 0;
+  }
+  if (resp.result() != h2::status::partial_content)
+    return Status(StatusCode::IO_ERROR, "Bad status");
+
+  if (obj_size) {
+    RETURN_IF_ERROR(ParseObjectSize(resp, obj_size));
+  }
+
+  string body = beast::buffers_to_string(resp.body().data());
+  CHECK_LE(body.size(), range.size());
+  memcpy(range.data(), body.data(), body.size());
+  return body.size();
+}
+
+ParallelRangeReader::FetchCb RangeReaderTest::FetchCb(IoContext* io_context) {
+  return [this, io_context](size_t offset, const strings::MutableByteRange& range) {
+    return Fetch(io_context, offset, range, nullptr);
+  };
+}
+
+TEST(ParseObjectSizeTest, Headers) {
+  size_t size = 0;
+  h2::fields flds;
+  EXPECT_FALSE(ParseObjectSize(flds, &size).ok());
+
+  // The server ignored the range.
+  flds.set(h2::field::content_length, "1000");
+  ASSERT_TRUE(ParseObjectSize(flds, &size).ok());
+  EXPECT_EQ(1000, size);
+
+  flds.set(h2::field::content_range, "bytes 0-99/146515");
+  ASSERT_TRUE(ParseObjectSize(flds, &size).ok());
+  EXPECT_EQ(146515, size);
+
+  flds.set(h2::field::content_range, "bytes */0");
+  ASSERT_TRUE(ParseObjectSize(flds, &size).ok());
+  EXPECT_EQ(0, size);
+
+  flds.set(h2::field::content_range, "bytes 0-99/*");
+  EXPECT_FALSE(ParseObjectSize(flds, &size).ok());
+
+  flds.erase(h2::field::content_range);
+  flds.set(h2::field::content_length, "abc");
+  EXPECT_FALSE(ParseObjectSize(flds, &size).ok());
+
+  SetRange(10, kuint64max, &flds);
+  EXPECT_EQ("bytes=10-", flds[h2::field::range]);
+  SetRange(10, 20, &flds);
+  EXPECT_EQ("bytes=10-19", flds[h2::field::range]);
+}
+
+TEST_F(RangeReaderTest, ObjectSize) {
+  IoContext& io_context = pool_->GetNextContext();
+  uint8_t buf[100];
+  strings::MutableByteRange range(buf, sizeof(buf));
+
+  io_context.AwaitSafe([&] {
+    size_t size = 0;
+    auto res = Fetch(&io_context, 0, range, &size);
+    ASSERT_TRUE(res.ok()) << res.status;
+    EXPECT_EQ(sizeof(buf), res.obj);
+    EXPECT_EQ(object_.size(), size);
+
+    // Past the end the server responds with 416.
+    res = Fetch(&io_context, object_.size(), range, &size);
+    ASSERT_TRUE(res.ok()) << res.status;
+    EXPECT_EQ(0, res.obj);
+    EXPECT_EQ(0, size);
+  });
+}
+
+TEST_F(RangeReaderTest, Read) {
+  IoContext& io_context = pool_->GetNextContext();
+
+  ParallelRangeReader::Stats stats;
+  ParallelRangeReader::Options opts;
+  opts.range_size = 1 << 16;
+  opts.max_concurrency = 16;
+  opts.stats = &stats;
+
+  io_context.AwaitSafe([&] {
+    ParallelRangeReader reader(object_.size(), FetchCb(&io_context), opts);
+
+    string res(object_.size() + 100, '\0');
+    size_t offset = 0;
+    while (true) {
+      size_t len = std::min<size_t>(10000, res.size() - offset);
+      auto read_res = reader.Read(offset, strings::MutableByteRange(
+                                              reinterpret_cast<uint8_t*>(&res[offset]), len));
+      ASSERT_TRUE(read_res.ok()) << read_res.status;
+      offset += read_res.obj;
+      if (read_res.obj < len)
+        break;
+    }
+    res.resize(offset);
+    EXPECT_TRUE(res == object_);
+
+    // The requests are latency bound, so the reader keeps adding them.
+    EXPECT_GT(reader.concurrency(), 2);
+  });
+
+  EXPECT_EQ(object_.size(), stats.fetched_bytes);
+  EXPECT_EQ((object_.size() + opts.range_size - 1) / opts.range_size, stats.fetch_cnt);
+  EXPECT_GT(stats.wait_cnt, 0);
+  EXPECT_GT(stats.concurrency, 2);
+}
+
+TEST_F(RangeReaderTest, Seek) {
+  IoContext& io_context = pool_->GetNextContext();
+
+  ParallelRangeReader::Options opts;
+  opts.range_size = 1 << 16;
+
+  io_context.AwaitSafe([&] {
+    ParallelRangeReader reader(object_.size(), FetchCb(&io_context), opts);
+    uint8_t buf[100];
+    strings::MutableByteRange range(buf, sizeof(buf));
+
+    for (size_t offset : {size_t(10), size_t(1000), size_t(1 << 16) - 50, size_t(1 << 21)}) {
+      auto read_res = reader.Read(offset, range);
+      ASSERT_TRUE(read_res.ok()) << read_res.status;
+      ASSERT_EQ(sizeof(buf), read_res.obj);
+      EXPECT_EQ(object_.substr(offset, sizeof(buf)),
+                string(reinterpret_cast<char*>(buf), sizeof(buf)));
+    }
+
+    EXPECT_FALSE(reader.Read(0, range).ok());
+    auto read_res = reader.Read(object_.size(), range);
+    ASSERT_TRUE(read_res.ok());
+    EXPECT_EQ(0, read_res.obj);
+  });
+}
+
+TEST_F(RangeReaderTest, Error) {
+  IoContext& io_context = pool_->GetNextContext();
+
+  ParallelRangeReader::Options opts;
+  opts.range_size = 1 << 16;
+  fail_offset_ = 3 << 16;
+
+  io_context.AwaitSafe([&] {
+    ParallelRangeReader reader(object_.size(), FetchCb(&io_context), opts);
+    string res(1 << 20, '\0');
+    auto read_res = reader.Read(
+        0, strings::MutableByteRange(reinterpret_cast<uint8_t*>(&res[0]), res.size()));
+    EXPECT_FALSE(read_res.ok());
+
+    // The reader retries the failed range.
+    fail_offset_ = kuint32max;
+    read_res = reader.Read(
+        3 << 16, strings::MutableByteRange(reinterpret_cast<uint8_t*>(&res[0]), res.size()));
+    ASSERT_TRUE(read_res.ok()) << read_res.status;
+    EXPECT_EQ(res.size(), read_res.obj);
+    EXPECT_TRUE(object_.substr(3 << 16, res.size()) == res);
+  });
+}
+
+}  // namespace http
+}  // namespace util
@@ -2,9 +2,11 @@
 // Author: Roman Gershman (roman@ubimo.com)
 //
 #include <boost/asio/ssl/error.hpp>
+#include <openssl/x509.h>
 
 #include "base/gtest.h"
 #include "base/logging.h"
+#include "util/http/https_client.h"
 #include "util/http/ssl_stream.h"
 
 namespace util {
@@ -56,6 +58,79 @@ TEST_F(SslStreamTest, BIO_s_bio_ZeroCopy) {
   BIO_free(bio2);
 }
 
+// Handshakes client with server over a memory bio pair. Returns true if the session was reused.
+static bool Handshake(SSL_CTX* client_ctx, SSL_CTX* server_ctx, TlsSessionCache* cache) {
+  SSL* client = SSL_new(client_ctx);
+  SSL* server = SSL_new(server_ctx);
+  BIO *client_bio, *server_bio;
+  CHECK_EQ(1, BIO_new_bio_pair(&client_bio, 0, &server_bio, 0));
+  SSL_set_bio(client, client_bio, client_bio);
+  SSL_set_bio(server, server_bio, server_bio);
+  SSL_set_connect_state(client);
+  SSL_set_accept_state(server);
+  cache->Resume(client);
+
+  // TLS 1.3 tickets are sent after the handshake, hence we also read application data.
+  char buf[8];
+  bool client_done = false, server_done = false;
+  for (unsigned i = 0; i < 20 && !(client_done && server_done); ++i) {
+    if (!client_done) {
+      int res = SSL_do_handshake(client);
+      client_done = res == 1 && SSL_read(client, buf, sizeof(buf)) > 0;
+    }
+    if (!server_done && SSL_do_handshake(server) == 1) {
+      server_done = SSL_write(server, "x", 1) == 1;
+    }
+  }
+  CHECK(client_done && server_done);
+
+  bool reused = SSL_session_reused(client);
+  cache->Update(client);
+
+  SSL_free(client);
+  SSL_free(server);
+
+  return reused;
+}
+
+TEST_F(SslStreamTest, SessionCache) {
+  EVP_PKEY* pkey = EVP_PKEY_new();
+  RSA* rsa = RSA_new();
+  BIGNUM* e = BN_new();
+  BN_set_word(e, RSA_F4);
+  ASSERT_EQ(1, RSA_generate_key_ex(rsa, 2048, e, nullptr));
+  EVP_PKEY_assign_RSA(pkey, rsa);
+  BN_free(e);
+
+  X509* cert = X509_new();
+  ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+  X509_gmtime_adj(X509_get_notBefore(cert), 0);
+  X509_gmtime_adj(X509_get_notAfter(cert), 3600);
+  X509_set_pubkey(cert, pkey);
+  X509_NAME* name = X509_get_subject_name(cert);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*)"localhost", -1, -1,
+                             0);
+  X509_set_issuer_name(cert, name);
+  ASSERT_GT(X509_sign(cert, pkey, EVP_sha256()), 0);
+
+  SSL_CTX* server_ctx = SSL_CTX_new(TLS_server_method());
+  ASSERT_EQ(1, SSL_CTX_use_certificate(server_ctx, cert));
+  ASSERT_EQ(1, SSL_CTX_use_PrivateKey(server_ctx, pkey));
+  SSL_CTX* client_ctx = SSL_CTX_new(TLS_client_method());
+
+  TlsSessionCache cache;
+  EXPECT_FALSE(Handshake(client_ctx, server_ctx, &cache));
+  ASSERT_FALSE(cache.empty());
+
+  EXPECT_TRUE(Handshake(client_ctx, server_ctx, &cache));
+  EXPECT_TRUE(Handshake(client_ctx, server_ctx, &cache));
+
+  SSL_CTX_free(client_ctx);
+  SSL_CTX_free(server_ctx);
+  X509_free(cert);
+  EVP_PKEY_free(pkey);
+}
+
 }  // namespace http
 
 }  // namespace util